@@ -0,0 +1,206 @@
+#include "annexb_converter.h"
+#include <string.h>
+
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "es_index.h"
+#include "es_params.h"
+#include "log.h"
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/intreadwrite.h>
+}
+
+// 缓冲池中缓冲区的最小大小，池中缓冲区大小相同，包超过当前大小时按 1.5 倍重建缓冲池
+#define ANNEXB_POOL_MIN_SIZE (256 * 1024)
+
+#define HEVC_NAL_VPS 32
+#define HEVC_NAL_PPS 34
+
+struct annexb_converter {
+    AVBufferPool* pool = nullptr;
+    size_t pool_size = 0;
+    std::vector<std::pair<const uint8_t*, const uint8_t*>> nals; ///< 当前包中每个 NAL 的起止位置（不含起始码），跨包复用
+    bool strip_parameter_sets = false;
+    std::vector<std::string> parameter_sets;  ///< extradata 中的 VPS/SPS/PPS，去除带内参数集时用于比较
+
+    int64_t in_place_packets = 0;   ///< 原地转换的包数
+    int64_t pooled_packets = 0;     ///< 写入缓冲池的包数
+    int64_t stripped_nals = 0;      ///< 去除的带内参数集个数
+};
+
+static bool is_parameter_set(const uint8_t* nal, const uint8_t* nal_end)
+{
+    if (nal_end <= nal) {
+        return false;
+    }
+    int32_t nal_type = (nal[0] >> 1) & 0x3f;
+    return nal_type >= HEVC_NAL_VPS && nal_type <= HEVC_NAL_PPS;
+}
+
+// 比较时去掉 NAL 末尾多余的 0，extradata 与包中同一参数集的尾部填充可能不同
+static std::string trimmed_nal(const uint8_t* nal, const uint8_t* nal_end)
+{
+    while (nal_end > nal && nal_end[-1] == 0) {
+        nal_end--;
+    }
+    return std::string((const char*)nal, nal_end - nal);
+}
+
+annexb_converter* alloc_annexb_converter(AVCodecParameters* par, int32_t strip_parameter_sets)
+{
+    annexb_converter* conv = new (std::nothrow) annexb_converter();
+    if (conv == nullptr) {
+        LOGE("alloc annexb converter fail\n");
+        return nullptr;
+    }
+
+    // extradata 转换为 hvcC 之前取出其中带起始码的参数集
+    if (strip_parameter_sets && par->extradata != nullptr) {
+        const uint8_t* end = par->extradata + par->extradata_size;
+        const uint8_t* sc = es_find_start_code(par->extradata, end);
+        while (sc < end) {
+            const uint8_t* nal = sc + 3;
+            const uint8_t* next = es_find_start_code(nal, end);
+            if (is_parameter_set(nal, next)) {
+                conv->parameter_sets.push_back(trimmed_nal(nal, next));
+            }
+            sc = next;
+        }
+        conv->strip_parameter_sets = true;
+    }
+
+    if (hevc_extradata_to_hvcc(par, strip_parameter_sets) < 0) {
+        delete conv;
+        return nullptr;
+    }
+
+    return conv;
+}
+
+// 与 extradata 中的参数集相同时返回 1，不是参数集或不去除时返回 0。hvc1 不允许带内参数集，
+// mov 复用器也不会写出新的样本描述，参数集发生变化时返回 AVERROR_INVALIDDATA
+static int32_t strip_nal(annexb_converter* conv, const uint8_t* nal, const uint8_t* nal_end)
+{
+    if (!conv->strip_parameter_sets || !is_parameter_set(nal, nal_end)) {
+        return 0;
+    }
+
+    std::string ps = trimmed_nal(nal, nal_end);
+    for (const auto& p : conv->parameter_sets) {
+        if (p == ps) {
+            conv->stripped_nals++;
+            return 1;
+        }
+    }
+
+    LOGE("HEVC parameter set (type %d) differs from extradata, not allowed in hvc1\n", (nal[0] >> 1) & 0x3f);
+    return AVERROR_INVALIDDATA;
+}
+
+// 写入缓冲池中的缓冲区。起始码为 3 字节或者包被其他引用共享（如原生解复用的包引用只读的映射内存）时不能原地转换
+static int32_t convert_to_pool(annexb_converter* conv, AVPacket* pkt, size_t out_size)
+{
+    if (out_size + AV_INPUT_BUFFER_PADDING_SIZE > conv->pool_size) {
+        // 已经取出的缓冲区在释放后才随旧的缓冲池一起释放
+        av_buffer_pool_uninit(&conv->pool);
+        conv->pool_size = FFMAX((out_size + AV_INPUT_BUFFER_PADDING_SIZE) * 3 / 2, ANNEXB_POOL_MIN_SIZE);
+        conv->pool = av_buffer_pool_init(conv->pool_size, nullptr);
+        if (conv->pool == nullptr) {
+            conv->pool_size = 0;
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    AVBufferRef* buf = av_buffer_pool_get(conv->pool);
+    if (buf == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+
+    uint8_t* out = buf->data;
+    for (const auto& nal : conv->nals) {
+        size_t nal_size = nal.second - nal.first;
+        AV_WB32(out, nal_size);
+        memcpy(out + 4, nal.first, nal_size);
+        out += 4 + nal_size;
+    }
+    memset(out, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    pkt->size = out_size;
+    conv->pooled_packets++;
+
+    return 0;
+}
+
+int32_t annexb_convert_packet(annexb_converter* conv, AVPacket* pkt)
+{
+    const uint8_t* data = pkt->data;
+    const uint8_t* end = data + pkt->size;
+    const uint8_t* sc = es_find_start_code(data, end);
+    if (sc >= end) {
+        LOGE("no start code in packet of %d bytes\n", pkt->size);
+        return AVERROR_INVALIDDATA;
+    }
+
+    // 4 字节起始码与 NAL 长度字段一样长，全部 NAL 都使用 4 字节起始码时直接把起始码改写为长度，包的大小不变
+    bool in_place = sc == data + 1 && data[0] == 0 && pkt->buf != nullptr && av_buffer_is_writable(pkt->buf);
+    size_t out_size = 0;
+    conv->nals.clear();
+    while (sc < end) {
+        const uint8_t* nal = sc + 3;
+        const uint8_t* next = es_find_start_code(nal, end);
+
+        // 下一个起始码的前导 0 不属于当前 NAL，NAL 末尾多余的 0 保留在 NAL 中，与 mov 复用器的转换结果一致
+        const uint8_t* nal_end = next;
+        if (next < end && next[-1] == 0) {
+            nal_end = next - 1;
+        } else if (next < end) {
+            in_place = false;
+        }
+
+        // 去除参数集后包变小，只能写入缓冲池，每个 GOP 一次
+        int32_t stripped = strip_nal(conv, nal, nal_end);
+        if (stripped < 0) {
+            return stripped;
+        } else if (stripped > 0) {
+            in_place = false;
+        } else {
+            conv->nals.push_back(std::make_pair(nal, nal_end));
+            out_size += 4 + (nal_end - nal);
+        }
+        sc = next;
+    }
+
+    if (!in_place) {
+        return convert_to_pool(conv, pkt, out_size);
+    }
+
+    for (const auto& nal : conv->nals) {
+        AV_WB32((uint8_t*)nal.first - 4, nal.second - nal.first);
+    }
+    conv->in_place_packets++;
+
+    return 0;
+}
+
+void free_annexb_converter(annexb_converter** conv)
+{
+    if (conv == nullptr || *conv == nullptr) {
+        return;
+    }
+
+    annexb_converter* c = *conv;
+    LOG_AT(LOG_LEVEL_COUNTERS, "annexb convert: %jd packets in place, %jd through the buffer pool, "
+           "%jd parameter sets stripped\n", c->in_place_packets, c->pooled_packets, c->stripped_nals);
+
+    av_buffer_pool_uninit(&c->pool);
+    delete c;
+    *conv = nullptr;
+}
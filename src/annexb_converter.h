@@ -0,0 +1,30 @@
+//
+// 裸 HEVC 写入 MP4 前的格式转换。把访问单元中的 Annex-B 起始码替换为 4 字节 NAL 长度，配合 hvcC 形式的 extradata，
+// mov 复用器收到的包已经是目标格式，不再逐包分配缓冲区重写。全部 NAL 都使用 4 字节起始码且包可写时原地转换，
+// 否则写入缓冲池中的缓冲区，不逐包分配内存。去除带内参数集时（hvc1 样本描述），与 extradata 相同的 VPS/SPS/PPS
+// 不写入包中
+//
+
+#ifndef ANNEXB_CONVERTER_H
+#define ANNEXB_CONVERTER_H
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+typedef struct annexb_converter annexb_converter;
+
+// par 为输出流的编码参数，其 extradata 转换为 hvcC。strip_parameter_sets 非 0 时 hvcC 中的参数集数组标记为完整，
+// 之后转换的包中去除与 extradata 相同的参数集，调用者需要把输出流的 codec_tag 设为 hvc1。
+// par 不是 Annex-B 的 HEVC 或者转换失败时返回 nullptr，此时 par 不变，由 mov 复用器自行转换
+annexb_converter* alloc_annexb_converter(AVCodecParameters* par, int32_t strip_parameter_sets);
+
+// 把 pkt 转换为 NAL 长度前缀的形式，pkt 不以起始码开头、或者去除带内参数集时遇到与 extradata 不同的参数集时
+// 返回 AVERROR_INVALIDDATA
+int32_t annexb_convert_packet(annexb_converter* conv, AVPacket* pkt);
+
+// 输出统计信息并释放缓冲池，已转换的包仍然可以使用
+void free_annexb_converter(annexb_converter** conv);
+
+#endif
@@ -0,0 +1,939 @@
+/**
+* 复用吞吐量基准测试。输入为内存中生成的合成 HEVC Annex-B 与 AAC ADTS 码流，不需要任何素材文件，
+* 分别测试 muxer_core 与 mem_io_muxer 两条路径，每个测试项输出一行 JSON，便于在发布前对比性能回退
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../annexb_converter.h"
+#include "../es_demuxer.h"
+#include "../es_index.h"
+#include "../es_params.h"
+#include "../log.h"
+#include "../mem_output.h"
+#include "../mem_io_muxer.h"
+#include "../muxer_core.h"
+#include "../probe_cache.h"
+#include "../ts_generator.h"
+#include "synth_es.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/log.h>
+#include <libavutil/mathematics.h>
+}
+
+// 替换 libc 的分配函数以统计分配次数，FFmpeg 的 av_malloc 最终也会调用到这里
+static std::atomic<int64_t> g_alloc_calls(0);
+static std::atomic<int64_t> g_alloc_bytes(0);
+
+static inline void count_alloc(size_t size)
+{
+    g_alloc_calls.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) noexcept
+{
+    count_alloc(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) noexcept
+{
+    count_alloc(n * size);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept
+{
+    count_alloc(size);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) noexcept
+{
+    count_alloc(size);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr != nullptr ? 0 : ENOMEM;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    count_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size) noexcept
+{
+    count_alloc(size);
+    return __libc_memalign(alignment, size);
+}
+}
+
+typedef struct bench_env {
+    std::string video_path;  ///< 合成视频码流所在 memfd 的路径
+    std::string audio_path;
+    std::string output_path; ///< muxer_core 的输出文件
+    std::string probe_cache_dir; ///< 探测缓存测试项使用的临时缓存目录
+    int64_t packets;         ///< 一次复用的包数
+    int64_t bytes;           ///< 一次复用的输入字节数
+    int64_t video_packets;   ///< 视频码流的访问单元数，只处理视频的测试项按此统计
+    int64_t video_bytes;
+    int64_t timestamps;      ///< 时间戳测试项一次生成的时间戳个数
+} bench_env;
+
+// 测试项结果中统计的包数和字节数
+enum bench_count {
+    BENCH_COUNT_MUX,        ///< 一次复用的全部音视频包
+    BENCH_COUNT_VIDEO,      ///< 视频码流的全部访问单元
+    BENCH_COUNT_NONE,       ///< 只打开输入或只扫描码流，不统计
+    BENCH_COUNT_TIMESTAMPS, ///< 生成的时间戳个数，不统计字节数
+};
+
+// 一个测试项，iterate 完成一次完整的复用
+typedef struct bench_case {
+    const char* name;
+    int32_t (*iterate)(const bench_env* env);
+    bench_count count;
+} bench_case;
+
+static void usage(const char* program_name)
+{
+    printf("usage: %s [-n iterations] [-d ms] [-b bitrate] [-g gop] [-s WxH] [-c case] [-l level]\n", program_name);
+    printf("  -n  timed iterations of each case after one warm up run, default 5\n");
+    printf("  -d  duration of the synthetic streams in milliseconds, default 60000\n");
+    printf("  -b  video bitrate in bit/s, default 4000000\n");
+    printf("  -g  video gop size, default 50\n");
+    printf("  -s  video size, default 1280x720, e.g. 3840x2160 with -b 40000000 for 4k\n");
+    printf("  -c  only run the case with this name, default runs all cases\n");
+    printf("  -l  log level of the muxers: quiet, error, warn, counters, info, debug, trace, default error\n");
+    printf("each case prints one json line with packets/s, MB/s, allocations per packet and peak rss\n");
+    printf("the open_input cases only open both inputs, run them with a small -d to see the probing cost\n");
+    printf("the es_index case only indexes the video stream, ms_per_iteration shows the scan speed\n");
+    printf("the annexb cases only process the video stream: annexb_convert converts read only native demux packets\n");
+    printf("through the buffer pool, annexb_convert_avio converts the writable av_read_frame packets in place,\n");
+    printf("annexb_mux_movenc and annexb_mux_converter mux them into an in memory mp4 with and without the converter\n");
+    printf("the ts_generator cases synthesize 10 hours of timestamps for several frame rates and time bases,\n");
+    printf("ts_drift prints the largest error against the exact timestamps and fails when ts_generator drifts\n");
+}
+
+// 把合成码流放进 memfd，通过 /proc/self/fd 路径交给按文件名打开输入的复用路径
+static int32_t make_memfd(const char* name, const std::vector<uint8_t>& data, std::string& path)
+{
+    int fd = memfd_create(name, 0);
+    if (fd < 0) {
+        LOGE("memfd_create fail: %s\n", strerror(errno));
+        return -1;
+    }
+
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n <= 0) {
+            LOGE("write memfd fail: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+
+    path = "/proc/self/fd/" + std::to_string(fd);
+    return 0;
+}
+
+static int32_t run_muxer_core(const bench_env* env, int32_t pipelined, int32_t direct_write, int32_t native_demux,
+                              int32_t uring_output, int32_t write_behind_depth)
+{
+    muxer_options opts;
+    init_muxer_options(&opts);
+    opts.pipelined = pipelined;
+    opts.direct_write = direct_write;
+    opts.native_demux = native_demux;
+    opts.uring_output = uring_output;
+    opts.write_behind_depth = write_behind_depth;
+
+    muxer_context* ctx = alloc_muxer(&opts);
+    if (ctx == nullptr) {
+        return -1;
+    }
+
+    int32_t result = init_muxer(ctx, (char*)env->video_path.c_str(), (char*)env->audio_path.c_str(),
+                                (char*)env->output_path.c_str());
+    if (result >= 0) {
+        result = muxing(ctx);
+    }
+
+    destory_muxer(&ctx);
+    return result;
+}
+
+static int32_t muxer_core_case(const bench_env* env)
+{
+    return run_muxer_core(env, 0, 0, 0, 0, 0);
+}
+
+static int32_t muxer_core_pipelined_case(const bench_env* env)
+{
+    return run_muxer_core(env, 1, 0, 0, 0, 0);
+}
+
+// 与 muxer_core 对比 av_interleaved_write_frame 交错缓冲的开销，峰值内存见 peak_rss
+static int32_t muxer_core_direct_case(const bench_env* env)
+{
+    return run_muxer_core(env, 0, 1, 0, 0, 0);
+}
+
+static int32_t muxer_core_pipelined_direct_case(const bench_env* env)
+{
+    return run_muxer_core(env, 1, 1, 0, 0, 0);
+}
+
+// 与 muxer_core 对比 libavformat 解复用（读入 AVIOContext 缓冲区再拷贝到包中）与映射内存上直接切分的开销
+static int32_t muxer_core_native_case(const bench_env* env)
+{
+    return run_muxer_core(env, 0, 0, 1, 0, 0);
+}
+
+static int32_t muxer_core_native_direct_case(const bench_env* env)
+{
+    return run_muxer_core(env, 0, 1, 1, 0, 0);
+}
+
+// 与 muxer_core 对比输出文件的同步 write 和 io_uring 异步写入，输出文件不在内存文件系统上时差别才明显
+static int32_t muxer_core_uring_case(const bench_env* env)
+{
+    return run_muxer_core(env, 0, 0, 0, 1, 0);
+}
+
+// 与 muxer_core 对比复用线程内同步写出和写线程写出，停顿次数和时长见 counters 级别的日志
+static int32_t muxer_core_write_behind_case(const bench_env* env)
+{
+    return run_muxer_core(env, 0, 0, 0, 0, 4);
+}
+
+// 以与命令行相同的参数调用 mem_io_muxer，输出先写入内存，复用完成后一次写入输出文件
+static int32_t run_mem_io_muxer(const bench_env* env, bool zero_copy)
+{
+    std::vector<char*> argv;
+    argv.push_back((char*)"mem_io_muxer");
+    if (zero_copy) {
+        argv.push_back((char*)"-z");
+    }
+    argv.push_back((char*)"-m");
+    argv.push_back((char*)"-o");
+    argv.push_back((char*)env->output_path.c_str());
+    argv.push_back((char*)env->video_path.c_str());
+    argv.push_back((char*)env->audio_path.c_str());
+    argv.push_back(nullptr);
+
+    return mem_io_muxer_main((int)argv.size() - 1, argv.data()) == 0 ? 0 : -1;
+}
+
+static int32_t mem_io_muxer_case(const bench_env* env)
+{
+    return run_mem_io_muxer(env, false);
+}
+
+static int32_t mem_io_muxer_zero_copy_case(const bench_env* env)
+{
+    return run_mem_io_muxer(env, true);
+}
+
+// 以 muxer_core 相同的方式打开两个输入并获取流信息。输入较小时打开耗时主要花在探测上。
+// fast_open 时与 muxer -F 相同，直接解析参数集和 ADTS 头
+static int32_t open_inputs(const bench_env* env, const char* cache_dir, bool fast_open)
+{
+    const char* paths[] = { env->video_path.c_str(), env->audio_path.c_str() };
+    const char* formats[] = { "hevc", "aac" };
+    for (int32_t i = 0; i < 2; i++) {
+        AVFormatContext* ic = nullptr;
+        if (avformat_open_input(&ic, paths[i], av_find_input_format(formats[i]), nullptr) < 0) {
+            LOGE("open %s fail\n", paths[i]);
+            return -1;
+        }
+
+        int32_t ret = 0;
+        if (!fast_open || ic->nb_streams != 1 || es_params_fill_stream(paths[i], ic->streams[0]) < 0) {
+            ret = probe_cache_find_stream_info(cache_dir, paths[i], ic);
+        }
+        avformat_close_input(&ic);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int32_t open_input_case(const bench_env* env)
+{
+    return open_inputs(env, nullptr, false);
+}
+
+// 预热的一次写入缓存，计时的各次都命中缓存
+static int32_t open_input_cached_case(const bench_env* env)
+{
+    return open_inputs(env, env->probe_cache_dir.c_str(), false);
+}
+
+static int32_t open_input_fast_case(const bench_env* env)
+{
+    return open_inputs(env, nullptr, true);
+}
+
+// 为合成视频码流建立访问单元索引，不读写索引文件，只测扫描起始码和划分访问单元的速度
+static int32_t es_index_case(const bench_env* env)
+{
+    int fd = open(env->video_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    void* data = fstat(fd, &st) == 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    es_index index;
+    int32_t result = es_index_build((const uint8_t*)data, st.st_size, AV_CODEC_ID_HEVC,
+                                    std::thread::hardware_concurrency(), &index);
+    munmap(data, st.st_size);
+    return result;
+}
+
+// 原生解复用合成视频码流并把每个访问单元转换为 NAL 长度前缀的形式，包引用只读的映射内存，转换结果写入缓冲池
+static int32_t annexb_convert_case(const bench_env* env)
+{
+    es_demuxer es;
+    if (open_es_demuxer(&es, env->video_path.c_str(), AV_CODEC_ID_HEVC) < 0) {
+        return -1;
+    }
+
+    AVCodecParameters* par = avcodec_parameters_alloc();
+    AVPacket* pkt = av_packet_alloc();
+    annexb_converter* conv = nullptr;
+    AVRational frame_rate;
+    int32_t result = -1;
+    if (par != nullptr && pkt != nullptr &&
+        hevc_parse_params(es.ptr, FFMIN(es.end - es.ptr, ES_PARAMS_HEAD_SIZE), par, &frame_rate) >= 0) {
+        conv = alloc_annexb_converter(par, 0);
+    }
+
+    if (conv != nullptr) {
+        while ((result = es_demuxer_read(&es, pkt)) >= 0) {
+            result = annexb_convert_packet(conv, pkt);
+            av_packet_unref(pkt);
+            if (result < 0) {
+                break;
+            }
+        }
+        result = result == AVERROR_EOF ? 0 : result;
+    }
+
+    free_annexb_converter(&conv);
+    av_packet_free(&pkt);
+    avcodec_parameters_free(&par);
+    close_es_demuxer(&es);
+    return result;
+}
+
+// 以 libavformat 的 hevc 解复用器打开合成视频码流，编码参数直接从参数集解析，不探测。
+// av_read_frame 得到的包由解析器组装，缓冲区只有一个引用，是可写的
+static int32_t open_hevc_input(const bench_env* env, AVFormatContext** ic)
+{
+    if (avformat_open_input(ic, env->video_path.c_str(), av_find_input_format("hevc"), nullptr) < 0) {
+        LOGE("open %s fail\n", env->video_path.c_str());
+        return -1;
+    }
+
+    if ((*ic)->nb_streams != 1 || es_params_fill_stream(env->video_path.c_str(), (*ic)->streams[0]) < 0) {
+        avformat_close_input(ic);
+        return -1;
+    }
+
+    return 0;
+}
+
+// 用 av_read_frame 读取的包转换，4 字节起始码的访问单元全部原地转换，与 annexb_convert 对比缓冲池拷贝的开销
+static int32_t annexb_convert_avio_case(const bench_env* env)
+{
+    AVFormatContext* ic = nullptr;
+    if (open_hevc_input(env, &ic) < 0) {
+        return -1;
+    }
+
+    // 转换器会把 extradata 改写为 hvcC，传入副本
+    AVCodecParameters* par = avcodec_parameters_alloc();
+    AVPacket* pkt = av_packet_alloc();
+    annexb_converter* conv = nullptr;
+    int32_t result = -1;
+    if (par != nullptr && pkt != nullptr && avcodec_parameters_copy(par, ic->streams[0]->codecpar) >= 0) {
+        conv = alloc_annexb_converter(par, 0);
+    }
+
+    if (conv != nullptr) {
+        while ((result = av_read_frame(ic, pkt)) >= 0) {
+            result = annexb_convert_packet(conv, pkt);
+            av_packet_unref(pkt);
+            if (result < 0) {
+                break;
+            }
+        }
+        result = result == AVERROR_EOF ? 0 : result;
+    }
+
+    free_annexb_converter(&conv);
+    av_packet_free(&pkt);
+    avcodec_parameters_free(&par);
+    avformat_close_input(&ic);
+    return result;
+}
+
+// 回调输出的接收端，按 offset 把每次写入拼装为完整的文件
+typedef struct callback_sink {
+    std::vector<uint8_t> data;
+    int64_t writes;
+    int64_t back_patches; ///< offset 小于已写入大小的写入，即 trailer 回写 box 大小
+} callback_sink;
+
+static int32_t callback_sink_write(void* opaque, const uint8_t* buf, int32_t size, int64_t offset)
+{
+    callback_sink* sink = (callback_sink*)opaque;
+    if ((size_t)offset < sink->data.size()) {
+        sink->back_patches++;
+    }
+    if (sink->data.size() < (size_t)offset + size) {
+        sink->data.resize(offset + size);
+    }
+    memcpy(sink->data.data() + offset, buf, size);
+    sink->writes++;
+    return 0;
+}
+
+// 把视频码流复用为内存中的 mp4。convert 为 false 时包保持 Annex-B，由 mov 复用器逐包分配缓冲区转换，
+// 为 true 时先经过 annexb_converter，对比两者的吞吐量和每个包的分配次数。
+// sink 非空时输出交给回调拼装，否则写入可扩容的缓冲区；output 非空时返回完整的输出
+static int32_t run_annexb_mux(const bench_env* env, bool convert, callback_sink* sink, std::vector<uint8_t>* output)
+{
+    AVFormatContext* ic = nullptr;
+    if (open_hevc_input(env, &ic) < 0) {
+        return -1;
+    }
+
+    AVFormatContext* oc = nullptr;
+    AVPacket* pkt = av_packet_alloc();
+    annexb_converter* conv = nullptr;
+    mem_output out = {};
+    AVStream* in_st = ic->streams[0];
+    AVStream* out_st = nullptr;
+    ts_generator ts;
+    int32_t result = -1;
+
+    do {
+        if (pkt == nullptr || avformat_alloc_output_context2(&oc, nullptr, "mp4", nullptr) < 0) {
+            break;
+        }
+
+        out_st = avformat_new_stream(oc, nullptr);
+        if (out_st == nullptr || avcodec_parameters_copy(out_st->codecpar, in_st->codecpar) < 0) {
+            break;
+        }
+        out_st->codecpar->codec_tag = 0;
+        out_st->time_base = in_st->time_base;
+
+        if (convert) {
+            conv = alloc_annexb_converter(out_st->codecpar, 0);
+            if (conv == nullptr) {
+                break;
+            }
+        }
+
+        int32_t ret = sink != nullptr ? open_mem_output_callback(&out, &oc->pb, callback_sink_write, sink)
+                                      : open_mem_output(&out, &oc->pb, 0);
+        if (init_video_ts_generator(&ts, in_st, (AVRational){ STREAM_FRAME_RATE, 1 }) < 0 || ret < 0 ||
+            avformat_write_header(oc, nullptr) < 0) {
+            break;
+        }
+
+        while ((result = av_read_frame(ic, pkt)) >= 0) {
+            ts_generator_fill(&ts, pkt);
+            if (conv != nullptr && (result = annexb_convert_packet(conv, pkt)) < 0) {
+                av_packet_unref(pkt);
+                break;
+            }
+
+            av_packet_rescale_ts(pkt, in_st->time_base, out_st->time_base);
+            pkt->stream_index = out_st->index;
+            result = av_write_frame(oc, pkt);
+            av_packet_unref(pkt);
+            if (result < 0) {
+                break;
+            }
+        }
+
+        if (result == AVERROR_EOF) {
+            result = av_write_trailer(oc);
+        }
+        if (result >= 0 && output != nullptr) {
+            avio_flush(oc->pb);
+            if (sink != nullptr) {
+                output->swap(sink->data);
+            } else {
+                output->assign(out.data, out.data + out.size);
+            }
+        }
+    } while (0);
+
+    free_annexb_converter(&conv);
+    if (oc != nullptr) {
+        close_mem_output(&out, &oc->pb);
+        avformat_free_context(oc);
+    }
+    av_packet_free(&pkt);
+    avformat_close_input(&ic);
+    return result < 0 ? -1 : 0;
+}
+
+static int32_t annexb_mux_movenc_case(const bench_env* env)
+{
+    return run_annexb_mux(env, false, nullptr, nullptr);
+}
+
+static int32_t annexb_mux_converter_case(const bench_env* env)
+{
+    return run_annexb_mux(env, true, nullptr, nullptr);
+}
+
+// 同一码流分别复用到可扩容的缓冲区和回调输出，回调按 offset 拼装的结果与缓冲区中的不一致、
+// 或者 trailer 没有回写时失败。每次迭代复用两遍
+static int32_t mem_output_callback_case(const bench_env* env)
+{
+    std::vector<uint8_t> expected;
+    std::vector<uint8_t> assembled;
+    callback_sink sink = {};
+    if (run_annexb_mux(env, true, nullptr, &expected) < 0 || run_annexb_mux(env, true, &sink, &assembled) < 0) {
+        return -1;
+    }
+
+    if (assembled != expected || sink.back_patches == 0) {
+        LOGE("callback output %zu bytes, %jd back patches, growable output %zu bytes\n", assembled.size(),
+             sink.back_patches, expected.size());
+        return -1;
+    }
+
+    LOGD("callback output %zu bytes in %jd writes, %jd back patches\n", assembled.size(), sink.writes,
+         sink.back_patches);
+    return 0;
+}
+
+// 时间戳测试使用的帧率和时间基。前三个是裸 HEVC 输入的时间基，帧时长为整数；
+// 毫秒和 90 kHz 时间基下帧时长不是整数，逐帧累加时需要处理余数进位
+typedef struct ts_bench_stream {
+    const char* name;
+    AVRational frame_rate;  ///< 视频帧率，音频为 0
+    int32_t sample_rate;    ///< AAC 采样率，视频为 0
+    AVRational time_base;
+} ts_bench_stream;
+
+static const ts_bench_stream ts_bench_streams[] = {
+    { "25fps", { 25, 1 }, 0, { 1, 1200000 } },
+    { "29.97fps", { 30000, 1001 }, 0, { 1, 1200000 } },
+    { "59.94fps", { 60000, 1001 }, 0, { 1, 1200000 } },
+    { "29.97fps_ms", { 30000, 1001 }, 0, { 1, 1000 } },
+    { "aac_44100", { 0, 0 }, 44100, { 1, 28224000 } },
+    { "aac_48000", { 0, 0 }, 48000, { 1, 28224000 } },
+    { "aac_44100_90k", { 0, 0 }, 44100, { 1, 90000 } },
+    { "aac_48000_ms", { 0, 0 }, 48000, { 1, 1000 } },
+};
+
+#define TS_BENCH_SECONDS (10 * 3600)
+#define AAC_FRAME_SIZE 1024
+
+// 10 小时的帧数
+static int64_t ts_bench_frames(const ts_bench_stream* s)
+{
+    if (s->sample_rate > 0) {
+        return (int64_t)TS_BENCH_SECONDS * s->sample_rate / AAC_FRAME_SIZE;
+    }
+    return (int64_t)TS_BENCH_SECONDS * s->frame_rate.num / s->frame_rate.den;
+}
+
+static int64_t ts_bench_total_frames()
+{
+    int64_t total = 0;
+    for (const ts_bench_stream& s : ts_bench_streams) {
+        total += ts_bench_frames(&s);
+    }
+    return total;
+}
+
+// 第 idx 帧的精确时间戳，四舍五入到最近的 time_base 单位
+static int64_t ts_bench_exact(const ts_bench_stream* s, int64_t idx)
+{
+    if (s->sample_rate > 0) {
+        return av_rescale(idx, (int64_t)AAC_FRAME_SIZE * s->time_base.den, (int64_t)s->sample_rate * s->time_base.num);
+    }
+    return av_rescale(idx, (int64_t)s->frame_rate.den * s->time_base.den,
+                      (int64_t)s->frame_rate.num * s->time_base.num);
+}
+
+static int32_t init_ts_bench_generator(const ts_bench_stream* s, ts_generator* gen)
+{
+    AVCodecParameters par = {};
+    AVStream st = {};
+    st.codecpar = &par;
+    st.time_base = s->time_base;
+    if (s->sample_rate > 0) {
+        par.sample_rate = s->sample_rate;
+        par.frame_size = AAC_FRAME_SIZE;
+        return init_audio_ts_generator(gen, &st);
+    }
+
+    st.r_frame_rate = s->frame_rate;
+    return init_video_ts_generator(gen, &st, s->frame_rate);
+}
+
+// ts_generator 之前的做法：帧时长先截断为微秒，每个包再用 double 换算到 time_base
+static inline void ts_bench_double_fill(AVRational frame_rate, AVRational time_base, int64_t idx, AVPacket* pkt)
+{
+    int64_t frame_duration = (double)AV_TIME_BASE / av_q2d(frame_rate);
+    pkt->duration = (double)frame_duration / (double)(av_q2d(time_base) * AV_TIME_BASE);
+    pkt->pts = (double)(idx * frame_duration) / (double)(av_q2d(time_base) * AV_TIME_BASE);
+    pkt->dts = pkt->pts;
+}
+
+static AVRational ts_bench_frame_rate(const ts_bench_stream* s)
+{
+    return s->sample_rate > 0 ? (AVRational){ s->sample_rate, AAC_FRAME_SIZE } : s->frame_rate;
+}
+
+// 逐包调用 ts_generator_fill，与 ts_generator_double 对比每个包的开销。最后一帧不等于精确值时失败
+static int32_t ts_generator_case(const bench_env* env)
+{
+    AVPacket pkt = {};
+    for (const ts_bench_stream& s : ts_bench_streams) {
+        ts_generator gen;
+        if (init_ts_bench_generator(&s, &gen) < 0) {
+            return -1;
+        }
+
+        int64_t frames = ts_bench_frames(&s);
+        for (int64_t i = 0; i < frames; i++) {
+            ts_generator_fill(&gen, &pkt);
+        }
+        if (pkt.pts != ts_bench_exact(&s, frames - 1)) {
+            LOGE("%s: frame %jd pts %jd, expected %jd\n", s.name, frames - 1, pkt.pts, ts_bench_exact(&s, frames - 1));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int32_t ts_generator_double_case(const bench_env* env)
+{
+    AVPacket pkt = {};
+    int64_t sum = 0;
+    for (const ts_bench_stream& s : ts_bench_streams) {
+        AVRational frame_rate = ts_bench_frame_rate(&s);
+        int64_t frames = ts_bench_frames(&s);
+        for (int64_t i = 0; i < frames; i++) {
+            ts_bench_double_fill(frame_rate, s.time_base, i, &pkt);
+            sum += pkt.pts;
+        }
+    }
+
+    // 使用计算结果，避免循环被编译器优化掉
+    return sum >= 0 ? 0 : -1;
+}
+
+// 逐帧对比 10 小时内每一帧的时间戳与精确值，每种帧率输出一行 JSON。ts_generator 有任何一帧不等于精确值时失败，
+// double 的做法只输出误差
+static int32_t ts_drift_case(const bench_env* env)
+{
+    int32_t result = 0;
+    AVPacket pkt = {};
+    for (const ts_bench_stream& s : ts_bench_streams) {
+        ts_generator gen;
+        if (init_ts_bench_generator(&s, &gen) < 0) {
+            return -1;
+        }
+
+        AVRational frame_rate = ts_bench_frame_rate(&s);
+        int64_t frames = ts_bench_frames(&s);
+        int64_t max_error = 0;
+        int64_t double_max_error = 0;
+        int64_t double_end_error = 0;
+        for (int64_t i = 0; i < frames; i++) {
+            int64_t exact = ts_bench_exact(&s, i);
+            ts_generator_fill(&gen, &pkt);
+            max_error = FFMAX(max_error, FFABS(pkt.pts - exact));
+
+            ts_bench_double_fill(frame_rate, s.time_base, i, &pkt);
+            double_end_error = pkt.pts - exact;
+            double_max_error = FFMAX(double_max_error, FFABS(double_end_error));
+        }
+
+        // 误差同时以 time_base 单位和毫秒表示
+        printf("{\"drift\":\"%s\",\"time_base\":\"%d/%d\",\"frames\":%jd,\"max_error\":%jd,"
+               "\"double_max_error\":%jd,\"double_end_error_ms\":%.3f}\n",
+               s.name, s.time_base.num, s.time_base.den, frames, max_error, double_max_error,
+               double_end_error * av_q2d(s.time_base) * 1000);
+        if (max_error != 0) {
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+static const bench_case cases[] = {
+    { "muxer_core", muxer_core_case, BENCH_COUNT_MUX },
+    { "muxer_core_pipelined", muxer_core_pipelined_case, BENCH_COUNT_MUX },
+    { "muxer_core_direct", muxer_core_direct_case, BENCH_COUNT_MUX },
+    { "muxer_core_pipelined_direct", muxer_core_pipelined_direct_case, BENCH_COUNT_MUX },
+    { "muxer_core_native", muxer_core_native_case, BENCH_COUNT_MUX },
+    { "muxer_core_native_direct", muxer_core_native_direct_case, BENCH_COUNT_MUX },
+    { "muxer_core_uring", muxer_core_uring_case, BENCH_COUNT_MUX },
+    { "muxer_core_write_behind", muxer_core_write_behind_case, BENCH_COUNT_MUX },
+    { "mem_io_muxer", mem_io_muxer_case, BENCH_COUNT_MUX },
+    { "mem_io_muxer_zero_copy", mem_io_muxer_zero_copy_case, BENCH_COUNT_MUX },
+    { "open_input", open_input_case, BENCH_COUNT_NONE },
+    { "open_input_cached", open_input_cached_case, BENCH_COUNT_NONE },
+    { "open_input_fast", open_input_fast_case, BENCH_COUNT_NONE },
+    { "es_index", es_index_case, BENCH_COUNT_NONE },
+    { "annexb_convert", annexb_convert_case, BENCH_COUNT_VIDEO },
+    { "annexb_convert_avio", annexb_convert_avio_case, BENCH_COUNT_VIDEO },
+    { "annexb_mux_movenc", annexb_mux_movenc_case, BENCH_COUNT_VIDEO },
+    { "annexb_mux_converter", annexb_mux_converter_case, BENCH_COUNT_VIDEO },
+    { "ts_generator", ts_generator_case, BENCH_COUNT_TIMESTAMPS },
+    { "ts_generator_double", ts_generator_double_case, BENCH_COUNT_TIMESTAMPS },
+    { "ts_drift", ts_drift_case, BENCH_COUNT_NONE },
+    { "mem_output_callback", mem_output_callback_case, BENCH_COUNT_VIDEO },
+};
+
+// 清零进程的 RSS 峰值，使每个测试项的峰值互不影响。内核不支持时峰值是进程启动以来的最大值
+static void reset_peak_rss()
+{
+    FILE* fp = fopen("/proc/self/clear_refs", "w");
+    if (fp != nullptr) {
+        fputs("5", fp);
+        fclose(fp);
+    }
+}
+
+static int64_t peak_rss_kb()
+{
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp != nullptr) {
+        char line[256];
+        long long kb = -1;
+        while (fgets(line, sizeof(line), fp) != nullptr) {
+            if (sscanf(line, "VmHWM: %lld kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(fp);
+        if (kb >= 0) {
+            return kb;
+        }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// 删除临时目录及其中的文件
+static void remove_dir(const char* path)
+{
+    DIR* dir = opendir(path);
+    if (dir != nullptr) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                unlink((std::string(path) + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+static int32_t run_case(const bench_case* c, const bench_env* env, int32_t iterations)
+{
+    // 预热一次，排除首次打开编解码器、分配全局表等一次性开销
+    reset_peak_rss();
+    int32_t result = c->iterate(env);
+
+    int64_t alloc_calls = g_alloc_calls.load();
+    int64_t alloc_bytes = g_alloc_bytes.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int32_t i = 0; i < iterations && result >= 0; i++) {
+        result = c->iterate(env);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    alloc_calls = g_alloc_calls.load() - alloc_calls;
+    alloc_bytes = g_alloc_bytes.load() - alloc_bytes;
+
+    int64_t packets = 0;
+    int64_t bytes = 0;
+    if (c->count == BENCH_COUNT_MUX) {
+        packets = env->packets * iterations;
+        bytes = env->bytes * iterations;
+    } else if (c->count == BENCH_COUNT_VIDEO) {
+        packets = env->video_packets * iterations;
+        bytes = env->video_bytes * iterations;
+    } else if (c->count == BENCH_COUNT_TIMESTAMPS) {
+        packets = env->timestamps * iterations;
+    }
+    printf("{\"case\":\"%s\",\"ok\":%s,\"iterations\":%d,\"packets\":%jd,\"bytes\":%jd,\"seconds\":%.6f,"
+           "\"ms_per_iteration\":%.3f,\"packets_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"allocs_per_packet\":%.3f,"
+           "\"alloc_bytes_per_packet\":%.1f,\"peak_rss_kb\":%jd}\n",
+           c->name, result >= 0 ? "true" : "false", iterations, packets, bytes, elapsed, elapsed * 1000 / iterations,
+           elapsed > 0 ? packets / elapsed : 0.0, elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0.0,
+           packets > 0 ? (double)alloc_calls / packets : 0.0, packets > 0 ? (double)alloc_bytes / packets : 0.0,
+           peak_rss_kb());
+    fflush(stdout);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    int32_t iterations = 5;
+    const char* only_case = nullptr;
+    synth_options synth;
+    init_synth_options(&synth);
+    log_set_level(LOG_LEVEL_ERROR);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:b:g:s:c:l:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'd':
+            synth.duration_ms = atoi(optarg);
+            break;
+        case 'b':
+            synth.video_bitrate = atoi(optarg);
+            break;
+        case 'g':
+            synth.gop_size = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &synth.width, &synth.height) != 2) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'c':
+            only_case = optarg;
+            break;
+        case 'l':
+            if (log_parse_level(optarg) < LOG_LEVEL_QUIET) {
+                usage(argv[0]);
+                return 1;
+            }
+            log_set_level(log_parse_level(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (iterations <= 0 || synth.duration_ms <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // av_dump_format 等信息输出到 stderr，只保留错误信息，避免干扰结果
+    av_log_set_level(AV_LOG_ERROR);
+
+    synth_stream video;
+    synth_stream audio;
+    if (synth_hevc(&synth, &video) < 0 || synth_adts(&synth, &audio) < 0) {
+        LOGE("invalid synthetic stream options\n");
+        return 1;
+    }
+
+    bench_env env;
+    env.packets = video.frames + audio.frames;
+    env.bytes = video.data.size() + audio.data.size();
+    env.video_packets = video.frames;
+    env.video_bytes = video.data.size();
+    env.timestamps = ts_bench_total_frames();
+    if (make_memfd("bench_video.hevc", video.data, env.video_path) < 0 ||
+        make_memfd("bench_audio.aac", audio.data, env.audio_path) < 0) {
+        return 1;
+    }
+
+    // muxer_core 按文件名打开输出，并由扩展名推断输出格式，因此输出到一个临时 mp4 文件
+    const char* tmp_dir = getenv("TMPDIR") != nullptr ? getenv("TMPDIR") : "/tmp";
+    std::string output_template = std::string(tmp_dir) + "/mux_bench_XXXXXX.mp4";
+    std::vector<char> output_path(output_template.begin(), output_template.end());
+    output_path.push_back('\0');
+    int output_fd = mkstemps(output_path.data(), 4);
+    if (output_fd < 0) {
+        LOGE("create temporary output in %s fail: %s\n", tmp_dir, strerror(errno));
+        return 1;
+    }
+    close(output_fd);
+    env.output_path = output_path.data();
+
+    std::string cache_template = std::string(tmp_dir) + "/mux_bench_probe_XXXXXX";
+    std::vector<char> cache_dir(cache_template.begin(), cache_template.end());
+    cache_dir.push_back('\0');
+    if (mkdtemp(cache_dir.data()) == nullptr) {
+        LOGE("create temporary probe cache directory in %s fail: %s\n", tmp_dir, strerror(errno));
+        unlink(env.output_path.c_str());
+        return 1;
+    }
+    env.probe_cache_dir = cache_dir.data();
+
+    int32_t failed = 0;
+    bool found = false;
+    for (const bench_case& c : cases) {
+        if (only_case != nullptr && strcmp(only_case, c.name) != 0) {
+            continue;
+        }
+        found = true;
+        if (run_case(&c, &env, iterations) < 0) {
+            failed++;
+        }
+    }
+
+    unlink(env.output_path.c_str());
+    remove_dir(env.probe_cache_dir.c_str());
+    if (!found) {
+        LOGE("unknown case %s\n", only_case);
+        return 1;
+    }
+
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,336 @@
+#include "synth_es.h"
+#include <string.h>
+
+// HEVC NAL 单元类型
+#define HEVC_NAL_TRAIL_R 1
+#define HEVC_NAL_IDR_W_RADL 19
+#define HEVC_NAL_VPS 32
+#define HEVC_NAL_SPS 33
+#define HEVC_NAL_PPS 34
+
+// slice header 之外的负载中不会出现连续的 0，因此不需要防竞争字节，也不会被误认为起始码
+#define FILL_BYTE 0xa5
+
+void init_synth_options(synth_options* opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->width = 1280;
+    opts->height = 720;
+    opts->frame_rate = 25;
+    opts->gop_size = 50;
+    opts->video_bitrate = 4 * 1000 * 1000;
+    opts->sample_rate = 48000;
+    opts->audio_bitrate = 128 * 1000;
+    opts->duration_ms = 60 * 1000;
+}
+
+// 按位写入 RBSP
+struct bit_writer {
+    std::vector<uint8_t> data;
+    uint32_t cache = 0;
+    int32_t bits = 0;
+
+    void put(int32_t n, uint32_t value)
+    {
+        for (int32_t i = n - 1; i >= 0; i--) {
+            cache = (cache << 1) | ((value >> i) & 1);
+            if (++bits == 8) {
+                data.push_back((uint8_t)cache);
+                cache = 0;
+                bits = 0;
+            }
+        }
+    }
+
+    void put_ue(uint32_t value)
+    {
+        uint32_t v = value + 1;
+        int32_t len = 0;
+        while ((v >> len) > 1) {
+            len++;
+        }
+        put(len, 0);
+        put(len + 1, v);
+    }
+
+    void put_se(int32_t value)
+    {
+        put_ue(value > 0 ? 2 * value - 1 : -2 * value);
+    }
+
+    // rbsp_trailing_bits：一个 1 加上补齐到字节边界的 0
+    void put_trailing()
+    {
+        put(1, 1);
+        if (bits > 0) {
+            put(8 - bits, 0);
+        }
+    }
+
+    void align_zero()
+    {
+        if (bits > 0) {
+            put(8 - bits, 0);
+        }
+    }
+};
+
+// 写入起始码、NAL 头以及插入防竞争字节之后的 RBSP
+static void put_nal(std::vector<uint8_t>& out, int32_t type, const std::vector<uint8_t>& rbsp)
+{
+    static const uint8_t start_code[] = { 0, 0, 0, 1 };
+    out.insert(out.end(), start_code, start_code + sizeof(start_code));
+    out.push_back((uint8_t)(type << 1));
+    out.push_back(1); // nuh_layer_id 0, nuh_temporal_id_plus1 1
+
+    int32_t zeros = 0;
+    for (uint8_t byte : rbsp) {
+        if (zeros == 2 && byte <= 3) {
+            out.push_back(3);
+            zeros = 0;
+        }
+        out.push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+}
+
+// Main profile，Main tier，level 4.1
+static void put_profile_tier_level(bit_writer& bw)
+{
+    bw.put(2, 0);          // general_profile_space
+    bw.put(1, 0);          // general_tier_flag
+    bw.put(5, 1);          // general_profile_idc
+    bw.put(32, 0x60000000); // general_profile_compatibility_flag[1] 和 [2]
+    bw.put(1, 1);          // general_progressive_source_flag
+    bw.put(1, 0);          // general_interlaced_source_flag
+    bw.put(1, 0);          // general_non_packed_constraint_flag
+    bw.put(1, 1);          // general_frame_only_constraint_flag
+    bw.put(32, 0);         // general_reserved_zero_43bits + general_inbld_flag，共 44 位
+    bw.put(12, 0);
+    bw.put(8, 123);        // general_level_idc
+}
+
+static void put_vps(std::vector<uint8_t>& out)
+{
+    bit_writer bw;
+    bw.put(4, 0);      // vps_video_parameter_set_id
+    bw.put(1, 1);      // vps_base_layer_internal_flag
+    bw.put(1, 1);      // vps_base_layer_available_flag
+    bw.put(6, 0);      // vps_max_layers_minus1
+    bw.put(3, 0);      // vps_max_sub_layers_minus1
+    bw.put(1, 1);      // vps_temporal_id_nesting_flag
+    bw.put(16, 0xffff); // vps_reserved_0xffff_16bits
+    put_profile_tier_level(bw);
+    bw.put(1, 1);      // vps_sub_layer_ordering_info_present_flag
+    bw.put_ue(1);      // vps_max_dec_pic_buffering_minus1
+    bw.put_ue(0);      // vps_max_num_reorder_pics
+    bw.put_ue(0);      // vps_max_latency_increase_plus1
+    bw.put(6, 0);      // vps_max_layer_id
+    bw.put_ue(0);      // vps_num_layer_sets_minus1
+    bw.put(1, 0);      // vps_timing_info_present_flag
+    bw.put(1, 0);      // vps_extension_flag
+    bw.put_trailing();
+    put_nal(out, HEVC_NAL_VPS, bw.data);
+}
+
+static void put_sps(std::vector<uint8_t>& out, const synth_options* opts)
+{
+    bit_writer bw;
+    bw.put(4, 0);          // sps_video_parameter_set_id
+    bw.put(3, 0);          // sps_max_sub_layers_minus1
+    bw.put(1, 1);          // sps_temporal_id_nesting_flag
+    put_profile_tier_level(bw);
+    bw.put_ue(0);          // sps_seq_parameter_set_id
+    bw.put_ue(1);          // chroma_format_idc，4:2:0
+    bw.put_ue(opts->width);  // pic_width_in_luma_samples
+    bw.put_ue(opts->height); // pic_height_in_luma_samples
+    bw.put(1, 0);          // conformance_window_flag
+    bw.put_ue(0);          // bit_depth_luma_minus8
+    bw.put_ue(0);          // bit_depth_chroma_minus8
+    bw.put_ue(4);          // log2_max_pic_order_cnt_lsb_minus4
+    bw.put(1, 1);          // sps_sub_layer_ordering_info_present_flag
+    bw.put_ue(1);          // sps_max_dec_pic_buffering_minus1
+    bw.put_ue(0);          // sps_max_num_reorder_pics
+    bw.put_ue(0);          // sps_max_latency_increase_plus1
+    bw.put_ue(0);          // log2_min_luma_coding_block_size_minus3
+    bw.put_ue(3);          // log2_diff_max_min_luma_coding_block_size，CTB 64x64
+    bw.put_ue(0);          // log2_min_luma_transform_block_size_minus2
+    bw.put_ue(3);          // log2_diff_max_min_luma_transform_block_size
+    bw.put_ue(1);          // max_transform_hierarchy_depth_inter
+    bw.put_ue(1);          // max_transform_hierarchy_depth_intra
+    bw.put(1, 0);          // scaling_list_enabled_flag
+    bw.put(1, 0);          // amp_enabled_flag
+    bw.put(1, 0);          // sample_adaptive_offset_enabled_flag
+    bw.put(1, 0);          // pcm_enabled_flag
+    bw.put_ue(0);          // num_short_term_ref_pic_sets
+    bw.put(1, 0);          // long_term_ref_pics_present_flag
+    bw.put(1, 0);          // sps_temporal_mvp_enabled_flag
+    bw.put(1, 0);          // strong_intra_smoothing_enabled_flag
+    bw.put(1, 0);          // vui_parameters_present_flag
+    bw.put(1, 0);          // sps_extension_present_flag
+    bw.put_trailing();
+    put_nal(out, HEVC_NAL_SPS, bw.data);
+}
+
+static void put_pps(std::vector<uint8_t>& out)
+{
+    bit_writer bw;
+    bw.put_ue(0);  // pps_pic_parameter_set_id
+    bw.put_ue(0);  // pps_seq_parameter_set_id
+    bw.put(1, 0);  // dependent_slice_segments_enabled_flag
+    bw.put(1, 0);  // output_flag_present_flag
+    bw.put(3, 0);  // num_extra_slice_header_bits
+    bw.put(1, 0);  // sign_data_hiding_enabled_flag
+    bw.put(1, 0);  // cabac_init_present_flag
+    bw.put_ue(0);  // num_ref_idx_l0_default_active_minus1
+    bw.put_ue(0);  // num_ref_idx_l1_default_active_minus1
+    bw.put_se(0);  // init_qp_minus26
+    bw.put(1, 0);  // constrained_intra_pred_flag
+    bw.put(1, 0);  // transform_skip_enabled_flag
+    bw.put(1, 0);  // cu_qp_delta_enabled_flag
+    bw.put_se(0);  // pps_cb_qp_offset
+    bw.put_se(0);  // pps_cr_qp_offset
+    bw.put(1, 0);  // pps_slice_chroma_qp_offsets_present_flag
+    bw.put(1, 0);  // weighted_pred_flag
+    bw.put(1, 0);  // weighted_bipred_flag
+    bw.put(1, 0);  // transquant_bypass_enabled_flag
+    bw.put(1, 0);  // tiles_enabled_flag
+    bw.put(1, 0);  // entropy_coding_sync_enabled_flag
+    bw.put(1, 0);  // pps_loop_filter_across_slices_enabled_flag
+    bw.put(1, 0);  // deblocking_filter_control_present_flag
+    bw.put(1, 0);  // pps_scaling_list_data_present_flag
+    bw.put(1, 0);  // lists_modification_present_flag
+    bw.put_ue(0);  // log2_parallel_merge_level_minus2
+    bw.put(1, 0);  // slice_segment_header_extension_present_flag
+    bw.put(1, 0);  // pps_extension_present_flag
+    bw.put_trailing();
+    put_nal(out, HEVC_NAL_PPS, bw.data);
+}
+
+// 一帧只有一个 slice。slice header 写到 slice_pic_order_cnt_lsb 为止，足够 libavformat 的 hevc parser
+// 判断帧边界、帧类型和关键帧，之后用填充字节补足帧大小
+static void put_slice(std::vector<uint8_t>& out, bool idr, int32_t poc, size_t size)
+{
+    bit_writer bw;
+    bw.put(1, 1);          // first_slice_segment_in_pic_flag
+    if (idr) {
+        bw.put(1, 0);      // no_output_of_prior_pics_flag
+    }
+    bw.put_ue(0);          // slice_pic_parameter_set_id
+    bw.put_ue(idr ? 2 : 1); // slice_type，I 或 P
+    if (!idr) {
+        bw.put(8, poc & 0xff); // slice_pic_order_cnt_lsb
+        bw.put(1, 0);      // short_term_ref_pic_set_sps_flag
+    }
+    bw.align_zero();
+
+    while (bw.data.size() + 1 < size) {
+        bw.data.push_back(FILL_BYTE);
+    }
+    bw.data.push_back(0x80); // rbsp_slice_segment_trailing_bits
+    put_nal(out, idr ? HEVC_NAL_IDR_W_RADL : HEVC_NAL_TRAIL_R, bw.data);
+}
+
+int32_t synth_hevc(const synth_options* opts, synth_stream* out)
+{
+    // 最小编码块为 8x8，分辨率必须是它的整数倍
+    if (opts->width <= 0 || opts->height <= 0 || opts->width % 8 != 0 || opts->height % 8 != 0 ||
+        opts->frame_rate <= 0 || opts->gop_size <= 0) {
+        return -1;
+    }
+
+    int64_t frames = (int64_t)opts->duration_ms * opts->frame_rate / 1000;
+    size_t avg_size = (size_t)opts->video_bitrate / 8 / opts->frame_rate;
+
+    // 一个 GOP 的总大小为 gop_size * avg_size，其中 IDR 帧是 P 帧的 key_ratio 倍
+    int32_t key_ratio = opts->gop_size / 4 > 1 ? opts->gop_size / 4 : 1;
+    size_t p_size = avg_size * opts->gop_size / (key_ratio + opts->gop_size - 1);
+    size_t idr_size = p_size * key_ratio;
+
+    out->data.clear();
+    out->data.reserve((size_t)(frames * avg_size * 11 / 10) + 1024);
+    for (int64_t i = 0; i < frames; i++) {
+        int32_t poc = i % opts->gop_size;
+        if (poc == 0) {
+            put_vps(out->data);
+            put_sps(out->data, opts);
+            put_pps(out->data);
+            put_slice(out->data, true, 0, idr_size);
+        } else {
+            put_slice(out->data, false, poc, p_size);
+        }
+    }
+
+    out->frames = frames;
+    return 0;
+}
+
+int32_t synth_adts(const synth_options* opts, synth_stream* out)
+{
+    static const int32_t sample_rates[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000,
+                                            22050, 16000, 12000, 11025, 8000, 7350 };
+    int32_t sr_index = -1;
+    for (int32_t i = 0; i < (int32_t)(sizeof(sample_rates) / sizeof(sample_rates[0])); i++) {
+        if (sample_rates[i] == opts->sample_rate) {
+            sr_index = i;
+        }
+    }
+    if (sr_index < 0) {
+        return -1;
+    }
+
+    // raw_data_block：一个最大 sfb 为 0 的 SCE（解码结果为静音），一个 FIL 填充元素，最后是 END
+    int32_t target = (int32_t)((int64_t)opts->audio_bitrate / 8 * 1024 / opts->sample_rate) - 7;
+    int32_t fill_count = target - 6;
+    fill_count = fill_count < 0 ? 0 : (fill_count > 269 ? 269 : fill_count);
+
+    bit_writer bw;
+    bw.put(3, 0);   // id_syn_ele，SCE
+    bw.put(4, 0);   // element_instance_tag
+    bw.put(8, 100); // global_gain
+    bw.put(1, 0);   // ics_reserved_bit
+    bw.put(2, 0);   // window_sequence，ONLY_LONG_SEQUENCE
+    bw.put(1, 0);   // window_shape
+    bw.put(6, 0);   // max_sfb
+    bw.put(1, 0);   // predictor_data_present
+    bw.put(1, 0);   // pulse_data_present
+    bw.put(1, 0);   // tns_data_present
+    bw.put(1, 0);   // gain_control_data_present
+    if (fill_count > 0) {
+        bw.put(3, 6); // id_syn_ele，FIL
+        if (fill_count < 15) {
+            bw.put(4, fill_count);
+        } else {
+            bw.put(4, 15);
+            bw.put(8, fill_count - 14);
+        }
+        bw.put(8, 0); // extension_type EXT_FILL 以及 fill_nibble
+        for (int32_t i = 1; i < fill_count; i++) {
+            bw.put(8, FILL_BYTE);
+        }
+    }
+    bw.put(3, 7);   // id_syn_ele，END
+    bw.align_zero();
+    const std::vector<uint8_t>& raw = bw.data;
+
+    int32_t frame_length = 7 + (int32_t)raw.size();
+    uint8_t header[7];
+    header[0] = 0xff;
+    header[1] = 0xf1;                                // MPEG-4，layer 0，protection_absent
+    header[2] = (uint8_t)((1 << 6) | (sr_index << 2)); // AAC LC，private_bit 0，channel_configuration 高位 0
+    header[3] = (uint8_t)((1 << 6) | (frame_length >> 11)); // channel_configuration 1
+    header[4] = (uint8_t)(frame_length >> 3);
+    header[5] = (uint8_t)(((frame_length & 7) << 5) | 0x1f); // adts_buffer_fullness 0x7ff
+    header[6] = 0xfc;                                // number_of_raw_data_blocks_in_frame 0
+
+    int64_t frames = (int64_t)opts->duration_ms * opts->sample_rate / 1000 / 1024;
+    out->data.clear();
+    out->data.reserve((size_t)(frames * frame_length));
+    for (int64_t i = 0; i < frames; i++) {
+        out->data.insert(out->data.end(), header, header + sizeof(header));
+        out->data.insert(out->data.end(), raw.begin(), raw.end());
+    }
+
+    out->frames = frames;
+    return 0;
+}
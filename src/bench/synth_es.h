@@ -0,0 +1,38 @@
+//
+// 在内存中生成合成的 HEVC Annex-B 与 AAC ADTS 码流，基准测试不依赖任何素材文件
+//
+
+#ifndef SYNTH_ES_H
+#define SYNTH_ES_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+typedef struct synth_options {
+    int32_t width;
+    int32_t height;
+    int32_t frame_rate;      ///< 视频帧率
+    int32_t gop_size;        ///< 每隔多少帧一个 IDR 帧
+    int32_t video_bitrate;   ///< 视频码率，单位 bit/s，决定每帧的大小，IDR 帧是 P 帧的 gop_size / 4 倍左右
+    int32_t sample_rate;     ///< 音频采样率，只支持 ADTS 采样率表中的值
+    int32_t audio_bitrate;   ///< 音频码率，单位 bit/s
+    int32_t duration_ms;
+} synth_options;
+
+void init_synth_options(synth_options* opts);
+
+// 生成的码流以及其中的帧数
+typedef struct synth_stream {
+    std::vector<uint8_t> data;
+    int64_t frames;
+} synth_stream;
+
+// 生成 HEVC Main profile 的 Annex-B 码流。每个 IDR 帧前带有 VPS/SPS/PPS，参数集和 slice header 都是合法的，
+// libavformat 可以据此探测出分辨率、像素格式和关键帧，slice 数据本身不可解码
+int32_t synth_hevc(const synth_options* opts, synth_stream* out);
+
+// 生成单声道 AAC LC 的 ADTS 码流，每帧都是可以正常解码的静音帧，并用填充元素补足码率
+int32_t synth_adts(const synth_options* opts, synth_stream* out);
+
+#endif
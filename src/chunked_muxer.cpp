@@ -0,0 +1,578 @@
+#include "chunked_muxer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "annexb_converter.h"
+#include "es_index.h"
+#include "es_params.h"
+#include "log.h"
+#include "muxer_core.h"
+#include "probe_cache.h"
+#include "ts_generator.h"
+
+extern "C" {
+#include <libavutil/avstring.h>
+#include <libavutil/mathematics.h>
+}
+
+// 只读映射的音频文件，逐帧跳过 ADTS 帧头时不需要把整个文件读到内存
+struct mapped_file {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+static int32_t map_file(const char* filename, mapped_file* file)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        LOGE("open %s fail\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        LOGE("stat %s fail or empty file\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOGE("mmap %s fail\n", filename);
+        return -1;
+    }
+
+    // 逐帧跳过是顺序读取，提示内核加大预读
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    file->data = (const uint8_t*)data;
+    file->size = st.st_size;
+    return 0;
+}
+
+static void unmap_file(mapped_file* file)
+{
+    if (file->data != nullptr) {
+        munmap((void*)file->data, file->size);
+        file->data = nullptr;
+    }
+}
+
+// 一块的范围和起点。视频和音频各自是输入文件中的一段连续字节，起点帧序号用于生成连续的时间戳
+struct chunk {
+    int64_t video_start = 0;
+    int64_t video_end = 0;
+    int64_t video_frame = 0; ///< 块内第一帧在整个视频流中的序号
+    int64_t audio_start = 0;
+    int64_t audio_end = 0;
+    int64_t audio_frame = 0;
+    std::string part_file;
+    int32_t result = 0;
+};
+
+// 在 ADTS 码流中逐帧跳过帧头，找到各块起点帧对应的字节位置。frames 为按升序排列的帧序号，超出码流时为文件末尾
+static int32_t find_audio_offsets(const mapped_file* audio, const std::vector<int64_t>& frames,
+                                  std::vector<int64_t>& offsets)
+{
+    offsets.assign(frames.size(), audio->size);
+    size_t pos = 0;
+    int64_t idx = 0;
+    size_t next = 0;
+    while (next < frames.size()) {
+        if (frames[next] == idx) {
+            offsets[next++] = pos;
+            continue;
+        }
+
+        if (pos + 7 > audio->size) {
+            break;
+        }
+
+        const uint8_t* h = audio->data + pos;
+        if (h[0] != 0xFF || (h[1] & 0xF6) != 0xF0) {
+            LOGE("lost adts sync at %zu\n", pos);
+            return -1;
+        }
+
+        size_t frame_length = ((h[3] & 0x03) << 11) | (h[4] << 3) | (h[5] >> 5);
+        if (frame_length < 7) {
+            LOGE("invalid adts frame length at %zu\n", pos);
+            return -1;
+        }
+        pos += frame_length;
+        idx++;
+    }
+
+    return 0;
+}
+
+// 整个文件的流参数，只探测一次，各块的输入直接使用
+struct chunked_job {
+    const char* video_file;
+    const char* audio_file;
+    AVFormatContext* video_ic = nullptr;
+    AVFormatContext* audio_ic = nullptr;
+    ts_generator video_ts;
+    ts_generator audio_ts;
+    AVRational frame_rate;
+};
+
+static int32_t open_whole_input(const char* filename, const char* format, AVFormatContext** ic)
+{
+    if (avformat_open_input(ic, filename, av_find_input_format(format), nullptr) < 0 || (*ic)->nb_streams != 1) {
+        LOGE("open %s fail\n", filename);
+        return -1;
+    }
+
+    if (es_params_fill_stream(filename, (*ic)->streams[0]) < 0 &&
+        probe_cache_find_stream_info(nullptr, filename, *ic) < 0) {
+        LOGE("find stream info of %s fail\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+// 块的输入用 subfile 协议只读取文件中的一段，编码参数从整个文件的探测结果复制，不再探测
+static int32_t open_chunk_input(const char* filename, const char* format, int64_t start, int64_t end,
+                                const AVFormatContext* whole, AVFormatContext** ic)
+{
+    std::string url = "subfile,,start," + std::to_string(start) + ",end," + std::to_string(end) + ",,:" + filename;
+    if (avformat_open_input(ic, url.c_str(), av_find_input_format(format), nullptr) < 0 || (*ic)->nb_streams != 1) {
+        LOGE("open %s fail\n", url.c_str());
+        return -1;
+    }
+
+    AVStream* st = (*ic)->streams[0];
+    if (avcodec_parameters_copy(st->codecpar, whole->streams[0]->codecpar) < 0) {
+        return -1;
+    }
+    st->time_base = whole->streams[0]->time_base;
+    return 0;
+}
+
+static int32_t read_chunk_packet(AVFormatContext* ic, ts_generator* ts, AVStream* out_st, AVPacket* pkt)
+{
+    if (ic == nullptr) {
+        return AVERROR_EOF;
+    }
+
+    int32_t ret = av_read_frame(ic, pkt);
+    if (ret < 0) {
+        return ret;
+    }
+
+    AVRational in_tb = ic->streams[0]->time_base;
+    ts_generator_fill(ts, pkt);
+    pkt->pts = av_rescale_q(pkt->pts, in_tb, out_st->time_base);
+    pkt->dts = av_rescale_q(pkt->dts, in_tb, out_st->time_base);
+    pkt->duration = av_rescale_q(pkt->duration, in_tb, out_st->time_base);
+    pkt->stream_index = out_st->index;
+    return 0;
+}
+
+// 复用一块，输出为只包含本块分片的 fragmented MP4。frag_discont 使第一个分片的 tfdt 取包的实际 dts，
+// 各块分片的时间线因此与整个文件连续，拼接时不需要改写时间戳
+static int32_t mux_chunk(const chunked_job* job, chunk* c)
+{
+    AVFormatContext* video_ic = nullptr;
+    AVFormatContext* audio_ic = nullptr;
+    AVFormatContext* oc = nullptr;
+    annexb_converter* annexb = nullptr;
+    AVPacket* pkts[2] = { av_packet_alloc(), av_packet_alloc() };
+    AVDictionary* opts = nullptr;
+    int32_t result = -1;
+
+    do {
+        if (pkts[0] == nullptr || pkts[1] == nullptr) {
+            break;
+        }
+        if (open_chunk_input(job->video_file, "hevc", c->video_start, c->video_end, job->video_ic, &video_ic) < 0) {
+            break;
+        }
+        // 音频比视频短时后面的块没有音频
+        if (c->audio_end > c->audio_start &&
+            open_chunk_input(job->audio_file, "aac", c->audio_start, c->audio_end, job->audio_ic, &audio_ic) < 0) {
+            break;
+        }
+
+        if (avformat_alloc_output_context2(&oc, nullptr, "mp4", c->part_file.c_str()) < 0) {
+            break;
+        }
+
+        // 所有块的输出流参数相同，拼接时使用第一块的 moov
+        AVFormatContext* whole[2] = { job->video_ic, job->audio_ic };
+        bool ok = true;
+        for (int32_t i = 0; i < 2 && ok; i++) {
+            AVStream* st = avformat_new_stream(oc, nullptr);
+            ok = st != nullptr && avcodec_parameters_copy(st->codecpar, whole[i]->streams[0]->codecpar) >= 0;
+            if (ok) {
+                st->time_base = i == 0 ? av_inv_q(job->frame_rate) : (AVRational){ 1, st->codecpar->sample_rate };
+            }
+        }
+        // 各块由相同的参数集生成相同的 hvcC，拼接后第一块的 moov 对所有块都适用
+        if (ok) {
+            annexb = alloc_annexb_converter(oc->streams[0]->codecpar, 0);
+        }
+        if (!ok || avio_open(&oc->pb, c->part_file.c_str(), AVIO_FLAG_WRITE) < 0) {
+            LOGE("open chunk output %s fail\n", c->part_file.c_str());
+            break;
+        }
+
+        av_dict_set(&opts, "movflags", "+frag_keyframe+empty_moov+default_base_moof+frag_discont+skip_trailer", 0);
+        av_dict_set(&opts, "use_editlist", "0", 0);
+        // 默认会把每块的第一个时间戳平移到 0，这里必须保留块在整个文件中的时间
+        av_dict_set(&opts, "avoid_negative_ts", "make_non_negative", 0);
+        if (avformat_write_header(oc, &opts) < 0) {
+            LOGE("write chunk header fail\n");
+            break;
+        }
+
+        ts_generator ts[2] = { job->video_ts, job->audio_ts };
+        ts_generator_seek(&ts[0], c->video_frame);
+        ts_generator_seek(&ts[1], c->audio_frame);
+        AVFormatContext* ics[2] = { video_ic, audio_ic };
+        bool has[2];
+        for (int32_t i = 0; i < 2; i++) {
+            has[i] = read_chunk_packet(ics[i], &ts[i], oc->streams[i], pkts[i]) >= 0;
+        }
+
+        // 两路输入按 dts 交错写入
+        result = 0;
+        while ((has[0] || has[1]) && result >= 0) {
+            int32_t i = !has[1] || (has[0] && av_compare_ts(pkts[0]->dts, oc->streams[0]->time_base, pkts[1]->dts,
+                                                            oc->streams[1]->time_base) <= 0) ? 0 : 1;
+            if (i == 0 && annexb != nullptr) {
+                result = annexb_convert_packet(annexb, pkts[0]);
+                if (result < 0) {
+                    break;
+                }
+            }
+            result = av_interleaved_write_frame(oc, pkts[i]);
+            has[i] = read_chunk_packet(ics[i], &ts[i], oc->streams[i], pkts[i]) >= 0;
+        }
+
+        if (av_write_trailer(oc) < 0 || result < 0) {
+            LOGE("mux chunk %s fail\n", c->part_file.c_str());
+            result = -1;
+        }
+    } while (0);
+
+    av_dict_free(&opts);
+    av_packet_free(&pkts[0]);
+    av_packet_free(&pkts[1]);
+    free_annexb_converter(&annexb);
+    avformat_close_input(&video_ic);
+    avformat_close_input(&audio_ic);
+    if (oc != nullptr) {
+        avio_closep(&oc->pb);
+        avformat_free_context(oc);
+    }
+    return result;
+}
+
+static int32_t read_full(int fd, uint8_t* buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = read(fd, buf, size);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int32_t write_full(int fd, const uint8_t* buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// 把 in_fd 当前位置的 size 字节复制到 out_fd。优先用 copy_file_range 在内核中复制，不支持时退回 read/write
+static int32_t copy_range(int in_fd, int out_fd, int64_t size)
+{
+    while (size > 0) {
+        ssize_t n = copy_file_range(in_fd, nullptr, out_fd, nullptr, size, 0);
+        if (n > 0) {
+            size -= n;
+            continue;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+            return -1;
+        }
+
+        std::vector<uint8_t> buf(1 << 20);
+        while (size > 0) {
+            size_t len = size < (int64_t)buf.size() ? size : buf.size();
+            if (read_full(in_fd, buf.data(), len) < 0 || write_full(out_fd, buf.data(), len) < 0) {
+                return -1;
+            }
+            size -= len;
+        }
+    }
+    return 0;
+}
+
+static uint32_t read_u32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void write_u32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// 把一块的分片追加到输出。第一块之外跳过 ftyp 和 moov，moof 中 mfhd 的序号改为在整个文件中连续编号，
+// mdat 原样复制
+static int32_t append_chunk(int out_fd, const chunk* c, bool first, uint32_t* sequence)
+{
+    int in_fd = open(c->part_file.c_str(), O_RDONLY);
+    if (in_fd < 0) {
+        LOGE("open %s fail\n", c->part_file.c_str());
+        return -1;
+    }
+
+    int32_t result = 0;
+    std::vector<uint8_t> moof;
+    uint8_t header[16];
+    while (result == 0) {
+        ssize_t n = read(in_fd, header, 8);
+        if (n == 0) {
+            break;
+        }
+        if (n != 8) {
+            result = -1;
+            break;
+        }
+
+        int64_t box_size = read_u32(header);
+        int32_t header_size = 8;
+        if (box_size == 1) {
+            if (read_full(in_fd, header + 8, 8) < 0) {
+                result = -1;
+                break;
+            }
+            box_size = ((int64_t)read_u32(header + 8) << 32) | read_u32(header + 12);
+            header_size = 16;
+        }
+        if (box_size < header_size) {
+            LOGE("invalid box in %s\n", c->part_file.c_str());
+            result = -1;
+            break;
+        }
+
+        if (!first && (memcmp(header + 4, "ftyp", 4) == 0 || memcmp(header + 4, "moov", 4) == 0)) {
+            result = lseek(in_fd, box_size - header_size, SEEK_CUR) < 0 ? -1 : 0;
+        } else if (memcmp(header + 4, "moof", 4) == 0) {
+            moof.resize(box_size);
+            memcpy(moof.data(), header, header_size);
+            if (read_full(in_fd, moof.data() + header_size, box_size - header_size) < 0) {
+                result = -1;
+                break;
+            }
+            for (size_t pos = header_size; pos + 16 <= moof.size(); pos += read_u32(&moof[pos])) {
+                if (memcmp(&moof[pos + 4], "mfhd", 4) == 0) {
+                    write_u32(&moof[pos + 12], ++*sequence);
+                    break;
+                }
+                if (read_u32(&moof[pos]) < 8) {
+                    break;
+                }
+            }
+            result = write_full(out_fd, moof.data(), moof.size());
+        } else {
+            result = write_full(out_fd, header, header_size) < 0 ? -1 : copy_range(in_fd, out_fd, box_size - header_size);
+        }
+    }
+
+    close(in_fd);
+    if (result < 0) {
+        LOGE("append chunk %s fail\n", c->part_file.c_str());
+    }
+    return result;
+}
+
+// 划分各块：视频按访问单元索引取目标位置之后的第一个 IRAP 帧，索引的下标即帧序号；再按视频起点的时间定位音频帧
+static int32_t split_chunks(const chunked_job* job, int32_t chunk_num, int32_t worker_num, std::vector<chunk>& chunks)
+{
+    // 索引保存在输入旁边，同一输入再次分块时不需要重新扫描
+    es_index index;
+    if (es_index_open(job->video_file, AV_CODEC_ID_HEVC, worker_num, &index) < 0 || index.entries.empty()) {
+        LOGE("index %s fail\n", job->video_file);
+        return -1;
+    }
+
+    mapped_file audio;
+    if (map_file(job->audio_file, &audio) < 0) {
+        return -1;
+    }
+
+    // 第一块从文件开头开始。相邻两块的目标位置之间没有 IRAP 帧时两块的起点相同，只保留一块
+    chunks.clear();
+    for (int32_t k = 0; k < chunk_num; k++) {
+        size_t idx = k == 0 ? 0 : es_index_next_key(&index, index.file_size * k / chunk_num);
+        if (idx >= index.entries.size() || (!chunks.empty() && (int64_t)idx <= chunks.back().video_frame)) {
+            continue;
+        }
+
+        chunk c;
+        c.video_start = k == 0 ? 0 : index.entries[idx].offset;
+        c.video_frame = idx;
+        if (!chunks.empty()) {
+            chunks.back().video_end = c.video_start;
+        }
+        chunks.push_back(c);
+    }
+    chunks.back().video_end = index.file_size;
+
+    // 音频起点取时间上最接近视频起点的音频帧
+    std::vector<int64_t> audio_frames;
+    AVRational audio_frame_rate = { job->audio_ic->streams[0]->codecpar->sample_rate,
+                                    job->audio_ic->streams[0]->codecpar->frame_size > 0
+                                        ? job->audio_ic->streams[0]->codecpar->frame_size : 1024 };
+    for (const chunk& c : chunks) {
+        audio_frames.push_back(av_rescale_q_rnd(c.video_frame, av_inv_q(job->frame_rate), av_inv_q(audio_frame_rate),
+                                                AV_ROUND_NEAR_INF));
+    }
+
+    std::vector<int64_t> audio_offsets;
+    int32_t result = find_audio_offsets(&audio, audio_frames, audio_offsets);
+    for (size_t i = 0; i < chunks.size() && result == 0; i++) {
+        chunks[i].audio_frame = audio_frames[i];
+        chunks[i].audio_start = i == 0 ? 0 : audio_offsets[i];
+        chunks[i].audio_end = i + 1 < chunks.size() ? audio_offsets[i + 1] : audio.size;
+        LOGD("chunk %zu: video [%jd, %jd) frame %jd, audio [%jd, %jd) frame %jd\n", i, chunks[i].video_start,
+             chunks[i].video_end, chunks[i].video_frame, chunks[i].audio_start, chunks[i].audio_end,
+             chunks[i].audio_frame);
+    }
+
+    unmap_file(&audio);
+    return result;
+}
+
+int32_t chunked_mux(const char* video_file, const char* audio_file, const char* output_file, int32_t chunk_num,
+                    int32_t worker_num)
+{
+    // 各块固定复用为 fragmented MP4 后直接拼接，输出不能是其他格式
+    const AVOutputFormat* ofmt = av_guess_format(nullptr, output_file, nullptr);
+    if (ofmt == nullptr || !av_match_name(ofmt->name, "mp4,mov,ismv")) {
+        LOGE("chunked mux only writes fragmented mp4, %s is not an mp4 output\n", output_file);
+        return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    chunk_num = chunk_num > 0 ? chunk_num : 1;
+    worker_num = worker_num > 0 ? worker_num : 1;
+
+    chunked_job job;
+    job.video_file = video_file;
+    job.audio_file = audio_file;
+    std::vector<chunk> chunks;
+    int32_t result = -1;
+
+    do {
+        if (open_whole_input(video_file, "hevc", &job.video_ic) < 0 ||
+            open_whole_input(audio_file, "aac", &job.audio_ic) < 0) {
+            break;
+        }
+
+        AVStream* video_st = job.video_ic->streams[0];
+        if (init_video_ts_generator(&job.video_ts, video_st, (AVRational){ STREAM_FRAME_RATE, 1 }) < 0 ||
+            init_audio_ts_generator(&job.audio_ts, job.audio_ic->streams[0]) < 0) {
+            break;
+        }
+        // 与 ts_generator 使用相同的帧率
+        av_reduce(&job.frame_rate.num, &job.frame_rate.den, job.video_ts.step_den * video_st->time_base.den,
+                  job.video_ts.step_num * video_st->time_base.num, INT32_MAX);
+
+        if (split_chunks(&job, chunk_num, worker_num, chunks) < 0) {
+            break;
+        }
+
+        auto split_end = std::chrono::steady_clock::now();
+
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            chunks[i].part_file = std::string(output_file) + ".part" + std::to_string(i);
+        }
+        for (int32_t w = 0; w < worker_num && w < (int32_t)chunks.size(); w++) {
+            workers.emplace_back([&]() {
+                size_t idx;
+                while ((idx = next.fetch_add(1)) < chunks.size()) {
+                    chunks[idx].result = mux_chunk(&job, &chunks[idx]);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        auto mux_end = std::chrono::steady_clock::now();
+
+        bool failed = false;
+        for (const chunk& c : chunks) {
+            failed |= c.result < 0;
+        }
+        if (failed) {
+            break;
+        }
+
+        int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            LOGE("open output %s fail\n", output_file);
+            break;
+        }
+
+        uint32_t sequence = 0;
+        result = 0;
+        for (size_t i = 0; i < chunks.size() && result == 0; i++) {
+            result = append_chunk(out_fd, &chunks[i], i == 0, &sequence);
+        }
+        if (close(out_fd) < 0) {
+            result = -1;
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        LOG_AT(LOG_LEVEL_COUNTERS, "%s: %zu chunks on %d workers, split %.3f s, mux %.3f s, stitch %.3f s\n",
+               output_file, chunks.size(), worker_num, std::chrono::duration<double>(split_end - start).count(),
+               std::chrono::duration<double>(mux_end - split_end).count(),
+               std::chrono::duration<double>(end - mux_end).count());
+    } while (0);
+
+    for (const chunk& c : chunks) {
+        if (!c.part_file.empty()) {
+            unlink(c.part_file.c_str());
+        }
+    }
+    avformat_close_input(&job.video_ic);
+    avformat_close_input(&job.audio_ic);
+    return result;
+}
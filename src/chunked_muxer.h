@@ -0,0 +1,15 @@
+//
+// 单个大文件的分块并行复用。按裸 HEVC 码流的访问单元索引找到各块起点处的 IRAP 帧，按相同的时间在 ADTS 码流中找到对应的音频帧，
+// 各块在独立线程中复用为 fragmented MP4，时间戳按块起点的帧序号连续生成，最后依次拼接成一个输出文件
+//
+
+#ifndef CHUNKED_MUXER_H
+#define CHUNKED_MUXER_H
+#include <stdint.h>
+
+// 把裸 HEVC 视频和 ADTS AAC 音频分成最多 chunk_num 块，用 worker_num 个线程复用，输出为 fragmented MP4，output_file 不是 mp4 文件时返回 -1。
+// 块的临时文件为 <output_file>.part<n>，拼接完成后删除。失败时返回 -1
+int32_t chunked_mux(const char* video_file, const char* audio_file, const char* output_file, int32_t chunk_num,
+                    int32_t worker_num);
+
+#endif
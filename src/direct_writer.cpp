@@ -0,0 +1,178 @@
+#include "direct_writer.h"
+#include <new>
+
+#include <algorithm>
+#include <vector>
+
+#include "log.h"
+
+struct direct_writer {
+    AVFormatContext* ofmt_ctx = nullptr;
+    int32_t window_size = 0;
+    std::vector<AVPacket*> window;  ///< 按 dts 排列的最小堆，为空时处于直接写入状态
+    std::vector<int64_t> last_dts;  ///< 每路输出流最后写出的 dts，av_write_frame 要求单路流内严格递增
+
+    // 最后提交的包的时间戳，用于检查顺序
+    bool has_last = false;
+    int64_t last_ts = 0;
+    AVRational last_tb = { 0, 1 };
+    int64_t in_order_run = 0;       ///< 窗口模式下连续有序的包数
+
+    int64_t direct_packets = 0;     ///< 不经过窗口直接写入的包数
+    int64_t window_packets = 0;     ///< 经过重排窗口的包数
+    int32_t max_window = 0;
+    int64_t fixed_dts = 0;          ///< 为保证单路流 dts 递增而修正的包数
+};
+
+// 排序使用的时间戳，没有 dts 时用 pts
+static int64_t packet_ts(const AVPacket* pkt)
+{
+    return pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+}
+
+static AVRational packet_tb(const direct_writer* writer, const AVPacket* pkt)
+{
+    return writer->ofmt_ctx->streams[pkt->stream_index]->time_base;
+}
+
+// std::push_heap 默认是最大堆，比较结果取反得到按时间戳的最小堆
+struct packet_later {
+    const direct_writer* writer;
+
+    bool operator()(const AVPacket* a, const AVPacket* b) const
+    {
+        return av_compare_ts(packet_ts(a), packet_tb(writer, a), packet_ts(b), packet_tb(writer, b)) > 0;
+    }
+};
+
+direct_writer* alloc_direct_writer(AVFormatContext* ofmt_ctx, int32_t window_size)
+{
+    direct_writer* writer = new (std::nothrow) direct_writer;
+    if (writer == nullptr) {
+        LOGE("alloc direct writer fail\n");
+        return nullptr;
+    }
+
+    writer->ofmt_ctx = ofmt_ctx;
+    writer->window_size = window_size > 0 ? window_size : 1;
+    writer->last_dts.assign(ofmt_ctx->nb_streams, AV_NOPTS_VALUE);
+    return writer;
+}
+
+// 最终写出一个包。乱序超出窗口时单路流的 dts 可能回退，修正为比上一个包大 1，与 ffmpeg 命令行工具的处理相同
+static int32_t write_out(direct_writer* writer, AVPacket* pkt)
+{
+    int64_t& last_dts = writer->last_dts[pkt->stream_index];
+    if (pkt->dts != AV_NOPTS_VALUE && last_dts != AV_NOPTS_VALUE && pkt->dts <= last_dts) {
+        LOGD("stream %d dts %jd after %jd, fixed\n", pkt->stream_index, pkt->dts, last_dts);
+        pkt->dts = last_dts + 1;
+        if (pkt->pts != AV_NOPTS_VALUE && pkt->pts < pkt->dts) {
+            pkt->pts = pkt->dts;
+        }
+        writer->fixed_dts++;
+    }
+    if (pkt->dts != AV_NOPTS_VALUE) {
+        last_dts = pkt->dts;
+    }
+
+    // av_write_frame 不取得包的所有权，写完由这里释放引用
+    int32_t ret = av_write_frame(writer->ofmt_ctx, pkt);
+    av_packet_unref(pkt);
+    if (ret < 0) {
+        LOGE("av_write_frame fail\n");
+    }
+    return ret;
+}
+
+// 写出窗口中最早的包
+static int32_t write_earliest(direct_writer* writer)
+{
+    std::pop_heap(writer->window.begin(), writer->window.end(), packet_later{ writer });
+    AVPacket* pkt = writer->window.back();
+    writer->window.pop_back();
+
+    int32_t ret = write_out(writer, pkt);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+int32_t direct_writer_write(direct_writer* writer, AVPacket* pkt)
+{
+    // 顺序检查：只与上一个提交的包比较一次
+    int64_t ts = packet_ts(pkt);
+    AVRational tb = packet_tb(writer, pkt);
+    bool in_order = ts == AV_NOPTS_VALUE || !writer->has_last || av_compare_ts(ts, tb, writer->last_ts, writer->last_tb) >= 0;
+    if (ts != AV_NOPTS_VALUE && in_order) {
+        writer->has_last = true;
+        writer->last_ts = ts;
+        writer->last_tb = tb;
+    }
+
+    if (writer->window.empty()) {
+        if (in_order) {
+            writer->direct_packets++;
+            return write_out(writer, pkt);
+        }
+
+        LOGW("out of order packet on stream %d, reorder through a window of %d packets\n", pkt->stream_index,
+             writer->window_size);
+        writer->in_order_run = 0;
+    }
+
+    // 窗口模式：放入窗口，窗口满时写出最早的包
+    AVPacket* queued = av_packet_alloc();
+    if (queued == nullptr) {
+        av_packet_unref(pkt);
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(queued, pkt);
+    writer->window.push_back(queued);
+    std::push_heap(writer->window.begin(), writer->window.end(), packet_later{ writer });
+    writer->window_packets++;
+    writer->max_window = std::max(writer->max_window, (int32_t)writer->window.size());
+    writer->in_order_run = in_order ? writer->in_order_run + 1 : 0;
+
+    while ((int32_t)writer->window.size() > writer->window_size) {
+        int32_t ret = write_earliest(writer);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    // 连续两个窗口长度的包都有序，说明乱序已经过去，清空窗口回到直接写入
+    if (writer->in_order_run >= 2 * (int64_t)writer->window_size) {
+        LOGD("input back in order, leave the reorder window\n");
+        return direct_writer_flush(writer);
+    }
+
+    return 0;
+}
+
+int32_t direct_writer_flush(direct_writer* writer)
+{
+    while (!writer->window.empty()) {
+        int32_t ret = write_earliest(writer);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+void free_direct_writer(direct_writer** writer)
+{
+    if (writer == nullptr || *writer == nullptr) {
+        return;
+    }
+
+    direct_writer* w = *writer;
+    LOG_AT(LOG_LEVEL_COUNTERS, "direct write: %jd packets direct, %jd through the reorder window (max %d), "
+           "%jd dts fixed\n", w->direct_packets, w->window_packets, w->max_window, w->fixed_dts);
+
+    for (AVPacket* pkt : w->window) {
+        av_packet_free(&pkt);
+    }
+    delete w;
+    *writer = nullptr;
+}
@@ -0,0 +1,29 @@
+//
+// 预排序输入的直接写入。上游已按 dts 排好序时用 av_write_frame 直接写入，跳过 av_interleaved_write_frame 内部的
+// 交错缓冲和重排，省去缓冲的内存和等待其他流的延迟。每个包只与前一个包比较一次 dts 检查顺序，
+// 发现乱序时才启用一个有界的重排窗口，之后连续有序一段时间再回到直接写入
+//
+
+#ifndef DIRECT_WRITER_H
+#define DIRECT_WRITER_H
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+typedef struct direct_writer direct_writer;
+
+// window_size 为重排窗口最多缓存的包数，也是乱序时增加的最大延迟（以包计）
+direct_writer* alloc_direct_writer(AVFormatContext* ofmt_ctx, int32_t window_size);
+
+// 与 av_interleaved_write_frame 相同，调用后 pkt 的引用归 writer 所有，pkt 被重置为空包
+int32_t direct_writer_write(direct_writer* writer, AVPacket* pkt);
+
+// 按顺序写出窗口中剩余的包，在 av_write_trailer 之前调用
+int32_t direct_writer_flush(direct_writer* writer);
+
+// 输出统计信息并释放窗口中未写出的包
+void free_direct_writer(direct_writer** writer);
+
+#endif
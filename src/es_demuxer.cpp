@@ -0,0 +1,196 @@
+#include "es_demuxer.h"
+#include <string.h>
+
+#include "es_index.h"
+#include "log.h"
+
+extern "C" {
+#include <libavutil/file.h>
+}
+
+static void unmap_buffer(void *opaque, uint8_t *data)
+{
+    av_file_unmap(data, (size_t)(uintptr_t)opaque);
+}
+
+bool es_demuxer_supports(AVCodecID codec_id)
+{
+    return codec_id == AV_CODEC_ID_HEVC || codec_id == AV_CODEC_ID_H264 || codec_id == AV_CODEC_ID_AAC;
+}
+
+int32_t open_es_demuxer(es_demuxer *es, const char *filename, AVCodecID codec_id)
+{
+    memset(es, 0, sizeof(*es));
+    if (!es_demuxer_supports(codec_id)) {
+        LOGE("es demuxer does not support %s\n", avcodec_get_name(codec_id));
+        return -1;
+    }
+
+    uint8_t *data = nullptr;
+    size_t size = 0;
+    int32_t ret = av_file_map(filename, &data, &size, 0, nullptr);
+    if (ret < 0) {
+        LOGE("map %s fail\n", filename);
+        return ret;
+    }
+
+    // 映射区域交给引用计数管理，AVPacket 持有其引用，最后一个引用释放时才解除映射
+    es->map_buf = av_buffer_create(data, size, unmap_buffer, (void *)(uintptr_t)size, 0);
+    if (es->map_buf == nullptr) {
+        av_file_unmap(data, size);
+        return AVERROR(ENOMEM);
+    }
+
+    es->ptr = data;
+    es->end = data + size;
+    es->codec_id = codec_id;
+    return 0;
+}
+
+// 判断当前 NAL 是否开始一个新的访问单元（前提是当前访问单元中已经出现过 VCL NAL）
+static bool nal_starts_au(AVCodecID codec_id, const uint8_t *nal, const uint8_t *end)
+{
+    if (nal + 3 > end) {
+        return false;
+    }
+
+    if (codec_id == AV_CODEC_ID_HEVC) {
+        int32_t nal_type = (nal[0] >> 1) & 0x3f;
+        if (nal_type < 32) {
+            // VCL NAL 中 first_slice_segment_in_pic_flag 为 1 表示一帧的第一个 slice
+            return (nal[2] & 0x80) != 0;
+        }
+
+        // AUD、VPS、SPS、PPS、前缀 SEI 以及保留类型只能出现在访问单元的开头
+        return (nal_type >= 32 && nal_type <= 35) || nal_type == 39 ||
+               (nal_type >= 41 && nal_type <= 44) || (nal_type >= 48 && nal_type <= 55);
+    }
+
+    int32_t nal_type = nal[0] & 0x1f;
+    if (nal_type >= 1 && nal_type <= 5) {
+        // first_mb_in_slice 为 0 时 ue(v) 编码为单个 1 比特，表示一帧的第一个 slice
+        return (nal[1] & 0x80) != 0;
+    }
+
+    // SEI、SPS、PPS、AUD 以及 14~18 只能出现在访问单元的开头
+    return (nal_type >= 6 && nal_type <= 9) || (nal_type >= 14 && nal_type <= 18);
+}
+
+// 返回 NAL 是否为 VCL，并通过 is_key 返回是否为 IRAP（HEVC）或 IDR（H.264）图像
+static bool nal_is_vcl(AVCodecID codec_id, const uint8_t *nal, bool *is_key)
+{
+    if (codec_id == AV_CODEC_ID_HEVC) {
+        int32_t nal_type = (nal[0] >> 1) & 0x3f;
+        *is_key = *is_key || (nal_type >= 16 && nal_type <= 23);
+        return nal_type < 32;
+    }
+
+    int32_t nal_type = nal[0] & 0x1f;
+    *is_key = *is_key || nal_type == 5;
+    return nal_type >= 1 && nal_type <= 5;
+}
+
+// 从映射内存中切分出一个访问单元，返回访问单元的长度，is_key 表示其中是否包含关键帧
+static size_t split_au(AVCodecID codec_id, const uint8_t *start, const uint8_t *end, bool *is_key)
+{
+    bool seen_vcl = false;
+    *is_key = false;
+
+    const uint8_t *sc = es_find_start_code(start, end);
+    while (sc < end) {
+        const uint8_t *nal = sc + 3;
+        if (seen_vcl && nal_starts_au(codec_id, nal, end)) {
+            // 4 字节起始码的前导 0 属于下一个访问单元
+            if (sc > start && sc[-1] == 0) {
+                sc--;
+            }
+            return sc - start;
+        }
+
+        if (nal < end) {
+            seen_vcl = nal_is_vcl(codec_id, nal, is_key) || seen_vcl;
+        }
+
+        sc = es_find_start_code(nal, end);
+    }
+
+    return end - start;
+}
+
+// 从映射内存中切分出一个 ADTS 帧，返回整帧长度并通过 header_size 返回 ADTS 头长度，数据损坏时返回 0
+static size_t split_adts_frame(const uint8_t *start, const uint8_t *end, size_t *header_size)
+{
+    if (end - start < 7 || start[0] != 0xff || (start[1] & 0xf0) != 0xf0) {
+        return 0;
+    }
+
+    size_t frame_size = ((start[3] & 0x03) << 11) | (start[4] << 3) | (start[5] >> 5);
+    *header_size = (start[1] & 0x01) ? 7 : 9; // protection_absent 为 0 时头部带 2 字节 CRC
+    if (frame_size <= *header_size || frame_size > (size_t)(end - start)) {
+        return 0;
+    }
+
+    return frame_size;
+}
+
+int32_t es_demuxer_read(es_demuxer *es, AVPacket *pkt)
+{
+    if (es->ptr >= es->end) {
+        return AVERROR_EOF;
+    }
+
+    const uint8_t *data = es->ptr;
+    size_t size = 0;
+    bool is_key = false;
+
+    if (es->codec_id != AV_CODEC_ID_AAC) {
+        size = split_au(es->codec_id, es->ptr, es->end, &is_key);
+        es->ptr += size;
+    } else {
+        size_t header_size = 0;
+        size_t frame_size = split_adts_frame(es->ptr, es->end, &header_size);
+        if (frame_size == 0) {
+            LOGE("invalid adts frame at offset %td\n", es->ptr - es->map_buf->data);
+            return AVERROR_INVALIDDATA;
+        }
+
+        // 去掉 ADTS 头，只保留原始 AAC 帧，mp4 中不需要 ADTS 头（等价于 aac_adtstoasc 的处理）
+        data = es->ptr + header_size;
+        size = frame_size - header_size;
+        es->ptr += frame_size;
+        is_key = true;
+    }
+
+    // AVPacket 要求数据后面有 AV_INPUT_BUFFER_PADDING_SIZE 字节可读。映射区域的最后一个包后面可能没有足够的空间，
+    // 只有这种情况才拷贝一次
+    if ((size_t)(es->map_buf->data + es->map_buf->size - (data + size)) < AV_INPUT_BUFFER_PADDING_SIZE) {
+        int ret = av_new_packet(pkt, size);
+        if (ret < 0) {
+            return ret;
+        }
+        memcpy(pkt->data, data, size);
+        es->copied_packets++;
+    } else {
+        pkt->buf = av_buffer_ref(es->map_buf);
+        if (pkt->buf == nullptr) {
+            return AVERROR(ENOMEM);
+        }
+        pkt->data = (uint8_t*)data;
+        pkt->size = size;
+    }
+
+    if (is_key) {
+        pkt->flags |= AV_PKT_FLAG_KEY;
+    }
+    pkt->pos = data - es->map_buf->data;
+    es->packets++;
+
+    return 0;
+}
+
+void close_es_demuxer(es_demuxer *es)
+{
+    av_buffer_unref(&es->map_buf);
+    es->ptr = nullptr;
+    es->end = nullptr;
+}
@@ -0,0 +1,36 @@
+//
+// 裸码流的零拷贝解复用。直接在映射内存上切分出访问单元（HEVC/H.264 Annex-B）或 ADTS 帧（AAC），
+// 输出的 AVPacket 只是映射区域的一个引用计数视图，负载数据不经过任何拷贝，可以代替 libavformat 的 hevc/h264/aac 解复用器
+//
+
+#ifndef ES_DEMUXER_H
+#define ES_DEMUXER_H
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+typedef struct es_demuxer {
+    AVBufferRef *map_buf; ///< 整个映射区域的引用，最后一个引用释放时解除映射
+    const uint8_t *ptr;   ///< 下一个待切分的位置
+    const uint8_t *end;
+    AVCodecID codec_id;
+    int64_t packets;        ///< 已输出的包数
+    int64_t copied_packets; ///< 映射区域末尾没有足够的填充空间、拷贝了负载的包数
+} es_demuxer;
+
+// 是否支持该编码格式：HEVC、H.264 和 ADTS AAC
+bool es_demuxer_supports(AVCodecID codec_id);
+
+// 映射 filename 并从头开始切分。失败时返回负数
+int32_t open_es_demuxer(es_demuxer *es, const char *filename, AVCodecID codec_id);
+
+// 读取下一个包。视频包为一个完整的访问单元（含起始码），AAC 包去掉了 ADTS 头（等价于 aac_adtstoasc 的处理），
+// 因此输出流需要 AudioSpecificConfig 形式的 extradata。包没有时间戳，读完返回 AVERROR_EOF
+int32_t es_demuxer_read(es_demuxer *es, AVPacket *pkt);
+
+// 释放解复用器持有的映射引用，尚未释放的 AVPacket 仍然可以使用，最后一个包释放时解除映射
+void close_es_demuxer(es_demuxer *es);
+
+#endif
@@ -0,0 +1,338 @@
+#include "es_index.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ES_INDEX_X86 1
+#endif
+
+#include "log.h"
+
+static const uint8_t* find_start_code_scalar(const uint8_t* p, const uint8_t* end)
+{
+    for (; p + 3 <= end; p++) {
+        if (p[2] > 1) {
+            p += 2;
+        } else if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            return p;
+        }
+    }
+
+    return end;
+}
+
+#ifdef ES_INDEX_X86
+// 一次比较 16 个位置：p[i] == 0、p[i + 1] == 0、p[i + 2] == 1 三个比较结果相与，掩码中最低的置位即第一个起始码
+static const uint8_t* find_start_code_sse2(const uint8_t* p, const uint8_t* end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; p + 18 <= end; p += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)p);
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(p + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i*)(p + 2));
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                                  _mm_cmpeq_epi8(b2, one));
+        int32_t mask = _mm_movemask_epi8(m);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+
+    return find_start_code_scalar(p, end);
+}
+
+// 只有这个函数用 AVX2 编译，其余代码不要求 CPU 支持 AVX2
+__attribute__((target("avx2"))) static const uint8_t* find_start_code_avx2(const uint8_t* p, const uint8_t* end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    for (; p + 34 <= end; p += 32) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)p);
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(p + 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i*)(p + 2));
+        __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)),
+                                     _mm256_cmpeq_epi8(b2, one));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+
+    return find_start_code_sse2(p, end);
+}
+#endif
+
+typedef const uint8_t* (*find_start_code_fn)(const uint8_t* p, const uint8_t* end);
+
+static find_start_code_fn select_find_start_code()
+{
+#ifdef ES_INDEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return find_start_code_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return find_start_code_sse2;
+    }
+#endif
+    return find_start_code_scalar;
+}
+
+const uint8_t* es_find_start_code(const uint8_t* p, const uint8_t* end)
+{
+    // 只在第一次调用时检测 CPU，C++11 保证局部静态变量的初始化是线程安全的
+    static const find_start_code_fn fn = select_find_start_code();
+    return fn(p, end);
+}
+
+// 一个 NAL 的起始位置和 NAL 头，分段扫描时先收集，合并时再划分访问单元
+struct nal_pos {
+    int64_t offset; ///< 含 4 字节起始码的前导 0
+    uint8_t header[3];
+};
+
+// 查找起始码位于 [start, end) 中的所有 NAL
+static void scan_range(const uint8_t* data, size_t size, size_t start, size_t end, std::vector<nal_pos>& nals)
+{
+    const uint8_t* file_end = data + size;
+    const uint8_t* limit = data + (end + 2 < size ? end + 2 : size);
+    for (const uint8_t* sc = es_find_start_code(data + start, limit); sc < limit;
+         sc = es_find_start_code(sc + 3, limit)) {
+        nal_pos nal;
+        nal.offset = (sc > data && sc[-1] == 0 ? sc - 1 : sc) - data;
+        for (int32_t i = 0; i < 3; i++) {
+            nal.header[i] = sc + 3 + i < file_end ? sc[3 + i] : 0;
+        }
+        nals.push_back(nal);
+    }
+}
+
+enum nal_class {
+    NAL_OTHER,     ///< 属于当前访问单元，如后缀 SEI、填充数据
+    NAL_AU_PREFIX, ///< 出现在一帧的 slice 之前，开始一个新的访问单元，如 AUD、参数集、前缀 SEI
+    NAL_FIRST_SLICE,
+    NAL_SLICE,
+};
+
+static nal_class classify(AVCodecID codec_id, const uint8_t* header, int32_t* nal_type, bool* key)
+{
+    *key = false;
+    if (codec_id == AV_CODEC_ID_HEVC) {
+        int32_t type = (header[0] >> 1) & 0x3f;
+        *nal_type = type;
+        if (type < 32) {
+            // slice 头的第一位为 first_slice_segment_in_pic_flag
+            *key = type >= 16 && type <= 23;
+            return (header[2] & 0x80) ? NAL_FIRST_SLICE : NAL_SLICE;
+        }
+        bool prefix = type <= 35 || type == 39 || (type >= 41 && type <= 44) || (type >= 48 && type <= 55);
+        return prefix ? NAL_AU_PREFIX : NAL_OTHER;
+    }
+
+    int32_t type = header[0] & 0x1f;
+    *nal_type = type;
+    if (type >= 1 && type <= 5) {
+        // first_mb_in_slice 为 0 时 ue(v) 编码为单个 1 比特，即新的一帧
+        *key = type == 5;
+        return (header[1] & 0x80) ? NAL_FIRST_SLICE : NAL_SLICE;
+    }
+    bool prefix = (type >= 6 && type <= 9) || (type >= 14 && type <= 18);
+    return prefix ? NAL_AU_PREFIX : NAL_OTHER;
+}
+
+int32_t es_index_build(const uint8_t* data, size_t size, AVCodecID codec_id, int32_t thread_num, es_index* index)
+{
+    if (codec_id != AV_CODEC_ID_HEVC && codec_id != AV_CODEC_ID_H264) {
+        LOGE("es index only supports hevc and h264\n");
+        return -1;
+    }
+
+    // 分段查找起始码是主要的开销，各段互不依赖。每段至少 16 MiB，小文件不值得启动线程
+    size_t max_threads = size / (16 << 20) + 1;
+    size_t n = thread_num > 0 ? (size_t)thread_num : 1;
+    n = n < max_threads ? n : max_threads;
+
+    std::vector<std::vector<nal_pos>> nals(n);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n; i++) {
+        threads.emplace_back(scan_range, data, size, size * i / n, size * (i + 1) / n, std::ref(nals[i]));
+    }
+    scan_range(data, size, 0, size / n, nals[0]);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // 按顺序合并，一帧的访问单元从它之前连续的前缀 NAL 开始，没有前缀 NAL 时从第一个 slice 开始
+    index->codec_id = codec_id;
+    index->file_size = size;
+    index->key_count = 0;
+    index->entries.clear();
+    int64_t au_start = -1;
+    for (const std::vector<nal_pos>& part : nals) {
+        for (const nal_pos& nal : part) {
+            int32_t nal_type = 0;
+            bool key = false;
+            nal_class cls = classify(codec_id, nal.header, &nal_type, &key);
+            if (cls == NAL_AU_PREFIX) {
+                au_start = au_start < 0 ? nal.offset : au_start;
+            } else if (cls == NAL_FIRST_SLICE) {
+                es_index_entry entry = { au_start >= 0 ? au_start : nal.offset, key ? ES_INDEX_KEY : 0, nal_type };
+                index->entries.push_back(entry);
+                index->key_count += key;
+                au_start = -1;
+            } else if (cls == NAL_SLICE) {
+                au_start = -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+size_t es_index_next_key(const es_index* index, int64_t offset)
+{
+    // entries 按 offset 升序排列，先二分找到第一个不小于 offset 的访问单元
+    size_t lo = 0;
+    size_t hi = index->entries.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (index->entries[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    while (lo < index->entries.size() && !(index->entries[lo].flags & ES_INDEX_KEY)) {
+        lo++;
+    }
+    return lo;
+}
+
+// 索引文件的头部。条目按本机字节序原样保存，索引只在生成它的机器上使用
+struct index_file_header {
+    char magic[8];
+    int32_t codec_id;
+    int32_t entry_size;
+    int64_t file_size;
+    int64_t mtime_ns;
+    int64_t count;
+};
+
+static const char index_magic[8] = { 'E', 'S', 'I', 'D', 'X', '0', '1', 0 };
+
+static int32_t load_index(const std::string& path, AVCodecID codec_id, const struct stat* st, es_index* index)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr) {
+        return -1;
+    }
+
+    index_file_header header;
+    int64_t mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    int32_t result = -1;
+    if (fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, index_magic, sizeof(index_magic)) == 0 &&
+        header.codec_id == codec_id && header.entry_size == (int32_t)sizeof(es_index_entry) &&
+        header.file_size == st->st_size && header.mtime_ns == mtime_ns && header.count >= 0) {
+        index->entries.resize(header.count);
+        if (fread(index->entries.data(), sizeof(es_index_entry), header.count, fp) == (size_t)header.count) {
+            index->codec_id = codec_id;
+            index->file_size = header.file_size;
+            index->key_count = 0;
+            for (const es_index_entry& entry : index->entries) {
+                index->key_count += (entry.flags & ES_INDEX_KEY) != 0;
+            }
+            result = 0;
+        }
+    }
+
+    fclose(fp);
+    return result;
+}
+
+// 先写临时文件再 rename，并发打开同一输入的任务不会读到写了一半的索引
+static int32_t save_index(const std::string& path, const struct stat* st, const es_index* index)
+{
+    index_file_header header;
+    memcpy(header.magic, index_magic, sizeof(index_magic));
+    header.codec_id = index->codec_id;
+    header.entry_size = sizeof(es_index_entry);
+    header.file_size = st->st_size;
+    header.mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    header.count = index->entries.size();
+
+    std::string tmp = path + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        return -1;
+    }
+
+    FILE* fp = fdopen(fd, "wb");
+    if (fp == nullptr) {
+        close(fd);
+        unlink(tmp.c_str());
+        return -1;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(index->entries.data(), sizeof(es_index_entry), index->entries.size(), fp) == index->entries.size();
+    if (fclose(fp) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+int32_t es_index_open(const char* filename, AVCodecID codec_id, int32_t thread_num, es_index* index)
+{
+    std::string path = std::string(filename) + ".esidx";
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        LOGE("open %s fail\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+        LOGE("%s is not a regular file or is empty\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    if (load_index(path, codec_id, &st, index) == 0) {
+        close(fd);
+        LOGD("es index %s loaded, %zu access units, %jd key\n", path.c_str(), index->entries.size(), index->key_count);
+        return 0;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOGE("mmap %s fail\n", filename);
+        return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    int32_t result = es_index_build((const uint8_t*)data, st.st_size, codec_id, thread_num, index);
+    munmap(data, st.st_size);
+    if (result < 0) {
+        return result;
+    }
+
+    if (save_index(path, &st, index) < 0) {
+        LOGW("save es index %s fail, the index is rebuilt next time\n", path.c_str());
+    }
+    LOGD("es index %s built, %zu access units, %jd key\n", path.c_str(), index->entries.size(), index->key_count);
+    return 0;
+}
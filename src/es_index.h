@@ -0,0 +1,47 @@
+//
+// 裸 Annex-B 码流（HEVC/H.264）的访问单元索引。用 SIMD 在内存映射的文件上查找起始码，记录每个访问单元的位置和
+// 是否为关键帧（HEVC 的 IRAP，H.264 的 IDR）。索引保存在输入文件旁边，文件不变时再次打开直接读取，
+// 分块、定位时不需要再完整解复用一遍
+//
+
+#ifndef ES_INDEX_H
+#define ES_INDEX_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+extern "C" {
+#include <libavcodec/codec_id.h>
+}
+
+#define ES_INDEX_KEY 0x1 ///< 访问单元是 IRAP/IDR 帧，可以从这里开始解码
+
+typedef struct es_index_entry {
+    int64_t offset;   ///< 访问单元第一个 NAL（含 4 字节起始码的前导 0）在文件中的位置
+    int32_t flags;
+    int32_t nal_type; ///< 第一个 slice 的 NAL 类型
+} es_index_entry;
+
+// 访问单元按解码顺序排列，第 n 项即第 n 帧，访问单元的大小为下一项的 offset 减去本项的 offset
+typedef struct es_index {
+    AVCodecID codec_id;
+    int64_t file_size;
+    int64_t key_count;
+    std::vector<es_index_entry> entries;
+} es_index;
+
+// 返回 [p, end) 中第一个 00 00 01 的位置，没有时返回 end。按 CPU 支持的指令集选择 AVX2、SSE2 或标量实现
+const uint8_t* es_find_start_code(const uint8_t* p, const uint8_t* end);
+
+// 为内存中的码流建立索引，thread_num 个线程分段查找起始码后按顺序合并。codec_id 只支持 HEVC 和 H.264
+int32_t es_index_build(const uint8_t* data, size_t size, AVCodecID codec_id, int32_t thread_num, es_index* index);
+
+// 读取 <filename>.esidx 中的索引，文件大小或修改时间与索引记录的不同时重新建立索引并写回。
+// 索引文件写不了（如目录只读）时只打印日志，仍然返回建立的索引
+int32_t es_index_open(const char* filename, AVCodecID codec_id, int32_t thread_num, es_index* index);
+
+// 第一个 offset 不小于 offset 的关键帧的下标，没有时返回 entries.size()
+size_t es_index_next_key(const es_index* index, int64_t offset);
+
+#endif
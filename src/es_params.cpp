@@ -0,0 +1,696 @@
+#include "es_params.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "es_index.h"
+#include "log.h"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/intreadwrite.h>
+}
+
+#define HEVC_NAL_VPS 32
+#define HEVC_NAL_SPS 33
+#define HEVC_NAL_PPS 34
+#define HEVC_NAL_SEI_PREFIX 39
+#define HEVC_NAL_SEI_SUFFIX 40
+
+#define HEVC_MAX_SUB_LAYERS 7
+#define HEVC_MAX_SHORT_TERM_REF_PIC_SETS 64
+#define HEVC_MAX_DELTA_POCS 32
+
+// 按位读取 RBSP。读到末尾之后返回 0 并置 overread，调用方在关键位置检查即可，不需要每次读取都判断
+struct bit_reader {
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0; ///< 以位为单位
+    bool overread = false;
+
+    bit_reader(const uint8_t* d, size_t s) : data(d), size(s) {}
+
+    uint32_t get(int32_t n)
+    {
+        uint32_t value = 0;
+        for (int32_t i = 0; i < n; i++) {
+            if (pos >= size * 8) {
+                overread = true;
+                return 0;
+            }
+            value = (value << 1) | ((data[pos >> 3] >> (7 - (pos & 7))) & 1);
+            pos++;
+        }
+        return value;
+    }
+
+    void skip(int32_t n)
+    {
+        pos += n;
+        if (pos > size * 8) {
+            overread = true;
+        }
+    }
+
+    // 合法码流中的 ue(v) 不超过 32 位，前导 0 超过 31 个视为数据损坏
+    uint32_t get_ue()
+    {
+        int32_t zeros = 0;
+        while (get(1) == 0) {
+            if (overread || ++zeros > 31) {
+                overread = true;
+                return 0;
+            }
+        }
+        return zeros == 0 ? 0 : (uint32_t)(((uint64_t)1 << zeros) - 1 + get(zeros));
+    }
+
+    int32_t get_se()
+    {
+        uint32_t v = get_ue();
+        return (v & 1) ? (int32_t)((v + 1) / 2) : -(int32_t)(v / 2);
+    }
+};
+
+// 去掉 NAL 中的防竞争字节（00 00 03 中的 03），得到 RBSP
+static std::vector<uint8_t> nal_to_rbsp(const uint8_t* nal, size_t size)
+{
+    std::vector<uint8_t> rbsp;
+    rbsp.reserve(size);
+    int32_t zeros = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (zeros >= 2 && nal[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        rbsp.push_back(nal[i]);
+        zeros = nal[i] == 0 ? zeros + 1 : 0;
+    }
+    return rbsp;
+}
+
+typedef struct hevc_sps_info {
+    int32_t profile_idc;
+    int32_t level_idc;
+    int32_t chroma_format_idc;
+    int32_t width;
+    int32_t height;
+    int32_t bit_depth;
+    int32_t bit_depth_chroma;
+    int32_t num_reorder_pics;
+    AVRational sar;
+    int32_t color_range; ///< 0 表示未指定
+    int32_t color_primaries;
+    int32_t color_trc;
+    int32_t color_space;
+    int32_t chroma_location; ///< AVChromaLocation，0 表示未指定
+    AVRational frame_rate;
+} hevc_sps_info;
+
+static void skip_profile_tier_level(bit_reader& br, int32_t max_sub_layers_minus1, hevc_sps_info* info)
+{
+    br.skip(2);                         // general_profile_space
+    br.skip(1);                         // general_tier_flag
+    info->profile_idc = br.get(5);
+    br.skip(32);                        // general_profile_compatibility_flag
+    br.skip(4);                         // progressive/interlaced/non_packed/frame_only
+    br.skip(43);
+    br.skip(1);                         // general_inbld_flag
+    info->level_idc = br.get(8);
+
+    bool profile_present[HEVC_MAX_SUB_LAYERS] = { false };
+    bool level_present[HEVC_MAX_SUB_LAYERS] = { false };
+    for (int32_t i = 0; i < max_sub_layers_minus1; i++) {
+        profile_present[i] = br.get(1);
+        level_present[i] = br.get(1);
+    }
+    if (max_sub_layers_minus1 > 0) {
+        br.skip(2 * (8 - max_sub_layers_minus1)); // reserved_zero_2bits
+    }
+    for (int32_t i = 0; i < max_sub_layers_minus1; i++) {
+        if (profile_present[i]) {
+            br.skip(88);
+        }
+        if (level_present[i]) {
+            br.skip(8);
+        }
+    }
+}
+
+static void skip_scaling_list_data(bit_reader& br)
+{
+    for (int32_t size_id = 0; size_id < 4; size_id++) {
+        for (int32_t matrix_id = 0; matrix_id < 6; matrix_id += (size_id == 3) ? 3 : 1) {
+            if (!br.get(1)) {           // scaling_list_pred_mode_flag
+                br.get_ue();            // scaling_list_pred_matrix_id_delta
+                continue;
+            }
+
+            int32_t coef_num = FFMIN(64, 1 << (4 + (size_id << 1)));
+            if (size_id > 1) {
+                br.get_se();            // scaling_list_dc_coef_minus8
+            }
+            for (int32_t i = 0; i < coef_num; i++) {
+                br.get_se();            // scaling_list_delta_coef
+            }
+        }
+    }
+}
+
+// 跳过 SPS 中的第 idx 个 st_ref_pic_set，num_delta_pocs 记录每个集合的参考图像数，后面的集合预测时需要
+static int32_t skip_st_ref_pic_set(bit_reader& br, int32_t idx, int32_t* num_delta_pocs)
+{
+    bool inter_rps_pred = idx != 0 && br.get(1);
+    if (inter_rps_pred) {
+        br.skip(1);                     // delta_rps_sign
+        br.get_ue();                    // abs_delta_rps_minus1
+
+        // SPS 中总是从前一个集合预测
+        int32_t count = 0;
+        for (int32_t j = 0; j <= num_delta_pocs[idx - 1]; j++) {
+            bool used_by_curr_pic = br.get(1);
+            bool use_delta = used_by_curr_pic || br.get(1);
+            count += use_delta ? 1 : 0;
+        }
+        num_delta_pocs[idx] = count;
+    } else {
+        uint32_t num_negative = br.get_ue();
+        uint32_t num_positive = br.get_ue();
+        if (num_negative > HEVC_MAX_DELTA_POCS || num_positive > HEVC_MAX_DELTA_POCS) {
+            return -1;
+        }
+        for (uint32_t j = 0; j < num_negative + num_positive; j++) {
+            br.get_ue();                // delta_poc_s0/s1_minus1
+            br.skip(1);                 // used_by_curr_pic_s0/s1_flag
+        }
+        num_delta_pocs[idx] = num_negative + num_positive;
+    }
+
+    return num_delta_pocs[idx] > HEVC_MAX_DELTA_POCS ? -1 : 0;
+}
+
+// Table E-1 中 aspect_ratio_idc 1~16 对应的宽高比
+static const AVRational hevc_sar_table[] = {
+    { 0, 1 }, { 1, 1 }, { 12, 11 }, { 10, 11 }, { 16, 11 }, { 40, 33 }, { 24, 11 }, { 20, 11 }, { 32, 11 },
+    { 80, 33 }, { 18, 11 }, { 15, 11 }, { 64, 33 }, { 160, 99 }, { 4, 3 }, { 3, 2 }, { 2, 1 },
+};
+
+static void parse_vui(bit_reader& br, hevc_sps_info* info)
+{
+    if (br.get(1)) {                    // aspect_ratio_info_present_flag
+        uint32_t idc = br.get(8);
+        if (idc == 255) {
+            info->sar.num = br.get(16);
+            info->sar.den = br.get(16);
+        } else if (idc < sizeof(hevc_sar_table) / sizeof(hevc_sar_table[0])) {
+            info->sar = hevc_sar_table[idc];
+        }
+    }
+
+    if (br.get(1)) {                    // overscan_info_present_flag
+        br.skip(1);
+    }
+
+    if (br.get(1)) {                    // video_signal_type_present_flag
+        br.skip(3);                     // video_format
+        info->color_range = br.get(1) ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+        if (br.get(1)) {                // colour_description_present_flag，取值与 FFmpeg 的枚举值一致
+            info->color_primaries = br.get(8);
+            info->color_trc = br.get(8);
+            info->color_space = br.get(8);
+        }
+    }
+
+    if (br.get(1)) {                    // chroma_loc_info_present_flag
+        info->chroma_location = br.get_ue() + 1;
+        br.get_ue();                    // chroma_sample_loc_type_bottom_field
+    }
+
+    br.skip(3);                         // neutral_chroma/field_seq/frame_field_info_present
+    if (br.get(1)) {                    // default_display_window_flag
+        br.get_ue();
+        br.get_ue();
+        br.get_ue();
+        br.get_ue();
+    }
+
+    if (br.get(1)) {                    // vui_timing_info_present_flag
+        uint32_t num_units_in_tick = br.get(32);
+        uint32_t time_scale = br.get(32);
+        if (!br.overread && num_units_in_tick > 0 && time_scale > 0) {
+            av_reduce(&info->frame_rate.num, &info->frame_rate.den, time_scale, num_units_in_tick, INT32_MAX);
+        }
+    }
+}
+
+// 按 H.265 7.3.2.2 解析 SPS，只保留填充编码参数需要的字段
+static int32_t parse_sps(const uint8_t* nal, size_t size, hevc_sps_info* info)
+{
+    // 跳过 2 字节 NAL 头
+    std::vector<uint8_t> rbsp = nal_to_rbsp(nal + 2, size - 2);
+    bit_reader br(rbsp.data(), rbsp.size());
+
+    br.skip(4);                         // sps_video_parameter_set_id
+    int32_t max_sub_layers_minus1 = br.get(3);
+    br.skip(1);                         // sps_temporal_id_nesting_flag
+    if (max_sub_layers_minus1 >= HEVC_MAX_SUB_LAYERS) {
+        return -1;
+    }
+    skip_profile_tier_level(br, max_sub_layers_minus1, info);
+
+    br.get_ue();                        // sps_seq_parameter_set_id
+    info->chroma_format_idc = br.get_ue();
+    if (info->chroma_format_idc > 3) {
+        return -1;
+    }
+    if (info->chroma_format_idc == 3) {
+        br.skip(1);                     // separate_colour_plane_flag
+    }
+
+    uint32_t width = br.get_ue();
+    uint32_t height = br.get_ue();
+    if (br.get(1)) {                    // conformance_window_flag，偏移以色度采样为单位
+        int32_t sub_width = (info->chroma_format_idc == 1 || info->chroma_format_idc == 2) ? 2 : 1;
+        int32_t sub_height = info->chroma_format_idc == 1 ? 2 : 1;
+        uint32_t left = br.get_ue();
+        uint32_t right = br.get_ue();
+        uint32_t top = br.get_ue();
+        uint32_t bottom = br.get_ue();
+        uint64_t crop_width = (uint64_t)(left + right) * sub_width;
+        uint64_t crop_height = (uint64_t)(top + bottom) * sub_height;
+        if (crop_width >= width || crop_height >= height) {
+            return -1;
+        }
+        width -= crop_width;
+        height -= crop_height;
+    }
+    if (width == 0 || height == 0 || width > 16384 || height > 16384) {
+        return -1;
+    }
+    info->width = width;
+    info->height = height;
+
+    info->bit_depth = br.get_ue() + 8;
+    info->bit_depth_chroma = br.get_ue() + 8;
+    uint32_t log2_max_poc_lsb = br.get_ue() + 4;
+    if (log2_max_poc_lsb > 16) {
+        return -1;
+    }
+
+    // 最高子层的 sps_max_num_reorder_pics 决定输出延迟
+    bool ordering_info_present = br.get(1);
+    for (int32_t i = ordering_info_present ? 0 : max_sub_layers_minus1; i <= max_sub_layers_minus1; i++) {
+        br.get_ue();                    // sps_max_dec_pic_buffering_minus1
+        info->num_reorder_pics = br.get_ue();
+        br.get_ue();                    // sps_max_latency_increase_plus1
+    }
+
+    for (int32_t i = 0; i < 6; i++) {
+        br.get_ue();                    // 编码块、变换块大小和变换层级
+    }
+
+    if (br.get(1) && br.get(1)) {       // scaling_list_enabled_flag, sps_scaling_list_data_present_flag
+        skip_scaling_list_data(br);
+    }
+
+    br.skip(2);                         // amp_enabled_flag, sample_adaptive_offset_enabled_flag
+    if (br.get(1)) {                    // pcm_enabled_flag
+        br.skip(8);                     // pcm_sample_bit_depth_luma/chroma_minus1
+        br.get_ue();
+        br.get_ue();
+        br.skip(1);                     // pcm_loop_filter_disabled_flag
+    }
+
+    uint32_t num_st_rps = br.get_ue();
+    if (num_st_rps > HEVC_MAX_SHORT_TERM_REF_PIC_SETS) {
+        return -1;
+    }
+    int32_t num_delta_pocs[HEVC_MAX_SHORT_TERM_REF_PIC_SETS] = { 0 };
+    for (uint32_t i = 0; i < num_st_rps; i++) {
+        if (skip_st_ref_pic_set(br, i, num_delta_pocs) < 0 || br.overread) {
+            return -1;
+        }
+    }
+
+    if (br.get(1)) {                    // long_term_ref_pics_present_flag
+        uint32_t num_long_term = br.get_ue();
+        if (num_long_term > 32) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < num_long_term; i++) {
+            br.skip(log2_max_poc_lsb + 1); // lt_ref_pic_poc_lsb_sps, used_by_curr_pic_lt_sps_flag
+        }
+    }
+
+    br.skip(2);                         // sps_temporal_mvp_enabled_flag, strong_intra_smoothing_enabled_flag
+    if (br.get(1)) {                    // vui_parameters_present_flag
+        parse_vui(br, info);
+    }
+
+    return br.overread ? -1 : 0;
+}
+
+static int32_t hevc_pix_fmt(int32_t chroma_format_idc, int32_t bit_depth)
+{
+    static const int32_t formats_8bit[] = { AV_PIX_FMT_GRAY8, AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV422P, AV_PIX_FMT_YUV444P };
+    static const int32_t formats_10bit[] = { AV_PIX_FMT_GRAY10, AV_PIX_FMT_YUV420P10, AV_PIX_FMT_YUV422P10,
+                                             AV_PIX_FMT_YUV444P10 };
+    if (bit_depth == 8) {
+        return formats_8bit[chroma_format_idc];
+    }
+    if (bit_depth == 10) {
+        return formats_10bit[chroma_format_idc];
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+static int32_t set_extradata(AVCodecParameters* par, const std::vector<uint8_t>& data)
+{
+    av_freep(&par->extradata);
+    par->extradata_size = 0;
+    par->extradata = (uint8_t*)av_mallocz(data.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (par->extradata == nullptr) {
+        return -1;
+    }
+
+    memcpy(par->extradata, data.data(), data.size());
+    par->extradata_size = data.size();
+    return 0;
+}
+
+int32_t hevc_parse_params(const uint8_t* data, size_t size, AVCodecParameters* par, AVRational* frame_rate)
+{
+    const uint8_t* end = data + size;
+    const uint8_t* nals[3] = { nullptr, nullptr, nullptr }; // VPS、SPS、PPS
+    size_t nal_sizes[3] = { 0, 0, 0 };
+
+    const uint8_t* sc = es_find_start_code(data, end);
+    while (sc < end && (nals[0] == nullptr || nals[1] == nullptr || nals[2] == nullptr)) {
+        const uint8_t* nal = sc + 3;
+        const uint8_t* next = es_find_start_code(nal, end);
+
+        // 4 字节起始码的前导 0 不属于当前 NAL
+        const uint8_t* nal_end = next;
+        while (nal_end > nal && nal_end[-1] == 0) {
+            nal_end--;
+        }
+
+        if (nal_end - nal >= 3) {
+            int32_t nal_type = (nal[0] >> 1) & 0x3f;
+            if (nal_type < 32 && nals[1] == nullptr) {
+                // 第一帧之前没有参数集
+                break;
+            }
+            if (nal_type >= HEVC_NAL_VPS && nal_type <= HEVC_NAL_PPS && nals[nal_type - HEVC_NAL_VPS] == nullptr) {
+                nals[nal_type - HEVC_NAL_VPS] = nal;
+                nal_sizes[nal_type - HEVC_NAL_VPS] = nal_end - nal;
+            }
+        }
+
+        sc = next;
+    }
+
+    // 最后一个参数集可能被数据末尾截断，要求之后还能找到起始码
+    if (nals[0] == nullptr || nals[1] == nullptr || nals[2] == nullptr || sc >= end) {
+        return -1;
+    }
+
+    hevc_sps_info info;
+    memset(&info, 0, sizeof(info));
+    info.sar = (AVRational){ 0, 1 };
+    info.frame_rate = (AVRational){ 0, 1 };
+    info.color_primaries = AVCOL_PRI_UNSPECIFIED;
+    info.color_trc = AVCOL_TRC_UNSPECIFIED;
+    info.color_space = AVCOL_SPC_UNSPECIFIED;
+    if (parse_sps(nals[1], nal_sizes[1], &info) < 0) {
+        return -1;
+    }
+
+    // 与 libavformat 从码流中提取的 extradata 一致：带 4 字节起始码的 VPS、SPS、PPS
+    std::vector<uint8_t> extradata;
+    for (int32_t i = 0; i < 3; i++) {
+        static const uint8_t start_code[] = { 0, 0, 0, 1 };
+        extradata.insert(extradata.end(), start_code, start_code + sizeof(start_code));
+        extradata.insert(extradata.end(), nals[i], nals[i] + nal_sizes[i]);
+    }
+    if (set_extradata(par, extradata) < 0) {
+        return -1;
+    }
+
+    par->codec_type = AVMEDIA_TYPE_VIDEO;
+    par->codec_id = AV_CODEC_ID_HEVC;
+    par->width = info.width;
+    par->height = info.height;
+    par->profile = info.profile_idc;
+    par->level = info.level_idc;
+    par->format = hevc_pix_fmt(info.chroma_format_idc, info.bit_depth);
+    par->bits_per_raw_sample = info.bit_depth;
+    par->video_delay = info.num_reorder_pics;
+    par->sample_aspect_ratio = info.sar;
+    par->color_range = (AVColorRange)info.color_range;
+    par->color_primaries = (AVColorPrimaries)info.color_primaries;
+    par->color_trc = (AVColorTransferCharacteristic)info.color_trc;
+    par->color_space = (AVColorSpace)info.color_space;
+    par->chroma_location = (AVChromaLocation)info.chroma_location;
+    *frame_rate = info.frame_rate;
+
+    return 0;
+}
+
+int32_t hevc_extradata_to_hvcc(AVCodecParameters* par, int32_t parameter_sets_complete)
+{
+    if (par->codec_id != AV_CODEC_ID_HEVC || par->extradata_size < 4 ||
+        (AV_RB24(par->extradata) != 1 && AV_RB32(par->extradata) != 1)) {
+        return -1;
+    }
+
+    // hvcC 中参数集按 VPS、SPS、PPS、SEI 的顺序分组保存
+    static const int32_t array_types[] = { HEVC_NAL_VPS, HEVC_NAL_SPS, HEVC_NAL_PPS, HEVC_NAL_SEI_PREFIX,
+                                           HEVC_NAL_SEI_SUFFIX };
+    std::vector<std::pair<const uint8_t*, size_t>> arrays[FF_ARRAY_ELEMS(array_types)];
+
+    const uint8_t* end = par->extradata + par->extradata_size;
+    const uint8_t* sc = es_find_start_code(par->extradata, end);
+    while (sc < end) {
+        const uint8_t* nal = sc + 3;
+        const uint8_t* next = es_find_start_code(nal, end);
+        const uint8_t* nal_end = next;
+        while (nal_end > nal && nal_end[-1] == 0) {
+            nal_end--;
+        }
+
+        if (nal_end - nal >= 3) {
+            int32_t nal_type = (nal[0] >> 1) & 0x3f;
+            for (size_t i = 0; i < FF_ARRAY_ELEMS(array_types); i++) {
+                if (nal_type == array_types[i]) {
+                    arrays[i].push_back(std::make_pair(nal, (size_t)(nal_end - nal)));
+                }
+            }
+        }
+
+        sc = next;
+    }
+
+    if (arrays[0].empty() || arrays[1].empty() || arrays[2].empty()) {
+        return -1;
+    }
+
+    // profile_tier_level 的 general 部分在 SPS 中字节对齐，直接取 RBSP 的第 2~13 字节
+    const uint8_t* sps = arrays[1][0].first;
+    size_t sps_size = arrays[1][0].second;
+    std::vector<uint8_t> rbsp = nal_to_rbsp(sps + 2, sps_size - 2);
+    hevc_sps_info info;
+    memset(&info, 0, sizeof(info));
+    if (rbsp.size() < 13 || parse_sps(sps, sps_size, &info) < 0) {
+        return -1;
+    }
+
+    std::vector<uint8_t> hvcc;
+    hvcc.push_back(1);                                      // configurationVersion
+    hvcc.insert(hvcc.end(), rbsp.begin() + 1, rbsp.begin() + 13);
+    hvcc.push_back(0xf0);                                   // min_spatial_segmentation_idc 为 0
+    hvcc.push_back(0x00);
+    hvcc.push_back(0xfc);                                   // parallelismType 为 0（未知）
+    hvcc.push_back(0xfc | info.chroma_format_idc);
+    hvcc.push_back(0xf8 | (info.bit_depth - 8));
+    hvcc.push_back(0xf8 | (info.bit_depth_chroma - 8));
+    hvcc.push_back(0);                                      // avgFrameRate 为 0（未指定）
+    hvcc.push_back(0);
+    // constantFrameRate 为 0，numTemporalLayers、temporalIdNested 与 SPS 相同，NAL 长度字段为 4 字节
+    hvcc.push_back(((((rbsp[0] >> 1) & 0x07) + 1) << 3) | ((rbsp[0] & 0x01) << 2) | 0x03);
+
+    uint8_t num_arrays = 0;
+    for (const auto& nals : arrays) {
+        num_arrays += !nals.empty();
+    }
+    hvcc.push_back(num_arrays);
+
+    for (size_t i = 0; i < FF_ARRAY_ELEMS(array_types); i++) {
+        if (arrays[i].empty()) {
+            continue;
+        }
+
+        // 访问单元中保留带内参数集时（hev1）array_completeness 为 0，与 movenc 自行生成的 hvcC 一致；
+        // 带内的参数集已去除时（hvc1）参数集数组必须完整，SEI 数组不受影响
+        bool complete = parameter_sets_complete && array_types[i] <= HEVC_NAL_PPS;
+        hvcc.push_back((complete ? 0x80 : 0x00) | array_types[i]);
+        hvcc.push_back(arrays[i].size() >> 8);
+        hvcc.push_back(arrays[i].size() & 0xff);
+        for (const auto& nal : arrays[i]) {
+            hvcc.push_back(nal.second >> 8);
+            hvcc.push_back(nal.second & 0xff);
+            hvcc.insert(hvcc.end(), nal.first, nal.first + nal.second);
+        }
+    }
+
+    return set_extradata(par, hvcc);
+}
+
+int32_t hevc_codec_string(const AVCodecParameters* par, char* buf, size_t size)
+{
+    if (par->codec_id != AV_CODEC_ID_HEVC || par->extradata_size < 13) {
+        return -1;
+    }
+
+    // general profile_tier_level 的前 12 字节：profile_space/tier/profile_idc、32 位兼容标志、48 位约束标志、level_idc。
+    // hvcC 中紧跟 configurationVersion，Annex-B 时为 SPS 的 RBSP 的第 2~13 字节
+    uint8_t ptl[12];
+    if (par->extradata[0] == 1) {
+        memcpy(ptl, par->extradata + 1, sizeof(ptl));
+    } else {
+        const uint8_t* end = par->extradata + par->extradata_size;
+        const uint8_t* sc = es_find_start_code(par->extradata, end);
+        std::vector<uint8_t> rbsp;
+        while (sc < end && rbsp.empty()) {
+            const uint8_t* nal = sc + 3;
+            const uint8_t* next = es_find_start_code(nal, end);
+            if (next - nal > 2 && ((nal[0] >> 1) & 0x3f) == HEVC_NAL_SPS) {
+                rbsp = nal_to_rbsp(nal + 2, next - nal - 2);
+            }
+            sc = next;
+        }
+        if (rbsp.size() < 13) {
+            return -1;
+        }
+        memcpy(ptl, rbsp.data() + 1, sizeof(ptl));
+    }
+
+    static const char* profile_spaces[] = { "", "A", "B", "C" };
+    uint32_t compat = AV_RB32(ptl + 1);
+    uint32_t reversed = 0;
+    for (int32_t i = 0; i < 32; i++) {
+        reversed |= ((compat >> i) & 1) << (31 - i);
+    }
+
+    int32_t len = snprintf(buf, size, "%s.%s%d.%X.%c%d", par->codec_tag == MKTAG('h', 'v', 'c', '1') ? "hvc1" : "hev1",
+                           profile_spaces[ptl[0] >> 6], ptl[0] & 0x1f, reversed, (ptl[0] & 0x20) ? 'H' : 'L',
+                           ptl[11]);
+
+    // 约束标志按字节输出，末尾为 0 的字节省略
+    int32_t constraint_bytes = 6;
+    while (constraint_bytes > 0 && ptl[4 + constraint_bytes] == 0) {
+        constraint_bytes--;
+    }
+    for (int32_t i = 0; i < constraint_bytes && len > 0 && (size_t)len < size; i++) {
+        len += snprintf(buf + len, size - len, ".%X", ptl[5 + i]);
+    }
+
+    return len > 0 && (size_t)len < size ? 0 : -1;
+}
+
+static const int32_t adts_sample_rates[] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350,
+};
+
+int32_t adts_parse_params(const uint8_t* data, size_t size, AVCodecParameters* par)
+{
+    if (size < 7 || data[0] != 0xff || (data[1] & 0xf6) != 0xf0) {
+        return -1;
+    }
+
+    int32_t object_type = (data[2] >> 6) + 1;
+    int32_t sample_rate_idx = (data[2] >> 2) & 0x0f;
+    int32_t channel_config = ((data[2] & 0x01) << 2) | (data[3] >> 6);
+    if (sample_rate_idx >= (int32_t)(sizeof(adts_sample_rates) / sizeof(adts_sample_rates[0]))) {
+        return -1;
+    }
+
+    // 声道配置为 0 时声道布局在码流内的 PCE 中，需要解码才能确定
+    if (channel_config == 0) {
+        return -1;
+    }
+
+    std::vector<uint8_t> asc(2);
+    asc[0] = (object_type << 3) | (sample_rate_idx >> 1);
+    asc[1] = ((sample_rate_idx & 0x01) << 7) | (channel_config << 3);
+    if (set_extradata(par, asc) < 0) {
+        return -1;
+    }
+
+    par->codec_type = AVMEDIA_TYPE_AUDIO;
+    par->codec_id = AV_CODEC_ID_AAC;
+    par->profile = object_type - 1; // FF_PROFILE_AAC_* 为 object type 减 1
+    par->sample_rate = adts_sample_rates[sample_rate_idx];
+    par->channels = channel_config == 7 ? 8 : channel_config;
+    par->channel_layout = av_get_default_channel_layout(par->channels);
+    par->format = AV_SAMPLE_FMT_FLTP; // AAC 解码器的输出格式
+    par->frame_size = 1024;
+
+    return 0;
+}
+
+int32_t es_params_fill_stream(const char* filename, AVStream* st)
+{
+    AVCodecID codec_id = st->codecpar->codec_id;
+    if (codec_id != AV_CODEC_ID_HEVC && codec_id != AV_CODEC_ID_AAC) {
+        return -1;
+    }
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    std::vector<uint8_t> head(ES_PARAMS_HEAD_SIZE);
+    size_t head_size = 0;
+    while (head_size < head.size()) {
+        ssize_t n = read(fd, head.data() + head_size, head.size() - head_size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        head_size += n;
+    }
+    close(fd);
+
+    // 解析到临时的参数中，失败时不改动 st
+    AVCodecParameters* par = avcodec_parameters_alloc();
+    if (par == nullptr) {
+        return -1;
+    }
+
+    AVRational frame_rate = { 0, 1 };
+    int32_t ret = codec_id == AV_CODEC_ID_HEVC ? hevc_parse_params(head.data(), head_size, par, &frame_rate)
+                                               : adts_parse_params(head.data(), head_size, par);
+    if (ret >= 0) {
+        ret = avcodec_parameters_copy(st->codecpar, par) < 0 ? -1 : 0;
+    }
+    avcodec_parameters_free(&par);
+    if (ret < 0) {
+        LOGD("parse %s parameters of %s fail\n", avcodec_get_name(codec_id), filename);
+        return -1;
+    }
+
+    if (frame_rate.num > 0) {
+        st->r_frame_rate = frame_rate;
+        st->avg_frame_rate = frame_rate;
+    }
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+//
+// 直接解析裸码流开头的 HEVC 参数集（VPS/SPS/PPS）和 AAC ADTS 头，填充 AVCodecParameters。
+// 输入格式已知时可以代替 avformat_find_stream_info，打开输入时不需要读取和解码若干帧
+//
+
+#ifndef ES_PARAMS_H
+#define ES_PARAMS_H
+#include <stddef.h>
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// 快速打开时从文件开头读取的数据量，参数集和第一个 ADTS 头都应位于其中
+#define ES_PARAMS_HEAD_SIZE (64 * 1024)
+
+// 从 Annex-B 码流开头找到第一组 VPS/SPS/PPS，解析 SPS 得到分辨率（已按 conformance window 裁剪）、
+// profile/level、像素格式、色彩信息和宽高比，extradata 为带起始码的 VPS/SPS/PPS。
+// SPS 的 VUI 中带有 timing info 时通过 frame_rate 返回帧率，否则 frame_rate 为 0/1。找不到参数集或数据有误时返回 -1
+int32_t hevc_parse_params(const uint8_t* data, size_t size, AVCodecParameters* par, AVRational* frame_rate);
+
+// 把 Annex-B 形式（带起始码的 VPS/SPS/PPS）的 HEVC extradata 转换为 hvcC（HEVCDecoderConfigurationRecord），
+// NAL 长度字段为 4 字节。parameter_sets_complete 非 0 时 VPS/SPS/PPS 数组的 array_completeness 置 1，
+// 表示访问单元中不再带有这些参数集（hvc1 样本描述）。extradata 已经是 hvcC 或者缺少参数集时返回 -1，此时 par 不变
+int32_t hevc_extradata_to_hvcc(AVCodecParameters* par, int32_t parameter_sets_complete);
+
+// 按 ISO/IEC 14496-15 附录 E 生成 RFC 6381 的 HEVC codecs 参数（如 hvc1.1.6.L93.B0），profile_space、tier、
+// 兼容标志和约束标志取自 extradata（hvcC 或 Annex-B 的 SPS）中的 general profile_tier_level。
+// codec_tag 为 hvc1 时前缀为 hvc1，否则为 hev1（mov 复用器的默认样本描述）。extradata 中没有 SPS 时返回 -1
+int32_t hevc_codec_string(const AVCodecParameters* par, char* buf, size_t size);
+
+// 解析第一个 ADTS 头，填充采样率、声道、profile、frame_size，extradata 为对应的 AudioSpecificConfig。
+// 数据不是以 ADTS 头开始或者声道配置需要 PCE 时返回 -1
+int32_t adts_parse_params(const uint8_t* data, size_t size, AVCodecParameters* par);
+
+// 读取 filename 开头的 ES_PARAMS_HEAD_SIZE 字节，按 st 的 codec_id 解析并填充 st 的编码参数和帧率。
+// 只支持 HEVC 和 AAC，失败时返回 -1，此时 st 不变，调用方应回退到 avformat_find_stream_info
+int32_t es_params_fill_stream(const char* filename, AVStream* st);
+
+#endif
@@ -0,0 +1,279 @@
+#include "live_input.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+#include "log.h"
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+}
+
+#define LIVE_RING_SIZE (4 * 1024 * 1024)
+#define LIVE_IDLE_TIMEOUT_MS 5000
+// 普通文件读到末尾后再次尝试读取的间隔，同时也是管道 poll 的超时，读线程按此间隔检查退出标志
+#define LIVE_POLL_MS 10
+
+struct live_input {
+    std::string filename;
+    int fd = -1;
+    bool owns_fd = false;  ///< 标准输入不由 live_input 关闭
+    bool regular = false;  ///< 普通文件读到末尾时等待增长，管道等读到末尾即结束
+    int64_t idle_timeout_us = 0;
+
+    uint8_t* ring = nullptr;
+    size_t ring_size = 0;
+
+    // 读线程写入 write_total，复用线程读取 read_total，两者之差为缓冲区中的数据量，都在持有 mutex 时更新。
+    // 数据的拷贝在锁外进行，读线程只写入空闲区域，复用线程只读取已写入的区域
+    std::mutex mutex;
+    std::condition_variable cond;
+    uint64_t write_total = 0;
+    uint64_t read_total = 0;
+    bool finished = false; ///< 读线程已结束，缓冲区中的数据读完后返回 EOF 或 error
+    int32_t error = 0;
+    bool quit = false;
+    std::thread thread;
+
+    // 以下在持有 mutex 时更新
+    int64_t full_waits = 0;  ///< 缓冲区满、读线程暂停读取的次数，复用速度跟不上输入时增加
+    int64_t underruns = 0;   ///< 缓冲区空、复用线程等待输入的次数
+    int64_t underrun_us = 0;
+    int64_t max_underrun_us = 0;
+    size_t max_fill = 0;
+};
+
+// 等待输入可读，超时或被信号打断时返回 0，出错时返回负数
+static int32_t wait_readable(live_input* in)
+{
+    struct pollfd p = { in->fd, POLLIN, 0 };
+    int ret = poll(&p, 1, LIVE_POLL_MS);
+    if (ret < 0) {
+        return errno == EINTR ? 0 : AVERROR(errno);
+    }
+    return ret;
+}
+
+static void reader_thread(live_input* in)
+{
+    int32_t error = 0;
+    int64_t idle_start = -1;
+    while (1) {
+        size_t off = 0;
+        size_t n = 0;
+        {
+            std::unique_lock<std::mutex> lock(in->mutex);
+            if (in->write_total - in->read_total == in->ring_size) {
+                in->full_waits++;
+            }
+            in->cond.wait(lock, [in] { return in->quit || in->write_total - in->read_total < in->ring_size; });
+            if (in->quit) {
+                break;
+            }
+
+            off = in->write_total % in->ring_size;
+            n = FFMIN(in->ring_size - off, in->ring_size - (in->write_total - in->read_total));
+        }
+
+        // 管道上阻塞的 read 无法被打断，先 poll 等待可读，关闭时最多等待一个 poll 间隔
+        if (!in->regular) {
+            int32_t ret = wait_readable(in);
+            if (ret < 0) {
+                error = ret;
+                break;
+            } else if (ret == 0) {
+                continue;
+            }
+        }
+
+        ssize_t ret = read(in->fd, in->ring + off, n);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            error = AVERROR(errno);
+            break;
+        }
+
+        if (ret == 0) {
+            if (!in->regular) {
+                break;
+            }
+
+            // 普通文件读到末尾时可能仍在写入，等待文件增长，超过空闲时长仍没有新数据时视为结束
+            int64_t now = av_gettime_relative();
+            if (idle_start < 0) {
+                idle_start = now;
+            } else if (now - idle_start >= in->idle_timeout_us) {
+                LOGD("%s has not grown for %jd ms, end of input\n", in->filename.c_str(), in->idle_timeout_us / 1000);
+                break;
+            }
+
+            std::unique_lock<std::mutex> lock(in->mutex);
+            in->cond.wait_for(lock, std::chrono::milliseconds(LIVE_POLL_MS), [in] { return in->quit; });
+            continue;
+        }
+
+        idle_start = -1;
+        std::lock_guard<std::mutex> lock(in->mutex);
+        in->write_total += ret;
+        in->max_fill = FFMAX(in->max_fill, (size_t)(in->write_total - in->read_total));
+        in->cond.notify_all();
+    }
+
+    if (error < 0) {
+        LOGE("read %s fail: %s\n", in->filename.c_str(), strerror(-error));
+    }
+
+    std::lock_guard<std::mutex> lock(in->mutex);
+    in->error = error;
+    in->finished = true;
+    in->cond.notify_all();
+}
+
+// 缓冲区为空时等待读线程读入新数据，读线程结束且缓冲区读完后返回 EOF 或者读取错误
+static int read_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+    live_input* in = (live_input*)opaque;
+
+    std::unique_lock<std::mutex> lock(in->mutex);
+    if (in->write_total == in->read_total && !in->finished) {
+        int64_t start = av_gettime_relative();
+        in->cond.wait(lock, [in] { return in->write_total != in->read_total || in->finished; });
+        int64_t elapsed = av_gettime_relative() - start;
+        in->underruns++;
+        in->underrun_us += elapsed;
+        in->max_underrun_us = FFMAX(in->max_underrun_us, elapsed);
+    }
+
+    size_t avail = in->write_total - in->read_total;
+    if (avail == 0) {
+        return in->error < 0 ? in->error : AVERROR_EOF;
+    }
+
+    size_t n = FFMIN(avail, (size_t)buf_size);
+    size_t off = in->read_total % in->ring_size;
+    lock.unlock();
+
+    // 数据跨过缓冲区末尾时分两段拷贝
+    size_t first = FFMIN(n, in->ring_size - off);
+    memcpy(buf, in->ring + off, first);
+    memcpy(buf + first, in->ring, n - first);
+
+    lock.lock();
+    in->read_total += n;
+    in->cond.notify_all();
+
+    return n;
+}
+
+static void stop_reader(live_input* in)
+{
+    if (in->thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(in->mutex);
+            in->quit = true;
+            in->cond.notify_all();
+        }
+        in->thread.join();
+    }
+}
+
+static void free_input(live_input* in)
+{
+    stop_reader(in);
+    if (in->owns_fd && in->fd >= 0) {
+        close(in->fd);
+    }
+    av_free(in->ring);
+    delete in;
+}
+
+int32_t open_live_input(live_input** in, AVIOContext** pb, const char* filename, int32_t avio_buffer_size,
+                        int32_t ring_size, int32_t idle_timeout_ms)
+{
+    live_input* l = new (std::nothrow) live_input();
+    if (l == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+
+    l->filename = filename;
+    if (strcmp(filename, "-") == 0) {
+        l->fd = STDIN_FILENO;
+    } else {
+        // 打开命名管道时阻塞到写端打开为止
+        l->fd = open(filename, O_RDONLY | O_CLOEXEC);
+        l->owns_fd = true;
+        if (l->fd < 0) {
+            int32_t ret = AVERROR(errno);
+            LOGE("open %s fail: %s\n", filename, strerror(errno));
+            free_input(l);
+            return ret;
+        }
+    }
+
+    struct stat st;
+    l->regular = fstat(l->fd, &st) == 0 && S_ISREG(st.st_mode);
+    l->idle_timeout_us = (int64_t)(idle_timeout_ms > 0 ? idle_timeout_ms : LIVE_IDLE_TIMEOUT_MS) * 1000;
+    l->ring_size = ring_size > 0 ? ring_size : LIVE_RING_SIZE;
+    l->ring = (uint8_t*)av_malloc(l->ring_size);
+    if (l->ring == nullptr) {
+        free_input(l);
+        return AVERROR(ENOMEM);
+    }
+
+    l->thread = std::thread(reader_thread, l);
+
+    uint8_t* avio_ctx_buffer = (uint8_t*)av_malloc(avio_buffer_size);
+    if (avio_ctx_buffer == nullptr) {
+        free_input(l);
+        return AVERROR(ENOMEM);
+    }
+
+    // 不提供 seek 回调，libavformat 探测时只能在 AVIOContext 的缓冲区内回退
+    *pb = avio_alloc_context(avio_ctx_buffer, avio_buffer_size, 0, l, &read_packet, nullptr, nullptr);
+    if (*pb == nullptr) {
+        av_free(avio_ctx_buffer);
+        free_input(l);
+        return AVERROR(ENOMEM);
+    }
+
+    LOGD("live input %s: %s, ring %zu bytes\n", filename, l->regular ? "growing file" : "stream", l->ring_size);
+    *in = l;
+    return 0;
+}
+
+void close_live_input(live_input** in, AVIOContext** pb)
+{
+    if (in == nullptr || *in == nullptr) {
+        return;
+    }
+
+    live_input* l = *in;
+    if (pb != nullptr && *pb != nullptr) {
+        // 内部缓冲区可能已被 AVIOContext 替换，需要释放 AVIOContext 当前持有的缓冲区
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+    }
+
+    stop_reader(l);
+
+    LOG_AT(LOG_LEVEL_COUNTERS, "live input %s: %ju bytes, ring max fill %zu/%zu, %jd full waits, "
+           "%jd underruns %.3f ms in total max %.3f ms\n", l->filename.c_str(), (uintmax_t)l->read_total,
+           l->max_fill, l->ring_size, l->full_waits, l->underruns, l->underrun_us / 1000.0,
+           l->max_underrun_us / 1000.0);
+
+    free_input(l);
+    *in = nullptr;
+}
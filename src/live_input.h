@@ -0,0 +1,26 @@
+//
+// 直播输入。输入是仍在写入的文件、管道或标准输入时不能预先映射整个文件，由读线程从 fd 持续读入固定大小的环形缓冲区，
+// AVIOContext 从环形缓冲区中读取。缓冲区为空时读取阻塞等待新数据而不是返回 EOF，缓冲区满时读线程暂停读取，
+// 内存占用与输入时长无关。管道在写端关闭时结束，普通文件在超过空闲时长没有增长时结束
+//
+
+#ifndef LIVE_INPUT_H
+#define LIVE_INPUT_H
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+typedef struct live_input live_input;
+
+// 打开 filename（"-" 表示标准输入）并启动读线程，创建读取环形缓冲区的 AVIOContext，avio_buffer_size 为其内部缓冲区大小。
+// ring_size 为环形缓冲区大小，idle_timeout_ms 为普通文件没有增长多久后视为结束，参数小于等于 0 时使用默认值（4 MiB、5000 ms）。
+// 输入不可 seek。打开失败时返回负数
+int32_t open_live_input(live_input** in, AVIOContext** pb, const char* filename, int32_t avio_buffer_size,
+                        int32_t ring_size, int32_t idle_timeout_ms);
+
+// 结束读线程并关闭输入，释放 AVIOContext 和环形缓冲区，输出读取等待等统计信息
+void close_live_input(live_input** in, AVIOContext** pb);
+
+#endif
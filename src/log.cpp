@@ -0,0 +1,69 @@
+#include "log.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+std::atomic<int32_t> g_log_level(LOG_LEVEL_INFO);
+
+static const char* level_names[] = { "error", "warn", "counters", "info", "debug", "trace" };
+
+void log_set_level(int32_t level)
+{
+    g_log_level.store(level, std::memory_order_relaxed);
+}
+
+int32_t log_parse_level(const char* name)
+{
+    if (strcmp(name, "quiet") == 0) {
+        return LOG_LEVEL_QUIET;
+    }
+
+    for (int32_t i = 0; i < (int32_t)(sizeof(level_names) / sizeof(level_names[0])); i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -2;
+}
+
+void log_write(int32_t level, const char* format, ...)
+{
+    // 先格式化到栈上的缓冲区，再一次性写出，多线程输出时每行只获取一次 stdout 的锁，行与行之间也不会交错
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    int32_t len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len < 0) {
+        return;
+    }
+
+    if (len >= (int32_t)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    fwrite(line, 1, len, level <= LOG_LEVEL_WARN ? stderr : stdout);
+}
+
+void stream_stats_init(stream_stats* stats, const char* name, int32_t tb_num, int32_t tb_den)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->name = name;
+    stats->tb_num = tb_num;
+    stats->tb_den = tb_den;
+}
+
+void stream_stats_print(const stream_stats* stats)
+{
+    double duration = 0.0;
+    if (stats->packets > 0 && stats->tb_den != 0) {
+        duration = (double)(stats->last_pts + stats->last_duration - stats->first_pts) * stats->tb_num / stats->tb_den;
+    }
+
+    LOG_AT(LOG_LEVEL_COUNTERS, "%s: packets %jd key %jd bytes %jd max %jd duration %.3f s bitrate %.1f kb/s\n",
+           stats->name, stats->packets, stats->key_packets, stats->bytes, stats->max_size, duration,
+           duration > 0 ? stats->bytes * 8 / duration / 1000 : 0.0);
+}
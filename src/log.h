@@ -0,0 +1,91 @@
+//
+// 分级日志与按流统计
+//
+
+#ifndef LOG_H
+#define LOG_H
+#include <stdint.h>
+
+#include <atomic>
+
+// 日志级别，数值越大越详细。LOG_LEVEL_COUNTERS 级别只输出错误、警告以及任务结束时的按流统计，
+// 逐包日志全部关闭，即 "只统计" 模式
+#define LOG_LEVEL_QUIET    -1
+#define LOG_LEVEL_ERROR    0
+#define LOG_LEVEL_WARN     1
+#define LOG_LEVEL_COUNTERS 2
+#define LOG_LEVEL_INFO     3
+#define LOG_LEVEL_DEBUG    4
+#define LOG_LEVEL_TRACE    5
+
+// 编译期日志级别，高于该级别的日志调用在编译期即被消除，不产生任何运行时开销。
+// Release 构建（定义了 NDEBUG）默认去掉 DEBUG 及以上级别的日志，也可以通过 -DLOG_COMPILE_LEVEL=n 指定
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+#endif
+
+extern std::atomic<int32_t> g_log_level;
+
+static inline bool log_enabled(int32_t level)
+{
+    return level <= g_log_level.load(std::memory_order_relaxed);
+}
+
+void log_set_level(int32_t level);
+
+// 解析 "quiet" "error" "warn" "counters" "info" "debug" "trace"，无法识别时返回 -2
+int32_t log_parse_level(const char* name);
+
+void log_write(int32_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// 先做编译期判断，再做运行时判断，只有两者都满足时才会格式化日志
+#define LOG_AT(level, format, ...)                                          \
+    do {                                                                    \
+        if ((level) <= LOG_COMPILE_LEVEL && log_enabled(level)) {           \
+            log_write((level), format, ##__VA_ARGS__);                      \
+        }                                                                   \
+    } while (0)
+
+#define LOGE(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOGW(format, ...) LOG_AT(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOGI(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOGD(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define LOGT(format, ...) LOG_AT(LOG_LEVEL_TRACE, format, ##__VA_ARGS__)
+
+// 单个流的统计信息。逐包只做几次整数累加，代替逐包打印，任务结束时一次性输出
+typedef struct stream_stats {
+    const char* name;
+    int32_t tb_num;      ///< 时间戳的时间基
+    int32_t tb_den;
+    int64_t packets;
+    int64_t key_packets;
+    int64_t bytes;
+    int64_t max_size;
+    int64_t first_pts;
+    int64_t last_pts;
+    int64_t last_duration;
+} stream_stats;
+
+void stream_stats_init(stream_stats* stats, const char* name, int32_t tb_num, int32_t tb_den);
+
+static inline void stream_stats_add(stream_stats* stats, int64_t pts, int64_t duration, int32_t size, bool key)
+{
+    if (stats->packets == 0) {
+        stats->first_pts = pts;
+    }
+    stats->packets++;
+    stats->key_packets += key ? 1 : 0;
+    stats->bytes += size;
+    stats->max_size = size > stats->max_size ? size : stats->max_size;
+    stats->last_pts = pts;
+    stats->last_duration = duration;
+}
+
+// 以 LOG_LEVEL_COUNTERS 级别输出统计信息
+void stream_stats_print(const stream_stats* stats);
+
+#endif
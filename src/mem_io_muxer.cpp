@@ -6,12 +6,26 @@ extern "C" {
 #include <libavutil/samplefmt.h>
 #include <libavutil/timestamp.h>
 #include <libavutil/file.h>
+#include <libavutil/time.h>
 #include <libavutil/common.h>
 #include <libavformat/avformat.h>
 }
 
 #include <algorithm>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "es_demuxer.h"
+#include "live_input.h"
+#include "log.h"
+#include "mem_io_muxer.h"
+#include "mem_output.h"
+#include "probe_cache.h"
+#include "ts_generator.h"
+#include "uring_output.h"
 
 static AVFormatContext* v_ifmt_ctx = nullptr; // 用于音频输入
 static AVFormatContext* a_ifmt_ctx = nullptr; // 用于视频输入
@@ -31,16 +45,62 @@ static AVIOContext *video_avio_ctx = nullptr;
 static uint8_t *audio_avio_ctx_buffer = nullptr;
 static uint8_t *video_avio_ctx_buffer = nullptr;
 
-static const size_t avio_ctx_buffer_size = 4096;
-
 typedef struct buffer_data {
+    uint8_t *base;     ///< 输入内存的起始地址，seek 时以此为基准
     uint8_t *ptr;
-    size_t size; ///< size left in the buffer
+    size_t size;       ///< size left in the buffer
+    size_t total_size; ///< 输入内存的总大小，用于响应 AVSEEK_SIZE
+    int64_t read_calls;
+    int64_t read_bytes;
+    int64_t seek_calls;
 } buffer_data;
 
 struct buffer_data v_bd = { 0 };
 struct buffer_data a_bd = { 0 };
 
+// 每个输入单独配置的读取参数。MP4/MOV 等格式的 moov 可能位于文件末尾，探测时需要 seek 和较大的探测数据量，
+// 而裸码流只需要很少的数据即可完成探测，因此这两个参数需要按输入分别设置
+typedef struct input_options {
+    int32_t buffer_size; ///< AVIOContext 内部缓冲区大小
+    int64_t probe_size;  ///< 探测数据大小，0 表示使用 libavformat 的默认值
+} input_options;
+
+static input_options v_opts = { 64 * 1024, 0 };
+static input_options a_opts = { 64 * 1024, 0 };
+
+// 非空时输入的探测结果缓存在该目录下，再次复用同一输入时跳过 avformat_find_stream_info
+static const char *probe_cache_dir = nullptr;
+
+// 零拷贝输入源，在 open_input 映射的内存上直接切分出访问单元或 ADTS 帧
+static es_demuxer v_es = { 0 };
+static es_demuxer a_es = { 0 };
+static bool zero_copy = false;
+
+// 直播输入模式。输入是仍在写入的文件、管道或标准输入，从固定大小的环形缓冲区中读取，读到末尾时等待新数据而不是结束
+typedef struct live_options {
+    int32_t idle_timeout_ms; ///< 普通文件超过该时长没有增长时视为结束，0 表示使用默认值
+    int32_t ring_size;       ///< 每个输入的环形缓冲区大小，0 表示使用默认值
+} live_options;
+
+static bool live_mode = false;
+static live_options live_opts = { 0, 0 };
+static live_input *v_live = nullptr;
+static live_input *a_live = nullptr;
+
+// 输出目标。内存输出模式下 muxer 直接写入内存缓冲区，下游可以直接使用 mem_out.data 中的数据而无需经过文件系统
+enum output_mode {
+    OUTPUT_FILE,         ///< 写入文件
+    OUTPUT_FILE_URING,   ///< 通过 io_uring 异步写入文件
+    OUTPUT_MEMORY,       ///< 写入可自动扩容的内存缓冲区
+    OUTPUT_MEMORY_FIXED, ///< 写入预分配的固定大小缓冲区
+};
+
+static output_mode out_mode = OUTPUT_FILE;
+static mem_output mem_out = { 0 };
+static uring_output *uring_out = nullptr;
+static uint8_t *fixed_output_buffer = nullptr;
+static size_t fixed_output_size = 0;
+
 // 从内存中读取数据，不用的应用场景需要自己实现这个函数
 static int read_packet(void *opaque, uint8_t *buf, int buf_size)
 {
@@ -48,46 +108,152 @@ static int read_packet(void *opaque, uint8_t *buf, int buf_size)
     buf_size = FFMIN(buf_size, bd->size);
 
     if (buf_size <= 0) {
-       return -1; 
+       return AVERROR_EOF;
     }
         
-    printf("ptr:%p size:%zu\n", bd->ptr, bd->size);
+    LOGT("ptr:%p size:%zu\n", bd->ptr, bd->size);
 
     /* copy internal buffer data to buf */
     memcpy(buf, bd->ptr, buf_size);
     bd->ptr  += buf_size; // 这里将设输入内存是一个连续的内存，每次读取一部分数据后，指针前移
     bd->size -= buf_size;
+    bd->read_calls++;
+    bd->read_bytes += buf_size;
 
     return buf_size;
 }
 
-static int32_t open_input(char* filename, struct buffer_data *bd, uint8_t **input_buffer, size_t *buffer_size, 
-                          AVIOContext **avio_ctx, uint8_t **avio_ctx_buffer, AVFormatContext** ifmt_ctx,
-                          int32_t *st_idx, AVMediaType type)
+// 在内存中 seek，输入是一块连续内存，seek 只需要移动读指针。
+// whence 为 AVSEEK_SIZE 时返回输入的总大小，libavformat 据此判断能否直接跳到文件末尾读取 moov 等信息
+static int64_t seek_packet(void *opaque, int64_t offset, int whence)
+{
+    struct buffer_data *bd = (struct buffer_data *)opaque;
+
+    int64_t new_pos = 0;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return bd->total_size;
+    case SEEK_SET:
+        new_pos = offset;
+        break;
+    case SEEK_CUR:
+        new_pos = (bd->ptr - bd->base) + offset;
+        break;
+    case SEEK_END:
+        new_pos = bd->total_size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (new_pos < 0 || new_pos > (int64_t)bd->total_size) {
+        return AVERROR(EINVAL);
+    }
+
+    bd->ptr = bd->base + new_pos;
+    bd->size = bd->total_size - new_pos;
+    bd->seek_calls++;
+
+    return new_pos;
+}
+
+static void unmap_buffer(void *opaque, uint8_t *data)
+{
+    av_file_unmap(data, (size_t)(uintptr_t)opaque);
+}
+
+// 根据第一个 ADTS 头生成 AudioSpecificConfig，零拷贝模式下去掉了 ADTS 头，mp4 需要以 extradata 的形式保存这些信息
+static int32_t build_audio_specific_config(const es_demuxer *es, AVCodecParameters *par)
 {
+    const uint8_t *h = es->map_buf->data;
+    if (es->end - h < 7 || h[0] != 0xff || (h[1] & 0xf0) != 0xf0) {
+        return -1;
+    }
+
+    int32_t object_type = (h[2] >> 6) + 1;
+    int32_t sample_rate_idx = (h[2] >> 2) & 0x0f;
+    int32_t channel_config = ((h[2] & 0x01) << 2) | (h[3] >> 6);
 
+    av_freep(&par->extradata);
+    par->extradata = (uint8_t*)av_mallocz(2 + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (par->extradata == nullptr) {
+        return -1;
+    }
+
+    par->extradata[0] = (object_type << 3) | (sample_rate_idx >> 1);
+    par->extradata[1] = ((sample_rate_idx & 0x01) << 7) | (channel_config << 3);
+    par->extradata_size = 2;
+
+    return 0;
+}
+
+static int32_t read_input_packet(es_demuxer *es, AVFormatContext *ifmt_ctx, AVPacket *pkt)
+{
+    if (zero_copy) {
+        return es_demuxer_read(es, pkt);
+    }
+
+    return av_read_frame(ifmt_ctx, pkt);
+}
+
+// 将整个输入文件映射到内存，创建从映射内存中读取的 AVIOContext
+static int32_t open_mapped_input(char* filename, struct buffer_data *bd, uint8_t **input_buffer, size_t *buffer_size,
+                                 AVIOContext **avio_ctx, uint8_t **avio_ctx_buffer, es_demuxer *es,
+                                 const input_options *opts)
+{
      /* 将文件中的内容映射到内存 */
     int ret = av_file_map(filename, input_buffer, buffer_size, 0, nullptr);
     if (ret < 0) {
         return ret;
     }
 
+    // 映射区域交给引用计数管理，零拷贝模式下的 AVPacket 持有其引用，最后一个引用释放时才解除映射
+    es->map_buf = av_buffer_create(*input_buffer, *buffer_size, unmap_buffer, (void*)(uintptr_t)*buffer_size, 0);
+    if (es->map_buf == nullptr) {
+        av_file_unmap(*input_buffer, *buffer_size);
+        return -1;
+    }
+    es->ptr = *input_buffer;
+    es->end = *input_buffer + *buffer_size;
+
+    bd->base = *input_buffer;
     bd->ptr = *input_buffer;
     bd->size = *buffer_size;
+    bd->total_size = *buffer_size;
 
     // 分配 io 缓存区
-    *avio_ctx_buffer = (uint8_t*)av_malloc(avio_ctx_buffer_size);
+    *avio_ctx_buffer = (uint8_t*)av_malloc(opts->buffer_size);
     if (*avio_ctx_buffer == nullptr) {
         return -1;
     }
 
-    // 分配 AVIOContext, 第三个参数 write_flag 为 0
-    *avio_ctx = avio_alloc_context(*avio_ctx_buffer, avio_ctx_buffer_size,
-                                 0, bd, &read_packet, nullptr, nullptr);
+    // 分配 AVIOContext, 第三个参数 write_flag 为 0。提供 seek 回调后 AVIOContext 即为可 seek 的，
+    // 这样 moov 位于文件末尾的 MP4/MOV 输入也能正常打开
+    *avio_ctx = avio_alloc_context(*avio_ctx_buffer, opts->buffer_size,
+                                 0, bd, &read_packet, nullptr, &seek_packet);
     if (*avio_ctx == nullptr) {
         return -1;
     }
 
+    return 0;
+}
+
+static int32_t open_input(char* filename, struct buffer_data *bd, uint8_t **input_buffer, size_t *buffer_size, 
+                          AVIOContext **avio_ctx, uint8_t **avio_ctx_buffer, AVFormatContext** ifmt_ctx,
+                          int32_t *st_idx, AVMediaType type, es_demuxer *es, live_input **live,
+                          const input_options *opts)
+{
+    int ret = 0;
+    if (live_mode) {
+        ret = open_live_input(live, avio_ctx, filename, opts->buffer_size, live_opts.ring_size,
+                              live_opts.idle_timeout_ms);
+    } else {
+        ret = open_mapped_input(filename, bd, input_buffer, buffer_size, avio_ctx, avio_ctx_buffer, es, opts);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
     // 分配 AVFormatContext, 指定 AVFormatContext.pb 字段。必须在调用 avformat_open_input() 之前完成
     // 如果输入是文件 AVFormatContext 的分配可以交由 avformat_open_input 完成
     *ifmt_ctx = avformat_alloc_context();
@@ -96,25 +262,40 @@ static int32_t open_input(char* filename, struct buffer_data *bd, uint8_t **inpu
     }
 
     (*ifmt_ctx)->pb = *avio_ctx;
-    (*ifmt_ctx)->probesize = 1024; // 指定探测数据大小
+    if (opts->probe_size > 0) {
+        (*ifmt_ctx)->probesize = opts->probe_size; // 指定探测数据大小
+    }
 
+    int64_t open_start = av_gettime_relative();
     ret = avformat_open_input(ifmt_ctx, nullptr, nullptr, nullptr);
     if (ret < 0) {
-        printf("Could not open input\n");
+        LOGE("Could not open input\n");
         return -1;
     }
 
-    // 探测流信息
-    ret = avformat_find_stream_info(*ifmt_ctx, nullptr);
+    // 探测流信息，缓存命中时直接使用上次的探测结果。直播输入仍在增长，不使用探测缓存
+    ret = probe_cache_find_stream_info(live_mode ? nullptr : probe_cache_dir, filename, *ifmt_ctx);
     if (ret < 0) {
-        printf("Could not find stream information\n");
+        LOGE("Could not find stream information\n");
         return -1;
     }
 
+    // 打开耗时以及打开过程中的读取量，用于对比不同 buffer_size/probe_size 配置以及探测缓存的效果
+    LOGI("open %s: format %s buffer_size %d probe_size %jd%s, %.3f ms, %jd reads %jd bytes %jd seeks\n",
+           filename, (*ifmt_ctx)->iformat->name, opts->buffer_size, (*ifmt_ctx)->probesize,
+           ret > 0 ? " (probe cache hit)" : "",
+           (av_gettime_relative() - open_start) / 1000.0, bd->read_calls, bd->read_bytes, bd->seek_calls);
+
     // 查找复合条件的流索引
     *st_idx = av_find_best_stream(*ifmt_ctx, type, -1, -1, nullptr, 0);
     if (*st_idx < 0) {
-        printf("find video stream in input video file failed\n");
+        LOGE("find video stream in input video file failed\n");
+        return -1;
+    }
+
+    es->codec_id = (*ifmt_ctx)->streams[*st_idx]->codecpar->codec_id;
+    if (zero_copy && !es_demuxer_supports(es->codec_id)) {
+        LOGE("zero copy input only supports raw hevc/h264 and adts aac, got %s\n", avcodec_get_name(es->codec_id));
         return -1;
     }
 
@@ -127,18 +308,18 @@ static int32_t open_output(char* output_file)
     // 创建 AVFormatContext 结构的输出文件上下文句柄
     avformat_alloc_output_context2(&ofmt_ctx, nullptr, nullptr, output_file);
     if (result < 0) {
-        printf("alloc output format context fail\n");
+        LOGE("alloc output format context fail\n");
         return -1;
     }
 
     // 在创建输出文件句柄后，接下来要向其中添加媒体流
     // 添加媒体流可以使用函数 avformat_new_stream 实现
     const AVOutputFormat* fmt = ofmt_ctx->oformat;
-    printf("Default video codec id: %d audio codec id: %d\n", fmt->video_codec, fmt->audio_codec);
+    LOGI("Default video codec id: %d audio codec id: %d\n", fmt->video_codec, fmt->audio_codec);
 
     AVStream* video_stream = avformat_new_stream(ofmt_ctx, nullptr);
     if (video_stream == nullptr) {
-        printf("add video stream to output format context fail\n");
+        LOGE("add video stream to output format context fail\n");
         return -1;
     }
 
@@ -147,7 +328,7 @@ static int32_t open_output(char* output_file)
     out_video_st_idx = video_stream->index;
     result = avcodec_parameters_copy(video_stream->codecpar, v_ifmt_ctx->streams[in_video_st_idx]->codecpar);
     if (result < 0) {
-        printf("copy video codec paramaters failed!\n");
+        LOGE("copy video codec paramaters failed!\n");
         return -1;
     }
 
@@ -156,28 +337,48 @@ static int32_t open_output(char* output_file)
 
     AVStream* audio_stream = avformat_new_stream(ofmt_ctx, nullptr);
     if (audio_stream == nullptr) {
-        printf("add audio stream to output format context fail\n");
+        LOGE("add audio stream to output format context fail\n");
         return -1;
     }
 
     out_audio_st_idx = audio_stream->index;
     result = avcodec_parameters_copy(audio_stream->codecpar, a_ifmt_ctx->streams[in_audio_st_idx]->codecpar);
     if (result < 0) {
-        printf("copy audio codec paramaters failed!\n");
+        LOGE("copy audio codec paramaters failed!\n");
         return -1;
     }
 
     audio_stream->id = ofmt_ctx->nb_streams - 1;
     audio_stream->time_base = (AVRational){1, audio_stream->codecpar->sample_rate};
 
+    if (zero_copy && audio_stream->codecpar->codec_id == AV_CODEC_ID_AAC &&
+        build_audio_specific_config(&a_es, audio_stream->codecpar) < 0) {
+        LOGE("build audio specific config fail\n");
+        return -1;
+    }
+
     av_dump_format(ofmt_ctx, 0, output_file, 1);
-    printf("output video idx: %d audio idx: %d\n", out_video_st_idx, out_audio_st_idx);
+    LOGI("output video idx: %d audio idx: %d\n", out_video_st_idx, out_audio_st_idx);
 
     // 有的输出格式不支持输出为文件
     if (!(fmt->flags & AVFMT_NOFILE)) {
-        result = avio_open(&ofmt_ctx->pb, output_file, AVIO_FLAG_WRITE);
+        switch (out_mode) {
+        case OUTPUT_MEMORY:
+            result = open_mem_output(&mem_out, &ofmt_ctx->pb, 0);
+            break;
+        case OUTPUT_MEMORY_FIXED:
+            result = open_mem_output_fixed(&mem_out, &ofmt_ctx->pb, fixed_output_buffer, fixed_output_size);
+            break;
+        case OUTPUT_FILE_URING:
+            result = open_uring_output(&uring_out, &ofmt_ctx->pb, output_file, 0, 0);
+            break;
+        default:
+            result = avio_open(&ofmt_ctx->pb, output_file, AVIO_FLAG_WRITE);
+            break;
+        }
+
         if (result < 0) {
-            printf("avio_open output file fail\n");
+            LOGE("open output %s fail\n", output_file);
             return -1;
         }
     }
@@ -197,11 +398,16 @@ static int32_t do_muxing()
     AVStream* output_stream = nullptr;
     AVStream* input_stream = nullptr;
 
-    int32_t video_frame_idx = 0;
-    int32_t audio_frame_idx = 0;
+    ts_generator video_ts;
+    ts_generator audio_ts;
+    if (init_video_ts_generator(&video_ts, in_video_st, (AVRational){25, 1}) < 0 ||
+        init_audio_ts_generator(&audio_ts, in_audio_st) < 0) {
+        return -1;
+    }
+
     result = avformat_write_header(ofmt_ctx, nullptr);
     if (result < 0) {
-        printf("avformat_write_header fail\n");
+        LOGE("avformat_write_header fail\n");
         return -1;
     }
 
@@ -209,17 +415,30 @@ static int32_t do_muxing()
     pkt->data = nullptr;
     pkt->size = 0;
 
-    printf("Video r_frame_rate: %d / %d\n", in_video_st->r_frame_rate.num, in_video_st->r_frame_rate.den);
-    printf("Video time_base: %d / %d\n", in_video_st->time_base.num, in_video_st->time_base.den);
+    LOGI("Video r_frame_rate: %d / %d\n", in_video_st->r_frame_rate.num, in_video_st->r_frame_rate.den);
+    LOGI("Video time_base: %d / %d\n", in_video_st->time_base.num, in_video_st->time_base.den);
+
+    // 逐包只累加统计信息，结束时一次性输出，代替逐包打印
+    AVStream* out_video_st = ofmt_ctx->streams[out_video_st_idx];
+    AVStream* out_audio_st = ofmt_ctx->streams[out_audio_st_idx];
+    stream_stats video_stats;
+    stream_stats audio_stats;
+    stream_stats_init(&video_stats, "video", out_video_st->time_base.num, out_video_st->time_base.den);
+    stream_stats_init(&audio_stats, "audio", out_audio_st->time_base.num, out_audio_st->time_base.den);
+
+    // 统计吞吐量，用于比较零拷贝输入与 AVIO 拷贝输入两种模式
+    int64_t start_time = av_gettime_relative();
+    int64_t total_packets = 0;
+    int64_t total_bytes = 0;
     
     while (1) {
         // av_compare_ts，其作用是根据对应的时间基比较两个时间戳的顺序。若当前已记录的音频时间戳比视频时间戳新，则从输入视频文件中读取数据并写入；
         // 反之，若当前已记录的视频时间戳比音频时间戳新，则从输入音频文件中读取数据并写入。
         if (av_compare_ts(cur_video_pts, in_video_st->time_base, cur_audio_pts, in_audio_st->time_base) <= 0) {
             input_stream = in_video_st;
-            result = av_read_frame(v_ifmt_ctx, pkt);
+            result = read_input_packet(&v_es, v_ifmt_ctx, pkt);
             if (result < 0) {
-                printf("av_read_frame fail\n");
+                LOGD("av_read_frame fail\n");
                 av_packet_unref(pkt);
                 break;
             }
@@ -228,24 +447,10 @@ static int32_t do_muxing()
                 // 有些输入流编码格式如 H.264 裸码流
                 // 从中读取的视频包中通常不包含时间戳数据，所以无法通过函数 av_compare_ts 来比较时间戳。
                 // 为此，我们通过视频帧数和给定帧率计算每一个 AVPacket 结构的时间戳并为其赋值。
+                // 帧时长在开始复用前已换算为以 time_base 为单位的有理数，这里只有整数运算
+                ts_generator_fill(&video_ts, pkt);
 
-                // r_frame_rate 表示的是音视频流中可以精准表示所有时间戳的最低帧率。
-                // 简单来说，如果当前音视频流的帧率是恒定的，那么 r_frame_rate 表示的是音视频流的实际帧率；
-                // 如果当前音视频流的帧率波动较大，那么 r_frame_rate 的值通常会高于整体平均帧率，以此作为每一帧的时间戳的单位
-                
-                // 计算每一帧持续的时间, 以 AV_TIME_BASE 为时间基准
-                int64_t frame_duration = (double)AV_TIME_BASE / av_q2d(in_video_st->r_frame_rate);
-
-                // 将帧时长的单位转换为以 time_base 为基准
-                pkt->duration = (double)frame_duration / (double)(av_q2d(in_video_st->time_base) * AV_TIME_BASE);
-                
-                // 通过帧时长与帧数量计算每一帧的时间戳, 以 time_base 为基准
-                pkt->pts = (double)(video_frame_idx * frame_duration) / (double)(av_q2d(in_video_st->time_base) * AV_TIME_BASE);
-                pkt->dts = pkt->dts;
-
-                printf("video frame_duration :%jd, pkt.duration: %jd, pkt.pts: %jd\n", frame_duration, pkt->duration, pkt->pts);
-
-                video_frame_idx++;
+                LOGT("video pkt.duration: %jd, pkt.pts: %jd, pkt.dts: %jd\n", pkt->duration, pkt->pts, pkt->dts);
             }
 
             cur_video_pts = pkt->pts;
@@ -255,27 +460,18 @@ static int32_t do_muxing()
 
             // write audio
             input_stream = in_audio_st;
-            result = av_read_frame(a_ifmt_ctx, pkt);
+            result = read_input_packet(&a_es, a_ifmt_ctx, pkt);
             if (result < 0) {
-                printf("av_read_frame fail\n");
+                LOGD("av_read_frame fail\n");
                 av_packet_unref(pkt);
                 break;
             }
 
             if (pkt->pts == AV_NOPTS_VALUE) {
-                // 计算每一帧持续的时间
-                int64_t frame_duration = (double)AV_TIME_BASE / av_q2d(in_audio_st->r_frame_rate);
+                // 音频帧时长由每帧采样数和采样率决定，与 r_frame_rate 无关
+                ts_generator_fill(&audio_ts, pkt);
 
-                // 将帧时长的单位转换为以 time_base 为基准
-                pkt->duration = (double)frame_duration / (double)(av_q2d(in_audio_st->time_base) * AV_TIME_BASE);
-                
-                // 通过帧时长与帧数量计算每一帧的时间戳
-                pkt->pts = (double)(audio_frame_idx * frame_duration) / (double)(av_q2d(in_audio_st->time_base) * AV_TIME_BASE);
-                pkt->dts = pkt->dts;
-
-                printf("audio frame_duration :%jd, pkt.duration: %jd, pkt.pts: %jd\n", frame_duration, pkt->duration, pkt->pts);
-
-                audio_frame_idx++;
+                LOGT("audio pkt.duration: %jd, pkt.pts: %jd\n", pkt->duration, pkt->pts);
             }
 
             cur_audio_pts = pkt->pts;
@@ -288,10 +484,15 @@ static int32_t do_muxing()
         pkt->dts = av_rescale_q_rnd(pkt->dts, input_stream->time_base, output_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
         pkt->duration = av_rescale_q(pkt->duration, input_stream->time_base, output_stream->time_base);
         
-        printf("Final pts: %jd duration: %jd timebase: %d / %d\n", pkt->pts, pkt->duration, output_stream->time_base.num, output_stream->time_base.den);
+        LOGT("Final pts: %jd duration: %jd timebase: %d / %d\n", pkt->pts, pkt->duration, output_stream->time_base.num, output_stream->time_base.den);
+        stream_stats_add(pkt->stream_index == out_video_st_idx ? &video_stats : &audio_stats,
+                         pkt->pts, pkt->duration, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+
+        total_packets++;
+        total_bytes += pkt->size;
 
         if (av_interleaved_write_frame(ofmt_ctx, pkt) < 0) {
-            printf("av_interleaved_write_frame fail\n");
+            LOGE("av_interleaved_write_frame fail\n");
             av_packet_unref(pkt);
             break;
         }
@@ -300,52 +501,272 @@ static int32_t do_muxing()
     }
 
     result = av_write_trailer(ofmt_ctx);
+
+    stream_stats_print(&video_stats);
+    stream_stats_print(&audio_stats);
+
+    double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    LOG_AT(LOG_LEVEL_COUNTERS, "%s input: %jd packets %jd bytes in %.3f s, %.0f packets/s %.2f MB/s\n",
+           zero_copy ? "zero copy" : "avio copy", total_packets, total_bytes, elapsed,
+           elapsed > 0 ? total_packets / elapsed : 0.0, elapsed > 0 ? total_bytes / elapsed / (1024 * 1024) : 0.0);
     
     av_packet_free(&pkt);
     return result;
 }
 
-int main(int argc, char *argv[])
+static void usage(const char* program_name)
+{
+    printf("usage: %s [-z | -L idle_ms[,ring_size]] [-V buffer_size[,probe_size]] [-A buffer_size[,probe_size]] [-o output] [-m | -M size | -U] [-P dir] [-l level] video_input_file audio_input_file\n", program_name);
+    printf("  -z  zero copy input, packets reference the mapped input files directly (raw hevc/h264 and adts aac only)\n");
+    printf("  -L  live input, the inputs may be files still being written, pipes or - for stdin. they are read through a\n");
+    printf("      fixed ring of ring_size bytes (default 4 MiB) and reads wait for new data instead of ending. a pipe\n");
+    printf("      ends when its writer closes it, a file ends when it has not grown for idle_ms (0 means 5000 ms)\n");
+    printf("  -V  avio buffer size and probe size of the video input, default 65536 and the libavformat default\n");
+    printf("  -A  avio buffer size and probe size of the audio input, default 65536 and the libavformat default\n");
+    printf("  -o  output file name, the output format is guessed from it, default test.mp4\n");
+    printf("  -m  mux into a growable memory buffer, then hand the whole buffer to the output file in a single write\n");
+    printf("  -M  mux into a pre-sized memory buffer of the given size in bytes, then write it out like -m\n");
+    printf("  -U  write the output file through io_uring with several writes in flight, falls back to pwrite\n");
+    printf("  -P  cache the probe results of the inputs in this directory, reopening an unchanged input skips probing\n");
+    printf("  -l  log level: quiet, error, warn, counters, info, debug, trace, default info\n");
+}
+
+// 解析 "buffer_size[,probe_size]" 形式的参数
+static int32_t parse_input_options(const char *arg, input_options *opts)
+{
+    long long buffer_size = 0;
+    long long probe_size = 0;
+    int32_t n = sscanf(arg, "%lld,%lld", &buffer_size, &probe_size);
+    if (n < 1 || buffer_size <= 0 || buffer_size > INT32_MAX || probe_size < 0) {
+        return -1;
+    }
+
+    opts->buffer_size = buffer_size;
+    if (n == 2) {
+        opts->probe_size = probe_size;
+    }
+
+    return 0;
+}
+
+// 解析 "idle_timeout_ms[,ring_size]" 形式的参数
+static int32_t parse_live_options(const char *arg, live_options *opts)
+{
+    long long idle_timeout_ms = 0;
+    long long ring_size = 0;
+    int32_t n = sscanf(arg, "%lld,%lld", &idle_timeout_ms, &ring_size);
+    if (n < 1 || idle_timeout_ms < 0 || idle_timeout_ms > INT32_MAX || ring_size < 0 || ring_size > INT32_MAX) {
+        return -1;
+    }
+
+    opts->idle_timeout_ms = idle_timeout_ms;
+    if (n == 2) {
+        opts->ring_size = ring_size;
+    }
+
+    return 0;
+}
+
+// 解析固定输出缓冲区的大小，必须是正整数
+static int32_t parse_output_size(const char *arg, size_t *size)
+{
+    long long value = 0;
+    char tail = 0;
+    if (sscanf(arg, "%lld%c", &value, &tail) != 1 || value <= 0) {
+        return -1;
+    }
+
+    *size = value;
+    return 0;
+}
+
+// 内存输出的下游：复用完成后把整个缓冲区一次写入输出文件，muxer 写 trailer 时的回写都已在内存中完成
+static int32_t write_memory_output(const char *filename, const uint8_t *data, size_t size)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (fp == nullptr) {
+        LOGE("open %s fail: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    int32_t ret = fwrite(data, 1, size, fp) == size ? 0 : -1;
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+    if (ret < 0) {
+        LOGE("write %s fail\n", filename);
+    }
+    return ret;
+}
+
+// 恢复全部全局状态，使 mem_io_muxer_main 可以在同一进程中反复调用
+static void reset_state()
+{
+    optind = 1;
+    in_video_st_idx = -1;
+    in_audio_st_idx = -1;
+    out_video_st_idx = -1;
+    out_audio_st_idx = -1;
+    v_bd = buffer_data{};
+    a_bd = buffer_data{};
+    v_opts = input_options{ 64 * 1024, 0 };
+    a_opts = input_options{ 64 * 1024, 0 };
+    v_es = es_demuxer{};
+    a_es = es_demuxer{};
+    zero_copy = false;
+    live_mode = false;
+    live_opts = live_options{ 0, 0 };
+    v_live = nullptr;
+    a_live = nullptr;
+    out_mode = OUTPUT_FILE;
+    mem_out = mem_output{};
+    uring_out = nullptr;
+    fixed_output_size = 0;
+    probe_cache_dir = nullptr;
+}
+
+int mem_io_muxer_main(int argc, char *argv[])
 {
 
     int ret = 0;
-    if (argc != 3) {
-//        printf("usage: %s video_input_file audio_input_file\n" argv[0]);
+    int opt;
+    reset_state();
+    char* output_filename = (char*)"test.mp4";
+    while ((opt = getopt(argc, argv, "zL:V:A:o:mM:UP:l:")) != -1) {
+        switch (opt) {
+        case 'z':
+            zero_copy = true;
+            break;
+        case 'L':
+            live_mode = true;
+            if (parse_live_options(optarg, &live_opts) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'V':
+            if (parse_input_options(optarg, &v_opts) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'A':
+            if (parse_input_options(optarg, &a_opts) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'o':
+            output_filename = optarg;
+            break;
+        case 'm':
+            out_mode = OUTPUT_MEMORY;
+            break;
+        case 'M':
+            out_mode = OUTPUT_MEMORY_FIXED;
+            if (parse_output_size(optarg, &fixed_output_size) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'U':
+            out_mode = OUTPUT_FILE_URING;
+            break;
+        case 'P':
+            probe_cache_dir = optarg;
+            break;
+        case 'l':
+            if (log_parse_level(optarg) < LOG_LEVEL_QUIET) {
+                usage(argv[0]);
+                return 1;
+            }
+            log_set_level(log_parse_level(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // 零拷贝输入需要映射整个文件
+    if (live_mode && zero_copy) {
+        LOGE("zero copy input can not be used with live input\n");
         return 1;
     }
     
-    char* video_input_filename = argv[1];
-    char* audio_input_filename = argv[2];
+    char* video_input_filename = argv[optind];
+    char* audio_input_filename = argv[optind + 1];
+
+    if (live_mode && strcmp(video_input_filename, "-") == 0 && strcmp(audio_input_filename, "-") == 0) {
+        LOGE("only one live input can be read from stdin\n");
+        return 1;
+    }
 
     ret = open_input(video_input_filename, &v_bd, &video_input_buffer, &video_buffer_size,
-                     &video_avio_ctx, &video_avio_ctx_buffer, &v_ifmt_ctx, &in_video_st_idx, AVMEDIA_TYPE_VIDEO);
+                     &video_avio_ctx, &video_avio_ctx_buffer, &v_ifmt_ctx, &in_video_st_idx, AVMEDIA_TYPE_VIDEO, &v_es, &v_live, &v_opts);
     if (ret < 0) {
         goto end;
     }
 
     ret = open_input(audio_input_filename, &a_bd, &audio_input_buffer, &audio_buffer_size,
-                     &audio_avio_ctx, &audio_avio_ctx_buffer, &a_ifmt_ctx, &in_audio_st_idx, AVMEDIA_TYPE_AUDIO);
+                     &audio_avio_ctx, &audio_avio_ctx_buffer, &a_ifmt_ctx, &in_audio_st_idx, AVMEDIA_TYPE_AUDIO, &a_es, &a_live, &a_opts);
     if (ret < 0) {
         goto end;
     }
 
-    ret = open_output("test.mp4");
+    if (out_mode == OUTPUT_MEMORY_FIXED) {
+        fixed_output_buffer = (uint8_t*)av_malloc(fixed_output_size);
+        if (fixed_output_buffer == nullptr) {
+            goto end;
+        }
+    }
+
+    ret = open_output(output_filename);
     if (ret < 0) {
         goto end;
     }
 
-    do_muxing();
+    ret = do_muxing();
+
+    if (out_mode == OUTPUT_FILE_URING && uring_output_drain(uring_out, ofmt_ctx->pb) < 0) {
+        LOGE("write output file fail\n");
+        ret = -1;
+    } else if (out_mode == OUTPUT_MEMORY || out_mode == OUTPUT_MEMORY_FIXED) {
+        // 此时 mem_out.data 中即为完整的输出文件，交给下游（这里是一次写入输出文件，也可以是上传）
+        avio_flush(ofmt_ctx->pb);
+        LOG_AT(LOG_LEVEL_COUNTERS, "muxed %zu bytes into memory\n", mem_out.size);
+        if (ret >= 0 && write_memory_output(output_filename, mem_out.data, mem_out.size) < 0) {
+            ret = -1;
+        }
+    }
 
 end:
-    avformat_free_context(v_ifmt_ctx);
-    avformat_free_context(a_ifmt_ctx);
-
-    if (!(ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&ofmt_ctx->pb);
+    avformat_close_input(&v_ifmt_ctx);
+    avformat_close_input(&a_ifmt_ctx);
+
+    if (ofmt_ctx != nullptr && !(ofmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (out_mode == OUTPUT_FILE) {
+            avio_closep(&ofmt_ctx->pb);
+        } else if (out_mode == OUTPUT_FILE_URING) {
+            close_uring_output(&uring_out, &ofmt_ctx->pb);
+        } else {
+            close_mem_output(&mem_out, &ofmt_ctx->pb);
+        }
     }
 
     avformat_free_context(ofmt_ctx);
+    ofmt_ctx = nullptr;
+    av_freep(&fixed_output_buffer);
+
 
+    // 直播输入的 AVIOContext 由 live_input 释放
+    close_live_input(&v_live, &video_avio_ctx);
+    close_live_input(&a_live, &audio_avio_ctx);
 
     /* note: the internal buffer could have changed, and be != avio_ctx_buffer */
     if (audio_avio_ctx) {
@@ -358,8 +779,16 @@ end:
         av_freep(&video_avio_ctx);
     }
 
-    av_file_unmap(video_input_buffer, video_buffer_size);
-    av_file_unmap(audio_input_buffer, audio_buffer_size);
+    // 映射区域在最后一个引用释放时解除映射
+    close_es_demuxer(&v_es);
+    close_es_demuxer(&a_es);
 
-    return 0;
-}
\ No newline at end of file
+    return ret < 0 ? 1 : 0;
+}
+
+#ifndef MEM_IO_MUXER_NO_MAIN
+int main(int argc, char *argv[])
+{
+    return mem_io_muxer_main(argc, argv);
+}
+#endif
@@ -0,0 +1,11 @@
+//
+// 以内存作为输入源的 muxer 程序入口，供基准测试等程序在进程内调用
+//
+
+#ifndef MEM_IO_MUXER_H
+#define MEM_IO_MUXER_H
+
+// 参数与 av_demo 的命令行相同，成功返回 0。每次调用前会恢复全部全局状态，可以反复调用，但不能在多个线程中同时调用
+int mem_io_muxer_main(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,158 @@
+#include "mem_output.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+// AVIOContext 内部缓冲区大小，muxer 的小块写入先在这里合并后再交给 write_packet
+static const int32_t avio_ctx_buffer_size = 64 * 1024;
+
+static int32_t reserve(mem_output *out, size_t required)
+{
+    if (required <= out->capacity) {
+        return 0;
+    }
+
+    if (!out->growable) {
+        LOGE("mem output overflow, capacity: %zu required: %zu\n", out->capacity, required);
+        return AVERROR(ENOSPC);
+    }
+
+    // 容量按 2 倍增长，摊还后每个字节只会被 realloc 拷贝常数次
+    size_t new_capacity = out->capacity > 0 ? out->capacity : avio_ctx_buffer_size;
+    while (new_capacity < required) {
+        new_capacity *= 2;
+    }
+
+    uint8_t *new_data = (uint8_t *)av_realloc(out->data, new_capacity);
+    if (new_data == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+
+    out->data = new_data;
+    out->capacity = new_capacity;
+    return 0;
+}
+
+static int write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    mem_output *out = (mem_output *)opaque;
+
+    if (out->write_cb != nullptr) {
+        int32_t ret = out->write_cb(out->cb_opaque, buf, buf_size, out->pos);
+        if (ret < 0) {
+            return ret;
+        }
+    } else {
+        int32_t ret = reserve(out, out->pos + buf_size);
+        if (ret < 0) {
+            return ret;
+        }
+
+        memcpy(out->data + out->pos, buf, buf_size);
+    }
+
+    out->pos += buf_size;
+    out->size = FFMAX(out->size, out->pos);
+    return buf_size;
+}
+
+// 写入方向的 seek 只移动写位置，MP4 trailer 回写 mdat 等 box 大小时会用到
+static int64_t seek_packet(void *opaque, int64_t offset, int whence)
+{
+    mem_output *out = (mem_output *)opaque;
+
+    int64_t new_pos = 0;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return out->size;
+    case SEEK_SET:
+        new_pos = offset;
+        break;
+    case SEEK_CUR:
+        new_pos = out->pos + offset;
+        break;
+    case SEEK_END:
+        new_pos = out->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (new_pos < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    out->pos = new_pos;
+    return new_pos;
+}
+
+static int32_t alloc_avio(mem_output *out, AVIOContext **pb)
+{
+    uint8_t *avio_ctx_buffer = (uint8_t *)av_malloc(avio_ctx_buffer_size);
+    if (avio_ctx_buffer == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+
+    // 第三个参数 write_flag 为 1，表示这是一个输出 AVIOContext
+    *pb = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 1, out, nullptr, &write_packet, &seek_packet);
+    if (*pb == nullptr) {
+        av_free(avio_ctx_buffer);
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+int32_t open_mem_output(mem_output *out, AVIOContext **pb, size_t initial_capacity)
+{
+    memset(out, 0, sizeof(*out));
+    out->growable = true;
+    out->owns_data = true;
+
+    int32_t ret = reserve(out, initial_capacity);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return alloc_avio(out, pb);
+}
+
+int32_t open_mem_output_fixed(mem_output *out, AVIOContext **pb, uint8_t *buffer, size_t capacity)
+{
+    memset(out, 0, sizeof(*out));
+    out->data = buffer;
+    out->capacity = capacity;
+
+    return alloc_avio(out, pb);
+}
+
+int32_t open_mem_output_callback(mem_output *out, AVIOContext **pb, mem_output_write_cb write_cb, void *opaque)
+{
+    memset(out, 0, sizeof(*out));
+    out->write_cb = write_cb;
+    out->cb_opaque = opaque;
+
+    return alloc_avio(out, pb);
+}
+
+void close_mem_output(mem_output *out, AVIOContext **pb)
+{
+    if (pb != nullptr && *pb != nullptr) {
+        avio_flush(*pb);
+        // 内部缓冲区可能已被 AVIOContext 替换，需要释放 AVIOContext 当前持有的缓冲区
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+    }
+
+    if (out->owns_data) {
+        av_freep(&out->data);
+    }
+
+    out->size = 0;
+    out->capacity = 0;
+    out->pos = 0;
+}
@@ -0,0 +1,42 @@
+//
+// 以内存作为 muxer 的输出目标，避免先写文件再读回内存
+//
+
+#ifndef MEM_OUTPUT_H
+#define MEM_OUTPUT_H
+#include <stddef.h>
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+// 回调模式下的写函数，将 size 字节写到输出的 offset 处。
+// MP4 在写 trailer 时会 seek 回文件头回写 box 大小等信息，因此 offset 不一定是递增的，返回值小于 0 表示失败
+typedef int32_t (*mem_output_write_cb)(void *opaque, const uint8_t *buf, int32_t size, int64_t offset);
+
+typedef struct mem_output {
+    uint8_t *data;     ///< 输出缓冲区，回调模式下为 nullptr
+    size_t size;       ///< 已写入数据的大小，即写到过的最大位置
+    size_t capacity;   ///< 输出缓冲区的容量
+    size_t pos;        ///< 当前写位置，回写 trailer 时会向前移动
+    bool growable;     ///< 容量不足时是否自动扩容，预分配的缓冲区写满时返回错误
+    bool owns_data;    ///< 缓冲区是否由 mem_output 分配，关闭时释放
+
+    mem_output_write_cb write_cb;
+    void *cb_opaque;
+} mem_output;
+
+// 输出到可自动扩容的内存缓冲区，initial_capacity 为初始容量
+int32_t open_mem_output(mem_output *out, AVIOContext **pb, size_t initial_capacity);
+
+// 输出到调用者提供的固定大小缓冲区，超出容量时写入失败
+int32_t open_mem_output_fixed(mem_output *out, AVIOContext **pb, uint8_t *buffer, size_t capacity);
+
+// 每次写入都交给调用者的回调处理，例如直接上传或写入其他存储
+int32_t open_mem_output_callback(mem_output *out, AVIOContext **pb, mem_output_write_cb write_cb, void *opaque);
+
+// 释放 AVIOContext 以及 mem_output 自己分配的缓冲区，调用前需要先取走 data 中的数据
+void close_mem_output(mem_output *out, AVIOContext **pb);
+
+#endif
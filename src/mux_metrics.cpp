@@ -0,0 +1,239 @@
+#include "mux_metrics.h"
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "log.h"
+
+static const char* stage_names[MUX_STAGE_NB] = { "read", "timestamp", "convert", "interleave", "write" };
+
+// Prometheus 直方图的桶边界，单位纳秒
+static const int64_t prom_bounds_ns[] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+    1000000, 2000000, 5000000, 10000000, 20000000, 50000000, 100000000, 200000000, 500000000,
+    1000000000, 2000000000, 5000000000, 10000000000,
+};
+
+// 桶 idx 覆盖的最小值
+static int64_t bucket_lower(int32_t idx)
+{
+    if (idx < (1 << LATENCY_SUB_BITS)) {
+        return idx;
+    }
+
+    int32_t exp = (idx >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    int64_t mantissa = (idx & ((1 << LATENCY_SUB_BITS) - 1)) + (1 << LATENCY_SUB_BITS);
+    return mantissa << (exp - LATENCY_SUB_BITS);
+}
+
+static int64_t bucket_upper(int32_t idx)
+{
+    return idx + 1 < LATENCY_BUCKETS ? bucket_lower(idx + 1) - 1 : INT64_MAX;
+}
+
+int64_t latency_percentile(const latency_histogram* h, double p)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+
+    int64_t target = (int64_t)(p * h->count + 0.5);
+    target = target < 1 ? 1 : target;
+    int64_t seen = 0;
+    for (int32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            int64_t upper = bucket_upper(i);
+            return upper < h->max_ns ? upper : h->max_ns;
+        }
+    }
+
+    return h->max_ns;
+}
+
+void mux_metrics_init(mux_metrics* m, const char* job)
+{
+    memset(m, 0, sizeof(*m));
+    m->job = job;
+    m->start_ns = mux_metrics_now();
+}
+
+int32_t mux_metrics_add_stream(mux_metrics* m, const char* name)
+{
+    if (m->nb_streams >= MUX_METRICS_MAX_STREAMS) {
+        return MUX_METRICS_MAX_STREAMS - 1;
+    }
+
+    m->streams[m->nb_streams].name = name;
+    return m->nb_streams++;
+}
+
+static int timed_write(void* opaque, uint8_t* buf, int buf_size)
+{
+    mux_metrics* m = (mux_metrics*)opaque;
+    int64_t start = mux_metrics_now();
+    int ret = m->orig_write(m->orig_opaque, buf, buf_size);
+    int64_t duration = mux_metrics_now() - start;
+    m->io_ns += duration;
+    mux_metrics_record(m, MUX_STAGE_WRITE, duration);
+    return ret;
+}
+
+// seek 只计入 IO 耗时，不单独记录
+static int64_t timed_seek(void* opaque, int64_t offset, int whence)
+{
+    mux_metrics* m = (mux_metrics*)opaque;
+    int64_t start = mux_metrics_now();
+    int64_t ret = m->orig_seek(m->orig_opaque, offset, whence);
+    m->io_ns += mux_metrics_now() - start;
+    return ret;
+}
+
+void mux_metrics_hook_io(mux_metrics* m, AVIOContext* pb)
+{
+    if (pb == nullptr || pb->write_packet == nullptr || m->hooked_pb != nullptr) {
+        return;
+    }
+
+    m->hooked_pb = pb;
+    m->orig_opaque = pb->opaque;
+    m->orig_write = pb->write_packet;
+    m->orig_seek = pb->seek;
+
+    pb->opaque = m;
+    pb->write_packet = timed_write;
+    if (pb->seek != nullptr) {
+        pb->seek = timed_seek;
+    }
+}
+
+void mux_metrics_unhook_io(mux_metrics* m)
+{
+    if (m->hooked_pb == nullptr) {
+        return;
+    }
+
+    // 先把缓冲区中剩余的数据经由计时回调写出，再恢复原来的回调
+    avio_flush(m->hooked_pb);
+    m->hooked_pb->opaque = m->orig_opaque;
+    m->hooked_pb->write_packet = m->orig_write;
+    m->hooked_pb->seek = m->orig_seek;
+    m->hooked_pb = nullptr;
+}
+
+// 转义 JSON 字符串以及 Prometheus 标签值中的特殊字符，两者的转义规则在这里用到的范围内相同
+static std::string escape(const char* s)
+{
+    std::string out;
+    for (; s != nullptr && *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            out += '\\';
+            out += *s;
+        } else if (*s == '\n') {
+            out += "\\n";
+        } else if ((unsigned char)*s >= 0x20) {
+            out += *s;
+        }
+    }
+    return out;
+}
+
+static void dump_json(const mux_metrics* m, FILE* fp)
+{
+    std::string job = escape(m->job);
+    fprintf(fp, "{\n  \"job\": \"%s\",\n  \"elapsed_seconds\": %.6f,\n  \"stages\": {\n", job.c_str(),
+            (mux_metrics_now() - m->start_ns) / 1e9);
+    for (int32_t i = 0; i < MUX_STAGE_NB; i++) {
+        const latency_histogram* h = &m->stages[i];
+        fprintf(fp,
+                "    \"%s\": {\"count\": %jd, \"sum_ns\": %jd, \"min_ns\": %jd, \"max_ns\": %jd, \"mean_ns\": %.1f, "
+                "\"p50_ns\": %jd, \"p90_ns\": %jd, \"p99_ns\": %jd, \"p999_ns\": %jd}%s\n",
+                stage_names[i], h->count, h->sum_ns, h->min_ns, h->max_ns,
+                h->count > 0 ? (double)h->sum_ns / h->count : 0.0, latency_percentile(h, 0.5),
+                latency_percentile(h, 0.9), latency_percentile(h, 0.99), latency_percentile(h, 0.999),
+                i + 1 < MUX_STAGE_NB ? "," : "");
+    }
+    fprintf(fp, "  },\n  \"streams\": [\n");
+    for (int32_t i = 0; i < m->nb_streams; i++) {
+        const mux_stream_counter* s = &m->streams[i];
+        std::string name = escape(s->name);
+        fprintf(fp, "    {\"name\": \"%s\", \"packets\": %jd, \"bytes\": %jd, \"key_packets\": %jd}%s\n",
+                name.c_str(), s->packets, s->bytes, s->key_packets, i + 1 < m->nb_streams ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+static void dump_prometheus(const mux_metrics* m, FILE* fp)
+{
+    std::string job = escape(m->job);
+
+    fprintf(fp, "# HELP mux_stage_duration_seconds Time spent in each mux stage.\n");
+    fprintf(fp, "# TYPE mux_stage_duration_seconds histogram\n");
+    for (int32_t i = 0; i < MUX_STAGE_NB; i++) {
+        const latency_histogram* h = &m->stages[i];
+
+        // 桶按值递增，一次遍历即可得到每个边界以下的累计数
+        int64_t cumulative = 0;
+        int32_t bucket = 0;
+        for (int64_t bound : prom_bounds_ns) {
+            while (bucket < LATENCY_BUCKETS && bucket_upper(bucket) <= bound) {
+                cumulative += h->buckets[bucket++];
+            }
+            fprintf(fp, "mux_stage_duration_seconds_bucket{mux_job=\"%s\",stage=\"%s\",le=\"%g\"} %jd\n",
+                    job.c_str(), stage_names[i], bound / 1e9, cumulative);
+        }
+        fprintf(fp, "mux_stage_duration_seconds_bucket{mux_job=\"%s\",stage=\"%s\",le=\"+Inf\"} %jd\n",
+                job.c_str(), stage_names[i], h->count);
+        fprintf(fp, "mux_stage_duration_seconds_sum{mux_job=\"%s\",stage=\"%s\"} %.9f\n", job.c_str(),
+                stage_names[i], h->sum_ns / 1e9);
+        fprintf(fp, "mux_stage_duration_seconds_count{mux_job=\"%s\",stage=\"%s\"} %jd\n", job.c_str(),
+                stage_names[i], h->count);
+    }
+
+    static const struct {
+        const char* name;
+        const char* help;
+    } counters[] = {
+        { "mux_stream_packets_total", "Packets written per stream." },
+        { "mux_stream_bytes_total", "Payload bytes written per stream." },
+        { "mux_stream_key_packets_total", "Key packets written per stream." },
+    };
+    for (int32_t c = 0; c < 3; c++) {
+        fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", counters[c].name, counters[c].help, counters[c].name);
+        for (int32_t i = 0; i < m->nb_streams; i++) {
+            const mux_stream_counter* s = &m->streams[i];
+            int64_t value = c == 0 ? s->packets : (c == 1 ? s->bytes : s->key_packets);
+            std::string name = escape(s->name);
+            fprintf(fp, "%s{mux_job=\"%s\",stream=\"%s\"} %jd\n", counters[c].name, job.c_str(), name.c_str(), value);
+        }
+    }
+}
+
+static int32_t dump_file(const mux_metrics* m, const std::string& path, void (*dump)(const mux_metrics*, FILE*))
+{
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "w");
+    if (fp == nullptr) {
+        LOGE("open metrics file %s fail\n", tmp.c_str());
+        return -1;
+    }
+
+    dump(m, fp);
+    if (fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGE("write metrics file %s fail\n", path.c_str());
+        remove(tmp.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+int32_t mux_metrics_dump(const mux_metrics* m, const char* prefix)
+{
+    int32_t ret = dump_file(m, std::string(prefix) + ".json", dump_json);
+    if (dump_file(m, std::string(prefix) + ".prom", dump_prometheus) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
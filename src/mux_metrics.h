@@ -0,0 +1,134 @@
+//
+// 复用各阶段的耗时直方图和每路流的计数，可以导出为 JSON 和 Prometheus 文本格式
+//
+
+#ifndef MUX_METRICS_H
+#define MUX_METRICS_H
+#include <stdint.h>
+#include <time.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+// 对数线性分桶（与 HdrHistogram 相同的思路）：小于 2^SUB_BITS 的值每个值一个桶，
+// 之后每个 2 的幂区间再等分为 2^SUB_BITS 个桶，相对误差不超过 1/64。最大记录约 2^41 ns（约 36 分钟）
+#define LATENCY_SUB_BITS 6
+#define LATENCY_MAX_EXP 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 2) << LATENCY_SUB_BITS)
+
+typedef struct latency_histogram {
+    int64_t count;
+    int64_t sum_ns;
+    int64_t min_ns;
+    int64_t max_ns;
+    int64_t buckets[LATENCY_BUCKETS];
+} latency_histogram;
+
+static inline int32_t latency_bucket(int64_t ns)
+{
+    uint64_t v = ns < 0 ? 0 : (uint64_t)ns;
+    if (v < (1u << LATENCY_SUB_BITS)) {
+        return (int32_t)v;
+    }
+
+    int32_t exp = 63 - __builtin_clzll(v);
+    if (exp > LATENCY_MAX_EXP) {
+        return LATENCY_BUCKETS - 1;
+    }
+
+    // 保留最高的 SUB_BITS + 1 位，其中最高位固定为 1
+    uint64_t mantissa = v >> (exp - LATENCY_SUB_BITS);
+    return ((exp - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + (int32_t)(mantissa - (1u << LATENCY_SUB_BITS));
+}
+
+static inline void latency_record(latency_histogram* h, int64_t ns)
+{
+    h->buckets[latency_bucket(ns)]++;
+    if (h->count == 0 || ns < h->min_ns) {
+        h->min_ns = ns;
+    }
+    if (ns > h->max_ns) {
+        h->max_ns = ns;
+    }
+    h->count++;
+    h->sum_ns += ns;
+}
+
+// 第 p（0~1）分位数，返回所在桶的上界
+int64_t latency_percentile(const latency_histogram* h, double p);
+
+// 复用流程的各个阶段
+enum mux_stage {
+    MUX_STAGE_READ,       ///< 从输入读取一个包，流水线模式下是从读线程队列取包的等待时间
+    MUX_STAGE_TIMESTAMP,  ///< 生成缺失的时间戳并转换到输出流的时间基
+    MUX_STAGE_CONVERT,    ///< 把 Annex-B 的 HEVC 包转换为 NAL 长度前缀的形式，只在输出为 MP4 时有
+    MUX_STAGE_INTERLEAVE, ///< 交给 muxer 的耗时中扣除输出 IO 的部分，即交错排序和封装的耗时
+    MUX_STAGE_WRITE,      ///< 每一次输出 IO（AVIOContext 把缓冲区写到下层）的耗时
+    MUX_STAGE_NB,
+};
+
+#define MUX_METRICS_MAX_STREAMS 64
+
+typedef struct mux_stream_counter {
+    const char* name;
+    int64_t packets;
+    int64_t bytes;
+    int64_t key_packets;
+} mux_stream_counter;
+
+// 单线程使用，不同线程各自持有一份
+typedef struct mux_metrics {
+    const char* job; ///< 导出时作为 job 标签，通常是输出文件名或 URL
+    latency_histogram stages[MUX_STAGE_NB];
+    mux_stream_counter streams[MUX_METRICS_MAX_STREAMS];
+    int32_t nb_streams;
+    int64_t start_ns;
+
+    // 截获输出 AVIOContext 的写操作，区分封装耗时与 IO 耗时
+    AVIOContext* hooked_pb;
+    void* orig_opaque;
+    int (*orig_write)(void* opaque, uint8_t* buf, int buf_size);
+    int64_t (*orig_seek)(void* opaque, int64_t offset, int whence);
+    int64_t io_ns; ///< 累计的输出 IO 耗时
+} mux_metrics;
+
+static inline int64_t mux_metrics_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void mux_metrics_init(mux_metrics* m, const char* job);
+
+// 增加一路流的计数，返回其下标
+int32_t mux_metrics_add_stream(mux_metrics* m, const char* name);
+
+static inline void mux_metrics_record(mux_metrics* m, mux_stage stage, int64_t ns)
+{
+    latency_record(&m->stages[stage], ns);
+}
+
+static inline void mux_metrics_count(mux_metrics* m, int32_t stream, int32_t bytes, bool key)
+{
+    mux_stream_counter* counter = &m->streams[stream];
+    counter->packets++;
+    counter->bytes += bytes;
+    counter->key_packets += key ? 1 : 0;
+}
+
+// 替换 pb 的写和 seek 回调，记录每次输出 IO 的耗时。关闭 pb 之前必须调用 mux_metrics_unhook_io 恢复
+void mux_metrics_hook_io(mux_metrics* m, AVIOContext* pb);
+void mux_metrics_unhook_io(mux_metrics* m);
+
+// 把 duration_ns 记为封装阶段的耗时，扣除期间发生的输出 IO 耗时。io_start_ns 为开始时的 io_ns
+static inline void mux_metrics_record_mux(mux_metrics* m, int64_t duration_ns, int64_t io_start_ns)
+{
+    mux_metrics_record(m, MUX_STAGE_INTERLEAVE, duration_ns - (m->io_ns - io_start_ns));
+}
+
+// 写出 <prefix>.json 和 <prefix>.prom。先写临时文件再改名，周期性导出时读取方不会读到写了一半的文件
+int32_t mux_metrics_dump(const mux_metrics* m, const char* prefix);
+
+#endif
@@ -1,32 +1,332 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chunked_muxer.h"
+#include "log.h"
 #include "muxer_core.h"
 
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// 一个 mux 任务。输入写作 [format=]file，只有两个输入且都未指定格式时按裸 HEVC 和 ADTS AAC 打开，
+// 其余未指定格式的输入由 libavformat 探测
+struct mux_job {
+    std::vector<std::string> inputs;
+    std::string output_file;
+};
+
 static void usage(const char* program_name)
 {
-    printf("usage: %s video_file audio_file output_file\n", program_name);
+    printf("usage: %s [-p] [-q depth] [-f ms [-c]] [-m dir] [-P dir] [-F] [-N] [-U] [-w n [-d]] [-D [-W n]] [-S ms] [-C chunks] [-l level] input... output_file\n", program_name);
+    printf("       %s -b job_list [-j workers] [-s]\n", program_name);
+    printf("  input        [format=]file, each input adds one video, audio or subtitle track to the output.\n");
+    printf("               two inputs without a format are opened as raw hevc and adts aac\n");
+    printf("  -p           pipelined mode, each input is demuxed on its own thread\n");
+    printf("  -q depth     packets each input may read ahead in pipelined mode, default 256\n");
+    printf("  -f ms        fragmented mp4 output, fragments are cut at the first keyframe after ms milliseconds\n");
+    printf("  -c           make the fragments cmaf compliant, used with -f\n");
+    printf("  -m dir       write per stage latency histograms and per stream counters of each job to\n");
+    printf("               dir/<output file name>.json and .prom when the job ends\n");
+    printf("  -P dir       cache the probe results of the inputs in dir, later jobs on an unchanged input\n");
+    printf("               skip avformat_find_stream_info\n");
+    printf("  -F           fast open, fill the codec parameters from the hevc parameter sets and the adts header\n");
+    printf("               instead of probing, falls back to probing when they cannot be parsed\n");
+    printf("  -N           native demux, raw hevc/h264/aac inputs are mapped and split into packets that\n");
+    printf("               reference the mapping, without the demuxers and payload copies of libavformat\n");
+    printf("  -U           write the output file through io_uring with several large writes in flight, falls\n");
+    printf("               back to pwrite when io_uring is not available\n");
+    printf("  -w n         write the output file on a writer thread with up to n 4 MiB buffers queued, the\n");
+    printf("               muxer only waits for the disk when all of them are queued\n");
+    printf("  -d           write the queued buffers with O_DIRECT to keep them out of the page cache, used with -w\n");
+    printf("  -D           direct write, packets already sorted by dts go to av_write_frame without the\n");
+    printf("               interleaving buffer of libavformat\n");
+    printf("  -W n         packets held to reorder out of order input in direct write mode, default 16\n");
+    printf("  -S ms        segment duration of hls (.m3u8) and dash (.mpd) output, default 6000. segments are\n");
+    printf("               cut at the first video keyframe after ms milliseconds and written next to the playlist\n");
+    printf("  -C chunks    split one hevc + aac input pair at irap frames and remux the chunks in parallel on\n");
+    printf("               -j workers, then stitch them into one fragmented mp4. only -j and -l apply in this mode\n");
+    printf("  -b job_list  batch mode, each line of job_list is \"input... output_file\"\n");
+    printf("  -j workers   number of jobs running at the same time, default is the number of cpu cores\n");
+    printf("  -s           run the batch with 1, 2, 4 ... workers and report how throughput scales\n");
+    printf("  -l level     log level: quiet, error, warn, counters, info, debug, trace, default info\n");
 }
 
-int main(int argc, char** argv)
+// 指定了统计目录时，每个任务的统计文件以输出文件名命名，批处理模式下不同任务互不覆盖
+static std::string metrics_prefix(const char* metrics_dir, const std::string& output_file)
 {
+    size_t slash = output_file.find_last_of('/');
+    return std::string(metrics_dir) + "/" + (slash == std::string::npos ? output_file : output_file.substr(slash + 1));
+}
 
-    if (argc < 4) {
-        usage(argv[0]);
-        return 1;
+// 拆分 [format=]file 形式的输入，等号前是已知的输入格式名时才视为格式，返回文件名
+static const char* parse_input(const std::string& spec, std::string& format)
+{
+    size_t eq = spec.find('=');
+    if (eq != std::string::npos && av_find_input_format(spec.substr(0, eq).c_str()) != nullptr) {
+        format = spec.substr(0, eq);
+        return spec.c_str() + eq + 1;
+    }
+
+    format.clear();
+    return spec.c_str();
+}
+
+static int32_t run_job(const mux_job& job, const muxer_options& opts, const char* metrics_dir)
+{
+    muxer_options job_opts = opts;
+    std::string prefix;
+    if (metrics_dir != nullptr) {
+        prefix = metrics_prefix(metrics_dir, job.output_file);
+        job_opts.metrics_prefix = prefix.c_str();
+    }
+
+    std::vector<std::string> formats(job.inputs.size());
+    std::vector<muxer_input> inputs(job.inputs.size());
+    for (size_t i = 0; i < job.inputs.size(); i++) {
+        inputs[i].filename = parse_input(job.inputs[i], formats[i]);
+        inputs[i].format = formats[i].empty() ? nullptr : formats[i].c_str();
+    }
+    if (inputs.size() == 2 && inputs[0].format == nullptr && inputs[1].format == nullptr) {
+        inputs[0].format = "hevc";
+        inputs[1].format = "aac";
     }
 
-    int result = 0;
+    muxer_context* ctx = alloc_muxer(&job_opts);
+    if (ctx == nullptr) {
+        return -1;
+    }
+
+    int32_t result = 0;
     do {
-        result = init_muxer(argv[1], argv[2], argv[3]);
+        result = init_muxer_inputs(ctx, inputs.data(), inputs.size(), (char*)job.output_file.c_str());
         if (result < 0) {
             break;
         }
 
-        result = muxing();
-        if (result < 0) {
-            break;
-        }
+        result = muxing(ctx);
     } while (0);
 
-    destory_muxer();
+    destory_muxer(&ctx);
+    return result;
+}
+
+static int32_t load_jobs(const char* job_list, std::vector<mux_job>& jobs)
+{
+    FILE* fp = fopen(job_list, "r");
+    if (fp == nullptr) {
+        LOGE("open job list %s fail\n", job_list);
+        return -1;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), fp) != nullptr) {
+        if (line[0] == '#') {
+            continue;
+        }
+
+        // 以空白分隔，最后一项为输出文件，之前的都是输入
+        std::vector<std::string> fields;
+        char* save = nullptr;
+        for (char* field = strtok_r(line, " \t\r\n", &save); field != nullptr;
+             field = strtok_r(nullptr, " \t\r\n", &save)) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 2) {
+            continue;
+        }
+
+        mux_job job;
+        job.output_file = fields.back();
+        fields.pop_back();
+        job.inputs = fields;
+        jobs.push_back(job);
+    }
+
+    fclose(fp);
     return 0;
-}
\ No newline at end of file
+}
+
+// 用 worker_num 个线程执行全部任务。每个线程从共享的任务下标中领取下一个任务，直到任务全部领取完毕
+static int32_t run_batch(const std::vector<mux_job>& jobs, int32_t worker_num, const muxer_options& opts,
+                         const char* metrics_dir)
+{
+    std::atomic<size_t> next_job(0);
+    std::atomic<int32_t> failed_jobs(0);
+    std::vector<std::thread> workers;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int32_t i = 0; i < worker_num; i++) {
+        workers.emplace_back([&]() {
+            size_t idx;
+            while ((idx = next_job.fetch_add(1)) < jobs.size()) {
+                if (run_job(jobs[idx], opts, metrics_dir) < 0) {
+                    LOGE("job %zu (%s) fail\n", idx, jobs[idx].output_file.c_str());
+                    failed_jobs++;
+                }
+            }
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LOG_AT(LOG_LEVEL_COUNTERS, "workers: %d jobs: %zu failed: %d elapsed: %.3f s throughput: %.2f jobs/s\n",
+           worker_num, jobs.size(), failed_jobs.load(), elapsed, elapsed > 0 ? jobs.size() / elapsed : 0.0);
+
+    return failed_jobs.load() == 0 ? 0 : -1;
+}
+
+// 分块复用有自己的输入、时间戳和输出流程，不使用 muxer_options，也不支持批处理
+static bool chunked_options_supported(const muxer_options& opts, const char* metrics_dir, const char* job_list)
+{
+    muxer_options defaults;
+    init_muxer_options(&defaults);
+    return job_list == nullptr && metrics_dir == nullptr && !opts.pipelined &&
+           opts.queue_depth == defaults.queue_depth && opts.fragment_duration_ms == 0 && !opts.cmaf &&
+           opts.probe_cache_dir == nullptr && !opts.fast_open && !opts.native_demux && !opts.uring_output &&
+           opts.write_behind_depth <= 0 && !opts.direct_io && !opts.direct_write &&
+           opts.reorder_window == defaults.reorder_window && opts.segment_duration_ms == 0;
+}
+
+int main(int argc, char** argv)
+{
+    const char* job_list = nullptr;
+    const char* metrics_dir = nullptr;
+    int32_t worker_num = std::thread::hardware_concurrency();
+    bool scaling = false;
+    int32_t chunk_num = 0;
+    muxer_options opts;
+    init_muxer_options(&opts);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:j:spq:f:cm:P:FNUw:dDW:S:C:l:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            job_list = optarg;
+            break;
+        case 'j':
+            worker_num = atoi(optarg);
+            break;
+        case 's':
+            scaling = true;
+            break;
+        case 'p':
+            opts.pipelined = 1;
+            break;
+        case 'q':
+            opts.queue_depth = atoi(optarg);
+            break;
+        case 'f':
+            opts.fragment_duration_ms = atoi(optarg);
+            break;
+        case 'c':
+            opts.cmaf = 1;
+            break;
+        case 'm':
+            metrics_dir = optarg;
+            break;
+        case 'P':
+            opts.probe_cache_dir = optarg;
+            break;
+        case 'F':
+            opts.fast_open = 1;
+            break;
+        case 'N':
+            opts.native_demux = 1;
+            break;
+        case 'U':
+            opts.uring_output = 1;
+            break;
+        case 'w':
+            opts.write_behind_depth = atoi(optarg);
+            break;
+        case 'd':
+            opts.direct_io = 1;
+            break;
+        case 'D':
+            opts.direct_write = 1;
+            break;
+        case 'W':
+            opts.reorder_window = atoi(optarg);
+            break;
+        case 'S':
+            opts.segment_duration_ms = atoi(optarg);
+            break;
+        case 'C':
+            chunk_num = atoi(optarg);
+            break;
+        case 'l':
+            if (log_parse_level(optarg) < LOG_LEVEL_QUIET) {
+                usage(argv[0]);
+                return 1;
+            }
+            log_set_level(log_parse_level(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (worker_num <= 0) {
+        worker_num = 1;
+    }
+
+    if (chunk_num > 0 && !chunked_options_supported(opts, metrics_dir, job_list)) {
+        LOGE("-C only supports -j and -l, the other options are not applied to chunked mux\n");
+        return 1;
+    }
+
+    if (job_list != nullptr) {
+        std::vector<mux_job> jobs;
+        if (load_jobs(job_list, jobs) < 0) {
+            return 1;
+        }
+
+        if (!scaling) {
+            return run_batch(jobs, worker_num, opts, metrics_dir) < 0 ? 1 : 0;
+        }
+
+        // 依次以 1、2、4 ... 个线程执行同一批任务，观察吞吐量随并发数的变化
+        int32_t result = 0;
+        for (int32_t n = 1; ; n *= 2) {
+            n = n > worker_num ? worker_num : n;
+            result |= run_batch(jobs, n, opts, metrics_dir);
+            if (n == worker_num) {
+                break;
+            }
+        }
+
+        return result < 0 ? 1 : 0;
+    }
+
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // 分块模式只处理一对裸 HEVC 和 ADTS AAC 输入
+    if (chunk_num > 0) {
+        if (argc - optind != 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        return chunked_mux(argv[optind], argv[optind + 1], argv[argc - 1], chunk_num, worker_num) < 0 ? 1 : 0;
+    }
+
+    mux_job job;
+    job.inputs.assign(argv + optind, argv + argc - 1);
+    job.output_file = argv[argc - 1];
+    return run_job(job, opts, metrics_dir) < 0 ? 1 : 0;
+}
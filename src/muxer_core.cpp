@@ -1,303 +1,870 @@
 #include "muxer_core.h"
 #include <iostream>
+#include <new>
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "annexb_converter.h"
+#include "direct_writer.h"
+#include "es_demuxer.h"
+#include "es_params.h"
+#include "log.h"
+#include "mux_metrics.h"
+#include "probe_cache.h"
+#include "segmenter.h"
+#include "spsc_queue.h"
+#include "ts_generator.h"
+#include "uring_output.h"
+#include "write_behind.h"
+
 extern "C" {
+#include <libavutil/avstring.h>
 #include <libavutil/avutil.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/timestamp.h>
+#include <libavutil/time.h>
 #include <libavformat/avformat.h>
 }
 
-#define STREAM_FRAME_RATE 25
+// 流水线模式下一个输入的预读线程。读线程独占输入的 AVFormatContext，把解复用得到的包写入 packets 队列，
+// 复用线程用完的 AVPacket 结构通过 free_packets 队列还给读线程复用，避免每个包都分配一次 AVPacket
+struct input_reader {
+    AVFormatContext* fmt_ctx = nullptr;
+    es_demuxer* es = nullptr;       ///< 原生解复用时非空，此时不通过 fmt_ctx 读取
+    spsc_queue<AVPacket*>* packets = nullptr;
+    spsc_queue<AVPacket*>* free_packets = nullptr;
+    std::thread thread;
+    std::atomic<bool> done{false};  ///< 读线程已结束，之后不会再写入 packets
+    std::atomic<bool> abort{false}; ///< 复用线程提前结束，通知读线程退出
+    int32_t result = 0;             ///< 读线程结束的原因，AVERROR_EOF 表示正常读完
+};
+
+// 一个输入及其对应的一路输出流。每个输入只取一路流，各路流的读取、时间戳生成和统计都在这里按输入独立进行
+struct mux_input {
+    std::string filename;
+    std::string name;                ///< 统计信息中的名称，如 video、audio.1
+    AVFormatContext* fmt_ctx = nullptr;
+    int32_t in_st_idx = -1;
+    int32_t out_st_idx = -1;
+    AVMediaType type = AVMEDIA_TYPE_UNKNOWN;
+    es_demuxer es = {};
+    bool native = false;             ///< 使用 es 在映射内存上直接切分包，不经过 libavformat 的解复用
+
+    input_reader reader;
+    ts_generator ts;
+    bool has_ts_generator = false;   ///< 字幕等没有固定帧时长的流不生成时间戳
+    AVPacket* next = nullptr;        ///< 已读出、等待写入的下一个包，时间戳已转换到输出流的 time_base
+    int64_t last_dts = 0;            ///< 上一个包在堆中的排序位置
+    annexb_converter* annexb = nullptr; ///< 裸 HEVC 写入 MP4 时非空，包在交给 muxer 之前转换为 NAL 长度前缀的形式
+    stream_stats stats;
+    int32_t metrics_counter = 0;
+};
+
+// 一次 mux 任务的全部状态。每个任务持有独立的输入/输出上下文，任务之间不共享任何数据，
+// 因此不同任务可以在不同线程中同时执行
+struct muxer_context {
+    muxer_options opts;
+    std::vector<mux_input*> inputs;
+    AVFormatContext* output_fmt_ctx = nullptr;
+    segmenter* seg = nullptr; ///< 分段输出时非空，输出写到内存，由 segmenter 切段写文件
+    uring_output* uring = nullptr; ///< 使用 io_uring 写输出文件时非空，pb 由其创建和释放
+    write_behind* wb = nullptr;    ///< 由写线程写输出文件时非空，pb 由其创建和释放
+    int32_t read_error = 0;        ///< 第一个不是 EOF 的读取错误，写完 trailer 后作为 muxing 的返回值
+    int32_t write_error = 0;       ///< 第一个写包、刷新或切段错误，写完 trailer 后作为 muxing 的返回值
+};
+
+// 记录第一个写入错误，之后的错误多是其连带结果
+static void set_write_error(muxer_context* ctx, int32_t error)
+{
+    if (error < 0 && ctx->write_error == 0) {
+        ctx->write_error = error;
+    }
+}
 
-static AVFormatContext* video_fmt_ctx = nullptr;
-static AVFormatContext* audio_fmt_ctx = nullptr;
-static AVFormatContext* output_fmt_ctx = nullptr;
-static int32_t in_video_st_idx = -1;
-static int32_t in_audio_st_idx = -1;
-static int32_t out_video_st_idx = -1;
-static int32_t out_audio_st_idx = -1;
+// 原生解复用时直接从映射内存中切分出包，裸码流只有一路流，包的 stream_index 为 0
+static int32_t demux_packet(AVFormatContext* fmt_ctx, es_demuxer* es, AVPacket* pkt)
+{
+    if (es != nullptr) {
+        return es_demuxer_read(es, pkt);
+    }
+
+    return av_read_frame(fmt_ctx, pkt);
+}
 
-static int32_t init_input_video(char* video_input_file, const char* video_format)
+static void reader_thread(input_reader* reader)
 {
-    int32_t result = 0;
-    // 根据输入文件的格式名称查找 AVInputFormat 结构
-    const AVInputFormat* video_input_format = av_find_input_format(video_format);
-    if (video_input_format == nullptr) {
-        printf("Fail to find proper AVInputFormat for format: %s\n", video_format);
-        return -1;
+    while (!reader->abort.load(std::memory_order_relaxed)) {
+        AVPacket* pkt = nullptr;
+        if (!reader->free_packets->try_pop(pkt)) {
+            pkt = av_packet_alloc();
+            if (pkt == nullptr) {
+                reader->result = AVERROR(ENOMEM);
+                break;
+            }
+        }
+
+        reader->result = demux_packet(reader->fmt_ctx, reader->es, pkt);
+        if (reader->result < 0) {
+            av_packet_free(&pkt);
+            break;
+        }
+
+        if (!reader->packets->push_wait(pkt, reader->abort)) {
+            av_packet_free(&pkt);
+            break;
+        }
     }
 
-    result = avformat_open_input(&video_fmt_ctx, video_input_file, video_input_format, nullptr);
-    if (result < 0) {
-        printf("avformat_open_input fail\n");
+    reader->done.store(true, std::memory_order_release);
+}
+
+static int32_t start_reader(input_reader* reader, AVFormatContext* fmt_ctx, es_demuxer* es, int32_t queue_depth)
+{
+    reader->fmt_ctx = fmt_ctx;
+    reader->es = es;
+    reader->packets = new (std::nothrow) spsc_queue<AVPacket*>(queue_depth);
+    // 回收队列的容量要能容纳所有在途的包，否则复用线程归还时会因队列满而只能直接释放
+    reader->free_packets = new (std::nothrow) spsc_queue<AVPacket*>(queue_depth + 2);
+    if (reader->packets == nullptr || reader->free_packets == nullptr) {
         return -1;
     }
 
-    result = avformat_find_stream_info(video_fmt_ctx, nullptr);
-    if (result < 0) {
-        printf("avformat_find_stream_info fail\n");
-        return -1;
+    reader->thread = std::thread(reader_thread, reader);
+    return 0;
+}
+
+static void stop_reader(input_reader* reader)
+{
+    if (!reader->thread.joinable()) {
+        return;
     }
 
-    return result;
+    reader->abort.store(true);
+    reader->thread.join();
+
+    // 释放队列中尚未被消费以及等待复用的包
+    AVPacket* pkt = nullptr;
+    while (reader->packets->try_pop(pkt)) {
+        av_packet_free(&pkt);
+    }
+    while (reader->free_packets->try_pop(pkt)) {
+        av_packet_free(&pkt);
+    }
+
+    delete reader->packets;
+    delete reader->free_packets;
+    reader->packets = nullptr;
+    reader->free_packets = nullptr;
 }
 
-static int32_t init_input_audio(char* audio_input_file, const char* audio_format)
+// 读取输入的下一个包，跳过不复用的流。流水线模式下只从读线程的队列中取包，复用线程不会阻塞在输入 IO 上
+static int32_t read_input_packet(muxer_context* ctx, mux_input* input, AVPacket* pkt)
+{
+    while (1) {
+        if (!ctx->opts.pipelined) {
+            int32_t result = demux_packet(input->fmt_ctx, input->native ? &input->es : nullptr, pkt);
+            if (result < 0) {
+                return result;
+            }
+        } else {
+            AVPacket* queued = nullptr;
+            if (!input->reader.packets->pop_wait(queued, input->reader.done)) {
+                return input->reader.result < 0 ? input->reader.result : AVERROR_EOF;
+            }
+
+            av_packet_move_ref(pkt, queued);
+            if (!input->reader.free_packets->try_push(queued)) {
+                av_packet_free(&queued);
+            }
+        }
+
+        if (pkt->stream_index == input->in_st_idx) {
+            return 0;
+        }
+        av_packet_unref(pkt);
+    }
+}
+
+// 快速打开：输入格式已知为裸 HEVC/ADTS，直接解析码流开头的参数集或 ADTS 头填充编码参数，不读取、不解码任何帧。
+// 解析失败（例如参数集不在文件开头）时返回 false，由调用方回退到探测
+static bool fast_open_input(muxer_context* ctx, AVFormatContext* fmt_ctx, const char* filename)
+{
+    if (!ctx->opts.fast_open || fmt_ctx->nb_streams != 1) {
+        return false;
+    }
+
+    if (es_params_fill_stream(filename, fmt_ctx->streams[0]) < 0) {
+        LOGW("fast open %s fail, probe the input instead\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+// 原生解复用：输入是裸 HEVC/H.264/ADTS 码流时映射整个文件，由 es_demuxer 直接切分出引用映射内存的包。
+// libavformat 只用于探测编码参数。映射失败时打印日志，仍使用 libavformat 解复用
+static bool open_native_input(muxer_context* ctx, mux_input* input)
+{
+    static const char* raw_formats[] = { "hevc", "h264", "aac" };
+
+    if (!ctx->opts.native_demux || input->fmt_ctx->nb_streams != 1) {
+        return false;
+    }
+
+    bool is_raw = false;
+    for (const char* name : raw_formats) {
+        is_raw = is_raw || strcmp(input->fmt_ctx->iformat->name, name) == 0;
+    }
+    AVCodecParameters* par = input->fmt_ctx->streams[input->in_st_idx]->codecpar;
+    if (!is_raw || !es_demuxer_supports(par->codec_id)) {
+        return false;
+    }
+
+    if (open_es_demuxer(&input->es, input->filename.c_str(), par->codec_id) < 0) {
+        LOGW("native demux %s fail, use libavformat instead\n", input->filename.c_str());
+        return false;
+    }
+
+    // 原生解复用输出的 AAC 包去掉了 ADTS 头，mp4 需要以 extradata 的形式保存 AudioSpecificConfig
+    if (par->codec_id == AV_CODEC_ID_AAC && par->extradata_size == 0 &&
+        adts_parse_params(input->es.ptr, input->es.end - input->es.ptr, par) < 0) {
+        LOGW("parse adts header of %s fail, use libavformat instead\n", input->filename.c_str());
+        close_es_demuxer(&input->es);
+        return false;
+    }
+
+    return true;
+}
+
+static int32_t init_input(muxer_context* ctx, mux_input* input, const muxer_input* desc)
 {
     int32_t result = 0;
-    // 根据输入文件的格式名称查找 AVInputFormat 结构
-    const AVInputFormat* audio_input_format = av_find_input_format(audio_format);
-    if (audio_input_format == nullptr) {
-        printf("Fail to find proper AVInputFormat for format: %s\n", audio_format);
-        return -1;
+    input->filename = desc->filename;
+
+    // 根据输入文件的格式名称查找 AVInputFormat 结构，未指定格式时由 libavformat 探测
+    const AVInputFormat* input_format = nullptr;
+    if (desc->format != nullptr) {
+        input_format = av_find_input_format(desc->format);
+        if (input_format == nullptr) {
+            LOGE("Fail to find proper AVInputFormat for format: %s\n", desc->format);
+            return -1;
+        }
     }
 
-    result = avformat_open_input(&audio_fmt_ctx, audio_input_file, audio_input_format, nullptr);
+    int64_t open_start = av_gettime_relative();
+    result = avformat_open_input(&input->fmt_ctx, desc->filename, input_format, nullptr);
     if (result < 0) {
-        printf("avformat_open_input fail\n");
+        LOGE("avformat_open_input %s fail\n", desc->filename);
         return -1;
     }
 
-    result = avformat_find_stream_info(audio_fmt_ctx, nullptr);
-    if (result < 0) {
-        printf("avformat_find_stream_info fail\n");
+    const char* method = "fast open";
+    if (!fast_open_input(ctx, input->fmt_ctx, desc->filename)) {
+        // 启用探测缓存时，重复复用同一输入可以跳过探测
+        result = probe_cache_find_stream_info(ctx->opts.probe_cache_dir, desc->filename, input->fmt_ctx);
+        if (result < 0) {
+            LOGE("avformat_find_stream_info fail\n");
+            return -1;
+        }
+        method = result > 0 ? "probe cache hit" : "probed";
+    }
+
+    // 每个输入只复用一路流，依次查找视频、音频和字幕
+    static const AVMediaType types[] = { AVMEDIA_TYPE_VIDEO, AVMEDIA_TYPE_AUDIO, AVMEDIA_TYPE_SUBTITLE };
+    for (AVMediaType type : types) {
+        input->in_st_idx = av_find_best_stream(input->fmt_ctx, type, -1, -1, nullptr, 0);
+        if (input->in_st_idx >= 0) {
+            input->type = type;
+            break;
+        }
+    }
+    if (input->in_st_idx < 0) {
+        LOGE("find stream in input %s failed\n", desc->filename);
         return -1;
     }
 
-    return result;
+    // 其余的流在解复用时直接丢弃
+    for (unsigned int i = 0; i < input->fmt_ctx->nb_streams; i++) {
+        if ((int32_t)i != input->in_st_idx) {
+            input->fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    input->next = av_packet_alloc();
+    if (input->next == nullptr) {
+        return -1;
+    }
+
+    input->native = open_native_input(ctx, input);
+
+    LOGI("open %s: %s%s, %.3f ms\n", desc->filename, method, input->native ? ", native demux" : "",
+         (av_gettime_relative() - open_start) / 1000.0);
+    return 0;
 }
 
-static int32_t init_output(char* output_file)
+static int32_t init_output(muxer_context* ctx, char* output_file)
 {
     int32_t result = 0;
+    // 分段输出时 muxer 输出 fragmented MP4，播放列表和段文件由 segmenter 生成
+    segment_format seg_format = segment_format_from_path(output_file);
+    const char* format_name = seg_format != SEGMENT_FORMAT_NONE ? "mp4" : nullptr;
+
     // 创建 AVFormatContext 结构的输出文件上下文句柄
-    avformat_alloc_output_context2(&output_fmt_ctx, nullptr, nullptr, output_file);
+    result = avformat_alloc_output_context2(&ctx->output_fmt_ctx, nullptr, format_name, output_file);
     if (result < 0) {
-        printf("alloc output format context fail\n");
+        LOGE("alloc output format context fail\n");
         return -1;
     }
 
     // 在创建输出文件句柄后，接下来要向其中添加媒体流
     // 添加媒体流可以使用函数 avformat_new_stream 实现
-    const AVOutputFormat* fmt = output_fmt_ctx->oformat;
-    printf("Default video codec id: %d audio codec id: %d\n", fmt->video_codec, fmt->audio_codec);
+    const AVOutputFormat* fmt = ctx->output_fmt_ctx->oformat;
+    LOGI("Default video codec id: %d audio codec id: %d\n", fmt->video_codec, fmt->audio_codec);
 
-    AVStream* video_stream = avformat_new_stream(output_fmt_ctx, nullptr);
-    if (video_stream == nullptr) {
-        printf("add video stream to output format context fail\n");
-        return -1;
+    for (mux_input* input : ctx->inputs) {
+        AVStream* out_stream = avformat_new_stream(ctx->output_fmt_ctx, nullptr);
+        if (out_stream == nullptr) {
+            LOGE("add %s stream to output format context fail\n", input->name.c_str());
+            return -1;
+        }
+
+        // 新创建的 AVStream 结构基本是空的，缺少关键信息。为了将输入媒体流和输出媒体流的参数对齐，
+        // 需要将输入文件中媒体流的参数（主要是码流编码参数）复制到输出文件对应的媒体流中。
+        AVStream* in_stream = input->fmt_ctx->streams[input->in_st_idx];
+        result = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
+        if (result < 0) {
+            LOGE("copy %s codec paramaters failed!\n", input->name.c_str());
+            return -1;
+        }
+
+        // mov 复用器收到 Annex-B 的 HEVC 时会逐包重写起始码，extradata 也在写 moov 时才转换为 hvcC。
+        // 这里预先生成 hvcC，之后的包由 annexb_converter 转换。分片输出时去除带内参数集并写出 hvc1 样本描述，
+        // HLS 播放器不接受 hev1，清单中的 codecs 按 codec_tag 生成，与样本描述一致。hvc1 的样本描述只能有一组参数集，
+        // 码流中途参数集发生变化时转换失败，该输入按读取错误处理
+        if (in_stream->codecpar->codec_id == AV_CODEC_ID_HEVC && av_match_name(fmt->name, "mp4,mov,ismv")) {
+            bool hvc1 = seg_format != SEGMENT_FORMAT_NONE;
+            input->annexb = alloc_annexb_converter(out_stream->codecpar, hvc1);
+            if (input->annexb == nullptr) {
+                LOGD("%s: keep annexb, converted by the muxer\n", input->name.c_str());
+            } else if (hvc1) {
+                out_stream->codecpar->codec_tag = MKTAG('h', 'v', 'c', '1');
+            }
+        }
+
+        input->out_st_idx = out_stream->index;
+        out_stream->id = ctx->output_fmt_ctx->nb_streams - 1;
+        if (input->type == AVMEDIA_TYPE_VIDEO) {
+            out_stream->time_base = (AVRational){1, STREAM_FRAME_RATE};
+        } else if (input->type == AVMEDIA_TYPE_AUDIO) {
+            out_stream->time_base = (AVRational){1, out_stream->codecpar->sample_rate};
+        } else {
+            out_stream->time_base = in_stream->time_base;
+        }
+
+        LOGI("output %s idx: %d\n", input->name.c_str(), input->out_st_idx);
     }
 
-    // 新创建的 AVStream 结构基本是空的，缺少关键信息。为了将输入媒体流和输出媒体流的参数对齐，
-    // 需要将输入文件中媒体流的参数（主要是码流编码参数）复制到输出文件对应的媒体流中。
-    out_video_st_idx = video_stream->index;
-    in_video_st_idx = av_find_best_stream(video_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
-    if (in_video_st_idx < 0) {
-        printf("find video stream in input video file failed\n");
-        return -1;
+    av_dump_format(ctx->output_fmt_ctx, 0, output_file, 1);
+
+    if (seg_format != SEGMENT_FORMAT_NONE) {
+        // 按第一路视频流的关键帧切段，没有视频时按第一路流
+        int32_t ref_stream = 0;
+        for (mux_input* input : ctx->inputs) {
+            if (input->type == AVMEDIA_TYPE_VIDEO) {
+                ref_stream = input->out_st_idx;
+                break;
+            }
+        }
+
+        ctx->seg = alloc_segmenter(ctx->output_fmt_ctx, output_file, seg_format, ctx->opts.segment_duration_ms,
+                                   ref_stream, 0);
+        return ctx->seg != nullptr ? 0 : -1;
     }
 
-    result = avcodec_parameters_copy(video_stream->codecpar, video_fmt_ctx->streams[in_video_st_idx]->codecpar);
-    if (result < 0) {
-        printf("copy video codec paramaters failed!\n");
-        return -1;
+    // 有的输出格式没有输出文件
+    if (!(fmt->flags & AVFMT_NOFILE)) {
+        if (ctx->opts.uring_output) {
+            result = open_uring_output(&ctx->uring, &ctx->output_fmt_ctx->pb, output_file, 0, 0);
+        } else if (ctx->opts.write_behind_depth > 0) {
+            result = open_write_behind_output(&ctx->wb, &ctx->output_fmt_ctx->pb, output_file, 0,
+                                              ctx->opts.write_behind_depth, ctx->opts.direct_io);
+        } else {
+            result = avio_open(&ctx->output_fmt_ctx->pb, output_file, AVIO_FLAG_WRITE);
+        }
+        if (result < 0) {
+            LOGE("avio_open output file fail\n");
+            return -1;
+        }
     }
 
-    video_stream->id = output_fmt_ctx->nb_streams - 1;
-    video_stream->time_base = (AVRational){1, STREAM_FRAME_RATE};
+    return result;
+}
 
-    AVStream* audio_stream = avformat_new_stream(output_fmt_ctx, nullptr);
-    if (audio_stream == nullptr) {
-        printf("add audio stream to output format context fail\n");
-        return -1;
+static bool is_mov_family(const AVOutputFormat* fmt)
+{
+    static const char* names[] = { "mp4", "mov", "ipod", "ismv", "psp", "3gp", "3g2", "f4v" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(fmt->name, names[i]) == 0) {
+            return true;
+        }
     }
+    return false;
+}
 
-    out_audio_st_idx = audio_stream->index;
-    in_audio_st_idx = av_find_best_stream(audio_fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
-    if (in_audio_st_idx < 0) {
-        printf("find audio stream in input video file failed\n");
-        return -1;
+// 生成 avformat_write_header 的选项。分片模式下输出为 fragmented MP4：
+// empty_moov 使 moov 在文件头部一次写完且不包含样本索引，每个分片（moof + mdat）自带索引，
+// frag_keyframe 配合 min_frag_duration 使分片在不短于指定时长的第一个关键帧处切分。
+// 分片完成后立即写出并 flush，muxer 只需缓存当前分片的数据，内存占用不随录制时长增长，
+// 读端最多落后一个分片时长即可开始读取
+static int32_t build_header_options(muxer_context* ctx, AVDictionary** header_opts)
+{
+    if (ctx->seg != nullptr) {
+        if (ctx->opts.fragment_duration_ms > 0) {
+            LOGW("segmented output is cut by segment duration, fragment duration is ignored\n");
+        }
+        return segmenter_header_options(ctx->seg, ctx->opts.cmaf, header_opts);
     }
 
-    result = avcodec_parameters_copy(audio_stream->codecpar, audio_fmt_ctx->streams[in_audio_st_idx]->codecpar);
-    if (result < 0) {
-        printf("copy audio codec paramaters failed!\n");
+    if (ctx->opts.fragment_duration_ms <= 0) {
+        return 0;
+    }
+
+    if (!is_mov_family(ctx->output_fmt_ctx->oformat)) {
+        LOGW("fragmented output is only supported by mp4/mov, %s output is not fragmented\n",
+             ctx->output_fmt_ctx->oformat->name);
+        return 0;
+    }
+
+    const char* movflags = ctx->opts.cmaf ? "+frag_keyframe+empty_moov+default_base_moof+cmaf"
+                                          : "+frag_keyframe+empty_moov+default_base_moof";
+    if (av_dict_set(header_opts, "movflags", movflags, 0) < 0 ||
+        av_dict_set_int(header_opts, "min_frag_duration", (int64_t)ctx->opts.fragment_duration_ms * 1000, 0) < 0) {
+        LOGE("set fragment options fail\n");
         return -1;
     }
 
-    audio_stream->id = output_fmt_ctx->nb_streams - 1;
-    audio_stream->time_base = (AVRational){1, audio_stream->codecpar->sample_rate};
+    // 每次写包后 flush AVIOContext。分片模式下样本数据缓存在 muxer 内部，只有分片完成时才会写到 AVIOContext，
+    // 因此这里的 flush 只在分片边界真正产生写操作
+    ctx->output_fmt_ctx->flush_packets = 1;
 
-    av_dump_format(output_fmt_ctx, 0, output_file, 1);
-    printf("output video idx: %d audio idx: %d\n", out_video_st_idx, out_audio_st_idx);
+    LOGI("fragmented %s output, fragment duration: %d ms\n", ctx->opts.cmaf ? "cmaf" : "mp4", ctx->opts.fragment_duration_ms);
+    return 0;
+}
 
-    // 有的输出格式没有输出文件
-    if (!(fmt->flags & AVFMT_NOFILE)) {
-        result = avio_open(&output_fmt_ctx->pb, output_file, AVIO_FLAG_WRITE);
-        if (result < 0) {
-            printf("avio_open output file fail\n");
+void init_muxer_options(muxer_options* opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->pipelined = 0;
+    opts->queue_depth = 256;
+    opts->reorder_window = 16;
+}
+
+muxer_context* alloc_muxer(const muxer_options* opts)
+{
+    muxer_context* ctx = new (std::nothrow) muxer_context();
+    if (ctx == nullptr) {
+        LOGE("alloc muxer context fail\n");
+        return nullptr;
+    }
+
+    if (opts != nullptr) {
+        ctx->opts = *opts;
+    } else {
+        init_muxer_options(&ctx->opts);
+    }
+
+    if (ctx->opts.queue_depth <= 0) {
+        ctx->opts.queue_depth = 256;
+    }
+
+    if (ctx->opts.reorder_window <= 0) {
+        ctx->opts.reorder_window = 16;
+    }
+
+    return ctx;
+}
+
+int32_t init_muxer_inputs(muxer_context* ctx, const muxer_input* inputs, int32_t input_num, char* output_file)
+{
+    if (input_num <= 0 || !ctx->inputs.empty()) {
+        LOGE("invalid muxer inputs\n");
+        return -1;
+    }
+
+    int32_t type_count[AVMEDIA_TYPE_NB] = { 0 };
+    for (int32_t i = 0; i < input_num; i++) {
+        mux_input* input = new (std::nothrow) mux_input;
+        if (input == nullptr) {
             return -1;
         }
+        ctx->inputs.push_back(input);
+
+        int32_t result = init_input(ctx, input, &inputs[i]);
+        if (result < 0) {
+            return result;
+        }
+
+        // 同类型的第一路流沿用 video/audio 这样的名称，之后的依次为 audio.1、audio.2 ...
+        const char* type_name = av_get_media_type_string(input->type);
+        int32_t n = type_count[input->type]++;
+        input->name = n == 0 ? type_name : std::string(type_name) + "." + std::to_string(n);
     }
 
-    return result;
+    return init_output(ctx, output_file);
 }
 
-int32_t init_muxer(char* video_input_file, char* auido_input_file, char* output_file)
+int32_t init_muxer(muxer_context* ctx, char* video_input_file, char* auido_input_file, char* output_file)
 {
-    int32_t result = init_input_video(video_input_file, "hevc");
-    if (result < 0) {
-        return result;
+    muxer_input inputs[] = { { video_input_file, "hevc" }, { auido_input_file, "aac" } };
+    return init_muxer_inputs(ctx, inputs, 2, output_file);
+}
+
+// 最小堆中的一项，按输入下一个包的 dts 排序。每个输入在堆中最多只有一项，取出最小项和放回的代价都是 O(log N)
+struct heap_entry {
+    int64_t dts;
+    AVRational time_base;
+    int32_t input; ///< 输入的下标，dts 相同时下标小的先写
+};
+
+struct heap_later {
+    bool operator()(const heap_entry& a, const heap_entry& b) const
+    {
+        // av_compare_ts 根据各自的时间基比较两个时间戳的先后
+        int32_t cmp = av_compare_ts(a.dts, a.time_base, b.dts, b.time_base);
+        return cmp != 0 ? cmp > 0 : a.input > b.input;
     }
+};
 
-    result  = init_input_audio(auido_input_file, "aac");
+typedef std::priority_queue<heap_entry, std::vector<heap_entry>, heap_later> packet_heap;
+
+// 读取 input 的下一个包放到 input->next，补齐时间戳并转换到输出流的时间基。读完或出错时返回负数
+static int32_t read_next_packet(muxer_context* ctx, mux_input* input, mux_metrics* metrics)
+{
+    int64_t stage_start = metrics != nullptr ? mux_metrics_now() : 0;
+    AVPacket* pkt = input->next;
+    int32_t result = read_input_packet(ctx, input, pkt);
     if (result < 0) {
         return result;
     }
 
-    result = init_output(output_file);
-    if (result < 0) {
-        return result;
+    if (metrics != nullptr) {
+        int64_t now = mux_metrics_now();
+        mux_metrics_record(metrics, MUX_STAGE_READ, now - stage_start);
+        stage_start = now;
+    }
+
+    if (pkt->pts == AV_NOPTS_VALUE && input->has_ts_generator) {
+        // 有些输入流编码格式如 H.264 裸码流、ADTS AAC，读取的包中通常不包含时间戳数据。
+        // 为此按帧率（音频按每帧采样数和采样率）计算每一个 AVPacket 结构的时间戳并为其赋值。
+        // 帧时长在开始复用前已换算为以 time_base 为单位的有理数，这里只有整数运算
+        ts_generator_fill(&input->ts, pkt);
+
+        LOGT("%s pkt.duration: %jd, pkt.pts: %jd, pkt.dts: %jd\n", input->name.c_str(), pkt->duration, pkt->pts, pkt->dts);
+    }
+
+    // 从输入文件读取的码流包中保存的时间戳是以输入流的time_base为基准的，在写入输出文件之前需要转换为以输出流的time_base为基准
+    AVStream* input_stream = input->fmt_ctx->streams[input->in_st_idx];
+    AVStream* output_stream = ctx->output_fmt_ctx->streams[input->out_st_idx];
+    pkt->pts = av_rescale_q_rnd(pkt->pts, input_stream->time_base, output_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
+    pkt->dts = av_rescale_q_rnd(pkt->dts, input_stream->time_base, output_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
+    pkt->duration = av_rescale_q(pkt->duration, input_stream->time_base, output_stream->time_base);
+    pkt->stream_index = input->out_st_idx;
+
+    LOGT("Final pts: %jd duration: %jd timebase: %d / %d\n", pkt->pts, pkt->duration, output_stream->time_base.num, output_stream->time_base.den);
+
+    if (metrics != nullptr) {
+        int64_t now = mux_metrics_now();
+        mux_metrics_record(metrics, MUX_STAGE_TIMESTAMP, now - stage_start);
+        stage_start = now;
+    }
+
+    if (input->annexb != nullptr) {
+        result = annexb_convert_packet(input->annexb, pkt);
+        if (result < 0) {
+            av_packet_unref(pkt);
+            return result;
+        }
+
+        if (metrics != nullptr) {
+            mux_metrics_record(metrics, MUX_STAGE_CONVERT, mux_metrics_now() - stage_start);
+        }
     }
 
     return 0;
 }
 
-int32_t muxing()
+// 读取 input 的下一个包并放入堆中。读完的输入不再放回，出错的输入停止读取并记录第一个错误，
+// 其余输入继续复用，输出仍然是完整可播放的文件，但 muxing 返回失败
+static void refill_heap(muxer_context* ctx, packet_heap& heap, int32_t idx, mux_metrics* metrics)
+{
+    mux_input* input = ctx->inputs[idx];
+    int32_t result = read_next_packet(ctx, input, metrics);
+    if (result < 0) {
+        if (result != AVERROR_EOF) {
+            LOGE("%s: read packet fail (%d), stop reading this input\n", input->name.c_str(), result);
+            if (ctx->read_error == 0) {
+                ctx->read_error = result;
+            }
+        }
+        LOGD("%s: end of input\n", input->name.c_str());
+        return;
+    }
+
+    // 没有 dts 的包（如部分字幕）按该输入上一个包的位置排序
+    AVPacket* pkt = input->next;
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (dts == AV_NOPTS_VALUE) {
+        dts = input->last_dts;
+    }
+    input->last_dts = dts;
+
+    heap.push(heap_entry{ dts, ctx->output_fmt_ctx->streams[input->out_st_idx]->time_base, idx });
+}
+
+int32_t muxing(muxer_context* ctx)
 {
     int32_t result = 0;
-    int64_t pre_video_dts = -1;
-    int64_t cur_video_pts = 0;
-    int64_t cur_audio_pts = 0;
-
-    AVStream* in_video_st = video_fmt_ctx->streams[in_video_st_idx];
-    AVStream* in_audio_st = audio_fmt_ctx->streams[in_audio_st_idx];
-    AVStream* output_stream = nullptr;
-    AVStream* input_stream = nullptr;
-
-    int32_t video_frame_idx = 0;
-    int32_t audio_frame_idx = 0;
-    result = avformat_write_header(output_fmt_ctx, nullptr);
+
+    for (mux_input* input : ctx->inputs) {
+        AVStream* in_st = input->fmt_ctx->streams[input->in_st_idx];
+        if (input->type == AVMEDIA_TYPE_VIDEO) {
+            LOGI("%s r_frame_rate: %d / %d time_base: %d / %d\n", input->name.c_str(), in_st->r_frame_rate.num,
+                 in_st->r_frame_rate.den, in_st->time_base.num, in_st->time_base.den);
+            if (init_video_ts_generator(&input->ts, in_st, (AVRational){STREAM_FRAME_RATE, 1}) < 0) {
+                return -1;
+            }
+            input->has_ts_generator = true;
+        } else if (input->type == AVMEDIA_TYPE_AUDIO) {
+            if (init_audio_ts_generator(&input->ts, in_st) < 0) {
+                return -1;
+            }
+            input->has_ts_generator = true;
+        }
+    }
+
+    AVDictionary* header_opts = nullptr;
+    if (build_header_options(ctx, &header_opts) < 0) {
+        av_dict_free(&header_opts);
+        return -1;
+    }
+
+    result = avformat_write_header(ctx->output_fmt_ctx, &header_opts);
+    av_dict_free(&header_opts);
     if (result < 0) {
-        printf("avformat_write_header fail\n");
+        LOGE("avformat_write_header fail\n");
         return -1;
     }
 
-    AVPacket *pkt = av_packet_alloc();
-    pkt->data = nullptr;
-    pkt->size = 0;
+    if (ctx->seg != nullptr && segmenter_write_init(ctx->seg) < 0) {
+        return -1;
+    }
 
-    printf("Video r_frame_rate: %d / %d\n", in_video_st->r_frame_rate.num, in_video_st->r_frame_rate.den);
-    printf("Video time_base: %d / %d\n", in_video_st->time_base.num, in_video_st->time_base.den);
-    
-    while (1) {
-        // av_compare_ts，其作用是根据对应的时间基比较两个时间戳的顺序。若当前已记录的音频时间戳比视频时间戳新，则从输入视频文件中读取数据并写入；
-        // 反之，若当前已记录的视频时间戳比音频时间戳新，则从输入音频文件中读取数据并写入。
-        if (av_compare_ts(cur_video_pts, in_video_st->time_base, cur_audio_pts, in_audio_st->time_base) <= 0) {
-            input_stream = in_video_st;
-            result = av_read_frame(video_fmt_ctx, pkt);
-            if (result < 0) {
-                printf("av_read_frame fail\n");
-                av_packet_unref(pkt);
-                break;
+    // 堆输出的包已按 dts 排序，直接写入模式下不再经过 av_interleaved_write_frame 的缓冲和重排
+    direct_writer* writer = nullptr;
+    if (ctx->opts.direct_write) {
+        writer = alloc_direct_writer(ctx->output_fmt_ctx, ctx->opts.reorder_window);
+        if (writer == nullptr) {
+            return -1;
+        }
+    }
+
+    // 流水线模式下每个输入在各自的线程中解复用，一个输入的 IO 等待不会阻塞其他输入的读取和复用
+    if (ctx->opts.pipelined) {
+        for (mux_input* input : ctx->inputs) {
+            if (start_reader(&input->reader, input->fmt_ctx, input->native ? &input->es : nullptr,
+                             ctx->opts.queue_depth) < 0) {
+                LOGE("start input reader fail\n");
+                for (mux_input* started : ctx->inputs) {
+                    stop_reader(&started->reader);
+                }
+                free_direct_writer(&writer);
+                return -1;
             }
+        }
+    }
 
-            if (pkt->pts == AV_NOPTS_VALUE) {
-                // 有些输入流编码格式如 H.264 裸码流
-                // 从中读取的视频包中通常不包含时间戳数据，所以无法通过函数 av_compare_ts 来比较时间戳。
-                // 为此，我们通过视频帧数和给定帧率计算每一个 AVPacket 结构的时间戳并为其赋值。
+    // 分阶段耗时统计。只在指定了导出路径时开启，关闭时每个包只多一次指针判断
+    mux_metrics* metrics = nullptr;
+    if (ctx->opts.metrics_prefix != nullptr) {
+        metrics = new (std::nothrow) mux_metrics;
+        if (metrics != nullptr) {
+            mux_metrics_init(metrics, ctx->output_fmt_ctx->url);
+            for (mux_input* input : ctx->inputs) {
+                input->metrics_counter = mux_metrics_add_stream(metrics, input->name.c_str());
+            }
+            mux_metrics_hook_io(metrics, ctx->output_fmt_ctx->pb);
+        }
+    }
 
-                // r_frame_rate 表示的是音视频流中可以精准表示所有时间戳的最低帧率。
-                // 简单来说，如果当前音视频流的帧率是恒定的，那么 r_frame_rate 表示的是音视频流的实际帧率；
-                // 如果当前音视频流的帧率波动较大，那么 r_frame_rate 的值通常会高于整体平均帧率，以此作为每一帧的时间戳的单位
-                
-                // 计算每一帧持续的时间
-                int64_t frame_duration = (double)AV_TIME_BASE / av_q2d(in_video_st->r_frame_rate);
+    // 逐包只累加统计信息，结束时一次性输出，代替逐包打印
+    for (mux_input* input : ctx->inputs) {
+        AVStream* out_st = ctx->output_fmt_ctx->streams[input->out_st_idx];
+        stream_stats_init(&input->stats, input->name.c_str(), out_st->time_base.num, out_st->time_base.den);
+    }
 
-                // 将帧时长的单位转换为以 time_base 为基准
-                pkt->duration = (double)frame_duration / (double)(av_q2d(in_video_st->time_base) * AV_TIME_BASE);
-                
-                // 通过帧时长与帧数量计算每一帧的时间戳
-                pkt->pts = (double)(video_frame_idx * frame_duration) / (double)(av_q2d(in_video_st->time_base) * AV_TIME_BASE);
-                pkt->dts = pkt->dts;
+    // 每个输入预读一个包放入按 dts 排序的最小堆，之后每次写出堆顶的包并从同一输入补读一个包。
+    // 这样写出的包整体按 dts 有序，输入再多也不需要逐个比较
+    packet_heap heap;
+    for (int32_t i = 0; i < (int32_t)ctx->inputs.size() ; i++) {
+        refill_heap(ctx, heap, i, metrics);
+    }
 
-                printf("video frame_duration :%jd, pkt.duration: %jd, pkt.pts: %jd\n", frame_duration, pkt->duration, pkt->pts);
+    while (!heap.empty()) {
+        int32_t idx = heap.top().input;
+        heap.pop();
 
-                video_frame_idx++;
-            }
+        mux_input* input = ctx->inputs[idx];
+        AVPacket* pkt = input->next;
+        stream_stats_add(&input->stats, pkt->pts, pkt->duration, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
 
-            cur_video_pts = pkt->pts;
-            pkt->stream_index = out_video_st_idx;
-            output_stream = output_fmt_ctx->streams[out_video_st_idx];
-        } else {
+        // 如果输入是文件（非实时流），而输出是实时流，此处还应该增加帧间隔控制的逻辑
 
-            // write audio
-            input_stream = in_audio_st;
-            result = av_read_frame(audio_fmt_ctx, pkt);
-            if (result < 0) {
-                printf("av_read_frame fail\n");
+        int64_t stage_start = 0;
+        int64_t io_start = 0;
+        if (metrics != nullptr) {
+            mux_metrics_count(metrics, input->metrics_counter, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+            stage_start = mux_metrics_now();
+            io_start = metrics->io_ns;
+        }
+
+        // 切段前先写出交错队列或重排窗口中的包，它们的 dts 都不晚于当前包，属于上一段
+        if (ctx->seg != nullptr && segmenter_should_cut(ctx->seg, pkt)) {
+            int32_t ret = writer != nullptr ? direct_writer_flush(writer)
+                                            : av_interleaved_write_frame(ctx->output_fmt_ctx, nullptr);
+            if (ret >= 0) {
+                ret = segmenter_cut(ctx->seg, pkt);
+            }
+            if (ret < 0) {
+                LOGE("cut segment fail\n");
+                set_write_error(ctx, ret);
                 av_packet_unref(pkt);
                 break;
             }
+        }
 
-            if (pkt->pts == AV_NOPTS_VALUE) {
-                // 计算每一帧持续的时间
-                int64_t frame_duration = (double)AV_TIME_BASE / av_q2d(in_audio_st->r_frame_rate);
+        if (writer != nullptr) {
+            int32_t ret = direct_writer_write(writer, pkt);
+            if (ret < 0) {
+                set_write_error(ctx, ret);
+                break;
+            }
+        } else {
+            int32_t ret = av_interleaved_write_frame(ctx->output_fmt_ctx, pkt);
+            if (ret < 0) {
+                LOGE("av_interleaved_write_frame fail\n");
+                set_write_error(ctx, ret);
+                av_packet_unref(pkt);
+                break;
+            }
+        }
 
-                // 将帧时长的单位转换为以 time_base 为基准
-                pkt->duration = (double)frame_duration / (double)(av_q2d(in_audio_st->time_base) * AV_TIME_BASE);
-                
-                // 通过帧时长与帧数量计算每一帧的时间戳
-                pkt->pts = (double)(audio_frame_idx * frame_duration) / (double)(av_q2d(in_audio_st->time_base) * AV_TIME_BASE);
-                pkt->dts = pkt->dts;
+        if (metrics != nullptr) {
+            mux_metrics_record_mux(metrics, mux_metrics_now() - stage_start, io_start);
+        }
 
-                printf("audio frame_duration :%jd, pkt.duration: %jd, pkt.pts: %jd\n", frame_duration, pkt->duration, pkt->pts);
+        av_packet_unref(pkt);
+        refill_heap(ctx, heap, idx, metrics);
+    }
 
-                audio_frame_idx++;
-            }
+    for (mux_input* input : ctx->inputs) {
+        stop_reader(&input->reader);
+    }
 
-            cur_audio_pts = pkt->pts;
-            pkt->stream_index = out_audio_st_idx;
-            output_stream = output_fmt_ctx->streams[out_audio_st_idx];
+    if (writer != nullptr) {
+        int32_t ret = direct_writer_flush(writer);
+        if (ret < 0) {
+            LOGE("flush reorder window fail\n");
+            set_write_error(ctx, ret);
         }
+        free_direct_writer(&writer);
+    }
 
-        // 从输入文件读取的码流包中保存的时间戳是以输入流的time_base为基准的，在写入输出文件之前需要转换为以输出流的time_base为基准
-        pkt->pts = av_rescale_q_rnd(pkt->pts, input_stream->time_base, output_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
-        pkt->dts = av_rescale_q_rnd(pkt->dts, input_stream->time_base, output_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
-        pkt->duration = av_rescale_q(pkt->duration, input_stream->time_base, output_stream->time_base);
-        
-        printf("Final pts: %jd duration: %jd timebase: %d / %d\n", pkt->pts, pkt->duration, output_stream->time_base.num, output_stream->time_base.den);
-        
-        // 如果输入是文件（非实时流），而输出是实时流，此处还应该增加帧间隔控制的逻辑
+    int32_t segment_result = 0;
+    if (ctx->seg != nullptr) {
+        set_write_error(ctx, av_interleaved_write_frame(ctx->output_fmt_ctx, nullptr));
+        segment_result = segmenter_finish(ctx->seg);
+    }
 
-        // 上面的代码已经对数据通过 pts 排序，这里可以直接使用 av_write_frame
-        if (av_interleaved_write_frame(output_fmt_ctx, pkt) < 0) {
-            printf("av_interleaved_write_frame fail\n");
-            av_packet_unref(pkt);
-            break;
-        }
+    result = av_write_trailer(ctx->output_fmt_ctx);
+    if (segment_result < 0) {
+        result = segment_result;
+    }
+    // av_write_trailer 成功不代表之前的包都已写出，写入错误优先于读取错误返回
+    if (ctx->write_error < 0 && result >= 0) {
+        result = ctx->write_error;
+    }
+    if (ctx->read_error < 0 && result >= 0) {
+        result = ctx->read_error;
+    }
 
-        av_packet_unref(pkt);
+    // io_uring 和写线程的写入是异步的，写入错误在等待完成时才能发现
+    if (ctx->uring != nullptr && uring_output_drain(ctx->uring, ctx->output_fmt_ctx->pb) < 0) {
+        LOGE("write output fail\n");
+        result = -1;
+    }
+    if (ctx->wb != nullptr && write_behind_drain(ctx->wb, ctx->output_fmt_ctx->pb) < 0) {
+        LOGE("write output fail\n");
+        result = -1;
+    }
+
+    for (mux_input* input : ctx->inputs) {
+        stream_stats_print(&input->stats);
+    }
+
+    if (metrics != nullptr) {
+        // 关闭输出前必须恢复 AVIOContext 原来的回调
+        mux_metrics_unhook_io(metrics);
+        mux_metrics_dump(metrics, ctx->opts.metrics_prefix);
+        delete metrics;
     }
 
-    result = av_write_trailer(output_fmt_ctx);
-    
-    av_packet_free(&pkt);
     return result;
 }
 
-void destory_muxer()
+void destory_muxer(muxer_context** ctx)
 {
-    avformat_free_context(video_fmt_ctx);
-    avformat_free_context(audio_fmt_ctx);
+    if (ctx == nullptr || *ctx == nullptr) {
+        return;
+    }
+
+    muxer_context* muxer = *ctx;
+
+    for (mux_input* input : muxer->inputs) {
+        // 读线程使用输入上下文，必须在关闭输入之前结束
+        stop_reader(&input->reader);
+        close_es_demuxer(&input->es);
+
+        // 输入上下文由 avformat_open_input 打开，需要用 avformat_close_input 释放，否则其内部的 AVIOContext 会泄漏，
+        // 在同一进程中反复执行任务时泄漏会不断累积
+        avformat_close_input(&input->fmt_ctx);
+        av_packet_free(&input->next);
+        free_annexb_converter(&input->annexb);
+        delete input;
+    }
+    muxer->inputs.clear();
+
+    // 分段输出的 pb 是 segmenter 的内存输出，由 segmenter 释放
+    free_segmenter(&muxer->seg);
+
+    if (muxer->output_fmt_ctx != nullptr) {
+        if (muxer->uring != nullptr) {
+            close_uring_output(&muxer->uring, &muxer->output_fmt_ctx->pb);
+        } else if (muxer->wb != nullptr) {
+            close_write_behind_output(&muxer->wb, &muxer->output_fmt_ctx->pb);
+        } else if (!(muxer->output_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&muxer->output_fmt_ctx->pb);
+        }
 
-    if (!(output_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&output_fmt_ctx->pb);
+        avformat_free_context(muxer->output_fmt_ctx);
     }
 
-    avformat_free_context(output_fmt_ctx);
+    delete muxer;
+    *ctx = nullptr;
 }
@@ -2,8 +2,46 @@
 #define MUXER_CORE_H
 #include <stdint.h>
 
-int32_t init_muxer(char* video_input_file, char* auido_input_file, char* output_file);
-int32_t muxing();
-void destory_muxer();
+// 裸视频流中没有帧率信息时使用的默认帧率
+#define STREAM_FRAME_RATE 25
+
+// 一次 mux 任务的上下文，不同任务的上下文相互独立，可以在多个线程中同时使用（同一个上下文不能跨线程并发使用）
+typedef struct muxer_context muxer_context;
+
+typedef struct muxer_options {
+    int32_t pipelined;   ///< 非 0 时每个输入在独立线程中预读，通过有界 SPSC 队列交给复用线程
+    int32_t queue_depth; ///< 流水线模式下每个输入最多预读的包数
+    int32_t fragment_duration_ms; ///< 大于 0 时输出 fragmented MP4，分片在不短于该时长的第一个关键帧处切分
+    int32_t cmaf;        ///< 分片模式下输出符合 CMAF 规范的分片
+    const char* metrics_prefix; ///< 非空时统计各阶段耗时，任务结束时写出 <metrics_prefix>.json 和 .prom
+    int32_t fast_open;   ///< 非 0 时直接解析 HEVC 参数集和 ADTS 头得到编码参数，不调用 avformat_find_stream_info
+    const char* probe_cache_dir; ///< 非空时输入的探测结果缓存在该目录下，再次打开同一输入时跳过探测
+    int32_t direct_write; ///< 非 0 时用 av_write_frame 直接写入已按 dts 排序的包，不经过 libavformat 的交错缓冲
+    int32_t reorder_window; ///< 直接写入时检测到乱序后启用的重排窗口大小（包数）
+    int32_t segment_duration_ms; ///< 输出为 .m3u8 或 .mpd 时的段时长，段在不短于该时长的第一个视频关键帧处切分
+    int32_t native_demux; ///< 非 0 时裸 HEVC/H.264/AAC 输入由 es_demuxer 在映射内存上直接切分，包不拷贝负载数据
+    int32_t uring_output; ///< 非 0 时输出文件通过 io_uring 异步写入，多个写入同时在途，不可用时退回到 pwrite
+    int32_t write_behind_depth; ///< 大于 0 时输出文件由独立的写线程写出，最多该数量的 4 MiB 缓冲区排队等待写出
+    int32_t direct_io;   ///< 写线程写出时使用 O_DIRECT，不经过页缓存
+} muxer_options;
+
+// 一个输入文件，每个输入复用其中的一路流（依次查找视频、音频和字幕）
+typedef struct muxer_input {
+    const char* filename;
+    const char* format; ///< 输入格式名，如 "hevc"、"aac"，nullptr 时由 libavformat 探测
+} muxer_input;
+
+// 填充默认选项
+void init_muxer_options(muxer_options* opts);
+
+// opts 为 nullptr 时使用默认选项
+muxer_context* alloc_muxer(const muxer_options* opts);
+// 复用任意多个输入，如多机位视频、多语言音轨和字幕。复用时按各输入下一个包的 dts 交错写入。
+// output_file 以 .m3u8 或 .mpd 结尾时输出 HLS 或 DASH 分段，段文件与播放列表位于同一目录
+int32_t init_muxer_inputs(muxer_context* ctx, const muxer_input* inputs, int32_t input_num, char* output_file);
+// 一路裸 HEVC 视频加一路 ADTS AAC 音频
+int32_t init_muxer(muxer_context* ctx, char* video_input_file, char* auido_input_file, char* output_file);
+int32_t muxing(muxer_context* ctx);
+void destory_muxer(muxer_context** ctx);
 
 #endif
@@ -0,0 +1,466 @@
+#include "probe_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "log.h"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#define PROBE_CACHE_VERSION 1
+
+typedef struct file_identity {
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t head_hash;
+} file_identity;
+
+// 一路流的缓存内容。time_base 由解复用器在打开时确定，探测不会改变它，只用于校验
+typedef struct cached_stream {
+    AVCodecParameters* par = nullptr;
+    AVRational time_base = { 0, 1 };
+    AVRational r_frame_rate = { 0, 1 };
+    AVRational avg_frame_rate = { 0, 1 };
+    AVRational sample_aspect_ratio = { 0, 1 };
+    int64_t start_time = AV_NOPTS_VALUE;
+    int64_t duration = AV_NOPTS_VALUE;
+    int64_t nb_frames = 0;
+} cached_stream;
+
+typedef struct cache_entry {
+    file_identity id = { 0, 0, 0 };
+    std::string format;
+    int64_t probesize = 0;
+    int64_t analyze_duration = 0;
+    int64_t start_time = AV_NOPTS_VALUE;
+    int64_t duration = AV_NOPTS_VALUE;
+    int64_t bit_rate = 0;
+    std::vector<cached_stream> streams;
+} cache_entry;
+
+static void free_entry(cache_entry* entry)
+{
+    for (cached_stream& s : entry->streams) {
+        avcodec_parameters_free(&s.par);
+    }
+    entry->streams.clear();
+}
+
+// FNV-1a，只用于区分文件，不需要抗碰撞
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+// 管道、设备等不是普通文件的输入无法标识，返回 -1
+static int32_t get_identity(const char* filename, file_identity* id)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    std::vector<uint8_t> head(PROBE_CACHE_HEAD_SIZE);
+    size_t head_size = 0;
+    while (head_size < head.size()) {
+        ssize_t n = pread(fd, head.data() + head_size, head.size() - head_size, head_size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        head_size += n;
+    }
+    close(fd);
+
+    id->size = st.st_size;
+    id->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    id->head_hash = fnv1a(FNV1A_INIT, head.data(), head_size);
+    return 0;
+}
+
+// 缓存文件名由文件标识、输入格式和探测参数共同决定，同一文件以不同格式或探测参数打开时互不干扰
+static std::string entry_path(const char* cache_dir, const file_identity* id, const AVFormatContext* ic)
+{
+    uint64_t key = fnv1a(FNV1A_INIT, id, sizeof(*id));
+    key = fnv1a(key, ic->iformat->name, strlen(ic->iformat->name));
+    key = fnv1a(key, &ic->probesize, sizeof(ic->probesize));
+    key = fnv1a(key, &ic->max_analyze_duration, sizeof(ic->max_analyze_duration));
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".probe", key);
+    return std::string(cache_dir) + "/" + name;
+}
+
+static void write_rational(FILE* fp, const char* name, AVRational q)
+{
+    fprintf(fp, "%s %d/%d\n", name, q.num, q.den);
+}
+
+static void write_entry(FILE* fp, const file_identity* id, const AVFormatContext* ic)
+{
+    fprintf(fp, "probe_cache %d\n", PROBE_CACHE_VERSION);
+    fprintf(fp, "size %jd\nmtime_ns %jd\nhead_hash %016" PRIx64 "\n", (intmax_t)id->size, (intmax_t)id->mtime_ns,
+            id->head_hash);
+    fprintf(fp, "format %s\nprobesize %jd\nanalyze_duration %jd\n", ic->iformat->name, (intmax_t)ic->probesize,
+            (intmax_t)ic->max_analyze_duration);
+    fprintf(fp, "start_time %jd\nduration %jd\nbit_rate %jd\n", (intmax_t)ic->start_time, (intmax_t)ic->duration,
+            (intmax_t)ic->bit_rate);
+
+    for (unsigned int i = 0; i < ic->nb_streams; i++) {
+        const AVStream* st = ic->streams[i];
+        const AVCodecParameters* par = st->codecpar;
+
+        // 流以 "stream" 行开始，之后的字段都属于这一路流
+        fprintf(fp, "stream %u\n", i);
+        write_rational(fp, "time_base", st->time_base);
+        write_rational(fp, "r_frame_rate", st->r_frame_rate);
+        write_rational(fp, "avg_frame_rate", st->avg_frame_rate);
+        write_rational(fp, "stream_sample_aspect_ratio", st->sample_aspect_ratio);
+        fprintf(fp, "stream_start_time %jd\nstream_duration %jd\nnb_frames %jd\n", (intmax_t)st->start_time,
+                (intmax_t)st->duration, (intmax_t)st->nb_frames);
+
+#define WRITE_PAR(field) fprintf(fp, #field " %jd\n", (intmax_t)par->field)
+        WRITE_PAR(codec_type);
+        WRITE_PAR(codec_id);
+        WRITE_PAR(codec_tag);
+        WRITE_PAR(format);
+        WRITE_PAR(bit_rate);
+        WRITE_PAR(bits_per_coded_sample);
+        WRITE_PAR(bits_per_raw_sample);
+        WRITE_PAR(profile);
+        WRITE_PAR(level);
+        WRITE_PAR(width);
+        WRITE_PAR(height);
+        WRITE_PAR(field_order);
+        WRITE_PAR(color_range);
+        WRITE_PAR(color_primaries);
+        WRITE_PAR(color_trc);
+        WRITE_PAR(color_space);
+        WRITE_PAR(chroma_location);
+        WRITE_PAR(video_delay);
+        WRITE_PAR(channels);
+        WRITE_PAR(sample_rate);
+        WRITE_PAR(block_align);
+        WRITE_PAR(frame_size);
+        WRITE_PAR(initial_padding);
+        WRITE_PAR(trailing_padding);
+        WRITE_PAR(seek_preroll);
+#undef WRITE_PAR
+        fprintf(fp, "channel_layout %ju\n", (uintmax_t)par->channel_layout);
+        write_rational(fp, "sample_aspect_ratio", par->sample_aspect_ratio);
+
+        if (par->extradata_size > 0) {
+            fprintf(fp, "extradata ");
+            for (int32_t j = 0; j < par->extradata_size; j++) {
+                fprintf(fp, "%02x", par->extradata[j]);
+            }
+            fprintf(fp, "\n");
+        }
+    }
+}
+
+// 写到同目录下的临时文件再改名，并发的任务（批处理模式）不会读到写了一半的缓存项
+static void store_entry(const char* cache_dir, const std::string& path, const file_identity* id, const AVFormatContext* ic)
+{
+    if (mkdir(cache_dir, 0755) < 0 && errno != EEXIST) {
+        LOGW("create probe cache directory %s fail: %s\n", cache_dir, strerror(errno));
+        return;
+    }
+
+    std::string tmp_template = path + ".XXXXXX";
+    std::vector<char> tmp(tmp_template.begin(), tmp_template.end());
+    tmp.push_back('\0');
+    int fd = mkstemp(tmp.data());
+    if (fd < 0) {
+        LOGW("create probe cache entry in %s fail: %s\n", cache_dir, strerror(errno));
+        return;
+    }
+
+    FILE* fp = fdopen(fd, "w");
+    if (fp == nullptr) {
+        close(fd);
+        unlink(tmp.data());
+        return;
+    }
+
+    write_entry(fp, id, ic);
+    if (fclose(fp) != 0 || rename(tmp.data(), path.c_str()) != 0) {
+        LOGW("write probe cache entry %s fail\n", path.c_str());
+        unlink(tmp.data());
+    }
+}
+
+static bool parse_rational(const char* value, AVRational* q)
+{
+    return sscanf(value, "%d/%d", &q->num, &q->den) == 2;
+}
+
+static bool parse_extradata(const char* value, AVCodecParameters* par)
+{
+    size_t len = strlen(value);
+    if (len == 0 || len % 2 != 0 || len / 2 > INT32_MAX - AV_INPUT_BUFFER_PADDING_SIZE) {
+        return false;
+    }
+
+    uint8_t* data = (uint8_t*)av_mallocz(len / 2 + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (data == nullptr) {
+        return false;
+    }
+
+    for (size_t i = 0; i < len / 2; i++) {
+        unsigned int byte = 0;
+        if (sscanf(value + i * 2, "%2x", &byte) != 1) {
+            av_free(data);
+            return false;
+        }
+        data[i] = byte;
+    }
+
+    av_free(par->extradata);
+    par->extradata = data;
+    par->extradata_size = len / 2;
+    return true;
+}
+
+static bool parse_stream_field(cached_stream* s, const char* key, const char* value)
+{
+    AVCodecParameters* par = s->par;
+    int64_t v = strtoll(value, nullptr, 10);
+
+#define PARSE_PAR(field)                          \
+    if (strcmp(key, #field) == 0) {               \
+        par->field = (decltype(par->field))v;     \
+        return true;                              \
+    }
+    PARSE_PAR(codec_type);
+    PARSE_PAR(codec_id);
+    PARSE_PAR(codec_tag);
+    PARSE_PAR(format);
+    PARSE_PAR(bit_rate);
+    PARSE_PAR(bits_per_coded_sample);
+    PARSE_PAR(bits_per_raw_sample);
+    PARSE_PAR(profile);
+    PARSE_PAR(level);
+    PARSE_PAR(width);
+    PARSE_PAR(height);
+    PARSE_PAR(field_order);
+    PARSE_PAR(color_range);
+    PARSE_PAR(color_primaries);
+    PARSE_PAR(color_trc);
+    PARSE_PAR(color_space);
+    PARSE_PAR(chroma_location);
+    PARSE_PAR(video_delay);
+    PARSE_PAR(channels);
+    PARSE_PAR(sample_rate);
+    PARSE_PAR(block_align);
+    PARSE_PAR(frame_size);
+    PARSE_PAR(initial_padding);
+    PARSE_PAR(trailing_padding);
+    PARSE_PAR(seek_preroll);
+#undef PARSE_PAR
+
+    if (strcmp(key, "channel_layout") == 0) {
+        par->channel_layout = strtoull(value, nullptr, 10);
+    } else if (strcmp(key, "sample_aspect_ratio") == 0) {
+        return parse_rational(value, &par->sample_aspect_ratio);
+    } else if (strcmp(key, "extradata") == 0) {
+        return parse_extradata(value, par);
+    } else if (strcmp(key, "time_base") == 0) {
+        return parse_rational(value, &s->time_base);
+    } else if (strcmp(key, "r_frame_rate") == 0) {
+        return parse_rational(value, &s->r_frame_rate);
+    } else if (strcmp(key, "avg_frame_rate") == 0) {
+        return parse_rational(value, &s->avg_frame_rate);
+    } else if (strcmp(key, "stream_sample_aspect_ratio") == 0) {
+        return parse_rational(value, &s->sample_aspect_ratio);
+    } else if (strcmp(key, "stream_start_time") == 0) {
+        s->start_time = v;
+    } else if (strcmp(key, "stream_duration") == 0) {
+        s->duration = v;
+    } else if (strcmp(key, "nb_frames") == 0) {
+        s->nb_frames = v;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_entry_field(cache_entry* entry, const char* key, const char* value)
+{
+    int64_t v = strtoll(value, nullptr, 10);
+    if (strcmp(key, "probe_cache") == 0) {
+        return v == PROBE_CACHE_VERSION;
+    } else if (strcmp(key, "size") == 0) {
+        entry->id.size = v;
+    } else if (strcmp(key, "mtime_ns") == 0) {
+        entry->id.mtime_ns = v;
+    } else if (strcmp(key, "head_hash") == 0) {
+        entry->id.head_hash = strtoull(value, nullptr, 16);
+    } else if (strcmp(key, "format") == 0) {
+        entry->format = value;
+    } else if (strcmp(key, "probesize") == 0) {
+        entry->probesize = v;
+    } else if (strcmp(key, "analyze_duration") == 0) {
+        entry->analyze_duration = v;
+    } else if (strcmp(key, "start_time") == 0) {
+        entry->start_time = v;
+    } else if (strcmp(key, "duration") == 0) {
+        entry->duration = v;
+    } else if (strcmp(key, "bit_rate") == 0) {
+        entry->bit_rate = v;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// 缓存项不存在、格式不对或版本不同都按未命中处理
+static bool load_entry(const std::string& path, cache_entry* entry)
+{
+    FILE* fp = fopen(path.c_str(), "r");
+    if (fp == nullptr) {
+        return false;
+    }
+
+    bool ok = true;
+    std::string line;
+    char chunk[4096];
+    while (ok) {
+        // extradata 可能比 chunk 长，拼接成完整的一行再解析
+        line.clear();
+        while (fgets(chunk, sizeof(chunk), fp) != nullptr) {
+            line += chunk;
+            if (line.back() == '\n') {
+                break;
+            }
+        }
+        if (line.empty()) {
+            break;
+        }
+        if (line.back() == '\n') {
+            line.pop_back();
+        }
+
+        size_t space = line.find(' ');
+        if (space == std::string::npos) {
+            ok = false;
+            break;
+        }
+        line[space] = '\0';
+        const char* key = line.c_str();
+        const char* value = line.c_str() + space + 1;
+
+        if (strcmp(key, "stream") == 0) {
+            cached_stream s;
+            s.par = avcodec_parameters_alloc();
+            if (s.par == nullptr || strtoul(value, nullptr, 10) != entry->streams.size()) {
+                avcodec_parameters_free(&s.par);
+                ok = false;
+                break;
+            }
+            entry->streams.push_back(s);
+        } else if (entry->streams.empty()) {
+            ok = parse_entry_field(entry, key, value);
+        } else {
+            ok = parse_stream_field(&entry->streams.back(), key, value);
+        }
+    }
+
+    fclose(fp);
+    return ok && !entry->streams.empty();
+}
+
+// 缓存项与刚打开的输入一致时才使用：文件标识、格式和探测参数相同，解复用器创建的流与缓存的流一一对应
+static bool entry_matches(const cache_entry* entry, const file_identity* id, const AVFormatContext* ic)
+{
+    if (entry->id.size != id->size || entry->id.mtime_ns != id->mtime_ns || entry->id.head_hash != id->head_hash ||
+        entry->format != ic->iformat->name || entry->probesize != ic->probesize ||
+        entry->analyze_duration != ic->max_analyze_duration || entry->streams.size() != ic->nb_streams) {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < ic->nb_streams; i++) {
+        const AVStream* st = ic->streams[i];
+        const cached_stream* s = &entry->streams[i];
+        if (s->par->codec_type != st->codecpar->codec_type || s->par->codec_id != st->codecpar->codec_id ||
+            av_cmp_q(s->time_base, st->time_base) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int32_t apply_entry(const cache_entry* entry, AVFormatContext* ic)
+{
+    for (unsigned int i = 0; i < ic->nb_streams; i++) {
+        AVStream* st = ic->streams[i];
+        const cached_stream* s = &entry->streams[i];
+        if (avcodec_parameters_copy(st->codecpar, s->par) < 0) {
+            return -1;
+        }
+
+        st->r_frame_rate = s->r_frame_rate;
+        st->avg_frame_rate = s->avg_frame_rate;
+        st->sample_aspect_ratio = s->sample_aspect_ratio;
+        st->start_time = s->start_time;
+        st->duration = s->duration;
+        st->nb_frames = s->nb_frames;
+    }
+
+    ic->start_time = entry->start_time;
+    ic->duration = entry->duration;
+    ic->bit_rate = entry->bit_rate;
+    return 0;
+}
+
+int32_t probe_cache_find_stream_info(const char* cache_dir, const char* filename, AVFormatContext* ic)
+{
+    file_identity id;
+    if (cache_dir == nullptr || get_identity(filename, &id) < 0) {
+        return avformat_find_stream_info(ic, nullptr);
+    }
+
+    std::string path = entry_path(cache_dir, &id, ic);
+    cache_entry entry;
+    bool hit = load_entry(path, &entry) && entry_matches(&entry, &id, ic) && apply_entry(&entry, ic) >= 0;
+    free_entry(&entry);
+    if (hit) {
+        LOGD("probe cache hit: %s -> %s\n", filename, path.c_str());
+        return 1;
+    }
+
+    int32_t ret = avformat_find_stream_info(ic, nullptr);
+    if (ret < 0) {
+        return ret;
+    }
+
+    LOGD("probe cache miss: %s -> %s\n", filename, path.c_str());
+    store_entry(cache_dir, path, &id, ic);
+    return 0;
+}
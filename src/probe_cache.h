@@ -0,0 +1,23 @@
+//
+// 输入探测结果的磁盘缓存。同一个输入反复复用（输出为不同容器、失败重试）时，
+// 用缓存的流参数代替 avformat_find_stream_info，省去探测阶段的读取和解析
+//
+
+#ifndef PROBE_CACHE_H
+#define PROBE_CACHE_H
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// 参与文件标识的开头数据量
+#define PROBE_CACHE_HEAD_SIZE (64 * 1024)
+
+// 在 avformat_open_input 之后调用，代替 avformat_find_stream_info。
+// 输入以文件大小、修改时间和开头 PROBE_CACHE_HEAD_SIZE 字节的哈希标识，缓存项还区分输入格式和探测参数。
+// 命中时直接恢复各路流的编码参数、帧率和时长并返回 1；未命中时调用 avformat_find_stream_info，
+// 成功后写入缓存并返回 0。cache_dir 为 nullptr 或输入不是普通文件时只做探测。探测失败返回负数
+int32_t probe_cache_find_stream_info(const char* cache_dir, const char* filename, AVFormatContext* ic);
+
+#endif
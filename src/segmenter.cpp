@@ -0,0 +1,444 @@
+#include "segmenter.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <new>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "es_params.h"
+#include "log.h"
+#include "mem_output.h"
+
+// 一个已完成的段，时间以参考流的 time_base 计
+struct segment_info {
+    int64_t start;
+    int64_t duration;
+    size_t size;
+};
+
+// 等待 IO 线程写出的文件，data 由 av_malloc 分配，写完由 IO 线程释放
+struct io_job {
+    std::string path;
+    uint8_t* data;
+    size_t size;
+};
+
+struct segmenter {
+    AVFormatContext* ofmt_ctx = nullptr;
+    segment_format format = SEGMENT_FORMAT_NONE;
+    std::string playlist_path;
+    std::string dir;  ///< 段文件所在目录，带结尾的 '/'，当前目录时为空
+    std::string base; ///< 段文件名前缀，播放列表中以相对路径引用
+    int32_t segment_duration_ms = 0;
+    int32_t ref_stream = 0;
+
+    mem_output out;
+    bool out_opened = false;
+
+    bool started = false;  ///< 是否已收到参考流的第一个包
+    int64_t seg_start = 0; ///< 当前段第一个包的时间戳
+    int64_t end_ts = 0;    ///< 参考流已写出内容的结束时间，用作最后一段的结束时间
+    std::vector<segment_info> segments;
+
+    // 后台 IO 线程，jobs 为等待写出的文件，按提交顺序写出，播放列表总在全部段之后
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<io_job> jobs;
+    size_t max_pending = 0;
+    bool stop = false;
+    bool io_error = false;
+
+    int64_t stalls = 0;   ///< 复用线程因队列满而等待的次数
+    int64_t stall_ns = 0; ///< 复用线程等待写盘的总时间
+    int64_t bytes = 0;
+};
+
+segment_format segment_format_from_path(const char* output_file)
+{
+    const char* ext = strrchr(output_file, '.');
+    if (ext == nullptr) {
+        return SEGMENT_FORMAT_NONE;
+    }
+    if (strcmp(ext, ".m3u8") == 0) {
+        return SEGMENT_FORMAT_HLS;
+    }
+    if (strcmp(ext, ".mpd") == 0) {
+        return SEGMENT_FORMAT_DASH;
+    }
+    return SEGMENT_FORMAT_NONE;
+}
+
+// 先写临时文件再 rename，播放器或其他进程不会读到写了一半的段
+static int32_t write_file(const std::string& path, const uint8_t* data, size_t size)
+{
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (fp == nullptr) {
+        LOGE("open segment file %s fail\n", tmp.c_str());
+        return -1;
+    }
+
+    size_t written = fwrite(data, 1, size, fp);
+    if (fclose(fp) != 0 || written != size || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGE("write segment file %s fail\n", path.c_str());
+        remove(tmp.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+static void io_thread(segmenter* seg)
+{
+    for (;;) {
+        io_job job;
+        {
+            std::unique_lock<std::mutex> lock(seg->mutex);
+            seg->cond.wait(lock, [seg] { return !seg->jobs.empty() || seg->stop; });
+            if (seg->jobs.empty()) {
+                return;
+            }
+            job = seg->jobs.front();
+            seg->jobs.pop_front();
+        }
+        // 取出任务后立即唤醒可能在等待空位的复用线程
+        seg->cond.notify_all();
+
+        int32_t ret = write_file(job.path, job.data, job.size);
+        av_free(job.data);
+        if (ret < 0) {
+            std::lock_guard<std::mutex> lock(seg->mutex);
+            seg->io_error = true;
+            seg->cond.notify_all();
+        }
+    }
+}
+
+// 把 data 的所有权交给 IO 线程。队列已满时等待，写盘慢时由此限制复用速度和内存占用
+static int32_t submit(segmenter* seg, const std::string& path, uint8_t* data, size_t size)
+{
+    std::unique_lock<std::mutex> lock(seg->mutex);
+    if (seg->jobs.size() >= seg->max_pending) {
+        auto wait_start = std::chrono::steady_clock::now();
+        seg->cond.wait(lock, [seg] { return seg->jobs.size() < seg->max_pending || seg->io_error; });
+        seg->stalls++;
+        seg->stall_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                              wait_start).count();
+    }
+
+    if (seg->io_error) {
+        lock.unlock();
+        av_free(data);
+        return -1;
+    }
+
+    seg->jobs.push_back(io_job{ path, data, size });
+    seg->bytes += size;
+    lock.unlock();
+    seg->cond.notify_all();
+    return 0;
+}
+
+// 取走内存输出中已写出的数据并提交，之后内存输出从空缓冲区重新开始，不需要拷贝。
+// 返回提交的字节数，没有数据时返回 0
+static int64_t submit_output(segmenter* seg, const std::string& path)
+{
+    avio_flush(seg->ofmt_ctx->pb);
+    if (seg->out.size == 0) {
+        return 0;
+    }
+
+    uint8_t* data = seg->out.data;
+    size_t size = seg->out.size;
+    seg->out.data = nullptr;
+    seg->out.capacity = 0;
+    seg->out.size = 0;
+    seg->out.pos = 0;
+    return submit(seg, path, data, size) < 0 ? -1 : (int64_t)size;
+}
+
+segmenter* alloc_segmenter(AVFormatContext* ofmt_ctx, const char* output_file, segment_format format,
+                           int32_t segment_duration_ms, int32_t ref_stream, int32_t max_pending)
+{
+    segmenter* seg = new (std::nothrow) segmenter;
+    if (seg == nullptr) {
+        LOGE("alloc segmenter fail\n");
+        return nullptr;
+    }
+
+    seg->ofmt_ctx = ofmt_ctx;
+    seg->format = format;
+    seg->playlist_path = output_file;
+    seg->segment_duration_ms = segment_duration_ms > 0 ? segment_duration_ms : 6000;
+    seg->ref_stream = ref_stream;
+    seg->max_pending = max_pending > 0 ? max_pending : 4;
+
+    const char* slash = strrchr(output_file, '/');
+    const char* name = slash != nullptr ? slash + 1 : output_file;
+    seg->dir.assign(output_file, name - output_file);
+    seg->base = name;
+    seg->base.erase(seg->base.rfind('.'));
+
+    if (open_mem_output(&seg->out, &ofmt_ctx->pb, 0) < 0) {
+        LOGE("open segment output fail\n");
+        delete seg;
+        return nullptr;
+    }
+    seg->out_opened = true;
+    // 段数据交出后不能再回写，声明为不可 seek，muxer 不会 seek 回已写出的位置
+    ofmt_ctx->pb->seekable = 0;
+
+    seg->thread = std::thread(io_thread, seg);
+
+    LOGI("%s output, segment duration: %d ms, segments: %s%s_<n>.m4s\n", format == SEGMENT_FORMAT_HLS ? "hls" : "dash",
+         seg->segment_duration_ms, seg->dir.c_str(), seg->base.c_str());
+    return seg;
+}
+
+int32_t segmenter_header_options(segmenter* seg, int32_t cmaf, AVDictionary** header_opts)
+{
+    // frag_custom：只在 av_write_frame(ctx, nullptr) 时结束分片，分片边界完全由切段决定
+    const char* movflags = cmaf ? "+frag_custom+empty_moov+default_base_moof+skip_trailer+cmaf"
+                                : "+frag_custom+empty_moov+default_base_moof+skip_trailer";
+    if (av_dict_set(header_opts, "movflags", movflags, 0) < 0) {
+        LOGE("set segment options fail\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int32_t segmenter_write_init(segmenter* seg)
+{
+    if (submit_output(seg, seg->dir + seg->base + "_init.mp4") <= 0) {
+        LOGE("write init segment fail\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int64_t packet_time(const AVPacket* pkt)
+{
+    return pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+}
+
+bool segmenter_should_cut(segmenter* seg, const AVPacket* pkt)
+{
+    int64_t ts = packet_time(pkt);
+    if (pkt->stream_index != seg->ref_stream || ts == AV_NOPTS_VALUE) {
+        return false;
+    }
+
+    if (!seg->started) {
+        seg->started = true;
+        seg->seg_start = ts;
+        seg->end_ts = ts;
+    }
+
+    AVRational tb = seg->ofmt_ctx->streams[seg->ref_stream]->time_base;
+    bool cut = (pkt->flags & AV_PKT_FLAG_KEY) &&
+               ts - seg->seg_start >= av_rescale_q(seg->segment_duration_ms, (AVRational){ 1, 1000 }, tb);
+
+    if (ts + pkt->duration > seg->end_ts) {
+        seg->end_ts = ts + pkt->duration;
+    }
+    return cut;
+}
+
+// 结束 muxer 当前的分片，作为一段交给 IO 线程
+static int32_t close_segment(segmenter* seg, int64_t end)
+{
+    if (av_write_frame(seg->ofmt_ctx, nullptr) < 0) {
+        LOGE("flush fragment fail\n");
+        return -1;
+    }
+
+    std::string path = seg->dir + seg->base + "_" + std::to_string(seg->segments.size()) + ".m4s";
+    int64_t size = submit_output(seg, path);
+    if (size < 0) {
+        return -1;
+    }
+
+    if (size > 0) {
+        seg->segments.push_back(segment_info{ seg->seg_start, end - seg->seg_start, (size_t)size });
+        LOGD("segment %s, %jd bytes\n", path.c_str(), size);
+    }
+    return 0;
+}
+
+int32_t segmenter_cut(segmenter* seg, const AVPacket* pkt)
+{
+    int64_t ts = packet_time(pkt);
+    if (close_segment(seg, ts) < 0) {
+        return -1;
+    }
+
+    seg->seg_start = ts;
+    return 0;
+}
+
+// RFC 6381 的 codecs 参数，DASH 清单中用于播放器判断能否解码
+static std::string codec_string(const AVCodecParameters* par)
+{
+    char buf[64] = { 0 };
+    switch (par->codec_id) {
+    case AV_CODEC_ID_HEVC:
+        // 前缀与 init 分片中的样本描述一致，profile_tier_level 取自 extradata
+        if (hevc_codec_string(par, buf, sizeof(buf)) < 0) {
+            LOGW("no HEVC SPS in extradata, codecs omitted from manifest\n");
+            buf[0] = 0;
+        }
+        break;
+    case AV_CODEC_ID_H264:
+        snprintf(buf, sizeof(buf), "avc1.%02X00%02X", par->profile > 0 ? par->profile : 100,
+                 par->level > 0 ? par->level : 40);
+        break;
+    case AV_CODEC_ID_AAC:
+        // profile 为 audio object type 减 1
+        snprintf(buf, sizeof(buf), "mp4a.40.%d", par->profile >= 0 ? par->profile + 1 : 2);
+        break;
+    default:
+        break;
+    }
+    return buf;
+}
+
+static std::string hls_playlist(const segmenter* seg, AVRational tb)
+{
+    double max_duration = 0;
+    for (const segment_info& s : seg->segments) {
+        max_duration = fmax(max_duration, s.duration * av_q2d(tb));
+    }
+
+    std::string text = "#EXTM3U\n#EXT-X-VERSION:7\n";
+    text += "#EXT-X-TARGETDURATION:" + std::to_string((int64_t)ceil(max_duration)) + "\n";
+    text += "#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-PLAYLIST-TYPE:VOD\n#EXT-X-INDEPENDENT-SEGMENTS\n";
+    text += "#EXT-X-MAP:URI=\"" + seg->base + "_init.mp4\"\n";
+
+    char line[64];
+    for (size_t i = 0; i < seg->segments.size(); i++) {
+        snprintf(line, sizeof(line), "#EXTINF:%.6f,\n", seg->segments[i].duration * av_q2d(tb));
+        text += line;
+        text += seg->base + "_" + std::to_string(i) + ".m4s\n";
+    }
+    text += "#EXT-X-ENDLIST\n";
+    return text;
+}
+
+// 所有流复用在同一个 Representation 中，时间线以参考流的 time_base 为 timescale
+static std::string dash_manifest(const segmenter* seg, AVRational tb)
+{
+    int64_t total_duration = 0;
+    int64_t total_size = 0;
+    for (const segment_info& s : seg->segments) {
+        total_duration += s.duration;
+        total_size += s.size;
+    }
+    double seconds = total_duration * av_q2d(tb);
+    int64_t bandwidth = seconds > 0 ? (int64_t)(total_size * 8 / seconds) : 0;
+
+    std::string codecs;
+    std::string size_attrs;
+    for (unsigned int i = 0; i < seg->ofmt_ctx->nb_streams; i++) {
+        const AVCodecParameters* par = seg->ofmt_ctx->streams[i]->codecpar;
+        std::string codec = codec_string(par);
+        if (!codec.empty()) {
+            codecs += (codecs.empty() ? "" : ",") + codec;
+        }
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO && size_attrs.empty()) {
+            size_attrs = " width=\"" + std::to_string(par->width) + "\" height=\"" + std::to_string(par->height) + "\"";
+        }
+    }
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+             "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+             "type=\"static\" mediaPresentationDuration=\"PT%.3fS\" minBufferTime=\"PT%dS\">\n"
+             "  <Period id=\"0\" start=\"PT0S\">\n"
+             "    <AdaptationSet id=\"0\" segmentAlignment=\"true\" startWithSAP=\"1\">\n",
+             seconds, (seg->segment_duration_ms + 999) / 1000);
+    std::string text = buf;
+    text += "      <Representation id=\"0\" mimeType=\"" + std::string(size_attrs.empty() ? "audio" : "video") +
+            "/mp4\" codecs=\"" + codecs + "\" bandwidth=\"" + std::to_string(bandwidth) + "\"" + size_attrs + ">\n";
+    text += "        <SegmentTemplate timescale=\"" + std::to_string(tb.den / tb.num) + "\" initialization=\"" +
+            seg->base + "_init.mp4\" media=\"" + seg->base + "_$Number$.m4s\" startNumber=\"0\">\n";
+    text += "          <SegmentTimeline>\n";
+    for (const segment_info& s : seg->segments) {
+        text += "            <S t=\"" + std::to_string(s.start) + "\" d=\"" + std::to_string(s.duration) + "\" />\n";
+    }
+    text += "          </SegmentTimeline>\n        </SegmentTemplate>\n      </Representation>\n"
+            "    </AdaptationSet>\n  </Period>\n</MPD>\n";
+    return text;
+}
+
+static void stop_io_thread(segmenter* seg)
+{
+    if (!seg->thread.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(seg->mutex);
+        seg->stop = true;
+    }
+    seg->cond.notify_all();
+    seg->thread.join();
+}
+
+int32_t segmenter_finish(segmenter* seg)
+{
+    if (close_segment(seg, seg->end_ts) < 0) {
+        stop_io_thread(seg);
+        return -1;
+    }
+
+    AVRational tb = seg->ofmt_ctx->streams[seg->ref_stream]->time_base;
+    std::string text = seg->format == SEGMENT_FORMAT_HLS ? hls_playlist(seg, tb) : dash_manifest(seg, tb);
+    uint8_t* data = (uint8_t*)av_malloc(text.size());
+    if (data == nullptr) {
+        stop_io_thread(seg);
+        return -1;
+    }
+    memcpy(data, text.data(), text.size());
+    int32_t ret = submit(seg, seg->playlist_path, data, text.size());
+
+    // 等待所有段和播放列表写完
+    stop_io_thread(seg);
+    if (ret < 0 || seg->io_error) {
+        LOGE("write segments of %s fail\n", seg->playlist_path.c_str());
+        return -1;
+    }
+
+    LOG_AT(LOG_LEVEL_COUNTERS, "%s: %zu segments, %jd bytes, mux thread waited for io %jd times (%.3f ms)\n",
+           seg->playlist_path.c_str(), seg->segments.size(), seg->bytes, seg->stalls, seg->stall_ns / 1e6);
+    return 0;
+}
+
+void free_segmenter(segmenter** seg)
+{
+    if (seg == nullptr || *seg == nullptr) {
+        return;
+    }
+
+    segmenter* s = *seg;
+    stop_io_thread(s);
+    for (io_job& job : s->jobs) {
+        av_free(job.data);
+    }
+
+    if (s->out_opened) {
+        close_mem_output(&s->out, &s->ofmt_ctx->pb);
+    }
+    delete s;
+    *seg = nullptr;
+}
@@ -0,0 +1,52 @@
+//
+// HLS / DASH 分段输出。muxer 以 fragmented MP4 写到内存，每段为一个从关键帧开始的分片（moof + mdat），
+// 头部（ftyp + moov）为初始化段。切段时只把内存缓冲区的所有权交给后台 IO 线程，由它写文件，
+// 复用线程不会因为关闭、flush 段文件而阻塞。全部段写完后生成 m3u8 播放列表或 mpd 清单
+//
+
+#ifndef SEGMENTER_H
+#define SEGMENTER_H
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+enum segment_format {
+    SEGMENT_FORMAT_NONE = 0,
+    SEGMENT_FORMAT_HLS,  ///< .m3u8 媒体播放列表，段为 fMP4（EXT-X-MAP 指向初始化段）
+    SEGMENT_FORMAT_DASH, ///< .mpd 静态清单，SegmentTemplate + SegmentTimeline
+};
+
+// 按输出文件的扩展名判断是否分段输出，.m3u8 为 HLS，.mpd 为 DASH，其他返回 SEGMENT_FORMAT_NONE
+segment_format segment_format_from_path(const char* output_file);
+
+typedef struct segmenter segmenter;
+
+// 段文件与 output_file 位于同一目录，命名为 <output 去掉扩展名>_init.mp4 和 <output 去掉扩展名>_<序号>.m4s。
+// ofmt_ctx 应为 mp4 输出且还未打开 pb，这里将 pb 设为内存输出。ref_stream 为按关键帧切段的参考流，一般为视频流。
+// max_pending 为等待写文件的段数上限，写盘跟不上时复用线程在切段处等待，内存占用不超过 max_pending 个段
+segmenter* alloc_segmenter(AVFormatContext* ofmt_ctx, const char* output_file, segment_format format,
+                           int32_t segment_duration_ms, int32_t ref_stream, int32_t max_pending);
+
+// avformat_write_header 的选项：只在显式 flush 时结束分片，不写 mfra 等尾部信息
+int32_t segmenter_header_options(segmenter* seg, int32_t cmaf, AVDictionary** header_opts);
+
+// avformat_write_header 之后调用，把已写出的 ftyp + moov 作为初始化段
+int32_t segmenter_write_init(segmenter* seg);
+
+// 写入每个包之前调用。pkt 是参考流上的关键帧、且当前段已不短于段时长时返回 true，
+// 调用方应先写出交错队列中的包，再调用 segmenter_cut 切段
+bool segmenter_should_cut(segmenter* seg, const AVPacket* pkt);
+
+// 结束当前段并交给 IO 线程，下一段从 pkt 开始
+int32_t segmenter_cut(segmenter* seg, const AVPacket* pkt);
+
+// 所有包写完（交错队列也已清空）后调用：结束最后一段，写播放列表或清单，等待 IO 线程写完全部文件。
+// 任一文件写入失败时返回 -1
+int32_t segmenter_finish(segmenter* seg);
+
+// 结束 IO 线程并释放内存输出，ofmt_ctx->pb 被置为 nullptr
+void free_segmenter(segmenter** seg);
+
+#endif
@@ -0,0 +1,116 @@
+//
+// 有界无锁单生产者单消费者队列
+//
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// 只允许一个线程调用 push 系列函数、另一个线程调用 pop 系列函数。
+// 读写下标分别只由一方修改，借助 acquire/release 语义同步，不需要加锁
+template <typename T>
+class spsc_queue {
+public:
+    explicit spsc_queue(size_t capacity)
+    {
+        // 容量向上取整为 2 的幂，下标取模可以用位与代替
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    bool try_push(const T& value)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ > mask_) {
+            // 生产者缓存消费者的下标，只有看起来队列已满时才重新读取，减少跨核缓存行的同步
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ > mask_) {
+                return false;
+            }
+        }
+
+        slots_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_cache_) {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if (head == tail_cache_) {
+                return false;
+            }
+        }
+
+        value = slots_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 队列满时等待，直到写入成功或 abort 被置位，abort 时返回 false
+    bool push_wait(const T& value, const std::atomic<bool>& abort)
+    {
+        for (uint32_t spins = 0; !try_push(value); spins++) {
+            if (abort.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            backoff(spins);
+        }
+        return true;
+    }
+
+    // 队列空时等待，直到读到数据，或 done 被置位且队列已经读空，后一种情况返回 false。
+    // done 由生产者在写入最后一个元素之后置位
+    bool pop_wait(T& value, const std::atomic<bool>& done)
+    {
+        for (uint32_t spins = 0; !try_pop(value); spins++) {
+            if (done.load(std::memory_order_acquire)) {
+                // 生产者置位 done 之前写入的数据此时一定可见，再检查一次
+                return try_pop(value);
+            }
+            backoff(spins);
+        }
+        return true;
+    }
+
+    size_t capacity() const
+    {
+        return mask_ + 1;
+    }
+
+private:
+    // 先自旋，再让出 CPU，等待时间较长时短暂休眠，避免一方阻塞在 IO 上时另一方空转占满一个核
+    static void backoff(uint32_t spins)
+    {
+        if (spins < 64) {
+            return;
+        }
+        if (spins < 128) {
+            std::this_thread::yield();
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    std::vector<T> slots_;
+    size_t mask_ = 0;
+
+    alignas(64) std::atomic<size_t> head_{0}; ///< 消费者下标，只由消费者修改
+    size_t tail_cache_ = 0;                   ///< 消费者缓存的生产者下标
+    alignas(64) std::atomic<size_t> tail_{0}; ///< 生产者下标，只由生产者修改
+    size_t head_cache_ = 0;                   ///< 生产者缓存的消费者下标
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include "fanout.h"
+#include <new>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../log.h"
+#include "../spsc_queue.h"
+#include "pacer.h"
+
+static const AVRational ns_time_base = { 1, 1000000000 };
+
+// 一路输出。读线程把共享同一块数据的 AVPacket 写入 packets 队列，发送线程用完后把 AVPacket 结构
+// 通过 free_packets 还给读线程。free_packets 中预先放入 queue_depth 个包，读线程取不到空闲包即说明这一路积压已满
+struct fanout_output {
+    const char* url = nullptr;
+    rtp_output_options out_opts;
+    std::string metrics_prefix; ///< 各路输出的统计写到不同的文件
+    rtp_output out;
+    spsc_queue<AVPacket*>* packets = nullptr;
+    spsc_queue<AVPacket*>* free_packets = nullptr;
+    std::thread thread;
+    std::atomic<bool> done{false};   ///< 读线程已结束，之后不会再写入 packets
+    std::atomic<bool> failed{false}; ///< 这一路打开或发送失败，读线程不再向其写入
+    int32_t result = 0;
+
+    // 以下只由读线程访问
+    bool waiting_key = false; ///< 丢过包之后等到下一个关键帧再继续写入，避免接收端解出花屏
+    int64_t dropped = 0;
+};
+
+void init_fanout_options(fanout_options* opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    init_rtp_output_options(&opts->out_opts);
+    opts->queue_depth = 64;
+    opts->lead_ns = 100 * 1000000LL;
+}
+
+static void output_thread(fanout_output* output, const AVStream* in_stream)
+{
+    output->result = open_rtp_output(&output->out, output->url, in_stream, &output->out_opts);
+    if (output->result < 0) {
+        LOGE("%s: open fail, the other outputs continue\n", output->url);
+        output->failed.store(true, std::memory_order_relaxed);
+        close_rtp_output(&output->out);
+        return;
+    }
+
+    AVPacket* pkt = nullptr;
+    while (output->packets->pop_wait(pkt, output->done)) {
+        output->result = rtp_output_send(&output->out, pkt);
+        av_packet_unref(pkt);
+        output->free_packets->try_push(pkt);
+        if (output->result < 0) {
+            LOGE("%s: send fail, the other outputs continue\n", output->url);
+            output->failed.store(true, std::memory_order_relaxed);
+            break;
+        }
+    }
+
+    close_rtp_output(&output->out);
+}
+
+static int32_t start_output(fanout_output* output, int32_t index, const char* url, const AVStream* in_stream,
+                            const fanout_options* opts)
+{
+    output->url = url;
+    output->out_opts = opts->out_opts;
+    if (opts->out_opts.metrics_prefix != nullptr) {
+        output->metrics_prefix = std::string(opts->out_opts.metrics_prefix) + "." + std::to_string(index);
+        output->out_opts.metrics_prefix = output->metrics_prefix.c_str();
+    }
+    memset(&output->out, 0, sizeof(output->out));
+    output->packets = new (std::nothrow) spsc_queue<AVPacket*>(opts->queue_depth);
+    output->free_packets = new (std::nothrow) spsc_queue<AVPacket*>(opts->queue_depth);
+    if (output->packets == nullptr || output->free_packets == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+
+    for (int32_t i = 0; i < opts->queue_depth; i++) {
+        AVPacket* pkt = av_packet_alloc();
+        if (pkt == nullptr) {
+            return AVERROR(ENOMEM);
+        }
+        output->free_packets->try_push(pkt);
+    }
+
+    output->thread = std::thread(output_thread, output, in_stream);
+    return 0;
+}
+
+static void stop_output(fanout_output* output)
+{
+    output->done.store(true, std::memory_order_release);
+    if (output->thread.joinable()) {
+        output->thread.join();
+    }
+
+    AVPacket* pkt = nullptr;
+    while (output->packets != nullptr && output->packets->try_pop(pkt)) {
+        av_packet_free(&pkt);
+    }
+    while (output->free_packets != nullptr && output->free_packets->try_pop(pkt)) {
+        av_packet_free(&pkt);
+    }
+    delete output->packets;
+    delete output->free_packets;
+    output->packets = nullptr;
+    output->free_packets = nullptr;
+
+    LOG_AT(LOG_LEVEL_COUNTERS, "%s: %s, dropped %jd packets\n", output->url,
+           output->failed.load() ? "failed" : "finished", output->dropped);
+}
+
+// 把 pkt 的一个引用交给一路输出。这一路积压已满时丢弃，并一直丢到下一个关键帧
+static void dispatch(fanout_output* output, const AVPacket* pkt)
+{
+    bool key = pkt->flags & AV_PKT_FLAG_KEY;
+    if (output->waiting_key && !key) {
+        output->dropped++;
+        return;
+    }
+
+    AVPacket* ref = nullptr;
+    if (!output->free_packets->try_pop(ref)) {
+        if (!output->waiting_key) {
+            LOGW("%s: falling behind, drop packets until next keyframe\n", output->url);
+        }
+        output->waiting_key = true;
+        output->dropped++;
+        return;
+    }
+
+    // 只增加数据的引用计数，不复制数据
+    if (av_packet_ref(ref, pkt) < 0) {
+        output->free_packets->try_push(ref);
+        output->dropped++;
+        return;
+    }
+
+    output->waiting_key = false;
+    output->packets->try_push(ref);
+}
+
+int32_t run_fanout(AVFormatContext* ifmt_ctx, int32_t video_index, ts_generator* video_ts, const char* const* urls,
+                   int32_t url_num, const fanout_options* opts)
+{
+    AVStream* in_stream = ifmt_ctx->streams[video_index];
+    std::vector<fanout_output*> outputs;
+    int32_t ret = 0;
+
+    for (int32_t i = 0; i < url_num && ret >= 0; i++) {
+        fanout_output* output = new (std::nothrow) fanout_output;
+        if (output == nullptr) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        outputs.push_back(output);
+        ret = start_output(output, i, urls[i], in_stream, opts);
+    }
+
+    // 读线程按时间戳提前 lead_ns 读入，各路输出再按各自的 pacer 精确发送
+    pacer read_pacer;
+    pacer_init(&read_pacer, 0, opts->out_opts.max_lateness_ns);
+
+    // 读取阶段的耗时由读线程单独统计，写到 <prefix>.input
+    mux_metrics* read_metrics = nullptr;
+    std::string read_metrics_prefix;
+    int64_t next_dump_ns = 0;
+    if (opts->out_opts.metrics_prefix != nullptr) {
+        read_metrics_prefix = std::string(opts->out_opts.metrics_prefix) + ".input";
+        read_metrics = new (std::nothrow) mux_metrics;
+        if (read_metrics != nullptr) {
+            mux_metrics_init(read_metrics, ifmt_ctx->url);
+            next_dump_ns = read_metrics->start_ns + opts->out_opts.metrics_interval_ns;
+        }
+    }
+
+    AVPacket* pkt = av_packet_alloc();
+    if (pkt == nullptr) {
+        ret = AVERROR(ENOMEM);
+    }
+
+    while (ret >= 0) {
+        int64_t read_start = read_metrics != nullptr ? mux_metrics_now() : 0;
+        ret = av_read_frame(ifmt_ctx, pkt);
+        if (ret < 0) {
+            break;
+        }
+
+        if (read_metrics != nullptr) {
+            int64_t now = mux_metrics_now();
+            mux_metrics_record(read_metrics, MUX_STAGE_READ, now - read_start);
+            if (opts->out_opts.metrics_interval_ns > 0 && now >= next_dump_ns) {
+                mux_metrics_dump(read_metrics, read_metrics_prefix.c_str());
+                next_dump_ns += opts->out_opts.metrics_interval_ns;
+            }
+        }
+
+        if (pkt->stream_index != video_index) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        // FIX：No PTS (Example: Raw H.264)
+        if (pkt->pts == AV_NOPTS_VALUE) {
+            ts_generator_fill(video_ts, pkt);
+        }
+
+        if (opts->out_opts.pacing) {
+            int64_t deadline_ns = pacer_deadline(&read_pacer, av_rescale_q(pkt->dts, in_stream->time_base, ns_time_base));
+            pacer_wait_until(&read_pacer, deadline_ns - opts->lead_ns);
+        }
+
+        int32_t alive = 0;
+        for (fanout_output* output : outputs) {
+            if (!output->failed.load(std::memory_order_relaxed)) {
+                dispatch(output, pkt);
+                alive++;
+            }
+        }
+        av_packet_unref(pkt);
+
+        if (alive == 0) {
+            LOGE("all outputs failed\n");
+            ret = AVERROR(EIO);
+        }
+    }
+
+    av_packet_free(&pkt);
+    if (read_metrics != nullptr) {
+        mux_metrics_dump(read_metrics, read_metrics_prefix.c_str());
+        delete read_metrics;
+    }
+
+    int32_t failed = 0;
+    for (fanout_output* output : outputs) {
+        stop_output(output);
+        failed += output->failed.load() ? 1 : 0;
+        delete output;
+    }
+
+    if (ret == AVERROR_EOF && failed == url_num) {
+        ret = AVERROR(EIO);
+    }
+    return ret;
+}
@@ -0,0 +1,29 @@
+//
+// 一次解复用，多路输出：同一个输入的包以引用计数的方式共享给多个 RTP 输出
+//
+
+#ifndef FANOUT_H
+#define FANOUT_H
+#include <stdint.h>
+
+#include "../ts_generator.h"
+#include "rtp_output.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+typedef struct fanout_options {
+    rtp_output_options out_opts; ///< 每一路输出的发送参数，各路输出使用各自独立的 pacer
+    int32_t queue_depth;         ///< 每一路输出最多积压的包数，积压满时这一路丢包，不阻塞其他输出
+    int64_t lead_ns;             ///< 读线程比发送时间提前多少读入，给各路输出留出缓冲
+} fanout_options;
+
+void init_fanout_options(fanout_options* opts);
+
+// 从 ifmt_ctx 读取 video_index 流的包并同时发送到 urls 中的每一个地址，直到输入读完。
+// 每一路输出在独立的线程中打开和发送，某一路变慢或出错时只影响这一路。全部输出都失败时返回错误
+int32_t run_fanout(AVFormatContext* ifmt_ctx, int32_t video_index, ts_generator* video_ts, const char* const* urls,
+                   int32_t url_num, const fanout_options* opts);
+
+#endif
@@ -0,0 +1,102 @@
+#include "pacer.h"
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <time.h>
+
+#include "../log.h"
+
+int64_t pacer_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void pacer_init(pacer* p, int64_t spin_ns, int64_t max_lateness_ns)
+{
+    memset(p, 0, sizeof(*p));
+    p->spin_ns = spin_ns;
+    p->max_lateness_ns = max_lateness_ns;
+
+    // 默认 50us 的定时器松弛会直接叠加到每次唤醒的误差上，这里将其降到最小
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+}
+
+int64_t pacer_deadline(pacer* p, int64_t ts_ns)
+{
+    if (!p->started) {
+        p->start_ns = pacer_now_ns();
+        p->first_ts_ns = ts_ns;
+        p->started = true;
+    }
+
+    return p->start_ns + (ts_ns - p->first_ts_ns);
+}
+
+static void record(pacer* p, int64_t error_ns)
+{
+    p->samples++;
+    p->sum_ns += error_ns;
+    p->sum_sq_ns += (double)error_ns * error_ns;
+    p->max_late_ns = error_ns > p->max_late_ns ? error_ns : p->max_late_ns;
+
+    int64_t bucket = error_ns / PACER_HIST_BUCKET_NS;
+    p->hist[bucket < PACER_HIST_BUCKETS ? bucket : PACER_HIST_BUCKETS]++;
+}
+
+void pacer_wait_until(pacer* p, int64_t deadline_ns)
+{
+    int64_t sleep_until = deadline_ns - p->spin_ns;
+    if (sleep_until > pacer_now_ns()) {
+        struct timespec ts;
+        ts.tv_sec = sleep_until / 1000000000;
+        ts.tv_nsec = sleep_until % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+        }
+    }
+
+    int64_t now = pacer_now_ns();
+    while (now < deadline_ns) {
+        now = pacer_now_ns();
+    }
+
+    int64_t late_ns = now - deadline_ns;
+    record(p, late_ns);
+
+    // 严重落后时（例如进程被挂起）不再追赶已经错过的截止时间，而是把时间线整体后移，
+    // 否则后续所有已到期的包会被立即连续发出，形成突发
+    if (p->max_lateness_ns > 0 && late_ns > p->max_lateness_ns) {
+        p->start_ns += late_ns;
+        p->realigns++;
+    }
+}
+
+// 返回误差分布的 q 分位数（上界），单位微秒
+static double percentile_us(const pacer* p, double q)
+{
+    int64_t target = (int64_t)ceil(p->samples * q);
+    int64_t count = 0;
+    for (int32_t i = 0; i <= PACER_HIST_BUCKETS; i++) {
+        count += p->hist[i];
+        if (count >= target) {
+            return (i + 1) * (PACER_HIST_BUCKET_NS / 1000.0);
+        }
+    }
+    return PACER_HIST_BUCKETS * (PACER_HIST_BUCKET_NS / 1000.0);
+}
+
+void pacer_report(const pacer* p)
+{
+    if (p->samples == 0) {
+        return;
+    }
+
+    double mean = (double)p->sum_ns / p->samples;
+    double stddev = sqrt(fmax(p->sum_sq_ns / p->samples - mean * mean, 0.0));
+    LOG_AT(LOG_LEVEL_COUNTERS, "send jitter: samples %jd mean %.1f us stddev %.1f us p50 <%.0f us p99 <%.0f us "
+           "p99.9 <%.0f us max %.1f us realigns %jd\n",
+           p->samples, mean / 1000, stddev / 1000, percentile_us(p, 0.5), percentile_us(p, 0.99),
+           percentile_us(p, 0.999), p->max_late_ns / 1000.0, p->realigns);
+}
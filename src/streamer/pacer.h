@@ -0,0 +1,44 @@
+//
+// 基于单调时钟和绝对截止时间的发送节奏控制
+//
+
+#ifndef PACER_H
+#define PACER_H
+#include <stdint.h>
+
+// 发送时间误差统计的直方图，每个桶 10us，最后一个桶记录所有超出范围的样本
+#define PACER_HIST_BUCKET_NS 10000
+#define PACER_HIST_BUCKETS 2000
+
+typedef struct pacer {
+    int64_t start_ns;        ///< 时间线起点（单调时钟），对应第一个包的时间戳
+    int64_t first_ts_ns;     ///< 第一个包的时间戳，换算为纳秒
+    bool started;
+    int64_t spin_ns;         ///< 距截止时间不足 spin_ns 时改为忙等，用于进一步降低唤醒误差
+    int64_t max_lateness_ns; ///< 落后超过该值时重新对齐时间线，避免睡过头之后连续突发发送
+
+    // 实际发送时间相对截止时间的误差统计
+    int64_t samples;
+    int64_t sum_ns;
+    double sum_sq_ns;
+    int64_t max_late_ns;
+    int64_t realigns;
+    int64_t hist[PACER_HIST_BUCKETS + 1];
+} pacer;
+
+// 单调时钟的当前时间，单位纳秒
+int64_t pacer_now_ns();
+
+void pacer_init(pacer* p, int64_t spin_ns, int64_t max_lateness_ns);
+
+// 计算时间戳 ts_ns 对应的绝对截止时间，第一次调用时以当前时间作为时间线起点
+int64_t pacer_deadline(pacer* p, int64_t ts_ns);
+
+// 等待到绝对截止时间 deadline_ns 并记录实际唤醒时间的误差。
+// 使用 clock_nanosleep(TIMER_ABSTIME)，每次等待的误差不会累积到后续的包
+void pacer_wait_until(pacer* p, int64_t deadline_ns);
+
+// 输出发送时间误差统计
+void pacer_report(const pacer* p);
+
+#endif
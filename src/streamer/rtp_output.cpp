@@ -0,0 +1,277 @@
+#include "rtp_output.h"
+#include <new>
+#include <string.h>
+
+static const AVRational ns_time_base = { 1, 1000000000 };
+
+// 平滑发送时只使用帧间隔的一部分，为下一帧留出余量
+#define SMOOTH_SPREAD_NUM 4
+#define SMOOTH_SPREAD_DEN 5
+
+static const char* send_mode_names[] = { "avio", "sendmmsg", "gso" };
+
+int32_t rtp_send_mode_parse(const char* name)
+{
+    for (int32_t i = 0; i < (int32_t)(sizeof(send_mode_names) / sizeof(send_mode_names[0])); i++) {
+        if (strcmp(name, send_mode_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char* rtp_send_mode_name(rtp_send_mode mode)
+{
+    return send_mode_names[mode];
+}
+
+void init_rtp_output_options(rtp_output_options* opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->send_mode = RTP_SEND_AVIO;
+    opts->pacing = 1;
+    opts->smoothing = 0;
+    opts->smooth_min_packets = 4;
+    opts->spin_ns = 0;
+    opts->max_lateness_ns = 100 * 1000000LL;
+    opts->metrics_prefix = nullptr;
+    opts->metrics_interval_ns = 10 * 1000000000LL;
+}
+
+// rtp muxer 每生成一个 RTP 包就 flush 一次 AVIOContext，因此这里每次调用恰好对应一个 RTP 包
+static int write_rtp_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+    rtp_output* out = (rtp_output*)opaque;
+    int64_t start = out->metrics != nullptr ? mux_metrics_now() : 0;
+
+    if (out->smoothing_au) {
+        pacer_wait_until(&out->send_pacer, out->au_deadline_ns + out->au_sent * out->slot_ns);
+    }
+    out->au_sent++;
+    out->rtp_packets++;
+
+    int64_t send_start = out->metrics != nullptr ? mux_metrics_now() : 0;
+    bool sent = true;
+    int32_t ret = buf_size;
+    if (out->opts.send_mode != RTP_SEND_AVIO) {
+        // 批量模式下整帧的包在 rtp_output_send 中一次发出，平滑发送时每个包都要按时发出，不能缓存
+        ret = udp_batch_sender_queue(&out->sender, buf, buf_size);
+        sent = out->smoothing_au;
+        if (ret >= 0 && out->smoothing_au) {
+            ret = udp_batch_sender_flush(&out->sender);
+        }
+        ret = ret < 0 ? ret : buf_size;
+    } else {
+        avio_write(out->url_pb, buf, buf_size);
+        avio_flush(out->url_pb);
+        ret = out->url_pb->error < 0 ? out->url_pb->error : buf_size;
+    }
+
+    if (out->metrics != nullptr) {
+        // 平滑发送的等待和实际发送都不属于封装耗时，从 av_write_frame 的耗时中扣除
+        int64_t now = mux_metrics_now();
+        out->excluded_ns += now - start;
+        if (sent) {
+            mux_metrics_record(out->metrics, MUX_STAGE_WRITE, now - send_start);
+        }
+    }
+
+    return ret;
+}
+
+int32_t open_rtp_output(rtp_output* out, const char* url, const AVStream* in_stream, const rtp_output_options* opts)
+{
+    memset(out, 0, sizeof(*out));
+    out->sender.fd = -1;
+    out->opts = *opts;
+    if (opts->metrics_prefix != nullptr) {
+        out->metrics = new (std::nothrow) mux_metrics;
+        if (out->metrics != nullptr) {
+            mux_metrics_init(out->metrics, url);
+            out->metrics_stream = mux_metrics_add_stream(out->metrics, "video");
+            out->next_dump_ns = out->metrics->start_ns + opts->metrics_interval_ns;
+        }
+    }
+    out->in_time_base = in_stream->time_base;
+    pacer_init(&out->send_pacer, opts->spin_ns, opts->max_lateness_ns);
+
+    AVRational rate = in_stream->r_frame_rate.num > 0 ? in_stream->r_frame_rate : (AVRational){25, 1};
+    out->default_interval_ns = av_rescale(1000000000, rate.den, rate.num);
+
+    int32_t ret = avformat_alloc_output_context2(&out->ofmt_ctx, nullptr, "rtp", url);
+    if (out->ofmt_ctx == nullptr) {
+        LOGE("Could not create output context\n");
+        return ret < 0 ? ret : AVERROR_UNKNOWN;
+    }
+
+    AVStream* out_stream = avformat_new_stream(out->ofmt_ctx, nullptr);
+    if (out_stream == nullptr) {
+        LOGE("Failed allocating output stream\n");
+        return AVERROR_UNKNOWN;
+    }
+
+    // 复制 AVCodecContext 的设置
+    ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
+    if (ret < 0) {
+        LOGE("Failed to copy context from input to output stream codec context\n");
+        return ret;
+    }
+
+    av_dump_format(out->ofmt_ctx, 0, url, 1);
+
+    // 打开输出 URL。批量模式下由自己的 socket 发送，不经过 rtp:// 协议
+    int32_t max_packet_size = 0;
+    if (opts->send_mode != RTP_SEND_AVIO) {
+        udp_batch_mode mode = opts->send_mode == RTP_SEND_GSO ? UDP_BATCH_GSO : UDP_BATCH_SENDMMSG;
+        ret = open_udp_batch_sender(&out->sender, url, mode);
+        if (ret < 0) {
+            LOGE("Could not open output URL '%s'\n", url);
+            return ret;
+        }
+        max_packet_size = out->sender.max_packet_size;
+    } else {
+        ret = avio_open(&out->url_pb, url, AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            LOGE("Could not open output URL '%s'\n", url);
+            return ret;
+        }
+        max_packet_size = out->url_pb->max_packet_size > 0 ? out->url_pb->max_packet_size : 1472;
+    }
+
+    // 在 rtp muxer 与发送端之间插入自定义 AVIOContext，逐个 RTP 包控制发送时间。
+    // 缓冲区不小于最大包长，保证每次 flush 恰好交出一个完整的 RTP 包
+    uint8_t* buffer = (uint8_t*)av_malloc(max_packet_size);
+    if (buffer == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+
+    out->ofmt_ctx->pb = avio_alloc_context(buffer, max_packet_size, 1, out, nullptr, &write_rtp_packet, nullptr);
+    if (out->ofmt_ctx->pb == nullptr) {
+        av_free(buffer);
+        return AVERROR(ENOMEM);
+    }
+    out->ofmt_ctx->pb->max_packet_size = max_packet_size;
+
+    // 写文件头
+    ret = avformat_write_header(out->ofmt_ctx, nullptr);
+    if (ret < 0) {
+        LOGE("Error occurred when opening output URL\n");
+        return ret;
+    }
+    out->header_written = true;
+
+    stream_stats_init(&out->stats, url, out_stream->time_base.num, out_stream->time_base.den);
+    return 0;
+}
+
+int32_t rtp_output_send(rtp_output* out, AVPacket* pkt)
+{
+    AVStream* out_stream = out->ofmt_ctx->streams[0];
+
+    // 截止时间由时间戳相对第一个包的偏移直接算出，与之前每次等待的误差无关
+    int64_t deadline_ns = pacer_deadline(&out->send_pacer, av_rescale_q(pkt->dts, out->in_time_base, ns_time_base));
+    int64_t interval_ns = pkt->duration > 0 ? av_rescale_q(pkt->duration, out->in_time_base, ns_time_base)
+                                            : out->default_interval_ns;
+
+    // 估算这一帧会被拆成的 RTP 包数，包数较多的大帧（通常是 I 帧）平滑分散到帧间隔内发送
+    int32_t payload_size = out->ofmt_ctx->pb->max_packet_size - 12;
+    int32_t expected_packets = pkt->size / payload_size + 1;
+    out->smoothing_au = out->opts.pacing && out->opts.smoothing && expected_packets >= out->opts.smooth_min_packets;
+    out->au_sent = 0;
+    if (out->smoothing_au) {
+        out->au_deadline_ns = deadline_ns;
+        out->slot_ns = interval_ns * SMOOTH_SPREAD_NUM / SMOOTH_SPREAD_DEN / expected_packets;
+    } else if (out->opts.pacing) {
+        pacer_wait_until(&out->send_pacer, deadline_ns);
+    }
+
+    int64_t stage_start = out->metrics != nullptr ? mux_metrics_now() : 0;
+
+    // 转换PTS/DTS
+    pkt->pts = av_rescale_q_rnd(pkt->pts, out->in_time_base, out_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
+    pkt->dts = av_rescale_q_rnd(pkt->dts, out->in_time_base, out_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
+    pkt->duration = av_rescale_q(pkt->duration, out->in_time_base, out_stream->time_base);
+    pkt->pos = -1;
+    pkt->stream_index = 0;
+
+    stream_stats_add(&out->stats, pkt->pts, pkt->duration, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+
+    if (out->metrics != nullptr) {
+        int64_t now = mux_metrics_now();
+        mux_metrics_record(out->metrics, MUX_STAGE_TIMESTAMP, now - stage_start);
+        mux_metrics_count(out->metrics, out->metrics_stream, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+        stage_start = now;
+        out->excluded_ns = 0;
+    }
+
+    // 只有一路流，不需要交错，直接写出
+    int32_t ret = av_write_frame(out->ofmt_ctx, pkt);
+    out->smoothing_au = false;
+
+    if (out->metrics != nullptr) {
+        int64_t now = mux_metrics_now();
+        mux_metrics_record(out->metrics, MUX_STAGE_INTERLEAVE, now - stage_start - out->excluded_ns);
+        stage_start = now;
+    }
+
+    if (ret >= 0 && out->opts.send_mode != RTP_SEND_AVIO) {
+        bool pending = out->sender.count > 0;
+        ret = udp_batch_sender_flush(&out->sender);
+        if (out->metrics != nullptr && pending) {
+            mux_metrics_record(out->metrics, MUX_STAGE_WRITE, mux_metrics_now() - stage_start);
+        }
+    }
+
+    if (ret < 0) {
+        LOGE("Error muxing packet\n");
+    }
+
+    // 长时间推流时周期性地导出统计，不必等到结束
+    if (out->metrics != nullptr && out->opts.metrics_interval_ns > 0 && mux_metrics_now() >= out->next_dump_ns) {
+        mux_metrics_dump(out->metrics, out->opts.metrics_prefix);
+        out->next_dump_ns += out->opts.metrics_interval_ns;
+    }
+
+    return ret;
+}
+
+void close_rtp_output(rtp_output* out)
+{
+    if (out->ofmt_ctx == nullptr) {
+        delete out->metrics;
+        out->metrics = nullptr;
+        return;
+    }
+
+    if (out->header_written) {
+        // 写文件尾
+        av_write_trailer(out->ofmt_ctx);
+        stream_stats_print(&out->stats);
+        LOG_AT(LOG_LEVEL_COUNTERS, "%s: rtp packets %jd\n", out->stats.name, out->rtp_packets);
+        if (out->opts.send_mode != RTP_SEND_AVIO) {
+            udp_batch_sender_flush(&out->sender);
+            LOG_AT(LOG_LEVEL_COUNTERS, "%s: %s syscalls %jd errors %jd\n", out->stats.name,
+                   out->sender.mode == UDP_BATCH_GSO ? "gso" : "sendmmsg", out->sender.syscalls, out->sender.errors);
+        }
+        if (out->opts.pacing) {
+            pacer_report(&out->send_pacer);
+        }
+    }
+
+    if (out->ofmt_ctx->pb != nullptr) {
+        av_freep(&out->ofmt_ctx->pb->buffer);
+        avio_context_free(&out->ofmt_ctx->pb);
+    }
+
+    avio_closep(&out->url_pb);
+    close_udp_batch_sender(&out->sender);
+
+    if (out->metrics != nullptr) {
+        mux_metrics_dump(out->metrics, out->opts.metrics_prefix);
+        delete out->metrics;
+        out->metrics = nullptr;
+    }
+
+    avformat_free_context(out->ofmt_ctx);
+    out->ofmt_ctx = nullptr;
+}
@@ -0,0 +1,76 @@
+//
+// 按时间戳节奏发送的 RTP 输出
+//
+
+#ifndef RTP_OUTPUT_H
+#define RTP_OUTPUT_H
+#include <stdint.h>
+
+#include "../log.h"
+#include "../mux_metrics.h"
+#include "pacer.h"
+#include "udp_batch_sender.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+typedef enum rtp_send_mode {
+    RTP_SEND_AVIO,     ///< 经由 FFmpeg 的 rtp:// 协议发送，每个 RTP 包一次 sendto
+    RTP_SEND_SENDMMSG, ///< 一帧的 RTP 包缓存后用 sendmmsg 批量发送
+    RTP_SEND_GSO,      ///< 一帧的 RTP 包缓存后用 UDP GSO 发送，不支持时回退到 sendmmsg
+} rtp_send_mode;
+
+// 由名字 avio、sendmmsg、gso 得到发送方式，无效的名字返回 -1
+int32_t rtp_send_mode_parse(const char* name);
+const char* rtp_send_mode_name(rtp_send_mode mode);
+
+typedef struct rtp_output_options {
+    rtp_send_mode send_mode;
+    int32_t pacing;             ///< 为 0 时不按时间戳等待，尽快发送，用于测试吞吐量
+    int32_t smoothing;          ///< 非 0 时把大帧拆出的 RTP 包均匀分散到帧间隔内发送，而不是一次性突发
+    int32_t smooth_min_packets; ///< 一帧至少拆成多少个 RTP 包时才做平滑
+    int64_t spin_ns;            ///< 距截止时间不足该值时忙等
+    int64_t max_lateness_ns;    ///< 落后超过该值时重新对齐时间线
+    const char* metrics_prefix; ///< 非空时统计各阶段耗时，写出到 <metrics_prefix>.json 和 .prom
+    int64_t metrics_interval_ns; ///< 大于 0 时每隔该时长导出一次统计，否则只在结束时导出
+} rtp_output_options;
+
+void init_rtp_output_options(rtp_output_options* opts);
+
+typedef struct rtp_output {
+    rtp_output_options opts;
+    AVFormatContext* ofmt_ctx;
+    AVIOContext* url_pb;        ///< 实际发送数据的 rtp:// AVIOContext，ofmt_ctx->pb 是拦截每个 RTP 包的自定义 AVIOContext
+    udp_batch_sender sender;    ///< 批量发送模式下代替 url_pb
+    AVRational in_time_base;     ///< 输入包的时间基
+    int64_t default_interval_ns; ///< 包中没有 duration 时使用的帧间隔
+    pacer send_pacer;
+    bool header_written;
+
+    // 当前帧的平滑发送状态
+    bool smoothing_au;
+    int64_t au_deadline_ns;
+    int64_t slot_ns;
+    int32_t au_sent;
+
+    int64_t rtp_packets;
+    stream_stats stats;
+
+    // 分阶段耗时统计，读取阶段由调用者记录
+    mux_metrics* metrics;
+    int32_t metrics_stream;
+    int64_t next_dump_ns;
+    int64_t excluded_ns; ///< 本次 av_write_frame 期间等待与发送的耗时，不计入封装耗时
+} rtp_output;
+
+// 打开输出 url，in_stream 为要发送的输入流
+int32_t open_rtp_output(rtp_output* out, const char* url, const AVStream* in_stream, const rtp_output_options* opts);
+
+// 等待到 pkt 的发送时间后发送，pkt 的时间戳以输入流的时间基为单位，发送前会转换为输出流的时间基
+int32_t rtp_output_send(rtp_output* out, AVPacket* pkt);
+
+// 写文件尾、输出统计信息并释放资源
+void close_rtp_output(rtp_output* out);
+
+#endif
@@ -0,0 +1,492 @@
+/**
+* 本机回环上比较不同 RTP 发送方式的吞吐量和 CPU 占用。
+* 输入文件的视频包预先读入内存，每路流一个线程，不按时间戳等待、循环发送固定时长，
+* 另一个线程在 127.0.0.1 上接收所有流并统计收到的包数。
+* 按节奏发送模式（-P）下按时间戳发送，接收线程用内核的接收时间戳（SO_TIMESTAMPNS）计算
+* RFC 3550 的到达间隔抖动，验证发送时间的精度
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../log.h"
+#include "../ts_generator.h"
+#include "pacer.h"
+#include "rtp_output.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#define RECV_BATCH 64
+#define RECV_BUFFER_SIZE (8 * 1024 * 1024)
+// 视频 RTP 时间戳的时钟频率
+#define RTP_VIDEO_CLOCK_RATE 90000
+
+typedef struct bench_input {
+    AVFormatContext* ifmt_ctx;
+    AVStream* stream;
+    std::vector<AVPacket*> packets;
+    int64_t span; ///< 全部包覆盖的时长，循环发送时每一轮的时间戳加上该值，保持单调递增
+} bench_input;
+
+// 一路流的到达间隔抖动状态（RFC 3550 6.4.1），时间单位为纳秒
+typedef struct jitter_state {
+    bool has_prev;
+    int64_t prev_arrival_ns;
+    uint32_t prev_rtp_ts;
+    double jitter_ns; ///< J，每个包按 |D| 与 J 之差的 1/16 更新
+} jitter_state;
+
+typedef struct receive_result {
+    int64_t received;
+    bool measure_jitter;              ///< 按节奏发送时统计抖动，测吞吐量时只计数
+    bool kernel_timestamps;           ///< 使用内核的接收时间戳，不支持时在每批 recvmmsg 之后读取时钟
+    std::vector<jitter_state> streams;
+    std::vector<int64_t> transit_ns;  ///< 每个 RTP 包与上一个包的传输时间之差 |D|
+    std::vector<int64_t> jitter_ns;   ///< 每个 RTP 包到达后的 J
+} receive_result;
+
+typedef struct stream_result {
+    int64_t rtp_packets;
+    int64_t syscalls;
+    int64_t cpu_us;
+    int32_t ret;
+} stream_result;
+
+static void usage(const char* program_name)
+{
+    printf("usage: %s [-n streams] [-t seconds] [-p port] [-b mode] [-P] [-l level] input_file\n", program_name);
+    printf("  -n  number of streams sent at the same time, default 1\n");
+    printf("  -t  seconds each send mode runs, default 5\n");
+    printf("  -p  first udp port on 127.0.0.1, stream i uses port + 2 * i, default 20000\n");
+    printf("  -b  only run one send mode: avio, sendmmsg or gso, default runs all of them\n");
+    printf("  -P  send paced by timestamps and report the interarrival jitter seen by the receiver\n");
+    printf("  -l  log level: quiet, error, warn, counters, info, debug, trace, default counters\n");
+}
+
+static int64_t thread_cpu_us()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec +
+           usage.ru_stime.tv_usec;
+}
+
+static int32_t load_input(bench_input* input, const char* filename)
+{
+    int32_t ret = avformat_open_input(&input->ifmt_ctx, filename, nullptr, nullptr);
+    if (ret < 0) {
+        LOGE("Could not open input file %s\n", filename);
+        return ret;
+    }
+
+    ret = avformat_find_stream_info(input->ifmt_ctx, nullptr);
+    if (ret < 0) {
+        LOGE("Failed to retrieve input stream information\n");
+        return ret;
+    }
+
+    int32_t video_index = av_find_best_stream(input->ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (video_index < 0) {
+        LOGE("Could not find video stream\n");
+        return video_index;
+    }
+    input->stream = input->ifmt_ctx->streams[video_index];
+
+    ts_generator video_ts;
+    ret = init_video_ts_generator(&video_ts, input->stream, (AVRational){25, 1});
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (1) {
+        AVPacket* pkt = av_packet_alloc();
+        if (pkt == nullptr) {
+            return AVERROR(ENOMEM);
+        }
+
+        if (av_read_frame(input->ifmt_ctx, pkt) < 0) {
+            av_packet_free(&pkt);
+            break;
+        }
+
+        if (pkt->stream_index != video_index) {
+            av_packet_free(&pkt);
+            continue;
+        }
+
+        if (pkt->pts == AV_NOPTS_VALUE) {
+            ts_generator_fill(&video_ts, pkt);
+        }
+        input->packets.push_back(pkt);
+    }
+
+    if (input->packets.empty()) {
+        LOGE("no video packet in %s\n", filename);
+        return AVERROR_INVALIDDATA;
+    }
+
+    AVPacket* first = input->packets.front();
+    AVPacket* last = input->packets.back();
+    input->span = last->dts - first->dts + (last->duration > 0 ? last->duration : 1);
+    return 0;
+}
+
+static void free_input(bench_input* input)
+{
+    for (AVPacket* pkt : input->packets) {
+        av_packet_free(&pkt);
+    }
+    input->packets.clear();
+    avformat_close_input(&input->ifmt_ctx);
+}
+
+// 循环发送全部包，直到超过 duration_ns。pacing 为 0 时尽快发送，否则按时间戳发送
+static void send_stream(const bench_input* input, const char* url, rtp_send_mode mode, int32_t pacing,
+                        int64_t duration_ns, stream_result* result)
+{
+    rtp_output_options opts;
+    init_rtp_output_options(&opts);
+    opts.send_mode = mode;
+    opts.pacing = pacing;
+
+    rtp_output out;
+    memset(&out, 0, sizeof(out));
+    AVPacket* pkt = av_packet_alloc();
+    result->ret = pkt != nullptr ? open_rtp_output(&out, url, input->stream, &opts) : AVERROR(ENOMEM);
+    if (result->ret < 0) {
+        av_packet_free(&pkt);
+        close_rtp_output(&out);
+        return;
+    }
+
+    int64_t cpu_start = thread_cpu_us();
+    int64_t end_ns = pacer_now_ns() + duration_ns;
+    for (int64_t loop = 0; pacer_now_ns() < end_ns && result->ret >= 0; loop++) {
+        for (size_t i = 0; i < input->packets.size() && result->ret >= 0; i++) {
+            av_packet_ref(pkt, input->packets[i]);
+            pkt->pts += loop * input->span;
+            pkt->dts += loop * input->span;
+            result->ret = rtp_output_send(&out, pkt);
+            av_packet_unref(pkt);
+        }
+    }
+    result->cpu_us = thread_cpu_us() - cpu_start;
+    result->rtp_packets = out.rtp_packets;
+    result->syscalls = mode == RTP_SEND_AVIO ? out.rtp_packets : out.sender.syscalls;
+
+    av_packet_free(&pkt);
+    close_rtp_output(&out);
+}
+
+static int64_t realtime_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 内核的接收时间戳（CLOCK_REALTIME），没有时返回 -1
+static int64_t kernel_timestamp_ns(struct msghdr* msg)
+{
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+    }
+    return -1;
+}
+
+// D(i, j) = (Rj - Ri) - (Sj - Si)，S 为 RTP 时间戳换算的纳秒。同一帧的 RTP 包时间戳相同，帧内突发发送时 D 接近 0
+static void update_jitter(receive_result* result, jitter_state* st, const uint8_t* data, int32_t size,
+                          int64_t arrival_ns)
+{
+    if (size < 12 || (data[0] >> 6) != 2) {
+        return;
+    }
+
+    uint32_t rtp_ts = ((uint32_t)data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+    if (st->has_prev) {
+        int64_t send_diff_ns = (int64_t)(int32_t)(rtp_ts - st->prev_rtp_ts) * 1000000000 / RTP_VIDEO_CLOCK_RATE;
+        int64_t d = FFABS((arrival_ns - st->prev_arrival_ns) - send_diff_ns);
+        st->jitter_ns += (d - st->jitter_ns) / 16;
+        result->transit_ns.push_back(d);
+        result->jitter_ns.push_back((int64_t)st->jitter_ns);
+    }
+    st->has_prev = true;
+    st->prev_arrival_ns = arrival_ns;
+    st->prev_rtp_ts = rtp_ts;
+}
+
+// 接收所有流的 RTP 和 RTCP 端口并统计包数，measure_jitter 时计算 RTP 包的到达间隔抖动
+static void receive_streams(const std::vector<int>& fds, const std::atomic<bool>& stop, receive_result* result)
+{
+    std::vector<struct pollfd> pfds(fds.size());
+    for (size_t i = 0; i < fds.size(); i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    std::vector<uint8_t> bufs(RECV_BATCH * 2048);
+    std::vector<uint8_t> controls(RECV_BATCH * CMSG_SPACE(sizeof(struct timespec)));
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+    for (int32_t i = 0; i < RECV_BATCH; i++) {
+        iovs[i].iov_base = bufs.data() + i * 2048;
+        iovs[i].iov_len = 2048;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        if (poll(pfds.data(), pfds.size(), 100) <= 0) {
+            continue;
+        }
+
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            // 偶数端口为 RTP，奇数端口为 RTCP
+            bool rtp = result->measure_jitter && i % 2 == 0;
+            while (1) {
+                if (rtp) {
+                    for (int32_t j = 0; j < RECV_BATCH; j++) {
+                        msgs[j].msg_hdr.msg_control = controls.data() + j * CMSG_SPACE(sizeof(struct timespec));
+                        msgs[j].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+                    }
+                }
+
+                int n = recvmmsg(pfds[i].fd, msgs, RECV_BATCH, MSG_DONTWAIT, nullptr);
+                if (n <= 0) {
+                    break;
+                }
+                result->received += n;
+                if (!rtp) {
+                    continue;
+                }
+
+                int64_t batch_ns = realtime_now_ns();
+                for (int32_t j = 0; j < n; j++) {
+                    int64_t arrival_ns = kernel_timestamp_ns(&msgs[j].msg_hdr);
+                    if (arrival_ns < 0) {
+                        result->kernel_timestamps = false;
+                        arrival_ns = batch_ns;
+                    }
+                    update_jitter(result, &result->streams[i / 2], (const uint8_t*)iovs[j].iov_base, msgs[j].msg_len,
+                                  arrival_ns);
+                }
+            }
+        }
+    }
+}
+
+// 已排序的样本的 q 分位数，单位微秒
+static double sorted_percentile_us(const std::vector<int64_t>& samples, double q)
+{
+    if (samples.empty()) {
+        return 0;
+    }
+    size_t idx = FFMIN((size_t)(samples.size() * q), samples.size() - 1);
+    return samples[idx] / 1000.0;
+}
+
+static void report_jitter(receive_result* result)
+{
+    std::sort(result->transit_ns.begin(), result->transit_ns.end());
+    std::sort(result->jitter_ns.begin(), result->jitter_ns.end());
+    LOG_AT(LOG_LEVEL_COUNTERS,
+           "receive jitter (%s): samples %zu rfc3550 J p50 %.1f us p99 %.1f us max %.1f us, "
+           "|D| p50 %.1f us p99 %.1f us max %.1f us\n",
+           result->kernel_timestamps ? "kernel timestamps" : "per batch clock", result->jitter_ns.size(),
+           sorted_percentile_us(result->jitter_ns, 0.5), sorted_percentile_us(result->jitter_ns, 0.99),
+           sorted_percentile_us(result->jitter_ns, 1), sorted_percentile_us(result->transit_ns, 0.5),
+           sorted_percentile_us(result->transit_ns, 0.99), sorted_percentile_us(result->transit_ns, 1));
+}
+
+// 每路流的 RTP 与 RTCP 各占一个端口。timestamps 非 0 时在 RTP 端口上开启内核接收时间戳
+static int32_t open_receivers(int32_t base_port, int32_t stream_num, int32_t timestamps, std::vector<int>& fds)
+{
+    for (int32_t i = 0; i < stream_num * 2; i++) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            LOGE("create socket fail: %s\n", strerror(errno));
+            return -1;
+        }
+        fds.push_back(fd);
+
+        int buffer_size = RECV_BUFFER_SIZE;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+        int on = 1;
+        if (timestamps && i % 2 == 0 && setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+            LOGW("enable SO_TIMESTAMPNS fail: %s, use the clock after each recvmmsg\n", strerror(errno));
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(base_port + i);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            LOGE("bind port %d fail: %s\n", base_port + i, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int32_t run_mode(const bench_input* input, rtp_send_mode mode, int32_t stream_num, int32_t base_port,
+                        int32_t seconds, int32_t pacing)
+{
+    std::vector<int> fds;
+    int32_t ret = open_receivers(base_port, stream_num, pacing, fds);
+
+    std::atomic<bool> stop(false);
+    receive_result received;
+    received.received = 0;
+    received.measure_jitter = pacing != 0;
+    received.kernel_timestamps = true;
+    received.streams.resize(stream_num, jitter_state());
+    std::vector<stream_result> results(stream_num);
+    int64_t elapsed_ns = 0;
+    if (ret == 0) {
+        std::thread receiver(receive_streams, std::cref(fds), std::cref(stop), &received);
+
+        std::vector<std::thread> senders;
+        int64_t start_ns = pacer_now_ns();
+        for (int32_t i = 0; i < stream_num; i++) {
+            senders.emplace_back([=, &results]() {
+                char url[64];
+                snprintf(url, sizeof(url), "rtp://127.0.0.1:%d", base_port + 2 * i);
+                send_stream(input, url, mode, pacing, seconds * 1000000000LL, &results[i]);
+            });
+        }
+
+        for (auto& sender : senders) {
+            sender.join();
+        }
+        elapsed_ns = pacer_now_ns() - start_ns;
+
+        // 给接收线程留出时间读完 socket 中剩余的包
+        usleep(200 * 1000);
+        stop = true;
+        receiver.join();
+    }
+
+    for (int fd : fds) {
+        close(fd);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    int64_t packets = 0, syscalls = 0, cpu_us = 0;
+    for (const stream_result& result : results) {
+        if (result.ret < 0) {
+            ret = result.ret;
+        }
+        packets += result.rtp_packets;
+        syscalls += result.syscalls;
+        cpu_us += result.cpu_us;
+    }
+
+    double elapsed = elapsed_ns / 1e9;
+    LOG_AT(LOG_LEVEL_COUNTERS,
+           "mode: %s streams: %d packets: %jd received: %jd packets/s: %.0f packets/s per stream: %.0f "
+           "syscalls/packet: %.3f cpu per stream: %.1f%% cpu ns/packet: %.0f\n",
+           rtp_send_mode_name(mode), stream_num, packets, received.received, packets / elapsed,
+           packets / elapsed / stream_num, packets > 0 ? (double)syscalls / packets : 0.0,
+           cpu_us / 1e4 / elapsed / stream_num, packets > 0 ? cpu_us * 1000.0 / packets : 0.0);
+    if (pacing) {
+        report_jitter(&received);
+    }
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int32_t stream_num = 1;
+    int32_t seconds = 5;
+    int32_t base_port = 20000;
+    int32_t only_mode = -1;
+    int32_t pacing = 0;
+    log_set_level(LOG_LEVEL_COUNTERS);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:p:b:Pl:")) != -1) {
+        switch (opt) {
+        case 'n':
+            stream_num = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'p':
+            base_port = atoi(optarg);
+            break;
+        case 'b':
+            only_mode = rtp_send_mode_parse(optarg);
+            if (only_mode < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'P':
+            pacing = 1;
+            break;
+        case 'l':
+            if (log_parse_level(optarg) < LOG_LEVEL_QUIET) {
+                usage(argv[0]);
+                return 1;
+            }
+            log_set_level(log_parse_level(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc || stream_num <= 0 || seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    bench_input input;
+    input.ifmt_ctx = nullptr;
+    int32_t ret = load_input(&input, argv[optind]);
+    if (ret == 0) {
+        rtp_send_mode modes[] = { RTP_SEND_AVIO, RTP_SEND_SENDMMSG, RTP_SEND_GSO };
+        for (rtp_send_mode mode : modes) {
+            if (only_mode < 0 || only_mode == mode) {
+                if (run_mode(&input, mode, stream_num, base_port, seconds, pacing) < 0) {
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    free_input(&input);
+    return ret < 0 ? 1 : 0;
+}
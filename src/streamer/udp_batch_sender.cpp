@@ -0,0 +1,256 @@
+#include "udp_batch_sender.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../log.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+// 单个 UDP 报文的最大负载，GSO 合并后的总长度不能超过它
+#define UDP_MAX_PAYLOAD 65507
+#define UDP_SEND_BUFFER_SIZE (4 * 1024 * 1024)
+
+// RTCP 包的第二个字节是包类型 200~204，去掉最高位后正好落在 RTP 保留的负载类型 72~76 上
+#define RTP_PT_IS_RTCP(x) ((x) >= 72 && (x) <= 76)
+
+static int32_t resolve(const char* host, int32_t port, struct sockaddr_storage* addr, socklen_t* addr_len)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo* res = nullptr;
+    int ret = getaddrinfo(host, service, &hints, &res);
+    if (ret != 0) {
+        LOGE("resolve %s fail: %s\n", host, gai_strerror(ret));
+        return AVERROR(EINVAL);
+    }
+
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void set_port(struct sockaddr_storage* addr, int32_t port)
+{
+    if (addr->ss_family == AF_INET6) {
+        ((struct sockaddr_in6*)addr)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in*)addr)->sin_port = htons(port);
+    }
+}
+
+int32_t open_udp_batch_sender(udp_batch_sender* sender, const char* url, udp_batch_mode mode)
+{
+    memset(sender, 0, sizeof(*sender));
+    sender->fd = -1;
+    sender->mode = mode;
+    sender->max_packet_size = 1472;
+
+    char proto[16], host[256], path[1024];
+    int port = -1;
+    av_url_split(proto, sizeof(proto), nullptr, 0, host, sizeof(host), &port, path, sizeof(path), url);
+    if ((strcmp(proto, "rtp") != 0 && strcmp(proto, "udp") != 0) || port <= 0) {
+        LOGE("unsupported url %s, expect rtp://host:port\n", url);
+        return AVERROR(EINVAL);
+    }
+
+    // 与 FFmpeg 的 udp 协议一致，包长可以通过 pkt_size 参数指定
+    const char* query = strchr(path, '?');
+    char value[32];
+    if (query != nullptr && av_find_info_tag(value, sizeof(value), "pkt_size", query + 1)) {
+        sender->max_packet_size = atoi(value);
+    }
+
+    int32_t ret = resolve(host, port, &sender->rtp_addr, &sender->addr_len);
+    if (ret < 0) {
+        return ret;
+    }
+    memcpy(&sender->rtcp_addr, &sender->rtp_addr, sender->addr_len);
+    set_port(&sender->rtcp_addr, port + 1);
+
+    sender->fd = socket(sender->rtp_addr.ss_family, SOCK_DGRAM, 0);
+    if (sender->fd < 0) {
+        ret = AVERROR(errno);
+        LOGE("create socket fail: %s\n", strerror(errno));
+        return ret;
+    }
+
+    // 一个大的 I 帧会一次性交给内核，发送缓冲区需要能容纳整帧
+    int buffer_size = UDP_SEND_BUFFER_SIZE;
+    setsockopt(sender->fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    if (sender->mode == UDP_BATCH_GSO) {
+        int gso_size = 0;
+        if (setsockopt(sender->fd, IPPROTO_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) < 0) {
+            LOGW("UDP GSO is not supported, fall back to sendmmsg\n");
+            sender->mode = UDP_BATCH_SENDMMSG;
+        }
+    }
+
+    sender->data = (uint8_t*)av_malloc((size_t)UDP_BATCH_MAX_PACKETS * sender->max_packet_size);
+    sender->msgs = (struct mmsghdr*)av_mallocz(UDP_BATCH_MAX_PACKETS * sizeof(struct mmsghdr));
+    sender->iovs = (struct iovec*)av_mallocz(UDP_BATCH_MAX_PACKETS * sizeof(struct iovec));
+    sender->cmsgs = (uint8_t*)av_mallocz(UDP_BATCH_MAX_PACKETS * CMSG_SPACE(sizeof(uint16_t)));
+    if (sender->data == nullptr || sender->msgs == nullptr || sender->iovs == nullptr || sender->cmsgs == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+// 把缓存的包组织为 sendmmsg 的消息数组，返回消息数。
+// GSO 模式下连续的等长包合并为一个消息，最后一个分段允许更短，正好对应 RTP 分片中最后一个较小的包
+static int32_t build_messages(udp_batch_sender* sender)
+{
+    int32_t nmsg = 0;
+    int32_t offset = 0;
+    int32_t i = 0;
+
+    while (i < sender->count) {
+        int32_t first = i;
+        int32_t segment_size = sender->lens[i];
+        int32_t total = sender->lens[i];
+        i++;
+
+        if (sender->mode == UDP_BATCH_GSO) {
+            while (i < sender->count && i - first < UDP_BATCH_MAX_SEGMENTS && sender->lens[i] <= segment_size &&
+                   total + sender->lens[i] <= UDP_MAX_PAYLOAD) {
+                bool last = sender->lens[i] < segment_size;
+                total += sender->lens[i];
+                i++;
+                if (last) {
+                    break;
+                }
+            }
+        }
+
+        struct iovec* iov = &sender->iovs[nmsg];
+        iov->iov_base = sender->data + offset;
+        iov->iov_len = total;
+
+        struct msghdr* hdr = &sender->msgs[nmsg].msg_hdr;
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->msg_name = &sender->rtp_addr;
+        hdr->msg_namelen = sender->addr_len;
+        hdr->msg_iov = iov;
+        hdr->msg_iovlen = 1;
+
+        if (i - first > 1) {
+            hdr->msg_control = sender->cmsgs + nmsg * CMSG_SPACE(sizeof(uint16_t));
+            hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gso_size = segment_size;
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+
+        offset += total;
+        nmsg++;
+    }
+
+    return nmsg;
+}
+
+int32_t udp_batch_sender_flush(udp_batch_sender* sender)
+{
+    if (sender->count == 0) {
+        return 0;
+    }
+
+    int32_t nmsg = build_messages(sender);
+    int32_t sent = 0;
+    int32_t ret = 0;
+    while (sent < nmsg) {
+        int n = sendmmsg(sender->fd, sender->msgs + sent, nmsg - sent, 0);
+        sender->syscalls++;
+        if (n >= 0) {
+            sent += n;
+            continue;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        // 网卡不支持校验和卸载等情况下 GSO 发送会失败，此时改用逐包的 sendmmsg 重新发送
+        if (sender->mode == UDP_BATCH_GSO && sent == 0 && (errno == EIO || errno == EINVAL)) {
+            LOGW("UDP GSO send fail: %s, fall back to sendmmsg\n", strerror(errno));
+            sender->mode = UDP_BATCH_SENDMMSG;
+            return udp_batch_sender_flush(sender);
+        }
+
+        ret = AVERROR(errno);
+        LOGW("sendmmsg fail: %s, drop %d messages\n", strerror(errno), nmsg - sent);
+        sender->errors += nmsg - sent;
+        break;
+    }
+
+    sender->packets += sender->count;
+    sender->bytes += sender->used;
+    sender->count = 0;
+    sender->used = 0;
+    return ret;
+}
+
+int32_t udp_batch_sender_queue(udp_batch_sender* sender, const uint8_t* buf, int32_t size)
+{
+    if (size > sender->max_packet_size) {
+        LOGE("packet size %d exceed max packet size %d\n", size, sender->max_packet_size);
+        return AVERROR(EINVAL);
+    }
+
+    // RTCP 包发往另一个端口，不参与批量发送，同时保持与之前 RTP 包的先后顺序
+    if (size >= 2 && RTP_PT_IS_RTCP(buf[1] & 0x7f)) {
+        int32_t ret = udp_batch_sender_flush(sender);
+        sender->syscalls++;
+        if (sendto(sender->fd, buf, size, 0, (struct sockaddr*)&sender->rtcp_addr, sender->addr_len) < 0) {
+            LOGW("send rtcp fail: %s\n", strerror(errno));
+            sender->errors++;
+        }
+        return ret;
+    }
+
+    if (sender->count == UDP_BATCH_MAX_PACKETS) {
+        udp_batch_sender_flush(sender);
+    }
+
+    memcpy(sender->data + sender->used, buf, size);
+    sender->lens[sender->count++] = size;
+    sender->used += size;
+    return 0;
+}
+
+void close_udp_batch_sender(udp_batch_sender* sender)
+{
+    if (sender->fd >= 0) {
+        udp_batch_sender_flush(sender);
+        close(sender->fd);
+        sender->fd = -1;
+    }
+
+    av_freep(&sender->data);
+    av_freep(&sender->msgs);
+    av_freep(&sender->iovs);
+    av_freep(&sender->cmsgs);
+}
@@ -0,0 +1,61 @@
+//
+// 批量发送 UDP 包：一个访问单元拆出的 RTP 包先缓存，再用 sendmmsg 或 UDP GSO 一次系统调用发出
+//
+
+#ifndef UDP_BATCH_SENDER_H
+#define UDP_BATCH_SENDER_H
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// 一次最多缓存的包数，超过后先发出已缓存的包
+#define UDP_BATCH_MAX_PACKETS 1024
+// 内核单次 GSO 发送允许的最大分段数
+#define UDP_BATCH_MAX_SEGMENTS 64
+
+typedef enum udp_batch_mode {
+    UDP_BATCH_SENDMMSG, ///< 每个包对应 sendmmsg 中的一个消息
+    UDP_BATCH_GSO,      ///< 连续的等长包合并为一个消息，由内核或网卡分段
+} udp_batch_mode;
+
+struct mmsghdr;
+struct iovec;
+
+typedef struct udp_batch_sender {
+    int fd;
+    udp_batch_mode mode;
+    struct sockaddr_storage rtp_addr;  ///< RTP 目的地址
+    struct sockaddr_storage rtcp_addr; ///< RTCP 目的地址，端口为 RTP 端口加 1
+    socklen_t addr_len;
+    int32_t max_packet_size;
+
+    // 缓存的包连续存放在 data 中
+    uint8_t* data;
+    int32_t lens[UDP_BATCH_MAX_PACKETS];
+    int32_t count;
+    int32_t used;
+
+    // 组织 sendmmsg 参数的临时空间
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+    uint8_t* cmsgs;
+
+    // 统计
+    int64_t packets;
+    int64_t bytes;
+    int64_t syscalls;
+    int64_t errors;
+} udp_batch_sender;
+
+// 解析 rtp://host:port[?pkt_size=n] 并创建 socket。mode 为 UDP_BATCH_GSO 但内核不支持时回退到 sendmmsg
+int32_t open_udp_batch_sender(udp_batch_sender* sender, const char* url, udp_batch_mode mode);
+
+// 缓存一个包，缓存已满时先发送已有的包。RTCP 包会先发出缓存中的 RTP 包，然后立即单独发送
+int32_t udp_batch_sender_queue(udp_batch_sender* sender, const uint8_t* buf, int32_t size);
+
+// 发送全部缓存的包
+int32_t udp_batch_sender_flush(udp_batch_sender* sender);
+
+void close_udp_batch_sender(udp_batch_sender* sender);
+
+#endif
@@ -3,6 +3,14 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "../ts_generator.h"
+#include "fanout.h"
+#include "rtp_output.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -10,173 +18,185 @@ extern "C"
 #endif
 #include <libavformat/avformat.h>
 #include <libavutil/mathematics.h>
-#include <libavutil/time.h>
 #ifdef __cplusplus
 };
 #endif
 
+static void usage(const char* program_name)
+{
+    printf("usage: %s [-b mode] [-s] [-m packets] [-S us] [-r ms] [-q depth] [-M prefix [-i seconds]] [-l level] [input_file [output_url ...]]\n", program_name);
+    printf("  with more than one output_url the input is demuxed once and every packet is shared with all outputs\n");
+    printf("  -b  how rtp packets are sent: avio (one sendto per packet), sendmmsg or gso (one syscall per frame), default avio\n");
+    printf("  -s  spread the rtp packets of a large frame over the frame interval instead of sending them in a burst\n");
+    printf("  -m  only frames split into at least this many rtp packets are spread, used with -s, default 4\n");
+    printf("  -S  busy wait the last microseconds before each deadline, default 0\n");
+    printf("  -r  realign the timeline when sending falls behind by more than ms milliseconds, default 100\n");
+    printf("  -M  write per stage latency histograms to <prefix>.json and <prefix>.prom, in fan-out mode every\n");
+    printf("      output writes <prefix>.<n> and the input reader writes <prefix>.input\n");
+    printf("  -i  seconds between two metrics dumps while streaming, used with -M, default 10\n");
+    printf("  -q  packets each output may fall behind before it drops to the next keyframe, default 64\n");
+    printf("  -l  log level: quiet, error, warn, counters, info, debug, trace, default info\n");
+}
+
 int main(int argc, char* argv[])
 {
     const char* in_filename = "outdoor.h264";
     const char* out_filename = "rtp://192.168.200.1:1234";
+    const char* const* out_urls = &out_filename;
+    int32_t url_num = 1;
+    rtp_output_options out_opts;
+    init_rtp_output_options(&out_opts);
+    fanout_options fan_opts;
+    init_fanout_options(&fan_opts);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:sm:S:r:M:i:q:l:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (rtp_send_mode_parse(optarg) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            out_opts.send_mode = (rtp_send_mode)rtp_send_mode_parse(optarg);
+            break;
+        case 's':
+            out_opts.smoothing = 1;
+            break;
+        case 'm':
+            out_opts.smooth_min_packets = atoi(optarg);
+            break;
+        case 'S':
+            out_opts.spin_ns = atoll(optarg) * 1000;
+            break;
+        case 'r':
+            out_opts.max_lateness_ns = atoll(optarg) * 1000000;
+            break;
+        case 'M':
+            out_opts.metrics_prefix = optarg;
+            break;
+        case 'i':
+            out_opts.metrics_interval_ns = atoll(optarg) * 1000000000;
+            break;
+        case 'q':
+            fan_opts.queue_depth = atoi(optarg);
+            break;
+        case 'l':
+            if (log_parse_level(optarg) < LOG_LEVEL_QUIET) {
+                usage(argv[0]);
+                return 1;
+            }
+            log_set_level(log_parse_level(optarg));
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        in_filename = argv[optind];
+    }
+    if (optind + 1 < argc) {
+        out_urls = argv + optind + 1;
+        url_num = argc - optind - 1;
+    }
 
     // 打开输入
     AVFormatContext *ifmt_ctx = nullptr;
     int32_t video_index = -1;
-    AVFormatContext *ofmt_ctx = nullptr;
-    const AVOutputFormat *ofmt = nullptr;
-    int64_t start_time = av_gettime();
-    int32_t frame_index = 0;
+    rtp_output out;
+    memset(&out, 0, sizeof(out));
+    ts_generator video_ts;
+    AVPacket *pkt = nullptr;
 
     int32_t ret = avformat_open_input(&ifmt_ctx, in_filename, nullptr, nullptr);
     if (ret < 0) {
-        printf( "Could not open input file.\n");
+        LOGE("Could not open input file.\n");
         goto end;
     }
 
     // 查找输入流信息
     ret = avformat_find_stream_info(ifmt_ctx, nullptr);
     if (ret < 0) {
-        printf( "Failed to retrieve input stream information\n");
+        LOGE("Failed to retrieve input stream information\n");
         goto end;
     }
 
     video_index = av_find_best_stream(ifmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
-
-    av_dump_format(ifmt_ctx, 0, in_filename, 0);
-
-    // 输出
-    avformat_alloc_output_context2(&ofmt_ctx, nullptr, "rtp", out_filename);
-    if (ofmt_ctx == nullptr) {
-        printf( "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
+    if (video_index < 0) {
+        LOGE("Could not find video stream\n");
+        ret = video_index;
         goto end;
     }
 
-    ofmt = ofmt_ctx->oformat;
-    for (int32_t i = 0; i < ifmt_ctx->nb_streams; i++) {
-        // 根据输入流创建输出流，这里我们只处理视频流
-        if (i != video_index) {
-            continue;
-        }
-
-        AVStream *in_stream = ifmt_ctx->streams[i];
-        AVStream *out_stream = avformat_new_stream(ofmt_ctx, nullptr);
-        if (out_stream == nullptr) {
-            printf( "Failed allocating output stream\n");
-            ret = AVERROR_UNKNOWN;
-            goto end;
-        }
-
-        // 复制 AVCodecContext 的设置
-        ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
-        if (ret < 0) {
-            printf( "Failed to copy context from input to output stream codec context\n");
-            goto end;
-        }
-
-#if 0
-        out_stream->codec->codec_tag = 0;
-        if (ofmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
-            out_stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
-        }
-#endif
+    ret = init_video_ts_generator(&video_ts, ifmt_ctx->streams[video_index], (AVRational){25, 1});
+    if (ret < 0) {
+        goto end;
     }
 
-    // Dump Format------------------
-    av_dump_format(ofmt_ctx, 0, out_filename, 1);
+    av_dump_format(ifmt_ctx, 0, in_filename, 0);
 
-    // 打开输出 URL
-    if (!(ofmt->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&ofmt_ctx->pb, out_filename, AVIO_FLAG_WRITE);
-        if (ret < 0) {
-            printf( "Could not open output URL '%s'\n", out_filename);
-            goto end;
-        }
+    // 多个输出时只解复用一次，包以引用计数的方式分发给各路输出
+    if (url_num > 1) {
+        fan_opts.out_opts = out_opts;
+        ret = run_fanout(ifmt_ctx, video_index, &video_ts, out_urls, url_num, &fan_opts);
+        goto end;
     }
 
-    // 写文件头
-    ret = avformat_write_header(ofmt_ctx, nullptr);
+    // 输出
+    ret = open_rtp_output(&out, out_urls[0], ifmt_ctx->streams[video_index], &out_opts);
     if (ret < 0) {
-        printf( "Error occurred when opening output URL\n");
+        goto end;
+    }
+
+    pkt = av_packet_alloc();
+    if (pkt == nullptr) {
+        ret = AVERROR(ENOMEM);
         goto end;
     }
 
     while (1) {
         // 获取一个AVPacket
-        AVPacket *pkt = av_packet_alloc();
+        int64_t read_start = out.metrics != nullptr ? mux_metrics_now() : 0;
         ret = av_read_frame(ifmt_ctx, pkt);
         if (ret < 0) {
             break;
         }
 
+        if (out.metrics != nullptr) {
+            mux_metrics_record(out.metrics, MUX_STAGE_READ, mux_metrics_now() - read_start);
+        }
+
         if (pkt->stream_index != video_index) {
+            av_packet_unref(pkt);
             continue;
         }
 
         // FIX：No PTS (Example: Raw H.264)
-        // Simple Write PTS
-        if(pkt->pts == AV_NOPTS_VALUE){
-            //Write PTS
-            AVRational time_base = ifmt_ctx->streams[video_index]->time_base;
-
-            // Duration between 2 frames (us)
-            // 根据帧计算两帧之间的间隔
-            int64_t calc_duration = (double)AV_TIME_BASE / av_q2d(ifmt_ctx->streams[video_index]->r_frame_rate);
-
-            //Parameters
-            // 以下计算值都是以输入流的 time_base 为基准
-            pkt->pts = (double)(frame_index * calc_duration) / (double)(av_q2d(time_base) * AV_TIME_BASE);
-            pkt->dts = pkt->pts;
-            pkt->duration = (double)calc_duration / (double)(av_q2d(time_base) * AV_TIME_BASE);
+        // 按帧率生成精确的整数时间戳，以输入流的 time_base 为基准
+        if (pkt->pts == AV_NOPTS_VALUE) {
+            ts_generator_fill(&video_ts, pkt);
         }
 
-        //Important:Delay 保证按帧率进行发送
-        AVRational time_base = ifmt_ctx->streams[video_index]->time_base;
-        AVRational time_base_q = {1, AV_TIME_BASE};
-        int64_t pts_time = av_rescale_q(pkt->dts, time_base, time_base_q);
-        int64_t now_time = av_gettime() - start_time;
-        if (pts_time > now_time) {
-            av_usleep(pts_time - now_time);
-        }
-
-        AVStream *in_stream  = ifmt_ctx->streams[pkt->stream_index];
-        AVStream *out_stream = ofmt_ctx->streams[pkt->stream_index];
-
-        // 转换PTS/DTS
-        pkt->pts = av_rescale_q_rnd(pkt->pts, in_stream->time_base, out_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
-        pkt->dts = av_rescale_q_rnd(pkt->dts, in_stream->time_base, out_stream->time_base, (AVRounding)(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX));
-        pkt->duration = av_rescale_q(pkt->duration, in_stream->time_base, out_stream->time_base);
-        pkt->pos = -1;
-
-        printf("Send %8d video frames to output URL\n", frame_index);
-        frame_index++;
-
-        ret = av_interleaved_write_frame(ofmt_ctx, pkt);
+        // 按 dts 对应的绝对截止时间发送，保证按帧率进行发送
+        ret = rtp_output_send(&out, pkt);
+        av_packet_unref(pkt);
         if (ret < 0) {
-            printf( "Error muxing packet\n");
             break;
         }
-
-        av_packet_unref(pkt);
     }
 
-    // 写文件尾
-    av_write_trailer(ofmt_ctx);
-
 end:
+    av_packet_free(&pkt);
     avformat_close_input(&ifmt_ctx);
 
-    /* close output */
-    if (ofmt_ctx && !(ofmt->flags & AVFMT_NOFILE)) {
-        avio_close(ofmt_ctx->pb);
-    }
+    // 写文件尾并关闭输出
+    close_rtp_output(&out);
 
-    avformat_free_context(ofmt_ctx);
     if (ret < 0 && ret != AVERROR_EOF) {
-        printf( "Error occurred.\n");
+        LOGE("Error occurred.\n");
         return -1;
     }
 
     return 0;
-}
\ No newline at end of file
+}
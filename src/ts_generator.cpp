@@ -0,0 +1,74 @@
+#include "ts_generator.h"
+#include "log.h"
+
+extern "C" {
+#include <libavutil/mathematics.h>
+}
+
+// 设置帧时长 num / den（以 time_base 为单位）并约分
+static int32_t set_step(ts_generator* gen, int64_t num, int64_t den)
+{
+    if (num <= 0 || den <= 0) {
+        return -1;
+    }
+
+    int64_t gcd = av_gcd(num, den);
+    gen->step_num = num / gcd;
+    gen->step_den = den / gcd;
+    gen->step_int = gen->step_num / gen->step_den;
+    gen->step_rem = gen->step_num % gen->step_den;
+    ts_generator_seek(gen, 0);
+    return 0;
+}
+
+void ts_generator_seek(ts_generator* gen, int64_t idx)
+{
+    gen->frame_idx = idx;
+    gen->next_pts = ts_generator_pts(gen, idx);
+
+    // 余数小于 step_den，按无符号数计算时乘积溢出的部分相互抵消
+    gen->next_rem = (int64_t)((uint64_t)idx * gen->step_num + gen->step_den / 2 - (uint64_t)gen->next_pts * gen->step_den);
+}
+
+int32_t init_video_ts_generator(ts_generator* gen, const AVStream* st, AVRational default_rate)
+{
+    // r_frame_rate 表示的是音视频流中可以精准表示所有时间戳的最低帧率。
+    // 简单来说，如果当前音视频流的帧率是恒定的，那么 r_frame_rate 表示的是音视频流的实际帧率；
+    // 如果当前音视频流的帧率波动较大，那么 r_frame_rate 的值通常会高于整体平均帧率，以此作为每一帧的时间戳的单位
+    AVRational rate = st->r_frame_rate;
+    if (rate.num <= 0 || rate.den <= 0) {
+        rate = st->avg_frame_rate;
+    }
+    if (rate.num <= 0 || rate.den <= 0) {
+        rate = default_rate;
+    }
+
+    gen->time_base = st->time_base;
+
+    // 帧时长 = (1 / rate) / time_base = (rate.den * time_base.den) / (rate.num * time_base.num)
+    if (set_step(gen, (int64_t)rate.den * st->time_base.den, (int64_t)rate.num * st->time_base.num) < 0) {
+        LOGE("invalid video frame rate %d / %d or time base %d / %d\n",
+             rate.num, rate.den, st->time_base.num, st->time_base.den);
+        return -1;
+    }
+
+    LOGD("video ts step: %jd / %jd\n", gen->step_num, gen->step_den);
+    return 0;
+}
+
+int32_t init_audio_ts_generator(ts_generator* gen, const AVStream* st)
+{
+    int32_t frame_size = st->codecpar->frame_size > 0 ? st->codecpar->frame_size : 1024;
+
+    gen->time_base = st->time_base;
+
+    // 帧时长 = (frame_size / sample_rate) / time_base = (frame_size * time_base.den) / (sample_rate * time_base.num)
+    if (set_step(gen, (int64_t)frame_size * st->time_base.den, (int64_t)st->codecpar->sample_rate * st->time_base.num) < 0) {
+        LOGE("invalid audio sample rate %d or time base %d / %d\n",
+             st->codecpar->sample_rate, st->time_base.num, st->time_base.den);
+        return -1;
+    }
+
+    LOGD("audio ts step: %jd / %jd\n", gen->step_num, gen->step_den);
+    return 0;
+}
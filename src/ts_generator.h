@@ -0,0 +1,63 @@
+//
+// 为没有时间戳的输入流（如 HEVC/H.264 裸码流、ADTS AAC）生成精确的整数时间戳
+//
+
+#ifndef TS_GENERATOR_H
+#define TS_GENERATOR_H
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// 帧时长以 time_base 为单位表示为有理数 step_num / step_den，初始化时只计算一次。
+// 逐帧生成时用整数部分加分数余数累加，余数满 step_den 时进位，结果与按帧序号直接计算 av_rescale(n, step_num, step_den)
+// 完全相同，任意长时间运行都不会累积误差，每帧只有加法和比较
+typedef struct ts_generator {
+    AVRational time_base;  ///< 生成的时间戳的时间基，即输入流的 time_base
+    int64_t step_num;      ///< 帧时长的分子（已约分）
+    int64_t step_den;      ///< 帧时长的分母（已约分），为 1 时帧时长为整数
+    int64_t step_int;      ///< step_num / step_den
+    int64_t step_rem;      ///< step_num % step_den
+    int64_t frame_idx;     ///< 下一帧在解码顺序中的序号
+    int64_t next_pts;      ///< 下一帧的时间戳
+    int64_t next_rem;      ///< 下一帧的 frame_idx * step_num + step_den / 2 除以 step_den 的余数
+} ts_generator;
+
+// 视频按帧率生成时间戳，优先使用 r_frame_rate，无效时依次使用 avg_frame_rate 和 default_rate
+int32_t init_video_ts_generator(ts_generator* gen, const AVStream* st, AVRational default_rate);
+
+// 音频按每帧采样数与采样率生成时间戳，AAC 每帧 1024 个采样
+int32_t init_audio_ts_generator(ts_generator* gen, const AVStream* st);
+
+// 第 idx 帧的时间戳，用于随机访问。每一帧独立舍入到最近的整数，误差不超过半个 time_base 单位且不会累积
+static inline int64_t ts_generator_pts(const ts_generator* gen, int64_t idx)
+{
+    if (gen->step_den == 1) {
+        return idx * gen->step_num;
+    }
+
+    return av_rescale(idx, gen->step_num, gen->step_den);
+}
+
+// 把下一帧定位到第 idx 帧，之后从该帧开始逐帧生成
+void ts_generator_seek(ts_generator* gen, int64_t idx);
+
+// 为没有时间戳的包填充 pts、dts 和 duration。时间戳按包的解码顺序分配，pts 与 dts 相同，不解析 slice 的 POC，
+// 因此含 B 帧的裸码流不会还原显示顺序
+static inline void ts_generator_fill(ts_generator* gen, AVPacket* pkt)
+{
+    pkt->pts = gen->next_pts;
+    pkt->dts = pkt->pts;
+
+    gen->frame_idx++;
+    gen->next_pts += gen->step_int;
+    gen->next_rem += gen->step_rem;
+    if (gen->next_rem >= gen->step_den) {
+        gen->next_rem -= gen->step_den;
+        gen->next_pts++;
+    }
+    pkt->duration = gen->next_pts - pkt->pts;
+}
+
+#endif
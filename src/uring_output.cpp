@@ -0,0 +1,490 @@
+#include "uring_output.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <new>
+#include <vector>
+
+#include "log.h"
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+// 内核头文件中有 io_uring 的定义时才编译 io_uring 的实现，直接使用系统调用，不依赖 liburing
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+    defined(__NR_io_uring_register)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+// AVIOContext 内部缓冲区大小，muxer 的小块写入先在这里合并后再拷贝到输出缓冲区
+static const int32_t avio_ctx_buffer_size = 64 * 1024;
+
+#define URING_OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define URING_OUTPUT_QUEUE_DEPTH 8
+
+// 一个输出缓冲区，填满后整块提交，写入完成前不能再使用
+struct uring_slot {
+    uint8_t* data = nullptr;
+    struct iovec iov;       ///< 没有注册缓冲区时 writev 使用，在途期间必须保持有效
+    int64_t offset = 0;     ///< 缓冲区第一个字节在文件中的位置
+    size_t fill = 0;
+    bool in_flight = false;
+};
+
+struct uring_output {
+    int fd = -1;
+    std::vector<uring_slot> slots;
+    size_t buffer_size = 0;
+    int32_t cur = -1;         ///< 正在填充的缓冲区，-1 表示没有
+    int32_t in_flight = 0;
+    int64_t pos = 0;          ///< AVIOContext 的写位置
+    int64_t size = 0;         ///< 写到过的最大位置
+    int64_t next_offset = 0;  ///< 顺序写入时下一个字节的位置
+    int32_t error = 0;        ///< 第一个写入错误，之后的写入都返回该错误
+
+#if HAVE_IO_URING
+    int ring_fd = -1;         ///< 小于 0 时使用 pwrite
+    bool registered = false;  ///< 缓冲区已注册，使用 IORING_OP_WRITE_FIXED
+    void* sq_ptr = MAP_FAILED;
+    size_t sq_size = 0;
+    void* cq_ptr = MAP_FAILED;
+    size_t cq_size = 0;
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    struct io_uring_cqe* cqes = nullptr;
+#endif
+
+    int64_t writes = 0;       ///< 提交的写入次数
+    int64_t bytes = 0;
+    int64_t stalls = 0;       ///< 所有缓冲区都在途、复用线程等待写入完成的次数
+    int64_t drains = 0;       ///< 非顺序写入前等待全部写入完成的次数
+};
+
+static int32_t pwrite_full(int fd, const uint8_t* data, size_t size, int64_t offset)
+{
+    while (size > 0) {
+        ssize_t ret = pwrite(fd, data, size, offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+#if HAVE_IO_URING
+static void teardown_ring(uring_output* out)
+{
+    if (out->sqes != MAP_FAILED) {
+        munmap(out->sqes, out->sqes_size);
+        out->sqes = (struct io_uring_sqe*)MAP_FAILED;
+    }
+    if (out->cq_ptr != MAP_FAILED && out->cq_ptr != out->sq_ptr) {
+        munmap(out->cq_ptr, out->cq_size);
+    }
+    out->cq_ptr = MAP_FAILED;
+    if (out->sq_ptr != MAP_FAILED) {
+        munmap(out->sq_ptr, out->sq_size);
+        out->sq_ptr = MAP_FAILED;
+    }
+    if (out->ring_fd >= 0) {
+        // 关闭 ring 时注册的缓冲区一并注销
+        close(out->ring_fd);
+        out->ring_fd = -1;
+    }
+}
+
+// 创建 io_uring 并注册输出缓冲区，失败时返回 false，由调用方退回到 pwrite
+static bool setup_ring(uring_output* out)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, (unsigned)out->slots.size(), &params);
+    if (fd < 0) {
+        LOGW("io_uring unavailable (%s), output falls back to pwrite\n", strerror(errno));
+        return false;
+    }
+    out->ring_fd = fd;
+
+    out->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    out->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        out->sq_size = FFMAX(out->sq_size, out->cq_size);
+        out->cq_size = out->sq_size;
+    }
+
+    out->sq_ptr = mmap(nullptr, out->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQ_RING);
+    if (out->sq_ptr != MAP_FAILED) {
+        out->cq_ptr = single_mmap ? out->sq_ptr
+                                  : mmap(nullptr, out->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                         fd, IORING_OFF_CQ_RING);
+    }
+    out->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (out->cq_ptr != MAP_FAILED) {
+        out->sqes = (struct io_uring_sqe*)mmap(nullptr, out->sqes_size, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+    if (out->sqes == MAP_FAILED) {
+        LOGW("map io_uring fail (%s), output falls back to pwrite\n", strerror(errno));
+        teardown_ring(out);
+        return false;
+    }
+
+    uint8_t* sq = (uint8_t*)out->sq_ptr;
+    uint8_t* cq = (uint8_t*)out->cq_ptr;
+    out->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    out->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    out->sq_array = (unsigned*)(sq + params.sq_off.array);
+    out->cq_head = (unsigned*)(cq + params.cq_off.head);
+    out->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    out->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    out->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // 注册后内核不必每次写入都重新映射缓冲区的页。锁定内存的限制（RLIMIT_MEMLOCK）不够时注册失败，改用 writev
+    std::vector<struct iovec> iovs;
+    for (const uring_slot& slot : out->slots) {
+        iovs.push_back(slot.iov);
+    }
+    out->registered = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovs.data(),
+                              (unsigned)iovs.size()) == 0;
+    if (!out->registered) {
+        LOGD("register io_uring buffers fail (%s), use writev\n", strerror(errno));
+    }
+
+    return true;
+}
+
+// 收取完成的写入。wait 为 true 时至少等待一个写入完成
+static void reap_completions(uring_output* out, bool wait)
+{
+    int32_t reaped = 0;
+    while (out->in_flight > 0) {
+        unsigned head = *out->cq_head;
+        unsigned tail = __atomic_load_n(out->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (!wait || reaped > 0) {
+                break;
+            }
+            int ret = syscall(__NR_io_uring_enter, out->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0 && errno != EINTR) {
+                LOGE("io_uring_enter fail: %s\n", strerror(errno));
+                out->error = out->error < 0 ? out->error : AVERROR(errno);
+                return;
+            }
+            continue;
+        }
+
+        const struct io_uring_cqe* cqe = &out->cqes[head & *out->cq_mask];
+        uring_slot& slot = out->slots[cqe->user_data];
+        if (cqe->res < 0) {
+            LOGE("write %zu bytes at %jd fail: %s\n", slot.fill, slot.offset, strerror(-cqe->res));
+            out->error = out->error < 0 ? out->error : cqe->res;
+        } else if ((size_t)cqe->res < slot.fill) {
+            // 普通文件很少出现部分写入，剩余部分直接同步写完
+            int32_t ret = pwrite_full(out->fd, slot.data + cqe->res, slot.fill - cqe->res, slot.offset + cqe->res);
+            out->error = out->error < 0 ? out->error : ret;
+        }
+
+        slot.in_flight = false;
+        slot.fill = 0;
+        out->in_flight--;
+        reaped++;
+        __atomic_store_n(out->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+#endif
+
+static void submit_slot(uring_output* out, int32_t idx)
+{
+    uring_slot& slot = out->slots[idx];
+    if (slot.fill == 0) {
+        return;
+    }
+
+    out->writes++;
+    out->bytes += slot.fill;
+
+#if HAVE_IO_URING
+    if (out->ring_fd >= 0) {
+        unsigned tail = *out->sq_tail;
+        unsigned sq_idx = tail & *out->sq_mask;
+        struct io_uring_sqe* sqe = &out->sqes[sq_idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = out->fd;
+        sqe->off = slot.offset;
+        sqe->user_data = idx;
+        if (out->registered) {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->addr = (uint64_t)(uintptr_t)slot.data;
+            sqe->len = slot.fill;
+            sqe->buf_index = idx;
+        } else {
+            sqe->opcode = IORING_OP_WRITEV;
+            slot.iov.iov_len = slot.fill;
+            sqe->addr = (uint64_t)(uintptr_t)&slot.iov;
+            sqe->len = 1;
+        }
+        out->sq_array[sq_idx] = sq_idx;
+        __atomic_store_n(out->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, out->ring_fd, 1, 0, 0, nullptr, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            LOGE("io_uring_enter fail: %s\n", strerror(errno));
+            out->error = out->error < 0 ? out->error : AVERROR(errno);
+            return;
+        }
+
+        slot.in_flight = true;
+        out->in_flight++;
+        return;
+    }
+#endif
+
+    int32_t ret = pwrite_full(out->fd, slot.data, slot.fill, slot.offset);
+    if (ret < 0) {
+        LOGE("write %zu bytes at %jd fail: %s\n", slot.fill, slot.offset, strerror(-ret));
+        out->error = out->error < 0 ? out->error : ret;
+    }
+    slot.fill = 0;
+}
+
+// 取一个空闲的缓冲区从 offset 开始填充，所有缓冲区都在途时等待最早的一个写入完成
+static int32_t acquire_slot(uring_output* out, int64_t offset)
+{
+    while (out->error >= 0) {
+        for (size_t i = 0; i < out->slots.size(); i++) {
+            if (!out->slots[i].in_flight) {
+                out->cur = i;
+                out->slots[i].offset = offset;
+                out->slots[i].fill = 0;
+                return 0;
+            }
+        }
+
+#if HAVE_IO_URING
+        reap_completions(out, false);
+        if (out->in_flight == (int32_t)out->slots.size()) {
+            out->stalls++;
+            reap_completions(out, true);
+        }
+#endif
+    }
+
+    return out->error;
+}
+
+// 提交正在填充的缓冲区并等待所有写入完成
+static void drain_slots(uring_output* out)
+{
+    if (out->cur >= 0) {
+        submit_slot(out, out->cur);
+        out->cur = -1;
+    }
+
+#if HAVE_IO_URING
+    while (out->in_flight > 0 && out->error >= 0) {
+        reap_completions(out, true);
+    }
+#endif
+}
+
+static int write_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+    uring_output* out = (uring_output*)opaque;
+    if (out->error < 0) {
+        return out->error;
+    }
+
+    // 非顺序写入（如 trailer 回写 box 大小）可能与在途的写入重叠，io_uring 不保证写入的先后，先等待之前的写入全部完成
+    if (out->pos != out->next_offset) {
+        out->drains++;
+        drain_slots(out);
+        out->next_offset = out->pos;
+    }
+
+    const uint8_t* src = buf;
+    size_t left = buf_size;
+    while (left > 0 && out->error >= 0) {
+        if (out->cur < 0 && acquire_slot(out, out->pos + (buf_size - left)) < 0) {
+            break;
+        }
+
+        uring_slot& slot = out->slots[out->cur];
+        size_t n = FFMIN(left, out->buffer_size - slot.fill);
+        memcpy(slot.data + slot.fill, src, n);
+        slot.fill += n;
+        src += n;
+        left -= n;
+
+        if (slot.fill == out->buffer_size) {
+            submit_slot(out, out->cur);
+            out->cur = -1;
+        }
+    }
+
+    if (out->error < 0) {
+        return out->error;
+    }
+
+    out->pos += buf_size;
+    out->next_offset = out->pos;
+    out->size = FFMAX(out->size, out->pos);
+    return buf_size;
+}
+
+// 写入方向的 seek 只移动写位置，下一次写入时再处理非顺序写入
+static int64_t seek_packet(void* opaque, int64_t offset, int whence)
+{
+    uring_output* out = (uring_output*)opaque;
+
+    int64_t new_pos = 0;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return out->size;
+    case SEEK_SET:
+        new_pos = offset;
+        break;
+    case SEEK_CUR:
+        new_pos = out->pos + offset;
+        break;
+    case SEEK_END:
+        new_pos = out->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (new_pos < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    out->pos = new_pos;
+    return new_pos;
+}
+
+static void free_output(uring_output* out)
+{
+#if HAVE_IO_URING
+    teardown_ring(out);
+#endif
+    for (uring_slot& slot : out->slots) {
+        av_freep(&slot.data);
+    }
+    if (out->fd >= 0) {
+        close(out->fd);
+    }
+    delete out;
+}
+
+int32_t open_uring_output(uring_output** out, AVIOContext** pb, const char* filename, int32_t buffer_size,
+                          int32_t queue_depth)
+{
+    uring_output* o = new (std::nothrow) uring_output();
+    if (o == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+
+    o->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (o->fd < 0) {
+        int32_t ret = AVERROR(errno);
+        LOGE("open %s fail: %s\n", filename, strerror(errno));
+        free_output(o);
+        return ret;
+    }
+
+    o->buffer_size = buffer_size > 0 ? buffer_size : URING_OUTPUT_BUFFER_SIZE;
+    o->slots.resize(queue_depth > 0 ? queue_depth : URING_OUTPUT_QUEUE_DEPTH);
+    for (uring_slot& slot : o->slots) {
+        slot.data = (uint8_t*)av_malloc(o->buffer_size);
+        if (slot.data == nullptr) {
+            free_output(o);
+            return AVERROR(ENOMEM);
+        }
+        slot.iov.iov_base = slot.data;
+        slot.iov.iov_len = o->buffer_size;
+    }
+
+#if HAVE_IO_URING
+    setup_ring(o);
+#else
+    LOGW("built without io_uring, output falls back to pwrite\n");
+#endif
+
+    uint8_t* avio_ctx_buffer = (uint8_t*)av_malloc(avio_ctx_buffer_size);
+    if (avio_ctx_buffer == nullptr) {
+        free_output(o);
+        return AVERROR(ENOMEM);
+    }
+
+    // 提供 seek 回调后 AVIOContext 即为可 seek 的，MP4 可以在写 trailer 时回写
+    *pb = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 1, o, nullptr, &write_packet, &seek_packet);
+    if (*pb == nullptr) {
+        av_free(avio_ctx_buffer);
+        free_output(o);
+        return AVERROR(ENOMEM);
+    }
+
+    *out = o;
+    return 0;
+}
+
+int32_t uring_output_drain(uring_output* out, AVIOContext* pb)
+{
+    if (pb != nullptr) {
+        avio_flush(pb);
+    }
+    drain_slots(out);
+    return out->error;
+}
+
+void close_uring_output(uring_output** out, AVIOContext** pb)
+{
+    if (out == nullptr || *out == nullptr) {
+        return;
+    }
+
+    uring_output* o = *out;
+    if (pb != nullptr && *pb != nullptr) {
+        avio_flush(*pb);
+        // 内部缓冲区可能已被 AVIOContext 替换，需要释放 AVIOContext 当前持有的缓冲区
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+    }
+    drain_slots(o);
+
+#if HAVE_IO_URING
+    const char* backend = o->ring_fd < 0 ? "pwrite" : o->registered ? "io_uring fixed buffers" : "io_uring writev";
+#else
+    const char* backend = "pwrite";
+#endif
+    LOG_AT(LOG_LEVEL_COUNTERS, "uring output (%s): %jd writes %jd bytes, %jd stalls on a full queue, %jd drains\n",
+           backend, o->writes, o->bytes, o->stalls, o->drains);
+
+    free_output(o);
+    *out = nullptr;
+}
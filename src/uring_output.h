@@ -0,0 +1,29 @@
+//
+// 基于 io_uring 的文件输出。muxer 的写入先拷贝到一组注册过的大缓冲区中，缓冲区写满后以异步写提交，
+// 同时可以有多个写入在途，复用线程只有在所有缓冲区都在途时才需要等待磁盘。
+// MP4 写 trailer 时会 seek 回去回写 box 大小，非顺序写入之前先等待在途的写入完成，保证回写不会被之前的写入覆盖。
+// 内核不支持 io_uring 或者被禁止使用时退回到同步的 pwrite
+//
+
+#ifndef URING_OUTPUT_H
+#define URING_OUTPUT_H
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+typedef struct uring_output uring_output;
+
+// 创建并打开 filename，用 queue_depth 个 buffer_size 字节的缓冲区轮流写入，参数小于等于 0 时使用默认值（8 个 1 MiB）。
+// io_uring 不可用时仍然返回成功，此时写入退回到 pwrite。打开文件失败时返回负数
+int32_t open_uring_output(uring_output** out, AVIOContext** pb, const char* filename, int32_t buffer_size,
+                          int32_t queue_depth);
+
+// 写出 pb 中剩余的数据并等待全部写入完成，返回写入过程中的第一个错误。之后仍可以继续写入
+int32_t uring_output_drain(uring_output* out, AVIOContext* pb);
+
+// 等待写入完成后关闭文件，释放 AVIOContext 和缓冲区，输出统计信息
+void close_uring_output(uring_output** out, AVIOContext** pb);
+
+#endif
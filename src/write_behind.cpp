@@ -0,0 +1,376 @@
+#include "write_behind.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+}
+
+// O_DIRECT 要求缓冲区地址、文件偏移和长度按逻辑块大小对齐，这里统一按页对齐
+#define WRITE_BEHIND_ALIGN 4096
+#define WRITE_BEHIND_BUFFER_SIZE (4 * 1024 * 1024)
+#define WRITE_BEHIND_QUEUE_DEPTH 4
+
+// AVIOContext 内部缓冲区大小，muxer 的小块写入先在这里合并后再拷贝到输出缓冲区
+static const int32_t avio_ctx_buffer_size = 64 * 1024;
+
+struct wb_buffer {
+    uint8_t* data = nullptr;
+    int64_t offset = 0;     ///< 缓冲区第一个字节在文件中的位置
+    size_t fill = 0;
+};
+
+struct write_behind {
+    int fd = -1;
+    int direct_fd = -1;       ///< 以 O_DIRECT 打开的同一个文件，未启用时为 -1
+    size_t buffer_size = 0;
+    std::vector<wb_buffer> buffers;
+
+    // 以下只由复用线程访问
+    int32_t cur = -1;         ///< 正在填充的缓冲区，-1 表示没有
+    int64_t pos = 0;          ///< AVIOContext 的写位置
+    int64_t size = 0;         ///< 写到过的最大位置
+    int64_t next_offset = 0;  ///< 顺序写入时下一个字节的位置
+    int64_t stalls = 0;       ///< 没有空闲缓冲区、复用线程等待写线程的次数
+    int64_t stall_us = 0;
+    int64_t max_stall_us = 0;
+
+    // 写线程按提交顺序逐个写出，回写 trailer 等非顺序写入不会被之前提交的数据覆盖
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<int32_t> pending;    ///< 等待写出的缓冲区
+    std::vector<int32_t> free_list; ///< 空闲的缓冲区
+    bool writing = false;           ///< 写线程正在写出一个缓冲区
+    bool quit = false;
+    std::thread thread;
+    std::atomic<int32_t> error{0};  ///< 第一个写入错误，之后的写入都返回该错误
+
+    // 以下由写线程在持有 mutex 时更新
+    int64_t writes = 0;
+    int64_t bytes = 0;
+    int64_t direct_bytes = 0;
+    int64_t max_write_us = 0;
+};
+
+static int32_t pwrite_full(int fd, const uint8_t* data, size_t size, int64_t offset)
+{
+    while (size > 0) {
+        ssize_t ret = pwrite(fd, data, size, offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        data += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+// 起始位置对齐时对齐的部分走 O_DIRECT，不足一个块的尾部以及不对齐的缓冲区（如 trailer 回写）走普通写入
+static int32_t write_buffer(write_behind* out, const wb_buffer* buf, int64_t* direct_bytes)
+{
+    const uint8_t* data = buf->data;
+    size_t size = buf->fill;
+    int64_t offset = buf->offset;
+
+    if (out->direct_fd >= 0 && offset % WRITE_BEHIND_ALIGN == 0) {
+        size_t aligned = size & ~(size_t)(WRITE_BEHIND_ALIGN - 1);
+        if (aligned > 0) {
+            int32_t ret = pwrite_full(out->direct_fd, data, aligned, offset);
+            if (ret < 0) {
+                return ret;
+            }
+            data += aligned;
+            size -= aligned;
+            offset += aligned;
+            *direct_bytes += aligned;
+        }
+    }
+
+    return pwrite_full(out->fd, data, size, offset);
+}
+
+static void writer_thread(write_behind* out)
+{
+    std::unique_lock<std::mutex> lock(out->mutex);
+    while (1) {
+        out->cond.wait(lock, [out] { return out->quit || !out->pending.empty(); });
+        if (out->pending.empty()) {
+            break;
+        }
+
+        int32_t idx = out->pending.front();
+        out->pending.pop_front();
+        out->writing = true;
+        lock.unlock();
+
+        wb_buffer* buf = &out->buffers[idx];
+        int64_t direct_bytes = 0;
+        int64_t start = av_gettime_relative();
+        int32_t ret = out->error.load() < 0 ? out->error.load() : write_buffer(out, buf, &direct_bytes);
+        int64_t elapsed = av_gettime_relative() - start;
+
+        lock.lock();
+        if (ret < 0) {
+            LOGE("write %zu bytes at %jd fail: %s\n", buf->fill, buf->offset, strerror(-ret));
+            int32_t expected = 0;
+            out->error.compare_exchange_strong(expected, ret);
+        }
+        out->writes++;
+        out->bytes += buf->fill;
+        out->direct_bytes += direct_bytes;
+        out->max_write_us = FFMAX(out->max_write_us, elapsed);
+        buf->fill = 0;
+        out->writing = false;
+        out->free_list.push_back(idx);
+        out->cond.notify_all();
+    }
+}
+
+// 取一个空闲的缓冲区从 offset 开始填充。所有缓冲区都在排队时等待写线程写完一个，等待的时间计为写入停顿
+static int32_t acquire_buffer(write_behind* out, int64_t offset)
+{
+    std::unique_lock<std::mutex> lock(out->mutex);
+    if (out->free_list.empty()) {
+        int64_t start = av_gettime_relative();
+        out->cond.wait(lock, [out] { return !out->free_list.empty() || out->error.load() < 0; });
+        int64_t elapsed = av_gettime_relative() - start;
+        out->stalls++;
+        out->stall_us += elapsed;
+        out->max_stall_us = FFMAX(out->max_stall_us, elapsed);
+    }
+    if (out->error.load() < 0) {
+        return out->error.load();
+    }
+
+    out->cur = out->free_list.back();
+    out->free_list.pop_back();
+    out->buffers[out->cur].offset = offset;
+    out->buffers[out->cur].fill = 0;
+    return 0;
+}
+
+// 把正在填充的缓冲区交给写线程，空缓冲区直接放回
+static void submit_buffer(write_behind* out)
+{
+    if (out->cur < 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(out->mutex);
+    if (out->buffers[out->cur].fill > 0) {
+        out->pending.push_back(out->cur);
+        out->cond.notify_all();
+    } else {
+        out->free_list.push_back(out->cur);
+    }
+    out->cur = -1;
+}
+
+static int write_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+    write_behind* out = (write_behind*)opaque;
+    if (out->error.load() < 0) {
+        return out->error.load();
+    }
+
+    // 非顺序写入从新的缓冲区开始，写线程按提交顺序写出，不需要等待之前的缓冲区写完
+    if (out->pos != out->next_offset) {
+        submit_buffer(out);
+        out->next_offset = out->pos;
+    }
+
+    const uint8_t* src = buf;
+    size_t left = buf_size;
+    while (left > 0) {
+        if (out->cur < 0) {
+            int32_t ret = acquire_buffer(out, out->pos + (buf_size - left));
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        wb_buffer* b = &out->buffers[out->cur];
+        size_t n = FFMIN(left, out->buffer_size - b->fill);
+        memcpy(b->data + b->fill, src, n);
+        b->fill += n;
+        src += n;
+        left -= n;
+
+        if (b->fill == out->buffer_size) {
+            submit_buffer(out);
+        }
+    }
+
+    out->pos += buf_size;
+    out->next_offset = out->pos;
+    out->size = FFMAX(out->size, out->pos);
+    return buf_size;
+}
+
+// 写入方向的 seek 只移动写位置，下一次写入时再处理非顺序写入
+static int64_t seek_packet(void* opaque, int64_t offset, int whence)
+{
+    write_behind* out = (write_behind*)opaque;
+
+    int64_t new_pos = 0;
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return out->size;
+    case SEEK_SET:
+        new_pos = offset;
+        break;
+    case SEEK_CUR:
+        new_pos = out->pos + offset;
+        break;
+    case SEEK_END:
+        new_pos = out->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (new_pos < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    out->pos = new_pos;
+    return new_pos;
+}
+
+static void drain_buffers(write_behind* out)
+{
+    submit_buffer(out);
+
+    std::unique_lock<std::mutex> lock(out->mutex);
+    out->cond.wait(lock, [out] { return out->pending.empty() && !out->writing; });
+}
+
+static void free_output(write_behind* out)
+{
+    if (out->thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(out->mutex);
+            out->quit = true;
+            out->cond.notify_all();
+        }
+        out->thread.join();
+    }
+
+    for (wb_buffer& buf : out->buffers) {
+        free(buf.data);
+    }
+    if (out->direct_fd >= 0) {
+        close(out->direct_fd);
+    }
+    if (out->fd >= 0) {
+        close(out->fd);
+    }
+    delete out;
+}
+
+int32_t open_write_behind_output(write_behind** out, AVIOContext** pb, const char* filename, int32_t buffer_size,
+                                 int32_t queue_depth, int32_t direct_io)
+{
+    write_behind* o = new (std::nothrow) write_behind();
+    if (o == nullptr) {
+        return AVERROR(ENOMEM);
+    }
+
+    o->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (o->fd < 0) {
+        int32_t ret = AVERROR(errno);
+        LOGE("open %s fail: %s\n", filename, strerror(errno));
+        free_output(o);
+        return ret;
+    }
+
+    if (direct_io) {
+        // tmpfs 等文件系统不支持 O_DIRECT，打开时返回 EINVAL
+        o->direct_fd = open(filename, O_WRONLY | O_DIRECT | O_CLOEXEC);
+        if (o->direct_fd < 0) {
+            LOGW("open %s with O_DIRECT fail (%s), write through the page cache\n", filename, strerror(errno));
+        }
+    }
+
+    size_t size = buffer_size > 0 ? buffer_size : WRITE_BEHIND_BUFFER_SIZE;
+    o->buffer_size = FFALIGN(size, WRITE_BEHIND_ALIGN);
+    o->buffers.resize(queue_depth > 0 ? queue_depth : WRITE_BEHIND_QUEUE_DEPTH);
+    for (size_t i = 0; i < o->buffers.size(); i++) {
+        void* data = nullptr;
+        if (posix_memalign(&data, WRITE_BEHIND_ALIGN, o->buffer_size) != 0) {
+            free_output(o);
+            return AVERROR(ENOMEM);
+        }
+        o->buffers[i].data = (uint8_t*)data;
+        o->free_list.push_back(i);
+    }
+
+    o->thread = std::thread(writer_thread, o);
+
+    uint8_t* avio_ctx_buffer = (uint8_t*)av_malloc(avio_ctx_buffer_size);
+    if (avio_ctx_buffer == nullptr) {
+        free_output(o);
+        return AVERROR(ENOMEM);
+    }
+
+    // 提供 seek 回调后 AVIOContext 即为可 seek 的，MP4 可以在写 trailer 时回写
+    *pb = avio_alloc_context(avio_ctx_buffer, avio_ctx_buffer_size, 1, o, nullptr, &write_packet, &seek_packet);
+    if (*pb == nullptr) {
+        av_free(avio_ctx_buffer);
+        free_output(o);
+        return AVERROR(ENOMEM);
+    }
+
+    *out = o;
+    return 0;
+}
+
+int32_t write_behind_drain(write_behind* out, AVIOContext* pb)
+{
+    if (pb != nullptr) {
+        avio_flush(pb);
+    }
+    drain_buffers(out);
+    return out->error.load();
+}
+
+void close_write_behind_output(write_behind** out, AVIOContext** pb)
+{
+    if (out == nullptr || *out == nullptr) {
+        return;
+    }
+
+    write_behind* o = *out;
+    if (pb != nullptr && *pb != nullptr) {
+        avio_flush(*pb);
+        // 内部缓冲区可能已被 AVIOContext 替换，需要释放 AVIOContext 当前持有的缓冲区
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+    }
+    drain_buffers(o);
+
+    LOG_AT(LOG_LEVEL_COUNTERS, "write behind: %jd writes %jd bytes (%jd with O_DIRECT), max write %.3f ms, "
+           "%jd stalls %.3f ms in total max %.3f ms\n", o->writes, o->bytes, o->direct_bytes, o->max_write_us / 1000.0,
+           o->stalls, o->stall_us / 1000.0, o->max_stall_us / 1000.0);
+
+    free_output(o);
+    *out = nullptr;
+}
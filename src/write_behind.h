@@ -0,0 +1,29 @@
+//
+// 后台线程写出的文件输出。muxer 的写入先拷贝到一组按页对齐的大缓冲区中，缓冲区写满后交给专门的写线程，
+// av_interleaved_write_frame 不再因为磁盘延迟抖动而阻塞，只有所有缓冲区都在等待写出时复用线程才需要等待，
+// 等待的次数和时长作为写入停顿输出。可选 O_DIRECT，一次性写出的数据不占用页缓存
+//
+
+#ifndef WRITE_BEHIND_H
+#define WRITE_BEHIND_H
+#include <stdint.h>
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+typedef struct write_behind write_behind;
+
+// 创建并打开 filename，最多 queue_depth 个 buffer_size 字节的缓冲区排队写出，参数小于等于 0 时使用默认值（4 个 4 MiB），
+// buffer_size 向上取整到 4096 的倍数。direct_io 非 0 时用 O_DIRECT 写出对齐的部分，文件系统不支持时退回到普通写入。
+// 打开文件失败时返回负数
+int32_t open_write_behind_output(write_behind** out, AVIOContext** pb, const char* filename, int32_t buffer_size,
+                                 int32_t queue_depth, int32_t direct_io);
+
+// 写出 pb 中剩余的数据并等待写线程写完，返回写入过程中的第一个错误。之后仍可以继续写入
+int32_t write_behind_drain(write_behind* out, AVIOContext* pb);
+
+// 等待写完后结束写线程并关闭文件，释放 AVIOContext 和缓冲区，输出写入停顿等统计信息
+void close_write_behind_output(write_behind** out, AVIOContext** pb);
+
+#endif